@@ -121,8 +121,31 @@ class Client : private uv::TTY, private ClientContext
     {
         cout << "$ ";
         cout.flush();
-        if (!m_reading)
+        if (!m_reading) {
             start_reading();
+            m_reading = true;
+        }
+    }
+
+    // print the page at <cursor>, and all the ones after it
+    void search_from(const GeoPoint2D& lower, const GeoPoint2D& upper, const SearchCursor& cursor, size_t page_size, int page)
+    {
+        search_clients_page(lower, upper, cursor, page_size, [this, lower, upper, page_size, page](rpc::Error* err, const std::vector<NodeID>* nodes, const SearchCursor* next) {
+            if (err) {
+                cout << "Failed: " << err->what() << endl;
+                prompt();
+                return;
+            }
+            cout << "Page " << page << endl;
+            for (const auto& node : *nodes)
+                cout << "Found node " << node.to_hex() << endl;
+            if (next) {
+                search_from(lower, upper, *next, page_size, page+1);
+            } else {
+                cout << "Search complete" << endl;
+                prompt();
+            }
+        });
     }
 
 public:
@@ -151,6 +174,10 @@ public:
         cout << "  show-server" << endl;
         cout << "  get-metadata <node_id> <key>" << endl;
         cout << "  search <lat-low> <lon-low> <lat-high> <lon-high>" << endl;
+        cout << "  search-radius <lat> <lon> <meters>" << endl;
+        cout << "  search-page <lat-low> <lon-low> <lat-high> <lon-high> <page-size>" << endl;
+        cout << "  knn <lat> <lon> <k>" << endl;
+        cout << "  set-locations <node_id> <lat> <lon> [<node_id> <lat> <lon>...]" << endl;
         cout << "  quit" << endl;
         prompt();
     }
@@ -231,6 +258,93 @@ public:
             } catch(const std::invalid_argument& e) {
                 cout << "Invalid argument" << endl;
             }
+        } else if (command == "search-radius") {
+            double lat, lon, radius;
+            parser >> lat >> lon >> radius;
+            if (parser.fail() || radius < 0) {
+                cout << "Invalid argument" << endl;
+            } else {
+                m_reading = false;
+                stop_reading();
+                search_radius(GeoPoint2D {lat, lon}, radius, [this](rpc::Error* err, const std::vector<NodeID>& nodes) {
+                    if (err) {
+                        cout << "Failed: " << err->what() << endl;
+                    } else {
+                        for (const auto& node : nodes)
+                            cout << "Found node " << node.to_hex() << endl;
+                        cout << "Search complete" << endl;
+                    }
+                    prompt();
+                });
+                return;
+            }
+        } else if (command == "search-page") {
+            double lat_low, lon_low, lat_high, lon_high;
+            size_t page_size;
+            parser >> lat_low >> lon_low >> lat_high >> lon_high >> page_size;
+            if (parser.fail() || page_size == 0) {
+                cout << "Invalid argument" << endl;
+            } else {
+                m_reading = false;
+                stop_reading();
+                search_from(GeoPoint2D {lat_low, lon_low}, GeoPoint2D {lat_high, lon_high}, SearchCursor(), page_size, 1);
+            }
+        } else if (command == "knn") {
+            double lat, lon;
+            size_t k;
+            parser >> lat >> lon >> k;
+            if (parser.fail() || k == 0) {
+                cout << "Invalid argument" << endl;
+            } else {
+                m_reading = false;
+                stop_reading();
+                knn_clients(GeoPoint2D {lat, lon}, k, [this](rpc::Error* err, const std::vector<Neighbour>* neighbours) {
+                    if (err) {
+                        cout << "Failed: " << err->what() << endl;
+                    } else {
+                        for (const auto& neighbour : *neighbours)
+                            cout << "Found node " << neighbour.id.to_hex() << " at " << neighbour.distance << " m" << endl;
+                        cout << "Search complete" << endl;
+                    }
+                    prompt();
+                });
+                return;
+            }
+        } else if (command == "set-locations") {
+            try {
+                std::vector<std::pair<NodeID, GeoPoint2D>> updates;
+                std::string node_id;
+                double lat, lon;
+                while (parser >> node_id >> lat >> lon)
+                    updates.emplace_back(NodeID(node_id), GeoPoint2D {lat, lon});
+                if (updates.empty()) {
+                    cout << "Invalid argument" << endl;
+                } else {
+                    m_reading = false;
+                    stop_reading();
+                    set_locations_batch(updates, [this, updates](rpc::Error* err, const std::vector<LocationResult>* results) {
+                        if (err) {
+                            cout << "Failed: " << err->what() << endl;
+                            prompt();
+                            return;
+                        }
+                        for (size_t i = 0; i < results->size() && i < updates.size(); i++) {
+                            const LocationResult& result = (*results)[i];
+                            if (!result.id.is_valid())
+                                cout << "Failed to move node " << updates[i].first.to_hex() << endl;
+                            else if (result.server.is_valid())
+                                cout << "Moved node " << updates[i].first.to_hex() << " to " << result.id.to_hex()
+                                     << " at server " << result.server.to_string() << endl;
+                            else
+                                cout << "Moved node " << updates[i].first.to_hex() << " to " << result.id.to_hex() << endl;
+                        }
+                        prompt();
+                    });
+                    return;
+                }
+            } catch(const std::invalid_argument& e) {
+                cout << "Invalid argument" << endl;
+            }
         } else if (command == "quit") {
             cout << "Bye" << endl;
             m_event_loop.stop();
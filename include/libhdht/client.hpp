@@ -42,6 +42,34 @@ namespace rpc
     class Peer;
 }
 
+// The position of a paged search: the search continues with the clients
+// after <after>, asking the server at <server>
+// A default constructed cursor starts a new search, at the server that owns
+// the start of the rectangle along the curve
+struct SearchCursor
+{
+    NodeID after;
+    net::Address server;
+};
+
+// A client found by a nearest neighbour search, and its distance from the
+// searched point, in meters
+struct Neighbour
+{
+    NodeID id;
+    double distance;
+};
+
+// The outcome of the location update of one client in a batch: the new node
+// ID of the client, and the server that controls it if that is not the server
+// that was asked
+// The node ID is invalid if the client is unknown or could not be moved
+struct LocationResult
+{
+    NodeID id;
+    net::Address server;
+};
+
 // The context for a single client instance of libhdht
 class ClientContext
 {
@@ -111,6 +139,23 @@ public:
 
     void search_clients(const GeoPoint2D& upper, const GeoPoint2D& lower,
         std::function<void(rpc::Error*, const std::vector<NodeID>)> callback) const;
+    // find all clients within <radius> meters of <center>
+    void search_radius(const GeoPoint2D& center, double radius,
+        std::function<void(rpc::Error*, const std::vector<NodeID>)> callback) const;
+    // find at most <limit> clients, starting at <cursor>
+    // The callback receives the cursor of the next page, or nullptr if
+    // this was the last page
+    void search_clients_page(const GeoPoint2D& upper, const GeoPoint2D& lower,
+        const SearchCursor& cursor, size_t limit,
+        std::function<void(rpc::Error*, const std::vector<NodeID>*, const SearchCursor*)> callback) const;
+    // find the <k> clients closest to <point>, nearest first
+    void knn_clients(const GeoPoint2D& point, size_t k,
+        std::function<void(rpc::Error*, const std::vector<Neighbour>*)> callback) const;
+    // set the locations of many clients at once, each given by its current
+    // node ID (eg, as a gateway for a fleet of devices)
+    // The callback receives one result per update, in the same order
+    void set_locations_batch(const std::vector<std::pair<NodeID, GeoPoint2D>>& updates,
+        std::function<void(rpc::Error*, const std::vector<LocationResult>*)> callback) const;
 
     net::Address get_current_server() const;
     const NodeID& get_current_node_id() const
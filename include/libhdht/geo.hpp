@@ -35,7 +35,11 @@ struct GeoPoint2D
     std::string to_string() const;
     void canonicalize();
 
-    static double distance(GeoPoint2D& one, GeoPoint2D& two);
+    // the great-circle distance between <one> and <two>, in meters
+    static double distance(const GeoPoint2D& one, const GeoPoint2D& two);
+    // the distance from <pt> to the closest point of the area between the
+    // parallels and meridians of <lower> and <upper>, in meters
+    static double min_distance(const GeoPoint2D& pt, const GeoPoint2D& lower, const GeoPoint2D& upper);
 
     std::pair<uint64_t, uint64_t> to_fixed_point() const;
 };
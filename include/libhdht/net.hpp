@@ -86,6 +86,13 @@ public:
         else
             return ntohs(((sockaddr_in6*)&m_address)->sin6_port);
     }
+    void set_port(uint16_t port)
+    {
+        if (m_address.ss_family == AF_INET)
+            ((sockaddr_in*)&m_address)->sin_port = htons(port);
+        else if (m_address.ss_family == AF_INET6)
+            ((sockaddr_in6*)&m_address)->sin6_port = htons(port);
+    }
 
     const sockaddr *get() const
     {
@@ -111,6 +118,16 @@ public:
             return false;
         return memcmp(&m_address, &other.m_address, size()) == 0;
     }
+    // compares the IP addresses only, not the ports
+    bool same_host(const net::Address& other) const
+    {
+        if (family() != other.family())
+            return false;
+        if (family() == AF_INET)
+            return memcmp(&((const sockaddr_in*)&m_address)->sin_addr, &((const sockaddr_in*)&other.m_address)->sin_addr, sizeof(in_addr)) == 0;
+        else
+            return memcmp(&((const sockaddr_in6*)&m_address)->sin6_addr, &((const sockaddr_in6*)&other.m_address)->sin6_addr, sizeof(in6_addr)) == 0;
+    }
 
     std::string to_string() const;
 };
@@ -22,6 +22,7 @@
 
 #include <cstdlib>
 #include <algorithm>
+#include <memory>
 #include <vector>
 #include <unordered_set>
 
@@ -33,12 +34,34 @@ namespace libhdht
 
 // forward declarations of private classes
 class ServerMasterImpl;
+class SharedRangeTable;
 class Table;
 namespace rpc
 {
     class Context;
 }
 
+// A set of servers of the same process that divide the DHT among
+// themselves, each with its own event loop and listening on its own
+// address, and the state they share
+class ShardGroup
+{
+    friend class ServerContext;
+
+private:
+    std::vector<net::Address> m_addresses;
+    std::shared_ptr<SharedRangeTable> m_ranges;
+
+public:
+    // one server listens on each of <addresses>
+    ShardGroup(const std::vector<net::Address>& addresses);
+
+    size_t size() const
+    {
+        return m_addresses.size();
+    }
+};
+
 // The context for a single server instance of libhdht
 class ServerContext
 {
@@ -48,6 +71,14 @@ private:
     std::unique_ptr<rpc::Context> m_rpc;
     std::vector<net::Address> m_peers;
     std::unique_ptr<Table> m_table;
+    // the servers of this process that the DHT was divided among, in
+    // order, if this is one of them
+    std::vector<net::Address> m_shards;
+    size_t m_shard_index = 0;
+    // the clients that may set the locations of other clients
+    std::vector<net::Address> m_gateways;
+
+    void start_shard();
 
 public:
     ServerContext(uv::Loop& loop, uint8_t resolution);
@@ -59,11 +90,27 @@ public:
     ServerContext& operator=(ServerContext&&) = delete;
 
     // expose this server on this address
-    void add_address(const net::Address& address);
+    // With <shared>, the other servers of the process can listen on the
+    // same address too, and the kernel spreads the new connections among
+    // them (with SO_REUSEPORT); each still needs an address of its own
+    void add_address(const net::Address& address, bool shared = false);
+
+    // make this the server at <index> of <shards>, which talk to each
+    // other through in-process queues, and can answer for each other
+    // which server owns a node
+    // If there are no peers, start() divides the whole table among them,
+    // otherwise each of them joins the DHT on its own
+    // (must be called before add_address())
+    void set_shards(const ShardGroup& shards, size_t index);
 
     // add the given peer as known in the table
     void add_peer(const net::Address& address);
 
+    // let the clients that connect from the host of <address> (the port is
+    // ignored) set the locations of other clients in batches, as a gateway
+    // for them
+    void add_gateway(const net::Address& address);
+
     // register this server in the DHT
     // (must have at least one peer in the table)
     void start();
@@ -24,6 +24,7 @@
 #include <cstring>
 #include <memory>
 #include <streambuf>
+#include <vector>
 #include <uv.h>
 
 #include "net.hpp"
@@ -38,10 +39,63 @@ namespace uv
 
 class TCPSocket;
 
+// A cache of fixed size memory blocks, which sockets read into
+// Blocks are recycled as soon as their contents are consumed, so a busy
+// loop does not go through malloc for every read
+class BufferPool
+{
+private:
+    size_t m_block_size;
+    size_t m_max_cached;
+    std::vector<char*> m_free_blocks;
+
+public:
+    static const size_t DEFAULT_BLOCK_SIZE = 64 * 1024;
+    static const size_t DEFAULT_MAX_CACHED = 64;
+
+    BufferPool(size_t block_size = DEFAULT_BLOCK_SIZE, size_t max_cached = DEFAULT_MAX_CACHED) :
+        m_block_size(block_size), m_max_cached(max_cached)
+    {
+        // so that release() never needs to allocate
+        m_free_blocks.reserve(max_cached);
+    }
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+    ~BufferPool()
+    {
+        for (char *block : m_free_blocks)
+            free(block);
+    }
+
+    size_t block_size() const
+    {
+        return m_block_size;
+    }
+
+    // returns nullptr if out of memory
+    char *acquire()
+    {
+        if (m_free_blocks.empty())
+            return (char*)malloc(m_block_size);
+        char *block = m_free_blocks.back();
+        m_free_blocks.pop_back();
+        return block;
+    }
+    void release(char *block)
+    {
+        // past the limit, give the memory back rather than hoarding it
+        if (m_free_blocks.size() < m_max_cached)
+            m_free_blocks.push_back(block);
+        else
+            free(block);
+    }
+};
+
 class Loop
 {
 private:
     uv_loop_t m_loop;
+    BufferPool m_read_pool;
 
 public:
     Loop() {
@@ -54,6 +108,10 @@ public:
     uv_loop_t *loop() {
         return &m_loop;
     }
+    // the blocks that the sockets of this loop read into
+    BufferPool& read_pool() {
+        return m_read_pool;
+    }
 
     void run() {
         uv_run(&m_loop, UV_RUN_DEFAULT);
@@ -67,6 +125,19 @@ class Buffer : public uv_buf_t
 {
 private:
     bool owns_memory;
+    // if set, the memory is a block of this pool, and goes back to it
+    // instead of being freed
+    BufferPool *m_pool = nullptr;
+
+    void release()
+    {
+        if (!owns_memory)
+            return;
+        if (m_pool)
+            m_pool->release(base);
+        else
+            free(base);
+    }
 
 public:
     Buffer(const uint8_t* buffer, size_t length, bool own_memory = false)
@@ -75,6 +146,14 @@ public:
         len = length;
         owns_memory = own_memory;
     }
+    // takes ownership of <length> bytes at the start of a block of <pool>
+    Buffer(char* block, size_t length, BufferPool* pool)
+    {
+        base = block;
+        len = length;
+        owns_memory = true;
+        m_pool = pool;
+    }
     Buffer(const Buffer& buffer) = delete;
     Buffer& operator=(const Buffer&) = delete;
     Buffer(Buffer&& other)
@@ -82,15 +161,16 @@ public:
         base = other.base;
         len = other.len;
         owns_memory = other.owns_memory;
+        m_pool = other.m_pool;
         other.owns_memory = false;
     }
     Buffer& operator=(Buffer&& other)
     {
-        if (owns_memory)
-            free(base);
+        release();
         base = other.base;
         len = other.len;
         owns_memory = other.owns_memory;
+        m_pool = other.m_pool;
         other.owns_memory = false;
         return *this;
     }
@@ -102,14 +182,22 @@ public:
     }
     ~Buffer()
     {
-        if (owns_memory)
-            free(base);
+        release();
     }
 
     explicit operator bool() const {
         return base != nullptr;
     }
 
+    // whether the memory is freed together with this buffer
+    bool is_owned() const {
+        return owns_memory;
+    }
+    // whether the memory is a block of a BufferPool
+    bool is_pooled() const {
+        return owns_memory && m_pool != nullptr;
+    }
+
     static Buffer allocate(size_t size) {
         Buffer buf(nullptr, 0);
         buf.base = (char*)malloc(size);
@@ -187,10 +275,12 @@ private:
     }
 
     bool m_usable = true;
+    // where reads go, or nullptr to allocate each of them with malloc
+    BufferPool *m_read_pool;
 
 public:
-    TCPSocket(uv_loop_t* loop);
-    TCPSocket(Loop& loop) : TCPSocket(loop.loop()) {}
+    TCPSocket(uv_loop_t* loop, BufferPool *read_pool = nullptr);
+    TCPSocket(Loop& loop) : TCPSocket(loop.loop(), &loop.read_pool()) {}
     TCPSocket(const TCPSocket&) = delete;
     TCPSocket& operator=(const TCPSocket&) = delete;
     TCPSocket& operator=(TCPSocket&&) = delete;
@@ -205,7 +295,9 @@ public:
     net::Address get_peer_name() const;
 
     void connect(const net::Address& address);
-    void listen(const net::Address& address);
+    // with <reuse_port>, other sockets can listen on the same address,
+    // and the kernel spreads the incoming connections among them
+    void listen(const net::Address& address, bool reuse_port = false);
     void ref()
     {
         uv_ref(handle_cast<uv_handle_t>(this));
@@ -220,7 +312,10 @@ public:
     void stop_reading() {
         uv_read_stop(handle_cast<uv_stream_t>(this));
     }
-    void write(uint64_t req_id, const Buffer* buffers, size_t nbuffers);
+    // write <buffers> without copying them
+    // buffers that own their memory are moved into the write request and freed
+    // when it completes; the others must stay alive until write_complete()
+    void write(uint64_t req_id, Buffer* buffers, size_t nbuffers);
     void accept(TCPSocket *client);
 
     // override in subclasses to handle async IO results
@@ -259,9 +354,12 @@ private:
         return static_cast<TTY*>((uv_tty_t*)(socket));
     }
 
+    // where reads go, or nullptr to allocate each of them with malloc
+    BufferPool *m_read_pool;
+
 public:
-    TTY(uv_loop_t* loop, int fd);
-    TTY(uv::Loop& loop, int fd) : TTY(loop.loop(), fd) {}
+    TTY(uv_loop_t* loop, int fd, BufferPool *read_pool = nullptr);
+    TTY(uv::Loop& loop, int fd) : TTY(loop.loop(), fd, &loop.read_pool()) {}
     virtual ~TTY();
 
     virtual void read_line(Error err, uv::Buffer&&)
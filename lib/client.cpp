@@ -146,7 +146,7 @@ ClientContext::update_current_server()
     m_is_updating_location = true;
     auto proxy = m_current_server->get_proxy<protocol::ServerProxy>(protocol::MASTER_OBJECT_ID);
 
-    proxy->invoke_find_server_for_point([this](rpc::Error* err, net::Address server_address, const NodeIDRange&) {
+    proxy->invoke_find_server_for_point([this](rpc::Error* err, net::Address server_address, const NodeIDRange&, uint64_t) {
         if (err) {
             log(LOG_WARNING, "Failed to find own controlling server: %s", err->what());
 
@@ -311,4 +311,79 @@ ClientContext::search_clients(const GeoPoint2D &upper, const GeoPoint2D &lower,
     proxy->invoke_search_clients(callback, upper, lower);
 }
 
+void
+ClientContext::search_radius(const GeoPoint2D& center, double radius, std::function<void(rpc::Error*, const std::vector<NodeID>)> callback) const
+{
+    assert(m_is_registered);
+
+    auto proxy = m_current_server->get_proxy<protocol::ServerProxy>(protocol::MASTER_OBJECT_ID);
+
+    proxy->invoke_search_radius(callback, center, radius);
+}
+
+void
+ClientContext::search_clients_page(const GeoPoint2D &upper, const GeoPoint2D &lower, const SearchCursor& cursor, size_t limit,
+                                   std::function<void(rpc::Error*, const std::vector<NodeID>*, const SearchCursor*)> callback) const
+{
+    assert(m_is_registered);
+
+    auto proxy = m_current_server->get_proxy<protocol::ServerProxy>(protocol::MASTER_OBJECT_ID);
+
+    uint32_t page_size = std::min(limit, size_t(std::numeric_limits<uint32_t>::max()));
+    proxy->invoke_search_clients_paged([callback](rpc::Error *err, const std::vector<NodeID>& results, bool more, const SearchCursor& next) {
+        if (err)
+            callback(err, nullptr, nullptr);
+        else
+            callback(nullptr, &results, more ? &next : nullptr);
+    }, upper, lower, cursor, page_size);
+}
+
+void
+ClientContext::knn_clients(const GeoPoint2D& point, size_t k, std::function<void(rpc::Error*, const std::vector<Neighbour>*)> callback) const
+{
+    assert(m_is_registered);
+
+    auto proxy = m_current_server->get_proxy<protocol::ServerProxy>(protocol::MASTER_OBJECT_ID);
+
+    uint32_t max_k = std::min(k, size_t(std::numeric_limits<uint32_t>::max()));
+    proxy->invoke_knn_clients([callback](rpc::Error *err, const std::vector<Neighbour>& results) {
+        if (err)
+            callback(err, nullptr);
+        else
+            callback(nullptr, &results);
+    }, point, max_k);
+}
+
+void
+ClientContext::set_locations_batch(const std::vector<std::pair<NodeID, GeoPoint2D>>& updates,
+                                   std::function<void(rpc::Error*, const std::vector<LocationResult>*)> callback) const
+{
+    assert(m_is_registered);
+
+    auto proxy = m_current_server->get_proxy<protocol::ServerProxy>(protocol::MASTER_OBJECT_ID);
+
+    proxy->invoke_set_locations_batch([callback](rpc::Error *err, const std::vector<protocol::SetLocationReply>& replies) {
+        if (err) {
+            callback(err, nullptr);
+            return;
+        }
+
+        std::vector<LocationResult> results;
+        results.reserve(replies.size());
+        for (const auto& reply : replies) {
+            switch (std::get<0>(reply)) {
+            case protocol::SetLocationResult::SameServer:
+                results.push_back(LocationResult{ std::get<1>(reply), net::Address() });
+                break;
+            case protocol::SetLocationResult::DifferentServer:
+                results.push_back(LocationResult{ std::get<1>(reply), std::get<2>(reply) });
+                break;
+            default:
+                results.push_back(LocationResult{ NodeID(), net::Address() });
+            }
+        }
+        callback(nullptr, &results);
+    }, updates);
+}
+
 }
@@ -20,9 +20,13 @@
 
 #include "libhdht-private.hpp"
 #include "hilbert-values.hpp"
+#include "geo-batch.hpp"
+#include "endian.hpp"
 
 #include "rtree/rtree.hpp"
 
+#include <cmath>
+
 namespace libhdht {
 
 Table::Table(uint8_t resolution) : m_resolution(resolution)
@@ -42,26 +46,398 @@ Table::Table(uint8_t resolution) : m_resolution(resolution)
         delete new_node;
         throw;
     }
+    ranges_changed();
+}
+
+void
+Table::ranges_changed()
+{
+    m_ranges_version++;
+    m_snapshot.publish(std::make_unique<RangeSnapshot>(m_ranges, m_resolution, m_ranges_version));
+    // clients may now belong to a remote server, or to a local one
+    m_search_cache.clear();
+
+    if (m_shared_ranges) {
+        std::vector<NodeIDRange> local_ranges;
+        for (const auto& it : m_ranges) {
+            if (it.second->is_local())
+                local_ranges.push_back(it.second->get_range());
+        }
+        m_shared_ranges->publish(m_shared_address, local_ranges, m_ranges_version);
+    }
+}
+
+void
+Table::share_ranges(std::shared_ptr<SharedRangeTable> shared_ranges, const net::Address& address)
+{
+    m_shared_ranges = shared_ranges;
+    m_shared_address = address;
+    ranges_changed();
 }
 
 Table::~Table()
 {
+    // the clients are freed with m_client_pool
     for (auto& iter : m_ranges)
         delete iter.second;
+}
 
-    for (auto& iter : m_clients)
-        delete iter.second;
+// the first 64 bits of <id>, in the order NodeIDs compare
+static inline uint64_t
+node_id_prefix(const NodeID& id)
+{
+    uint64_t prefix;
+    memcpy(&prefix, id.get_buffer(), sizeof(prefix));
+    return be64toh(prefix);
+}
+
+RangeSnapshot::RangeSnapshot(const std::map<NodeID, ServerNode*>& ranges, uint8_t resolution, uint64_t version) :
+    m_resolution(resolution),
+    m_version(version)
+{
+    m_starts.reserve(ranges.size());
+    m_servers.reserve(ranges.size());
+    m_entries.reserve(ranges.size());
+    for (const auto& it : ranges) {
+        ServerNode *server = it.second;
+        Entry entry{ server->get_range(), server->is_local(), net::Address() };
+        if (!server->is_local()) {
+            auto proxy = static_cast<const RemoteServerNode*>(server)->get_proxy();
+            if (proxy != nullptr)
+                entry.owner = proxy->get_address();
+        }
+        m_starts.push_back(node_id_prefix(it.first));
+        m_servers.push_back(server);
+        m_entries.push_back(entry);
+    }
+}
+
+size_t
+RangeSnapshot::find_index(const NodeID& id) const
+{
+    if (m_resolution <= 64)
+        return find_prefix(node_id_prefix(id));
+
+    // ranges can differ past the first 64 bits, so the prefixes cannot
+    // tell them apart
+    auto it = std::upper_bound(m_entries.begin(), m_entries.end(), id, [](const NodeID& id, const Entry& entry) {
+        return id < entry.range.from();
+    });
+    return (it - 1) - m_entries.begin();
+}
+
+ClientNode*
+ClientIndex::find(const NodeID& id) const
+{
+    if (m_size == 0)
+        return nullptr;
+
+    uint64_t prefix = node_id_prefix(id);
+    size_t mask = m_slots.size() - 1;
+    for (size_t i = bucket_for(prefix); m_slots[i].client != nullptr; i = (i + 1) & mask) {
+        if (m_slots[i].prefix == prefix && m_slots[i].client->get_id() == id)
+            return m_slots[i].client;
+    }
+    return nullptr;
+}
+
+void
+ClientIndex::grow()
+{
+    // rehash into a table twice as large, built on the side
+    size_t capacity = std::max<size_t>(16, 2 * m_slots.size());
+    uint8_t shift = 64 - __builtin_ctzll(capacity);
+    std::vector<Slot> slots(capacity, Slot{ 0, nullptr });
+
+    std::swap(m_slots, slots);
+    std::swap(m_shift, shift);
+    size_t mask = capacity - 1;
+    for (const Slot& slot : slots) {
+        if (slot.client == nullptr)
+            continue;
+        size_t i = bucket_for(slot.prefix);
+        while (m_slots[i].client != nullptr)
+            i = (i + 1) & mask;
+        m_slots[i] = slot;
+    }
+}
+
+void
+ClientIndex::insert(ClientNode *client)
+{
+    // keep the table at most half full, so probe sequences stay short
+    if (2 * (m_size + 1) > m_slots.size())
+        grow();
+
+    uint64_t prefix = node_id_prefix(client->get_id());
+    size_t mask = m_slots.size() - 1;
+    size_t i = bucket_for(prefix);
+    while (m_slots[i].client != nullptr) {
+        assert(m_slots[i].client != client);
+        i = (i + 1) & mask;
+    }
+
+    m_slots[i] = Slot{ prefix, client };
+    m_size++;
+}
+
+void
+ClientIndex::erase(ClientNode *client)
+{
+    if (m_size == 0)
+        return;
+
+    uint64_t prefix = node_id_prefix(client->get_id());
+    size_t mask = m_slots.size() - 1;
+    size_t hole = bucket_for(prefix);
+    while (m_slots[hole].client != client) {
+        if (m_slots[hole].client == nullptr)
+            return;
+        hole = (hole + 1) & mask;
+    }
+
+    // shift back the entries that follow, so that no probe sequence
+    // goes through an empty slot
+    for (size_t i = (hole + 1) & mask; m_slots[i].client != nullptr; i = (i + 1) & mask) {
+        size_t home = bucket_for(m_slots[i].prefix);
+        // the entry can move to the hole unless its home is cyclically in (hole, i]
+        bool stays = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+        if (!stays) {
+            m_slots[hole] = m_slots[i];
+            hole = i;
+        }
+    }
+    m_slots[hole] = Slot{ 0, nullptr };
+    m_size--;
+}
+
+// the lowest <bits> bits set
+static inline uint64_t
+low_bits_mask(unsigned bits)
+{
+    return bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+}
+
+// the number of low bits that vary within <block>
+static inline unsigned
+block_bits(const SearchCache::Block& block)
+{
+    uint64_t span = block.second - block.first;
+    return span == 0 ? 0 : 64 - __builtin_clzll(span);
+}
+
+void
+SearchCache::erase(std::unordered_map<Block, Entry, BlockHash>::iterator it)
+{
+    m_per_size[block_bits(it->first) / 2]--;
+    m_memory -= memory_for(it->second.clients.size());
+    m_lru.erase(it->second.lru);
+    m_entries.erase(it);
+}
+
+const std::vector<SearchCache::Client>*
+SearchCache::find(const Block& block)
+{
+    auto it = m_entries.find(block);
+    if (it == m_entries.end())
+        return nullptr;
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+    return &it->second.clients;
+}
+
+const std::vector<SearchCache::Client>*
+SearchCache::insert(const Block& block, std::vector<Client>&& clients)
+{
+    // a block that is already cached keeps its entry, which is just as valid
+    const std::vector<Client>* existing = find(block);
+    if (existing != nullptr)
+        return existing;
+    size_t memory = memory_for(clients.size());
+    if (memory > m_budget)
+        return nullptr;
+    while (m_memory + memory > m_budget)
+        erase(m_entries.find(m_lru.back()));
+
+    m_lru.push_front(block);
+    std::unordered_map<Block, Entry, BlockHash>::iterator it;
+    try {
+        it = m_entries.emplace(block, Entry{ std::move(clients), m_lru.begin() }).first;
+    } catch(const std::bad_alloc& e) {
+        m_lru.pop_front();
+        throw;
+    }
+    m_per_size[block_bits(block) / 2]++;
+    m_memory += memory;
+    return &it->second.clients;
+}
+
+void
+SearchCache::invalidate(uint64_t hilbert_value, uint8_t resolution)
+{
+    if (m_entries.empty())
+        return;
+    for (unsigned bits = 0; bits <= resolution && bits <= 64; bits += 2) {
+        if (m_per_size[bits / 2] == 0)
+            continue;
+        uint64_t mask = low_bits_mask(bits);
+        auto it = m_entries.find(std::make_pair(hilbert_value & ~mask, hilbert_value | mask));
+        if (it != m_entries.end())
+            erase(it);
+    }
+}
+
+void
+SearchCache::set_budget(size_t budget)
+{
+    m_budget = budget;
+    while (m_memory > m_budget)
+        erase(m_entries.find(m_lru.back()));
+}
+
+void
+SearchCache::clear()
+{
+    m_entries.clear();
+    m_lru.clear();
+    std::fill(std::begin(m_per_size), std::end(m_per_size), 0);
+    m_memory = 0;
+}
+
+void
+SearchCache::split_interval(uint64_t first, uint64_t last, uint8_t resolution, std::vector<Block>& blocks)
+{
+    while (true) {
+        // the largest block that starts at <first> and ends at or before <last>
+        unsigned bits = 0;
+        while (bits + 2 <= resolution && (first & low_bits_mask(bits + 2)) == 0 &&
+               (first | low_bits_mask(bits + 2)) <= last)
+            bits += 2;
+
+        uint64_t block_last = first | low_bits_mask(bits);
+        blocks.push_back(std::make_pair(first, block_last));
+        if (block_last >= last)
+            break;
+        first = block_last + 1;
+    }
+}
+
+const SharedRangeTable::Owner*
+SharedRangeTable::find(const Snapshot& snapshot, const NodeID& id)
+{
+    // the last range that starts at or before id
+    auto it = std::upper_bound(snapshot.begin(), snapshot.end(), id, [](const NodeID& id, const Owner& owner) {
+        return id < owner.range.from();
+    });
+    if (it == snapshot.begin())
+        return nullptr;
+    --it;
+    return it->range.contains(id) ? &*it : nullptr;
+}
+
+void
+SharedRangeTable::publish(const net::Address& address, const std::vector<NodeIDRange>& ranges, uint64_t version)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    auto snapshot = std::make_unique<Snapshot>();
+    // the writers are serialized, nothing else frees the current snapshot
+    for (const Owner& owner : *m_snapshot.get()) {
+        if (owner.address == address)
+            continue;
+        bool overlaps = false;
+        for (const NodeIDRange& range : ranges)
+            overlaps = overlaps || range.contains(owner.range) || owner.range.contains(range);
+        if (!overlaps)
+            snapshot->push_back(owner);
+    }
+    for (const NodeIDRange& range : ranges)
+        snapshot->push_back(Owner{ range, address, version });
+    std::sort(snapshot->begin(), snapshot->end(), [](const Owner& a, const Owner& b) {
+        return a.range.from() < b.range.from();
+    });
+
+    m_snapshot.publish(std::move(snapshot));
+}
+
+void
+RangeOwnerCache::erase(std::map<NodeID, Entry>::iterator it)
+{
+    m_lru.erase(it->second.lru);
+    m_entries.erase(it);
+}
+
+const RangeOwnerCache::Owner*
+RangeOwnerCache::find(const NodeID& id)
+{
+    // the ranges do not overlap, so only the last one that starts at or
+    // before <id> can contain it
+    auto it = m_entries.upper_bound(id);
+    if (it == m_entries.begin())
+        return nullptr;
+    --it;
+    if (!it->second.owner.range.contains(id))
+        return nullptr;
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+    return &it->second.owner;
+}
+
+void
+RangeOwnerCache::insert(Owner&& owner)
+{
+    // ranges are aligned, so the ones that overlap <owner.range> are either
+    // a single one that starts before it and contains it, or all those that
+    // start within it (including at its start)
+    std::vector<std::map<NodeID, Entry>::iterator> overlapping;
+    auto it = m_entries.lower_bound(owner.range.from());
+    if (it != m_entries.begin()) {
+        auto previous = std::prev(it);
+        if (previous->second.owner.range.contains(owner.range))
+            overlapping.push_back(previous);
+    }
+    for (; it != m_entries.end() && owner.range.contains(it->first); ++it)
+        overlapping.push_back(it);
+
+    // answers can arrive out of order; if the same server already answered
+    // with a more recent table, this answer is stale
+    net::Address address = owner.proxy->get_address();
+    for (auto existing : overlapping) {
+        const Owner& other = existing->second.owner;
+        if (other.version > owner.version && other.proxy->get_address() == address)
+            return;
+    }
+    for (auto existing : overlapping)
+        erase(existing);
+
+    if (m_entries.size() >= m_capacity && !m_lru.empty())
+        erase(m_entries.find(m_lru.back()));
+
+    NodeID from = owner.range.from();
+    m_lru.push_front(from);
+    try {
+        m_entries.emplace(from, Entry{ std::move(owner), m_lru.begin() });
+    } catch(const std::bad_alloc& e) {
+        m_lru.pop_front();
+        throw;
+    }
+}
+
+void
+RangeOwnerCache::erase(const NodeIDRange& range)
+{
+    auto it = m_entries.find(range.from());
+    if (it != m_entries.end() && it->second.owner.range == range)
+        erase(it);
 }
 
 ServerNode*
 Table::find_controlling_server(const NodeID& node) const
 {
-    auto it = m_ranges.upper_bound(node);
-    it--;
+    const RangeSnapshot& index = range_index();
+    ServerNode *server = index.server_at(index.find_index(node));
 
     // there should be no holes in the table
-    assert(it->second->get_range().contains(node));
-    return it->second;
+    assert(server->get_range().contains(node));
+    return server;
 }
 
 bool
@@ -174,6 +550,7 @@ Table::add_remote_server_node(const NodeIDRange& range, std::shared_ptr<protocol
         it->second = new_node;
     }
 
+    ranges_changed();
     return true;
 }
 
@@ -194,7 +571,7 @@ Table::add_local_server_node(const NodeIDRange& range, LocalServerNode *previous
     if (range.contains(*current_range)) {
         LocalServerNode *new_node;
         if (previous == nullptr)
-            new_node = new LocalServerNode(range, m_resolution);
+            new_node = new LocalServerNode(range, m_resolution, m_client_pool);
         else
             new_node = previous;
 
@@ -276,13 +653,15 @@ Table::add_local_server_node(const NodeIDRange& range, LocalServerNode *previous
             // replace the RemoteServerNode with a local one
             ServerNode *new_node;
             if (previous == nullptr)
-                new_node = new LocalServerNode(range, m_resolution);
+                new_node = new LocalServerNode(range, m_resolution, m_client_pool);
             else
                 new_node = previous;
             delete current_node;
             it->second = new_node;
         }
     }
+
+    ranges_changed();
 }
 
 ClientNode*
@@ -291,9 +670,9 @@ Table::get_or_create_client_node(const NodeID& id, const GeoPoint2D& pt)
     if (!id.is_valid())
         return get_or_create_client_node(get_node_id_for_point(pt), pt);
 
-    auto it = m_clients.find(id);
-    if (it != m_clients.end())
-        return it->second;
+    ClientNode *existing = m_clients.find(id);
+    if (existing != nullptr)
+        return existing;
 
     ServerNode *server_node = find_controlling_server(id);
     if (!server_node->is_local())
@@ -301,27 +680,24 @@ Table::get_or_create_client_node(const NodeID& id, const GeoPoint2D& pt)
 
     LocalServerNode *local = static_cast<LocalServerNode*>(server_node);
     local->prepare_insert();
-    ClientNode *new_node = new ClientNode(id, pt);
+    ClientNode *new_node = m_client_pool.create(id, pt);
 
     try {
-        m_clients.insert(std::make_pair(id, new_node));
+        m_clients.insert(new_node);
     } catch(const std::bad_alloc& e) {
-        delete new_node;
+        m_client_pool.destroy(new_node);
         throw;
     }
 
     local->add_client(new_node);
+    m_search_cache.invalidate(id.to_hilbert_value(m_resolution), m_resolution);
     return new_node;
 }
 
 ClientNode*
 Table::get_existing_client_node(const NodeID &id)
 {
-    auto it = m_clients.find(id);
-    if (it != m_clients.end())
-        return it->second;
-    else
-        return nullptr;
+    return m_clients.find(id);
 }
 
 ServerNode *
@@ -329,23 +705,34 @@ Table::move_client(ClientNode* node, const GeoPoint2D & pt)
 {
     ServerNode *existing = find_controlling_server(node->get_id());
     assert(existing->is_local());
+    LocalServerNode *local = static_cast<LocalServerNode*>(existing);
 
     node->set_coordinates(pt);
 
+    NodeID old_node_id = node->get_id();
     NodeID new_node_id = get_node_id_for_point(pt);
-    if (new_node_id == node->get_id())
+    if (new_node_id == old_node_id)
         return existing; // fast path, the node did not move enough to matter
 
+    // the index is keyed on the current ID of the client, so take it out
+    // before changing it
+    m_clients.erase(node);
     node->set_id(new_node_id);
-    if (existing->get_range().contains(new_node_id))
-        return existing; // also fast path, the node did not move enough
+    m_clients.insert(node);
+    m_search_cache.invalidate(old_node_id.to_hilbert_value(m_resolution), m_resolution);
+    m_search_cache.invalidate(new_node_id.to_hilbert_value(m_resolution), m_resolution);
+    if (existing->get_range().contains(new_node_id)) {
+        // also fast path, the node did not move enough to change server
+        local->update_client(node, old_node_id);
+        return existing;
+    }
 
     ServerNode *new_server_node = find_controlling_server(new_node_id);
     assert(existing != new_server_node);
 
     if (new_server_node->is_local())
         static_cast<LocalServerNode*>(new_server_node)->add_client(node);
-    static_cast<LocalServerNode*>(existing)->remove_client(node);
+    local->remove_client(node, old_node_id);
 
     return new_server_node;
 }
@@ -353,8 +740,13 @@ Table::move_client(ClientNode* node, const GeoPoint2D & pt)
 void
 Table::forget_client(ClientNode* node)
 {
-    m_clients.erase(node->get_id());
-    delete node;
+    ServerNode *server_node = find_controlling_server(node->get_id());
+    if (server_node->is_local())
+        static_cast<LocalServerNode*>(server_node)->remove_client(node);
+    m_search_cache.invalidate(node->get_id().to_hilbert_value(m_resolution), m_resolution);
+
+    m_clients.erase(node);
+    m_client_pool.destroy(node);
 }
 
 void
@@ -381,16 +773,15 @@ Table::debug_dump_table() const
         }
     }
 
-    for (const auto& it : m_clients) {
-        const auto& node_id = it.second->get_id();
-        assert(it.first == node_id);
+    m_clients.foreach_client([](ClientNode *client) {
+        const auto& node_id = client->get_id();
         auto node_str = node_id.to_string();
-        const auto& coord = it.second->get_coordinates();
+        const auto& coord = client->get_coordinates();
 
-        log(LOG_DEBUG, "Client %p at id %s (%g, %g)", it.second, node_str.c_str(), coord.latitude, coord.longitude);
-        for (const auto& meta_it : it.second->get_all_metadata())
+        log(LOG_DEBUG, "Client %p at id %s (%g, %g)", client, node_str.c_str(), coord.latitude, coord.longitude);
+        for (const auto& meta_it : client->get_all_metadata())
             log(LOG_DEBUG, "Meta: %s = %s", meta_it.first.c_str(), meta_it.second.c_str());
-    }
+    });
 
     log(LOG_DEBUG, "--- end table dump ---");
 }
@@ -486,64 +877,64 @@ Table::load_balance_with_peer(std::shared_ptr<protocol::ServerProxy> proxy, std:
             callback(LoadBalanceAction::InformPeer, server);
         }
     }
-}
 
-static uint64_t point_to_hilbert(uint8_t resolution, const std::pair<uint64_t, uint64_t>& pt)
-{
-    uint64_t hilbert_size = (1ULL << (resolution/2));
-    return hilbert_values::xy2d(hilbert_size, pt.first, pt.second);
-}
-
-static std::pair<uint64_t, uint64_t> hilbert_to_point(uint8_t resolution, uint64_t hilbert_value)
-{
-    uint64_t hilbert_size = (1ULL << (resolution/2));
-    uint64_t x, y;
-    hilbert_values::d2xy(hilbert_size, hilbert_value, x, y);
-    return std::make_pair(x, y);
+    ranges_changed();
 }
 
+// Collects the results of a search from the remote servers, and passes
+// them on as soon as each server replies
 class SearchRequest
 {
 private:
-    size_t m_n_waiting = 0;
-    std::function<void(rpc::Error*, std::vector<NodeID>*)> m_callback;
-    std::vector<NodeID> m_accumulated_results;
-    bool m_callback_called = false;
+    // one more than the outstanding remote requests, until all of them are
+    // sent, so that a request that fails right away does not free this
+    size_t m_n_waiting = 1;
+    std::function<void(rpc::Error*, const std::vector<NodeID>*, bool)> m_callback;
+    bool m_callback_done = false;
+
+    void complete_one(rpc::Error *error, const std::vector<NodeID>* results)
+    {
+        m_n_waiting --;
+
+        if (!m_callback_done) {
+            if (error) {
+                m_callback_done = true;
+                m_callback(error, nullptr, true);
+            } else if (m_n_waiting == 0) {
+                m_callback_done = true;
+                m_callback(nullptr, results, true);
+            } else if (!results->empty()) {
+                m_callback(nullptr, results, false);
+            }
+        }
+
+        if (m_n_waiting == 0)
+            delete this;
+    }
 
 public:
-    SearchRequest(std::function<void(rpc::Error*, std::vector<NodeID>*)>&& callback) : m_callback(callback) {}
+    SearchRequest(std::function<void(rpc::Error*, const std::vector<NodeID>*, bool)>&& callback) : m_callback(callback) {}
 
-    void add_local(std::vector<NodeID>& local)
+    void add_local(const std::vector<NodeID>& local)
     {
-        m_accumulated_results.swap(local);
+        if (!local.empty())
+            m_callback(nullptr, &local, false);
     }
 
-    void perform_request(RemoteServerNode *node, const rtree::Rectangle& rect, const std::pair<uint64_t, uint64_t>& hilbert_bounds)
+    // the callback for the reply of one more remote server
+    ForwardCallback expect_reply()
     {
-        auto proxy = node->get_proxy();
-
         m_n_waiting ++;
-        proxy->invoke_forward_search_clients([this](rpc::Error *error, const std::vector<NodeID>& reply) {
-            m_n_waiting --;
-
-            if (error) {
-                if (!m_callback_called) {
-                    m_callback_called = true;
-                    m_callback(error, nullptr);
-                }
-            } else {
-                m_accumulated_results.insert(m_accumulated_results.end(), reply.begin(), reply.end());
-            }
-
-            if (m_n_waiting == 0) {
-                if (!m_callback_called) {
-                    m_callback_called = true;
-                    m_callback(nullptr, &m_accumulated_results);
-                }
+        return [this](rpc::Error *error, const std::vector<NodeID>& reply) {
+            complete_one(error, &reply);
+        };
+    }
 
-                delete this;
-            }
-        }, rect.get_lower(), rect.get_upper(), hilbert_bounds);
+    // call after the last expect_reply()
+    void all_requests_sent()
+    {
+        std::vector<NodeID> empty;
+        complete_one(nullptr, &empty);
     }
 };
 
@@ -567,64 +958,513 @@ Table::get_rectangle_for_points(const GeoPoint2D &upper, const GeoPoint2D &lower
     return rectangle;
 }
 
-void
-Table::search_clients(const rtree::Rectangle& rectangle, uint64_t min_hilbert_value, uint64_t max_hilbert_value, std::function<void(rpc::Error*, std::vector<NodeID>*)> callback) const
+rtree::Rectangle
+Table::get_rectangle_for_circle(const GeoPoint2D& center, double radius) const
 {
-    static const int rectangle_corners[4][2] = { {0, 0}, {0, 1}, {1, 1}, {1, 0} };
+    const double R = 6371000; // meters, as in GeoPoint2D::distance()
+    double angle = radius / R;
+    double delta_latitude = angle * 180.0 / M_PI;
+
+    GeoPoint2D lower{ std::max(center.latitude - delta_latitude, -90.0), -180.0 };
+    // +180 is the same as -180 in fixed point, so the box stops just before it
+    // (well within the last cell of the grid)
+    GeoPoint2D upper{ std::min(center.latitude + delta_latitude, 90.0), 180.0 - 1e-9 };
+
+    // the widest part of the circle is not on the parallel of the center, but
+    // it is never wider than asin(sin(angle) / cos(latitude)) on either side
+    // If the circle reaches a pole, or crosses the antimeridian, the box
+    // spans all the longitudes, which is conservative but still correct
+    double cos_latitude = std::cos(center.latitude * M_PI / 180.0);
+    if (lower.latitude > -90.0 && upper.latitude < 90.0 && std::sin(angle) < cos_latitude) {
+        double delta_longitude = std::asin(std::sin(angle) / cos_latitude) * 180.0 / M_PI;
+        if (center.longitude - delta_longitude >= -180.0 && center.longitude + delta_longitude < 180.0) {
+            lower.longitude = center.longitude - delta_longitude;
+            upper.longitude = center.longitude + delta_longitude;
+        }
+    }
 
-    uint64_t hilbert_corners[4];
-    for (int i = 0; i < 4; i++)
-        hilbert_corners[i] = point_to_hilbert(m_resolution, rectangle.get_corner(rectangle_corners[i]));
+    return get_rectangle_for_points(upper, lower);
+}
 
-    int last_corner = 0;
+// Curve quadrants smaller than 1/kSearchPrecision of the query rectangle
+// are searched whole instead of being split further, which bounds the number
+// of curve intervals that make up the query
+static const uint64_t kSearchPrecision = 64;
 
-    std::vector<std::pair<RemoteServerNode*, std::pair<uint64_t, uint64_t>>> to_query;
-    std::vector<NodeID> our_response;
+// Local results are passed on in batches of this many clients, so that a
+// large search does not need to be held in memory all at once
+static const size_t kSearchBatchSize = 16384;
 
-    for (auto i = std::max(hilbert_corners[0], min_hilbert_value); i <= max_hilbert_value;) {
-        auto current_point = hilbert_to_point(m_resolution, i);
-        if (rectangle.contains(current_point)) {
-            // search clients at the current point
+void
+Table::get_search_intervals(const rtree::Rectangle& rectangle, std::vector<std::pair<uint64_t, uint64_t>>& intervals) const
+{
+    const auto& lower = rectangle.get_lower();
+    const auto& upper = rectangle.get_upper();
+    uint64_t size = std::max(upper.first - lower.first, upper.second - lower.second) + 1;
+    uint64_t min_size = 1;
+    while (min_size * 2 <= size / kSearchPrecision)
+        min_size *= 2;
+
+    hilbert_values::rectangle_to_intervals(1ULL << (m_resolution/2), lower, upper, min_size, intervals);
+}
 
-            NodeID point_id(i, m_resolution);
-            ServerNode *server = find_controlling_server(point_id);
+rtree::Rectangle
+Table::get_block_rectangle(const SearchCache::Block& block) const
+{
+    uint64_t x, y;
+    hilbert_values::fast_d2xy(1ULL << (m_resolution / 2), block.first, x, y);
+    uint64_t side_mask = low_bits_mask(block_bits(block) / 2);
+    return rtree::Rectangle(std::make_pair(x | side_mask, y | side_mask), std::make_pair(x & ~side_mask, y & ~side_mask));
+}
 
-            if (server->is_local()) {
-                auto from_rtree = static_cast<LocalServerNode*>(server)->search(rectangle);
-                for (const auto& rtree_entry : from_rtree)
-                    our_response.push_back(static_cast<ClientNode*>(rtree_entry->get_data())->get_id());
-            } else {
-                auto pt_begin = server->get_range().from().to_hilbert_value(m_resolution);
-                auto pt_end = server->get_range().to().to_hilbert_value(m_resolution);
+void
+Table::visit_block_clients(const SearchCache::Block& block, const std::function<void(const SearchCache::Client&)>& visitor) const
+{
+    const std::vector<SearchCache::Client> *cached = m_search_cache.find(block);
+    if (cached != nullptr) {
+        for (const auto& client : *cached)
+            visitor(client);
+        return;
+    }
 
-                to_query.push_back(std::make_pair(static_cast<RemoteServerNode*>(server),
-                    std::make_pair(pt_begin, pt_end)));
+    // the clients are passed on as they are found, and a copy is kept for
+    // the cache until the block turns out to be too large for it
+    std::vector<SearchCache::Client> storage;
+    bool cacheable = true;
+    rtree::Rectangle square = get_block_rectangle(block);
+    uint64_t shift = 64 - m_resolution;
+    const RangeSnapshot& index = range_index();
+    for (size_t i = index.find_prefix(block.first << shift); i < index.size(); i++) {
+        if ((index.start_at(i) >> shift) > block.second)
+            break;
+        ServerNode *server = index.server_at(i);
+        if (!server->is_local())
+            continue;
+        static_cast<LocalServerNode*>(server)->search_handles(square, [&](ClientHandle handle, const rtree::Point& cell) {
+            SearchCache::Client client{ handle, uint32_t(cell.first), uint32_t(cell.second) };
+            visitor(client);
+            if (!cacheable)
+                return;
+            storage.push_back(client);
+            if (!m_search_cache.fits(storage.size())) {
+                cacheable = false;
+                std::vector<SearchCache::Client>().swap(storage);
             }
+        });
+    }
 
-            NodeID next_point = server->get_range().to();
-            i = next_point.to_hilbert_value(m_resolution) + 1;
-        } else {
-            bool found = false;
-            for (int j = last_corner + 1; j < 4; j++) {
-                if (hilbert_corners[j] > i) {
-                    i = hilbert_corners[j];
-                    found = true;
-                    break;
-                }
+    if (cacheable)
+        m_search_cache.insert(block, std::move(storage));
+}
+
+void
+Table::search_clients(const rtree::Rectangle& rectangle, uint64_t min_hilbert_value, uint64_t max_hilbert_value, std::function<void(rpc::Error*, const std::vector<NodeID>*, bool)> callback) const
+{
+    search_clients(rectangle, min_hilbert_value, max_hilbert_value, nullptr,
+        [&rectangle](RemoteServerNode *server, const std::pair<uint64_t, uint64_t>& hilbert_bounds, ForwardCallback&& reply) {
+        server->get_proxy()->invoke_forward_search_clients(std::move(reply), rectangle.get_lower(), rectangle.get_upper(), hilbert_bounds);
+    }, std::move(callback));
+}
+
+void
+Table::search_radius(const GeoPoint2D& center, double radius, uint64_t min_hilbert_value, uint64_t max_hilbert_value, std::function<void(rpc::Error*, const std::vector<NodeID>*, bool)> callback) const
+{
+    // the owner of each client does the exact check, so only the clients in
+    // the circle are sent back, not those in the whole bounding box
+    search_clients(get_rectangle_for_circle(center, radius), min_hilbert_value, max_hilbert_value,
+        [&center, radius](std::vector<ClientNode*>& clients) {
+        std::vector<double> latitudes(clients.size()), longitudes(clients.size());
+        for (size_t i = 0; i < clients.size(); i++) {
+            latitudes[i] = clients[i]->get_coordinates().latitude;
+            longitudes[i] = clients[i]->get_coordinates().longitude;
+        }
+        std::vector<uint32_t> indices(clients.size());
+        size_t n_found = geo::filter_within_radius(center, radius, latitudes.data(), longitudes.data(),
+                                                   clients.size(), indices.data());
+        // the indices are increasing, so the clients can be moved down in place
+        for (size_t i = 0; i < n_found; i++)
+            clients[i] = clients[indices[i]];
+        clients.resize(n_found);
+    }, [&center, radius](RemoteServerNode *server, const std::pair<uint64_t, uint64_t>& hilbert_bounds, ForwardCallback&& reply) {
+        server->get_proxy()->invoke_forward_search_radius(std::move(reply), center, radius, hilbert_bounds);
+    }, std::move(callback));
+}
+
+void
+Table::search_clients(const rtree::Rectangle& rectangle, uint64_t min_hilbert_value, uint64_t max_hilbert_value,
+                      const std::function<void(std::vector<ClientNode*>&)>& filter,
+                      const std::function<void(RemoteServerNode*, const std::pair<uint64_t, uint64_t>&, ForwardCallback&&)>& forward,
+                      std::function<void(rpc::Error*, const std::vector<NodeID>*, bool)> callback) const
+{
+    std::vector<std::pair<uint64_t, uint64_t>> intervals;
+    get_search_intervals(rectangle, intervals);
+
+    std::vector<std::pair<RemoteServerNode*, std::pair<uint64_t, uint64_t>>> to_query;
+    std::vector<SearchCache::Block> blocks;
+    // the local clients found, until there are enough to filter them, and
+    // those that passed, until there are enough to send them
+    std::vector<ClientNode*> clients;
+    std::vector<NodeID> our_response;
+    auto flush_clients = [&]() {
+        if (filter)
+            filter(clients);
+        for (ClientNode *client : clients) {
+            our_response.push_back(client->get_id());
+            if (our_response.size() == kSearchBatchSize) {
+                callback(nullptr, &our_response, false);
+                our_response.clear();
             }
-            if (!found)
+        }
+        clients.clear();
+    };
+
+    // both the intervals and the ranges are sorted along the curve, so a server
+    // can only be seen again by the interval right after the one that found it
+    const ServerNode *last_server = nullptr;
+    for (const auto& interval : intervals) {
+        uint64_t first = std::max(interval.first, min_hilbert_value);
+        uint64_t last = std::min(interval.second, max_hilbert_value);
+        if (first > last)
+            continue;
+
+        // the index holds the first 64 bits of each range, and the Hilbert
+        // values are the top m_resolution bits of those
+        uint64_t shift = 64 - m_resolution;
+        bool has_local = false;
+        const RangeSnapshot& index = range_index();
+        for (size_t i = index.find_prefix(first << shift); i < index.size(); i++) {
+            if ((index.start_at(i) >> shift) > last)
                 break;
+            ServerNode *server = index.server_at(i);
+            if (server->is_local()) {
+                has_local = true;
+                continue;
+            }
+            if (server == last_server)
+                continue;
+            last_server = server;
+
+            auto pt_begin = server->get_range().from().to_hilbert_value(m_resolution);
+            auto pt_end = server->get_range().to().to_hilbert_value(m_resolution);
+
+            to_query.push_back(std::make_pair(static_cast<RemoteServerNode*>(server),
+                std::make_pair(pt_begin, pt_end)));
+        }
+        if (!has_local)
+            continue;
+
+        // the local clients are found block by block, so that the blocks
+        // can be cached and the same interval found again without the R-tree
+        blocks.clear();
+        SearchCache::split_interval(first, last, m_resolution, blocks);
+        for (const auto& block : blocks) {
+            // coarse intervals can stick out of the rectangle
+            bool inside = rectangle.contains(get_block_rectangle(block));
+            visit_block_clients(block, [&](const SearchCache::Client& cached) {
+                if (!inside && !rectangle.contains(rtree::Point(cached.x, cached.y)))
+                    return;
+                ClientNode *client = m_client_pool.get(cached.handle);
+                assert(client != nullptr);
+                clients.push_back(client);
+                if (clients.size() == kSearchBatchSize)
+                    flush_clients();
+            });
         }
     }
 
+    flush_clients();
+
     if (to_query.empty()) {
-        callback(nullptr, &our_response);
+        callback(nullptr, &our_response, true);
     } else {
         SearchRequest *request = new SearchRequest(std::move(callback));
         request->add_local(our_response);
         for (auto& server : to_query)
-            request->perform_request(server.first, rectangle, server.second);
+            forward(server.first, server.second, request->expect_reply());
+        request->all_requests_sent();
+    }
+}
+
+ServerNode *
+Table::search_clients_page(const rtree::Rectangle& rectangle, const NodeID& after, size_t limit,
+                           std::vector<NodeID>& results, NodeID& next) const
+{
+    assert(limit > results.size());
+    std::vector<std::pair<uint64_t, uint64_t>> intervals;
+    get_search_intervals(rectangle, intervals);
+
+    uint64_t shift = 64 - m_resolution;
+    uint64_t start = after.to_hilbert_value(m_resolution);
+    const ServerNode *last_server = nullptr;
+    for (const auto& interval : intervals) {
+        if (interval.second < start)
+            continue;
+        uint64_t first = std::max(interval.first, start);
+
+        const RangeSnapshot& index = range_index();
+        for (size_t i = index.find_prefix(first << shift); i < index.size(); i++) {
+            if ((index.start_at(i) >> shift) > interval.second)
+                break;
+            ServerNode *server = index.server_at(i);
+            if (server == last_server)
+                continue;
+            last_server = server;
+
+            if (!server->is_local()) {
+                // the rest is fetched from the other server, with the next page
+                next = std::max(after, server->get_range().from());
+                return server;
+            }
+
+            // the clients come in node ID order, so the search stops as soon
+            // as the page is full, except that the clients in the same cell
+            // as the last one (which have the same ID) all go in the page,
+            // because the next page starts after that ID
+            bool full = false;
+            static_cast<LocalServerNode*>(server)->search_from(rectangle, start, [&](ClientNode* client) {
+                const NodeID& id = client->get_id();
+                if (!(after < id))
+                    return true;
+                if (results.size() >= limit && !(id == results.back())) {
+                    full = true;
+                    return false;
+                }
+                results.push_back(id);
+                return true;
+            });
+            if (full) {
+                next = results.back();
+                return server;
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+NodeID
+Table::search_page_start(const rtree::Rectangle& rectangle) const
+{
+    std::vector<std::pair<uint64_t, uint64_t>> intervals;
+    get_search_intervals(rectangle, intervals);
+    if (intervals.empty())
+        return NodeID();
+
+    // with the valid flag cleared, the ID sorts right before that of the
+    // first cell, and after the IDs of all the cells before it
+    NodeID start(intervals.front().first, m_resolution);
+    start.get_buffer()[NodeID::size - 1] &= ~1;
+    return start;
+}
+
+// The nearest clients found so far by a nearest neighbour search
+class NeighbourSet
+{
+private:
+    size_t m_k;
+    double m_max_distance;
+    // a max-heap on the distance, so the farthest neighbour is the one to go
+    std::vector<Neighbour> m_heap;
+
+    static bool closer(const Neighbour& one, const Neighbour& two)
+    {
+        return one.distance < two.distance;
+    }
+
+public:
+    NeighbourSet(size_t k, double max_distance) : m_k(k), m_max_distance(max_distance)
+    {
+        assert(k > 0);
+    }
+
+    // a client must be closer than this to be one of the neighbours
+    double bound() const
+    {
+        return m_heap.size() < m_k ? m_max_distance : m_heap.front().distance;
+    }
+
+    void add(const Neighbour& neighbour)
+    {
+        if (neighbour.distance >= bound())
+            return;
+        if (m_heap.size() == m_k) {
+            std::pop_heap(m_heap.begin(), m_heap.end(), closer);
+            m_heap.pop_back();
+        }
+        m_heap.push_back(neighbour);
+        std::push_heap(m_heap.begin(), m_heap.end(), closer);
+    }
+
+    // the neighbours, nearest first (this empties the set)
+    std::vector<Neighbour> take_sorted()
+    {
+        std::sort_heap(m_heap.begin(), m_heap.end(), closer);
+        return std::move(m_heap);
+    }
+};
+
+// Asks the remote servers that could hold some of the nearest clients, one
+// at a time and nearest first, so that each one is only asked for the clients
+// that are closer than the ones found so far
+class KnnRequest
+{
+private:
+    struct Server
+    {
+        double bound;
+        std::shared_ptr<protocol::ServerProxy> proxy;
+        std::pair<uint64_t, uint64_t> hilbert_bounds;
+    };
+
+    GeoPoint2D m_point;
+    size_t m_k;
+    NeighbourSet m_neighbours;
+    std::vector<Server> m_servers;
+    size_t m_next_server = 0;
+    std::function<void(rpc::Error*, const std::vector<Neighbour>*)> m_callback;
+
+public:
+    KnnRequest(const GeoPoint2D& point, size_t k, NeighbourSet&& neighbours,
+               std::function<void(rpc::Error*, const std::vector<Neighbour>*)>&& callback) :
+        m_point(point), m_k(k), m_neighbours(std::move(neighbours)), m_callback(callback) {}
+
+    // <server> is only asked about the part of its range between the
+    // two Hilbert values
+    void add_server(double bound, RemoteServerNode *server, uint8_t resolution,
+                    uint64_t min_hilbert_value, uint64_t max_hilbert_value)
+    {
+        // the server nodes can go away while the request is running, so only
+        // what is needed to ask them is kept (a server with no proxy fails
+        // the request if it is reached)
+        auto hilbert_bounds = std::make_pair(std::max(server->get_range().from().to_hilbert_value(resolution), min_hilbert_value),
+                                             std::min(server->get_range().to().to_hilbert_value(resolution), max_hilbert_value));
+        m_servers.push_back(Server{ bound, server->get_proxy(), hilbert_bounds });
+    }
+
+    // ask the next server, or complete the request if there is no server
+    // left that can hold a neighbour
+    void next()
+    {
+        if (m_next_server == m_servers.size() || m_servers[m_next_server].bound >= m_neighbours.bound()) {
+            std::vector<Neighbour> results = m_neighbours.take_sorted();
+            m_callback(nullptr, &results);
+            delete this;
+            return;
+        }
+
+        const Server& server = m_servers[m_next_server++];
+        if (server.proxy == nullptr) {
+            // the owner of this range is not known, so its clients cannot be
+            // ruled out
+            rpc::RemoteError error(ENXIO);
+            m_callback(&error, nullptr);
+            delete this;
+            return;
+        }
+        server.proxy->invoke_forward_knn_clients([this](rpc::Error *error, const std::vector<Neighbour>& reply) {
+            if (error) {
+                m_callback(error, nullptr);
+                delete this;
+                return;
+            }
+            for (const auto& neighbour : reply)
+                m_neighbours.add(neighbour);
+            next();
+        }, m_point, uint32_t(m_k), m_neighbours.bound(), server.hilbert_bounds);
     }
+};
+
+double
+Table::min_distance_to_range(const GeoPoint2D& pt, const NodeIDRange& range) const
+{
+    // a range is an aligned block of the curve, so it covers a square of the
+    // grid, or two squares next to each other if its size is an odd power of 2
+    int bits = m_resolution - std::min<int>(range.mask(), m_resolution);
+    uint64_t side_mask = (1ULL << (bits / 2)) - 1;
+    auto distance_to_square = [&pt, side_mask, this](uint64_t hilbert_value) {
+        uint64_t x, y;
+        hilbert_values::fast_d2xy(1ULL << (m_resolution / 2), hilbert_value, x, y);
+        auto lower = std::make_pair(x & ~side_mask, y & ~side_mask);
+        auto upper = std::make_pair(x | side_mask, y | side_mask);
+        return min_distance_to_cells(pt, rtree::Rectangle(upper, lower), m_resolution);
+    };
+
+    uint64_t first = range.from().to_hilbert_value(m_resolution);
+    double bound = distance_to_square(first);
+    if (bits % 2)
+        bound = std::min(bound, distance_to_square(first + (1ULL << (bits - 1))));
+    return bound;
+}
+
+void
+Table::knn_search(const GeoPoint2D& pt, uint64_t min_hilbert_value, uint64_t max_hilbert_value,
+                  NeighbourSet& neighbours, std::vector<std::pair<double, RemoteServerNode*>>* remote) const
+{
+    // neighbouring ranges along the curve are not necessarily close to pt,
+    // so the servers are sorted by distance instead, and the nearest ones
+    // are searched first, to prune the others as much as possible
+    uint64_t shift = 64 - m_resolution;
+    std::vector<std::pair<double, ServerNode*>> servers;
+    const RangeSnapshot& index = range_index();
+    for (size_t i = index.find_prefix(min_hilbert_value << shift); i < index.size(); i++) {
+        if ((index.start_at(i) >> shift) > max_hilbert_value)
+            break;
+        ServerNode *server = index.server_at(i);
+        if (!server->is_local() && remote == nullptr)
+            continue;
+        servers.push_back(std::make_pair(min_distance_to_range(pt, server->get_range()), server));
+    }
+    std::stable_sort(servers.begin(), servers.end(), [](const std::pair<double, ServerNode*>& one, const std::pair<double, ServerNode*>& two) {
+        return one.first < two.first;
+    });
+
+    for (const auto& candidate : servers) {
+        if (candidate.first >= neighbours.bound())
+            break;
+        if (!candidate.second->is_local()) {
+            remote->push_back(std::make_pair(candidate.first, static_cast<RemoteServerNode*>(candidate.second)));
+            continue;
+        }
+
+        // the clients come in order of the cell they are in, so the search
+        // stops at the first cell that is farther than the kth neighbour
+        static_cast<LocalServerNode*>(candidate.second)->visit_nearest(pt, [&pt, &neighbours](ClientNode *client, double bound) {
+            if (bound >= neighbours.bound())
+                return false;
+            neighbours.add(Neighbour{ client->get_id(), GeoPoint2D::distance(pt, client->get_coordinates()) });
+            return true;
+        });
+    }
+}
+
+void
+Table::knn_clients(const GeoPoint2D& pt, size_t k, std::function<void(rpc::Error*, const std::vector<Neighbour>*)> callback) const
+{
+    knn_clients(pt, k, std::numeric_limits<double>::infinity(), 0, (uint64_t)-1, std::move(callback));
+}
+
+void
+Table::knn_clients(const GeoPoint2D& pt, size_t k, double max_distance,
+                   uint64_t min_hilbert_value, uint64_t max_hilbert_value,
+                   std::function<void(rpc::Error*, const std::vector<Neighbour>*)> callback) const
+{
+    NeighbourSet neighbours(k, max_distance);
+    std::vector<std::pair<double, RemoteServerNode*>> remote;
+    knn_search(pt, min_hilbert_value, max_hilbert_value, neighbours, &remote);
+
+    KnnRequest *request = new KnnRequest(pt, k, std::move(neighbours), std::move(callback));
+    for (const auto& server : remote)
+        request->add_server(server.first, server.second, m_resolution, min_hilbert_value, max_hilbert_value);
+    request->next();
+}
+
+std::vector<Neighbour>
+Table::knn_local_clients(const GeoPoint2D& pt, size_t k, double max_distance,
+                         uint64_t min_hilbert_value, uint64_t max_hilbert_value) const
+{
+    NeighbourSet neighbours(k, max_distance);
+    knn_search(pt, min_hilbert_value, max_hilbert_value, neighbours, nullptr);
+    return neighbours.take_sorted();
 }
 
 }
@@ -24,11 +24,330 @@
 #include <algorithm>
 #include <map>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 #include "node.hpp"
+#include "rcu.hpp"
 
 namespace libhdht {
 
+// the index in <starts>, which has <n> sorted elements and starts with 0,
+// of the last one at or before <prefix>
+// The search is branchless: the loop runs log2(n) times regardless of
+// the key, and each step compiles to a conditional move
+static inline size_t
+find_range_start(const uint64_t *starts, size_t n, uint64_t prefix)
+{
+    const uint64_t *base = starts;
+    assert(n > 0 && base[0] == 0);
+
+    while (n > 1) {
+        size_t half = n / 2;
+        base = (base[half] <= prefix) ? base + half : base;
+        n -= half;
+    }
+    return base - starts;
+}
+
+// An immutable, flat copy of the range table, for fast lookups
+// The ranges are identified by the first 64 bits of their start, which is
+// enough to tell them apart as long as the resolution is at most 64 bits
+// The table publishes a new one every time its ranges change, which is rare
+// compared to lookups; any thread can read it within an rcu::ReadSection,
+// while the thread of the table changes it
+class RangeSnapshot
+{
+public:
+    struct Entry {
+        NodeIDRange range;
+        bool is_local;
+        // the listening address of the owner of a remote range, if known
+        net::Address owner;
+    };
+
+private:
+    std::vector<uint64_t> m_starts;
+    // only for the thread of the table, which owns the servers
+    std::vector<ServerNode*> m_servers;
+    std::vector<Entry> m_entries;
+    uint8_t m_resolution;
+    uint64_t m_version;
+
+public:
+    RangeSnapshot(const std::map<NodeID, ServerNode*>& ranges, uint8_t resolution, uint64_t version);
+
+    // the version of the table, as in Table::ranges_version()
+    uint64_t version() const
+    {
+        return m_version;
+    }
+    size_t size() const
+    {
+        return m_entries.size();
+    }
+    const Entry& at(size_t index) const
+    {
+        return m_entries[index];
+    }
+    uint64_t start_at(size_t index) const
+    {
+        return m_starts[index];
+    }
+    ServerNode *server_at(size_t index) const
+    {
+        return m_servers[index];
+    }
+
+    // the index of the last range that starts at or before <prefix>
+    size_t find_prefix(uint64_t prefix) const
+    {
+        return find_range_start(m_starts.data(), m_starts.size(), prefix);
+    }
+    // the index of the range that contains <id> (there are no holes)
+    size_t find_index(const NodeID& id) const;
+    const Entry& find(const NodeID& id) const
+    {
+        return m_entries[find_index(id)];
+    }
+};
+
+// An open addressing hash table of clients, keyed on their node ID
+// Each slot keeps the first 64 bits of the node ID next to the client, so
+// a lookup only touches the client it returns
+// Clients in the same cell of the grid have the same node ID, so a key can
+// have several clients: find() returns any of them, and erase() the one given
+class ClientIndex
+{
+    struct Slot {
+        uint64_t prefix;
+        ClientNode *client;
+    };
+
+    std::vector<Slot> m_slots;
+    size_t m_size = 0;
+    uint8_t m_shift = 64;
+
+    size_t bucket_for(uint64_t prefix) const
+    {
+        // node IDs are mostly zero in the low bits, so mix the high bits down
+        return (prefix * 0x9E3779B97F4A7C15ULL) >> m_shift;
+    }
+    void grow();
+
+public:
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    // one of the clients with node ID <id>, or nullptr
+    ClientNode *find(const NodeID& id) const;
+    // add <client> under its current node ID, next to the other clients
+    // with that ID, if any
+    void insert(ClientNode *client);
+    // remove <client>, if it is indexed under its current node ID
+    void erase(ClientNode *client);
+
+    template<typename Callback>
+    void foreach_client(const Callback& callback) const
+    {
+        for (const Slot& slot : m_slots) {
+            if (slot.client != nullptr)
+                callback(slot.client);
+        }
+    }
+};
+
+// A cache of the local clients found in the blocks of the Hilbert curve that
+// searches are decomposed into, so that the same area can be searched again
+// without going through the R-trees
+// A block is an aligned run of 4^k values of the curve, which covers a square
+// of 2^k by 2^k cells of the grid. The entries of the blocks that contain
+// a client are dropped when the client is added, removed or moves to another
+// cell, and the least recently used entries are evicted past the memory budget
+class SearchCache
+{
+public:
+    // the first and last Hilbert value of a block
+    typedef std::pair<uint64_t, uint64_t> Block;
+    // a client found in a block, and the cell of the grid it is in
+    // (searches use curves of at most 64 bits, so each coordinate fits in 32)
+    struct Client {
+        ClientHandle handle;
+        uint32_t x;
+        uint32_t y;
+    };
+
+private:
+    struct BlockHash {
+        size_t operator()(const Block& block) const
+        {
+            // blocks are mostly zero in the low bits, so mix the high bits down
+            return (block.first * 0x9E3779B97F4A7C15ULL) ^ (block.second - block.first);
+        }
+    };
+    struct Entry {
+        std::vector<Client> clients;
+        // the position in m_lru
+        std::list<Block>::iterator lru;
+    };
+
+    std::unordered_map<Block, Entry, BlockHash> m_entries;
+    // the cached blocks, most recently used first
+    std::list<Block> m_lru;
+    // how many entries there are for blocks of 4^k values, for each k, so
+    // that invalidating a client only looks for the sizes that are cached
+    size_t m_per_size[33] = {};
+    size_t m_memory = 0;
+    size_t m_budget;
+
+    static size_t memory_for(size_t n_clients)
+    {
+        // an estimate of the hash table node, the list node and the vector
+        return sizeof(Block) + sizeof(Entry) + 4 * sizeof(void*) + n_clients * sizeof(Client);
+    }
+    void erase(std::unordered_map<Block, Entry, BlockHash>::iterator it);
+
+public:
+    static const size_t DEFAULT_BUDGET = 16 * 1024 * 1024;
+
+    SearchCache(size_t budget = DEFAULT_BUDGET) : m_budget(budget) {}
+
+    size_t size() const
+    {
+        return m_entries.size();
+    }
+    size_t memory() const
+    {
+        return m_memory;
+    }
+    // whether a block of <n_clients> clients can be cached at all
+    bool fits(size_t n_clients) const
+    {
+        return memory_for(n_clients) <= m_budget;
+    }
+    // change the memory budget, in bytes, evicting entries as needed
+    void set_budget(size_t budget);
+
+    // the clients of <block>, or nullptr if they are not cached
+    const std::vector<Client>* find(const Block& block);
+    // cache the clients of <block>, evicting other entries as needed, and
+    // return the cached list; if the block alone is over the budget, nothing
+    // is cached, nullptr is returned and <clients> is left untouched
+    const std::vector<Client>* insert(const Block& block, std::vector<Client>&& clients);
+    // drop the entries of the blocks that contain <hilbert_value>, a value
+    // of a curve of <resolution> bits
+    void invalidate(uint64_t hilbert_value, uint8_t resolution);
+    void clear();
+
+    // split [first, last] into the largest blocks it is made of, for
+    // a curve of <resolution> bits, in order
+    static void split_interval(uint64_t first, uint64_t last, uint8_t resolution,
+        std::vector<Block>& blocks);
+};
+
+// A cache of the owners of ranges finer than those in the table, learned
+// from the answers to find_controlling_server, so that the next lookup in the
+// same range asks the owner directly instead of going through every server
+// of a coarser range
+// Unlike the table, which only changes when servers announce or hand over
+// ranges, the entries are hints: they can be out of date, and are dropped
+// when the owner denies owning them. The cached ranges never overlap, and
+// the least recently used ones are evicted past the capacity
+class RangeOwnerCache
+{
+public:
+    struct Owner {
+        NodeIDRange range;
+        std::shared_ptr<protocol::ServerProxy> proxy;
+        // the version of the range table of the owner, when it answered
+        uint64_t version;
+    };
+
+private:
+    struct Entry {
+        Owner owner;
+        // the position in m_lru
+        std::list<NodeID>::iterator lru;
+    };
+
+    // keyed on the start of the range
+    std::map<NodeID, Entry> m_entries;
+    // the starts of the cached ranges, most recently used first
+    std::list<NodeID> m_lru;
+    size_t m_capacity;
+
+    void erase(std::map<NodeID, Entry>::iterator it);
+
+public:
+    static const size_t DEFAULT_CAPACITY = 4096;
+
+    RangeOwnerCache(size_t capacity = DEFAULT_CAPACITY) : m_capacity(capacity) {}
+
+    size_t size() const
+    {
+        return m_entries.size();
+    }
+
+    // the owner of the cached range that contains <id>, or nullptr
+    const Owner* find(const NodeID& id);
+    // remember <owner>, replacing the entries of the ranges it overlaps,
+    // unless one of them comes from a more recent answer of the same server
+    void insert(Owner&& owner);
+    // forget the entry of exactly <range>, if any
+    void erase(const NodeIDRange& range);
+};
+
+// The ranges owned by each of the servers of a process, which run on
+// different threads, so that any of them can tell who owns a node without
+// asking the others
+// Each server publishes its local ranges every time they change, as a new
+// snapshot, which readers use within an rcu::ReadSection
+class SharedRangeTable
+{
+public:
+    struct Owner {
+        NodeIDRange range;
+        net::Address address;
+        // the version of the range table of the owner
+        uint64_t version;
+    };
+    // sorted by the start of the range, with no overlaps
+    typedef std::vector<Owner> Snapshot;
+
+private:
+    // serializes the writers
+    std::mutex m_lock;
+    rcu::Pointer<Snapshot> m_snapshot;
+
+public:
+    SharedRangeTable() : m_snapshot(std::make_unique<Snapshot>()) {}
+    SharedRangeTable(const SharedRangeTable&) = delete;
+    SharedRangeTable& operator=(const SharedRangeTable&) = delete;
+
+    // valid until the end of the enclosing rcu::ReadSection
+    const Snapshot *snapshot() const
+    {
+        return m_snapshot.get();
+    }
+
+    // the owner of the range of <snapshot> that contains <id>, or nullptr
+    static const Owner* find(const Snapshot& snapshot, const NodeID& id);
+
+    // replace the ranges published by the server at <address> with <ranges>
+    // (the ranges of other servers that overlap them are dropped, they
+    // changed hands)
+    void publish(const net::Address& address, const std::vector<NodeIDRange>& ranges, uint64_t version);
+};
+
+class NeighbourSet;
+
+// the reply of a remote server to a search
+typedef std::function<void(rpc::Error*, const std::vector<NodeID>&)> ForwardCallback;
+
 // the actual table, holds pointers to all the nodes, and is responsible
 // for freeing them
 class Table
@@ -40,8 +359,61 @@ class Table
     // and more finely
     std::map<NodeID, ServerNode*> m_ranges;
 
-    // the currently connected clients, indexed by their node ID
-    std::map<NodeID, ClientNode*> m_clients;
+    // the currently connected clients, and the index of them by node ID
+    ClientPool m_client_pool;
+    ClientIndex m_clients;
+    // the local clients found by the last searches
+    mutable SearchCache m_search_cache;
+    // the owners of the finer ranges found by the last lookups
+    RangeOwnerCache m_owner_cache;
+    // incremented every time m_ranges changes
+    uint64_t m_ranges_version = 0;
+    // the same ranges, as a sorted array, for the lookups of this thread
+    // and the others; it must be republished every time m_ranges changes,
+    // with ranges_changed()
+    rcu::Pointer<RangeSnapshot> m_snapshot;
+    // where the local ranges are published, if this table shares the DHT
+    // with the other servers of the process
+    std::shared_ptr<SharedRangeTable> m_shared_ranges;
+    net::Address m_shared_address;
+
+    void get_search_intervals(const rtree::Rectangle& rectangle,
+        std::vector<std::pair<uint64_t, uint64_t>>& intervals) const;
+    // call <visitor> on the local clients in <block>, from the cache or from
+    // the local servers as they are found, and cache them if they fit
+    void visit_block_clients(const SearchCache::Block& block,
+        const std::function<void(const SearchCache::Client&)>& visitor) const;
+    // the square of the grid covered by <block>
+    rtree::Rectangle get_block_rectangle(const SearchCache::Block& block) const;
+    // update the ranges index after m_ranges changed
+    void ranges_changed();
+    // the current index of the ranges
+    // The thread of the table needs no read section: only it publishes
+    // new snapshots, so the current one is never freed under it
+    const RangeSnapshot& range_index() const
+    {
+        return *m_snapshot.get();
+    }
+
+    // search the clients in <rectangle> that pass <filter> (all of them, if
+    // <filter> is empty), which is given the local clients in batches
+    // and removes the others; <forward> is called to ask each remote server,
+    // with the Hilbert bounds of its range and the callback for its reply
+    void search_clients(const rtree::Rectangle& rectangle,
+        uint64_t min_hilbert_value, uint64_t max_hilbert_value,
+        const std::function<void(std::vector<ClientNode*>&)>& filter,
+        const std::function<void(RemoteServerNode*, const std::pair<uint64_t, uint64_t>&, ForwardCallback&&)>& forward,
+        std::function<void(rpc::Error*, const std::vector<NodeID>*, bool)> callback) const;
+
+    // a lower bound of the distance from <pt> to the clients in <range>
+    double min_distance_to_range(const GeoPoint2D& pt, const NodeIDRange& range) const;
+    // offer the clients of the local servers with a range between the two
+    // Hilbert values to <neighbours>, visiting the servers nearest first
+    // The remote servers that could hold nearer clients are appended to
+    // <remote>, with the lower bound of their distance, nearest first
+    // (if <remote> is nullptr, they are ignored)
+    void knn_search(const GeoPoint2D& pt, uint64_t min_hilbert_value, uint64_t max_hilbert_value,
+        NeighbourSet& neighbours, std::vector<std::pair<double, RemoteServerNode*>>* remote) const;
 
 public:
     Table(uint8_t resolution);
@@ -64,10 +436,17 @@ public:
         return NodeID(pt, m_resolution);
     }
     rtree::Rectangle get_rectangle_for_points(const GeoPoint2D& upper, const GeoPoint2D& lower) const;
+    // a rectangle that contains all the points within <radius> meters of <center>
+    rtree::Rectangle get_rectangle_for_circle(const GeoPoint2D& center, double radius) const;
 
     // Client management
     ClientNode *get_or_create_client_node(const NodeID& id, const GeoPoint2D& pt);
     ClientNode *get_existing_client_node(const NodeID& id);
+    // the client that <handle> refers to, or nullptr if it was forgotten
+    ClientNode *get_client(ClientHandle handle) const
+    {
+        return m_client_pool.get(handle);
+    }
     ServerNode *move_client(ClientNode *, const GeoPoint2D&);
     void forget_client(ClientNode *);
     void forget_server(ServerNode *);
@@ -76,6 +455,45 @@ public:
     bool add_remote_server_node(const NodeIDRange& range, std::shared_ptr<protocol::ServerProxy> proxy);
     void add_local_server_node(const NodeIDRange& range, LocalServerNode *existing = nullptr);
     ServerNode *find_controlling_server(const NodeID& id) const;
+    // the version of the ranges in this table, which increases every time
+    // a range is split, merged, handed over or learned
+    uint64_t ranges_version() const
+    {
+        return m_ranges_version;
+    }
+
+    // publish the local ranges to <shared_ranges>, as those of the server
+    // at <address>, from now on
+    void share_ranges(std::shared_ptr<SharedRangeTable> shared_ranges, const net::Address& address);
+    const SharedRangeTable *shared_ranges() const
+    {
+        return m_shared_ranges.get();
+    }
+
+    // the current copy of the range table, which can be used from any
+    // thread, until the end of the enclosing rcu::ReadSection
+    const RangeSnapshot *ranges_snapshot() const
+    {
+        return m_snapshot.get();
+    }
+
+    // the owner of a range finer than the remote range of the table that
+    // contains <id>, if one was learned, or nullptr
+    const RangeOwnerCache::Owner *find_cached_owner(const NodeID& id)
+    {
+        return m_owner_cache.find(id);
+    }
+    // remember that <range>, within a remote range of the table, is owned
+    // by the server of <proxy>, whose table had the given version
+    void learn_owner(const NodeIDRange& range, std::shared_ptr<protocol::ServerProxy> proxy, uint64_t version)
+    {
+        m_owner_cache.insert(RangeOwnerCache::Owner{ range, proxy, version });
+    }
+    // forget the owner learned for <range>, which turned out to be wrong
+    void forget_owner(const NodeIDRange& range)
+    {
+        m_owner_cache.erase(range);
+    }
 
     // perform any load balancing by splitting any local range
     enum class LoadBalanceAction {
@@ -85,12 +503,58 @@ public:
     void load_balance_with_peer(std::shared_ptr<protocol::ServerProxy>,
         std::function<void(LoadBalanceAction, ServerNode*)>);
 
+    // the memory used to cache the local clients of recent searches, in bytes
+    void set_search_cache_budget(size_t budget)
+    {
+        m_search_cache.set_budget(budget);
+    }
+
     // dump the table to the log (with level LOG_DEBUG)
     void debug_dump_table() const;
 
+    // the callback is called with each batch of results as they are
+    // found, and the last argument is true for the last call (which
+    // is also the only call in case of error)
     void search_clients(const rtree::Rectangle& upper,
         uint64_t min_hilbert_value, uint64_t max_hilbert_value,
-        std::function<void(rpc::Error*, std::vector<NodeID>*)>) const;
+        std::function<void(rpc::Error*, const std::vector<NodeID>*, bool)>) const;
+    // same as search_clients(), for the clients within <radius> meters of <center>
+    void search_radius(const GeoPoint2D& center, double radius,
+        uint64_t min_hilbert_value, uint64_t max_hilbert_value,
+        std::function<void(rpc::Error*, const std::vector<NodeID>*, bool)>) const;
+
+    // find at most <limit> clients in <rectangle> with a node ID greater than
+    // <after>, in node ID order, and append them to <results> (more if the
+    // last ones share a node ID, so that the next page does not miss any)
+    // Only local servers are searched: the search stops at the first remote
+    // server, or when the limit is reached, and that server is returned,
+    // with <next> set to where the search continues; returns nullptr
+    // if the search is complete
+    ServerNode *search_clients_page(const rtree::Rectangle& rectangle,
+        const NodeID& after, size_t limit,
+        std::vector<NodeID>& results, NodeID& next) const;
+    // the <after> of the first page of a search of <rectangle>: just before
+    // the first node ID of the rectangle along the curve
+    NodeID search_page_start(const rtree::Rectangle& rectangle) const;
+
+    // find the <k> clients closest to <pt>, nearest first
+    // The servers are visited in order of their distance from <pt>, and
+    // the remote ones are asked one at a time, until the distance of the
+    // next server proves that all the neighbours were found
+    void knn_clients(const GeoPoint2D& pt, size_t k,
+        std::function<void(rpc::Error*, const std::vector<Neighbour>*)>) const;
+    // the same, but only the clients closer than <max_distance>, in the
+    // ranges between the two Hilbert values
+    // The remote servers are only asked about their part of those ranges.
+    void knn_clients(const GeoPoint2D& pt, size_t k, double max_distance,
+        uint64_t min_hilbert_value, uint64_t max_hilbert_value,
+        std::function<void(rpc::Error*, const std::vector<Neighbour>*)>) const;
+
+    // find the <k> clients closest to <pt> that are closer than <max_distance>,
+    // nearest first, among the local servers with a range between the two
+    // Hilbert values
+    std::vector<Neighbour> knn_local_clients(const GeoPoint2D& pt, size_t k, double max_distance,
+        uint64_t min_hilbert_value, uint64_t max_hilbert_value) const;
 };
 
 }
@@ -0,0 +1,75 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <libhdht/geo.hpp>
+
+namespace libhdht
+{
+
+namespace geo
+{
+
+// Great-circle distances from one point to many at once
+//
+// The points are given as separate arrays of latitudes and longitudes, in
+// degrees, within [-90, 90] and [-180, 180]. The distances are computed
+// with the same haversine formula as GeoPoint2D::distance(), but the
+// trigonometric functions are replaced by polynomials, which are evaluated
+// for 4 or 8 points in parallel with AVX2 or AVX-512.
+//
+// <max_error> is the largest acceptable error, in meters: the fastest
+// polynomials within it are used, and if it is below what the most accurate
+// ones can do (1e-6), the distances are computed with the standard library.
+// Unlike GeoPoint2D::distance(), nearly antipodal points do not lose
+// precision.
+static const double kDefaultMaxError = 1e-3;
+
+void distance_batch(const GeoPoint2D& origin, const double* latitudes, const double* longitudes,
+                    double* distances, size_t count, double max_error = kDefaultMaxError);
+
+// Writes to <indices> the positions of the points within <radius> meters of
+// <center>, in order, and returns how many there are
+// Points farther than the radius in latitude or longitude are rejected with
+// a simple comparison first, and the distance is computed for the others
+// (so points within <max_error> of the circle can be classified either way).
+size_t filter_within_radius(const GeoPoint2D& center, double radius, const double* latitudes,
+                            const double* longitudes, size_t count, uint32_t* indices,
+                            double max_error = kDefaultMaxError);
+
+// An implementation of distance_batch()
+struct Kernel {
+    const char *name;
+    void (*distance_batch)(const GeoPoint2D& origin, const double* latitudes, const double* longitudes,
+                           double* distances, size_t count, double max_error);
+};
+
+// Returns the kernels supported by this CPU, starting with the one
+// used by distance_batch() and filter_within_radius()
+std::vector<Kernel> get_available_kernels();
+
+}
+
+}
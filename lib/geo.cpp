@@ -19,11 +19,17 @@
 */
 
 #include "libhdht-private.hpp"
+#include "geo-batch.hpp"
 
 #include <cmath>
 #include <sstream>
 #include <iomanip>
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
 namespace libhdht {
 
 static inline double
@@ -39,7 +45,7 @@ GeoPoint2D::canonicalize()
 }
 
 double
-GeoPoint2D::distance(GeoPoint2D& one, GeoPoint2D& two)
+GeoPoint2D::distance(const GeoPoint2D& one, const GeoPoint2D& two)
 {
     const double R = 6371000; // meters
     double lat1 = one.latitude;
@@ -61,6 +67,37 @@ GeoPoint2D::distance(GeoPoint2D& one, GeoPoint2D& two)
     return R * c;
 }
 
+double
+GeoPoint2D::min_distance(const GeoPoint2D& pt, const GeoPoint2D& lower, const GeoPoint2D& upper)
+{
+    double latitude = std::min(std::max(pt.latitude, lower.latitude), upper.latitude);
+    if (pt.longitude >= lower.longitude && pt.longitude <= upper.longitude)
+        return distance(pt, GeoPoint2D{ latitude, pt.longitude });
+
+    // otherwise the closest point is on the nearest of the two meridians,
+    // because at any latitude the distance grows with the difference in longitude
+    double to_lower = std::fmod(std::abs(pt.longitude - lower.longitude), 360.0);
+    double to_upper = std::fmod(std::abs(upper.longitude - pt.longitude), 360.0);
+    to_lower = std::min(to_lower, 360.0 - to_lower);
+    to_upper = std::min(to_upper, 360.0 - to_upper);
+    double longitude = to_lower <= to_upper ? lower.longitude : upper.longitude;
+    double delta = std::min(to_lower, to_upper);
+
+    // within 90 degrees of longitude, the distance along the meridian shrinks
+    // up to the point closest to pt and grows after it, so the closest point
+    // of the edge is that point, moved inside the edge if needed
+    // past that, the distance grows up to the point farthest from pt, and
+    // shrinks after it, so the closest point is one of the ends of the edge
+    double cos_delta = std::cos(to_radians(delta));
+    if (cos_delta <= 0) {
+        return std::min(distance(pt, GeoPoint2D{ lower.latitude, longitude }),
+                        distance(pt, GeoPoint2D{ upper.latitude, longitude }));
+    }
+    double closest = std::atan(std::tan(to_radians(pt.latitude)) / cos_delta) * 180.0 / M_PI;
+    closest = std::min(std::max(closest, lower.latitude), upper.latitude);
+    return distance(pt, GeoPoint2D{ closest, longitude });
+}
+
 std::string
 GeoPoint2D::to_string() const
 {
@@ -127,4 +164,409 @@ GeoPoint2D::to_fixed_point() const
                           longitude_to_fixpoint(longitude));
 }
 
+namespace geo
+{
+
+// meters, as in GeoPoint2D::distance()
+static const double R = 6371000;
+
+// The haversine formula is
+//   h = sin^2(dphi/2) + cos(phi1) cos(phi2) sin^2(dlambda/2)
+//   distance = 2R asin(sqrt(h))
+// Close to the antipode, h is close to 1 and the rounding of the sum is
+// amplified by asin, so there the distance is computed from the antipode of
+// the second point instead, as pi R - 2R asin(sqrt(g)), with
+//   g = 1 - h = sin^2((phi1 + phi2)/2) + cos(phi1) cos(phi2) cos^2(dlambda/2)
+// sin^2 has a period of pi, so all sines are taken of an angle in
+// [-pi/2, pi/2], and cos(x) = sin(pi/2 - |x|). They all use
+//   sin(x) = x S(x^2)
+// where S approximates sin(x)/x on [0, pi/2], and the smaller of h and g
+// is at most 1/2, so
+//   asin(sqrt(u)) = sqrt(u) A(u)
+// where A approximates asin(sqrt(u))/sqrt(u) on [0, 1/2].
+// The coefficients are those of the Chebyshev interpolants, in powers of x^2
+// and u, and the maximum errors were measured against a long double reference.
+
+static const double sin_4[] = {
+    0.99999999569880882, -0.16666657947845753, 0.00833305017066748,
+    -0.0001980901740843103, 2.6051076348701538e-06,
+};
+static const double sin_5[] = {
+    0.99999999998291944, -0.1666666661681625, 0.0083333309742286872,
+    -0.0001984086118163161, 2.7525269918759622e-06, -2.3889219518205926e-08,
+};
+static const double sin_6[] = {
+    0.99999999999994926, -0.16666666666466451, 0.0083333333203528034,
+    -0.0001984126668220388, 2.7556952842877718e-06, -2.5030265962401893e-08,
+    1.5411195618431323e-10,
+};
+static const double sin_7[] = {
+    0.99999999999999922, -0.16666666666665347, 0.00833333333327263,
+    -0.00019841269827635755, 2.7557317324842598e-06, -2.5051940427078706e-08,
+    1.6050219206952829e-10, -7.4008229059446795e-13,
+};
+static const double asin_6[] = {
+    1.0000000803930298, 0.16665097873300005, 0.075490741717332915,
+    0.039013792144958523, 0.060124277570204353, -0.05354248370089669,
+    0.09990710559109825,
+};
+static const double asin_8[] = {
+    1.0000000016226234, 0.166666142378155, 0.075027573168334513,
+    0.044091616645080954, 0.03581424006167961, -0.0070205827917864854,
+    0.10740003060588303, -0.13591628348351353, 0.12391350138932467,
+};
+static const double asin_12[] = {
+    1.0000000000008058, 0.16666666612172826, 0.075000060651544881,
+    0.044640221414721938, 0.030441050221139247, 0.021589643953470482,
+    0.023937000148669951, -0.022680094617848767, 0.14865309300904092,
+    -0.33303313616376656, 0.56187527913313651, -0.52188537671015811,
+    0.24243794954740083,
+};
+static const double asin_15[] = {
+    0.99999999999999423, 0.16666666667067678, 0.074999999398522532,
+    0.044642895006932193, 0.030380666160937153, 0.022398450189257346,
+    0.016997419153085502, 0.0172743584116688, -0.010323724651243538,
+    0.11406747763976455, -0.35214151628315449, 0.9043910801410675,
+    -1.5649292469024658, 1.8544292449951172, -1.3185195922851562,
+    0.45068359375,
+};
+
+struct Approximation {
+    // the largest error of the distance, in meters
+    double max_error;
+    const double *sin;
+    size_t sin_degree;
+    const double *asin;
+    size_t asin_degree;
+};
+
+// from the least to the most accurate
+static const Approximation approximations[] = {
+    { 2.0, sin_4, 4, asin_6, 6 },
+    { 0.05, sin_5, 5, asin_8, 8 },
+    { 1e-4, sin_6, 6, asin_12, 12 },
+    { 1e-6, sin_7, 7, asin_15, 15 },
+};
+
+// the fastest approximation within <max_error>, or nullptr if there is none
+static const Approximation*
+choose_approximation(double max_error)
+{
+    for (const Approximation& approximation : approximations) {
+        if (approximation.max_error <= max_error)
+            return &approximation;
+    }
+    return nullptr;
+}
+
+// what the kernels need to know about the origin, in radians
+struct Origin {
+    double latitude;
+    double longitude;
+    double cos_latitude;
+
+    Origin(const GeoPoint2D& origin) :
+        latitude(origin.latitude * (M_PI / 180.0)),
+        longitude(origin.longitude * (M_PI / 180.0)),
+        cos_latitude(std::cos(latitude)) {}
+};
+
+static inline double
+horner(const double *coefficients, size_t degree, double x)
+{
+    double result = coefficients[degree];
+    for (size_t i = degree; i-- > 0; )
+        result = result * x + coefficients[i];
+    return result;
+}
+
+// with no approximation, these use the standard library
+static inline double
+approximate_sin(const Approximation *approx, double x)
+{
+    if (approx == nullptr)
+        return std::sin(x);
+    return x * horner(approx->sin, approx->sin_degree, x * x);
+}
+
+static inline double
+approximate_asin_sqrt(const Approximation *approx, double u)
+{
+    if (approx == nullptr)
+        return std::asin(std::sqrt(u));
+    return std::sqrt(u) * horner(approx->asin, approx->asin_degree, u);
+}
+
+static inline double
+approximate_distance(const Approximation *approx, const Origin& origin, double latitude, double longitude)
+{
+    double phi = latitude * (M_PI / 180.0);
+    double lambda = longitude * (M_PI / 180.0);
+
+    double sin_a = approximate_sin(approx, (phi - origin.latitude) * 0.5);
+    double sin_s = approximate_sin(approx, (phi + origin.latitude) * 0.5);
+    double b = std::abs((lambda - origin.longitude) * 0.5);
+    b = std::min(b, M_PI - b);
+    double sin_b = approximate_sin(approx, b);
+    double cos_b = approximate_sin(approx, M_PI / 2 - b);
+    double cos_phi = approximate_sin(approx, M_PI / 2 - std::abs(phi));
+
+    double k = origin.cos_latitude * cos_phi;
+    double h = sin_a * sin_a + k * sin_b * sin_b;
+    double g = sin_s * sin_s + k * cos_b * cos_b;
+    double angle = approximate_asin_sqrt(approx, std::max(std::min(h, g), 0.0));
+    return 2 * R * (h <= g ? angle : M_PI / 2 - angle);
+}
+
+static void
+portable_distance_batch(const GeoPoint2D& origin, const double* latitudes, const double* longitudes,
+                        double* distances, size_t count, double max_error)
+{
+    const Approximation *approx = choose_approximation(max_error);
+    Origin o(origin);
+    for (size_t i = 0; i < count; i++)
+        distances[i] = approximate_distance(approx, o, latitudes[i], longitudes[i]);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("avx2,fma"))) static inline __m256d
+avx2_horner(const double *coefficients, size_t degree, __m256d x)
+{
+    __m256d result = _mm256_set1_pd(coefficients[degree]);
+    for (size_t i = degree; i-- > 0; )
+        result = _mm256_fmadd_pd(result, x, _mm256_set1_pd(coefficients[i]));
+    return result;
+}
+
+__attribute__((target("avx2,fma"))) static inline __m256d
+avx2_sin(const Approximation *approx, __m256d x)
+{
+    return _mm256_mul_pd(x, avx2_horner(approx->sin, approx->sin_degree, _mm256_mul_pd(x, x)));
+}
+
+__attribute__((target("avx2,fma"))) static inline __m256d
+avx2_abs(__m256d x)
+{
+    return _mm256_andnot_pd(_mm256_set1_pd(-0.0), x);
+}
+
+__attribute__((target("avx2,fma"))) static void
+avx2_distance_batch(const GeoPoint2D& origin, const double* latitudes, const double* longitudes,
+                    double* distances, size_t count, double max_error)
+{
+    const Approximation *approx = choose_approximation(max_error);
+    if (approx == nullptr)
+        return portable_distance_batch(origin, latitudes, longitudes, distances, count, max_error);
+
+    Origin o(origin);
+    const __m256d to_radians = _mm256_set1_pd(M_PI / 180.0);
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d pi = _mm256_set1_pd(M_PI);
+    const __m256d half_pi = _mm256_set1_pd(M_PI / 2);
+    const __m256d origin_latitude = _mm256_set1_pd(o.latitude);
+    const __m256d origin_longitude = _mm256_set1_pd(o.longitude);
+    const __m256d origin_cos_latitude = _mm256_set1_pd(o.cos_latitude);
+    const __m256d diameter = _mm256_set1_pd(2 * R);
+
+    size_t i;
+    for (i = 0; i + 4 <= count; i += 4) {
+        __m256d phi = _mm256_mul_pd(_mm256_loadu_pd(latitudes + i), to_radians);
+        __m256d lambda = _mm256_mul_pd(_mm256_loadu_pd(longitudes + i), to_radians);
+
+        __m256d sin_a = avx2_sin(approx, _mm256_mul_pd(_mm256_sub_pd(phi, origin_latitude), half));
+        __m256d sin_s = avx2_sin(approx, _mm256_mul_pd(_mm256_add_pd(phi, origin_latitude), half));
+        __m256d b = avx2_abs(_mm256_mul_pd(_mm256_sub_pd(lambda, origin_longitude), half));
+        b = _mm256_min_pd(b, _mm256_sub_pd(pi, b));
+        __m256d sin_b = avx2_sin(approx, b);
+        __m256d cos_b = avx2_sin(approx, _mm256_sub_pd(half_pi, b));
+        __m256d cos_phi = avx2_sin(approx, _mm256_sub_pd(half_pi, avx2_abs(phi)));
+
+        __m256d k = _mm256_mul_pd(origin_cos_latitude, cos_phi);
+        __m256d h = _mm256_fmadd_pd(k, _mm256_mul_pd(sin_b, sin_b), _mm256_mul_pd(sin_a, sin_a));
+        __m256d g = _mm256_fmadd_pd(k, _mm256_mul_pd(cos_b, cos_b), _mm256_mul_pd(sin_s, sin_s));
+        __m256d u = _mm256_max_pd(_mm256_min_pd(h, g), _mm256_setzero_pd());
+        __m256d angle = _mm256_mul_pd(_mm256_sqrt_pd(u), avx2_horner(approx->asin, approx->asin_degree, u));
+        __m256d low = _mm256_cmp_pd(h, g, _CMP_LE_OQ);
+        angle = _mm256_blendv_pd(_mm256_sub_pd(half_pi, angle), angle, low);
+        _mm256_storeu_pd(distances + i, _mm256_mul_pd(angle, diameter));
+    }
+
+    for (; i < count; i++)
+        distances[i] = approximate_distance(approx, o, latitudes[i], longitudes[i]);
+}
+
+// as in hilbert-values.cpp, GCC's AVX-512 intrinsics trip its own warning
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+
+__attribute__((target("avx512f"))) static inline __m512d
+avx512_horner(const double *coefficients, size_t degree, __m512d x)
+{
+    __m512d result = _mm512_set1_pd(coefficients[degree]);
+    for (size_t i = degree; i-- > 0; )
+        result = _mm512_fmadd_pd(result, x, _mm512_set1_pd(coefficients[i]));
+    return result;
+}
+
+__attribute__((target("avx512f"))) static inline __m512d
+avx512_sin(const Approximation *approx, __m512d x)
+{
+    return _mm512_mul_pd(x, avx512_horner(approx->sin, approx->sin_degree, _mm512_mul_pd(x, x)));
+}
+
+__attribute__((target("avx512f"))) static void
+avx512_distance_batch(const GeoPoint2D& origin, const double* latitudes, const double* longitudes,
+                      double* distances, size_t count, double max_error)
+{
+    const Approximation *approx = choose_approximation(max_error);
+    if (approx == nullptr)
+        return portable_distance_batch(origin, latitudes, longitudes, distances, count, max_error);
+
+    Origin o(origin);
+    const __m512d to_radians = _mm512_set1_pd(M_PI / 180.0);
+    const __m512d half = _mm512_set1_pd(0.5);
+    const __m512d pi = _mm512_set1_pd(M_PI);
+    const __m512d half_pi = _mm512_set1_pd(M_PI / 2);
+    const __m512d origin_latitude = _mm512_set1_pd(o.latitude);
+    const __m512d origin_longitude = _mm512_set1_pd(o.longitude);
+    const __m512d origin_cos_latitude = _mm512_set1_pd(o.cos_latitude);
+    const __m512d diameter = _mm512_set1_pd(2 * R);
+
+    size_t i;
+    for (i = 0; i + 8 <= count; i += 8) {
+        __m512d phi = _mm512_mul_pd(_mm512_loadu_pd(latitudes + i), to_radians);
+        __m512d lambda = _mm512_mul_pd(_mm512_loadu_pd(longitudes + i), to_radians);
+
+        __m512d sin_a = avx512_sin(approx, _mm512_mul_pd(_mm512_sub_pd(phi, origin_latitude), half));
+        __m512d sin_s = avx512_sin(approx, _mm512_mul_pd(_mm512_add_pd(phi, origin_latitude), half));
+        __m512d b = _mm512_abs_pd(_mm512_mul_pd(_mm512_sub_pd(lambda, origin_longitude), half));
+        b = _mm512_min_pd(b, _mm512_sub_pd(pi, b));
+        __m512d sin_b = avx512_sin(approx, b);
+        __m512d cos_b = avx512_sin(approx, _mm512_sub_pd(half_pi, b));
+        __m512d cos_phi = avx512_sin(approx, _mm512_sub_pd(half_pi, _mm512_abs_pd(phi)));
+
+        __m512d k = _mm512_mul_pd(origin_cos_latitude, cos_phi);
+        __m512d h = _mm512_fmadd_pd(k, _mm512_mul_pd(sin_b, sin_b), _mm512_mul_pd(sin_a, sin_a));
+        __m512d g = _mm512_fmadd_pd(k, _mm512_mul_pd(cos_b, cos_b), _mm512_mul_pd(sin_s, sin_s));
+        __m512d u = _mm512_max_pd(_mm512_min_pd(h, g), _mm512_setzero_pd());
+        __m512d angle = _mm512_mul_pd(_mm512_sqrt_pd(u), avx512_horner(approx->asin, approx->asin_degree, u));
+        __mmask8 low = _mm512_cmp_pd_mask(h, g, _CMP_LE_OQ);
+        angle = _mm512_mask_blend_pd(low, _mm512_sub_pd(half_pi, angle), angle);
+        _mm512_storeu_pd(distances + i, _mm512_mul_pd(angle, diameter));
+    }
+
+    // the remainder is less than a vector of 8, but may fill one of 4
+    avx2_distance_batch(origin, latitudes + i, longitudes + i, distances + i, count - i, max_error);
+}
+
+#pragma GCC diagnostic pop
+
+static bool
+have_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+static bool
+have_avx512()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") && have_avx2();
+}
+
+#endif
+
+static const Kernel portable_kernel = { "portable", portable_distance_batch };
+#ifdef HAVE_X86_KERNELS
+static const Kernel avx2_kernel = { "avx2", avx2_distance_batch };
+static const Kernel avx512_kernel = { "avx512", avx512_distance_batch };
+#endif
+
+std::vector<Kernel>
+get_available_kernels()
+{
+    std::vector<Kernel> kernels;
+#ifdef HAVE_X86_KERNELS
+    if (have_avx512())
+        kernels.push_back(avx512_kernel);
+    if (have_avx2())
+        kernels.push_back(avx2_kernel);
+#endif
+    kernels.push_back(portable_kernel);
+    return kernels;
+}
+
+// the portable kernel is used until the static constructors run,
+// in case other static constructors need it
+static const Kernel* selected_kernel = &portable_kernel;
+
+namespace {
+struct KernelSelector
+{
+    KernelSelector()
+    {
+#ifdef HAVE_X86_KERNELS
+        if (have_avx512())
+            selected_kernel = &avx512_kernel;
+        else if (have_avx2())
+            selected_kernel = &avx2_kernel;
+#endif
+    }
+};
+}
+static KernelSelector kernel_selector;
+
+void
+distance_batch(const GeoPoint2D& origin, const double* latitudes, const double* longitudes,
+               double* distances, size_t count, double max_error)
+{
+    selected_kernel->distance_batch(origin, latitudes, longitudes, distances, count, max_error);
+}
+
+size_t
+filter_within_radius(const GeoPoint2D& center, double radius, const double* latitudes,
+                     const double* longitudes, size_t count, uint32_t* indices, double max_error)
+{
+    // a point within the radius is never farther than this in latitude,
+    // and, unless the circle reaches a pole, in longitude
+    // (see Table::get_rectangle_for_circle())
+    double angle = radius / R;
+    double max_delta_latitude = angle * 180.0 / M_PI;
+    double max_delta_longitude = 360.0;
+    double cos_latitude = std::cos(center.latitude * M_PI / 180.0);
+    if (std::abs(center.latitude) + max_delta_latitude < 90.0 && std::sin(angle) < cos_latitude)
+        max_delta_longitude = std::asin(std::sin(angle) / cos_latitude) * 180.0 / M_PI;
+
+    // the cheap pass, which only compares the coordinates
+    std::vector<uint32_t> candidates;
+    for (size_t i = 0; i < count; i++) {
+        double delta_longitude = std::abs(longitudes[i] - center.longitude);
+        delta_longitude = std::min(delta_longitude, 360.0 - delta_longitude);
+        if (std::abs(latitudes[i] - center.latitude) <= max_delta_latitude && delta_longitude <= max_delta_longitude)
+            candidates.push_back(i);
+    }
+
+    // the expensive pass, on the candidates only
+    std::vector<double> candidate_latitudes(candidates.size()), candidate_longitudes(candidates.size());
+    std::vector<double> distances(candidates.size());
+    for (size_t i = 0; i < candidates.size(); i++) {
+        candidate_latitudes[i] = latitudes[candidates[i]];
+        candidate_longitudes[i] = longitudes[candidates[i]];
+    }
+    distance_batch(center, candidate_latitudes.data(), candidate_longitudes.data(), distances.data(),
+                   candidates.size(), max_error);
+
+    size_t n_found = 0;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        if (distances[i] <= radius)
+            indices[n_found++] = candidates[i];
+    }
+    return n_found;
+}
+
+}
+
 }
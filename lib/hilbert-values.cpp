@@ -0,0 +1,667 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include "hilbert-values.hpp"
+
+#include <cassert>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace libhdht
+{
+
+namespace hilbert_values
+{
+
+// The curve is walked from the most significant level down, keeping track of
+// how the current quadrant is transformed relative to the whole square, the
+// same as rot() does for the reference implementation. The transformation is
+// a combination of swapping x and y (bit 0 of the state) and flipping both
+// (bit 1 of the state), which commute, so there are four states.
+//
+// At each level, the bits of x and y form a 2-bit Morton digit (x is the high
+// bit), and the Hilbert digit is a function of it and of the state; the tables
+// map a state and four Morton digits to four Hilbert digits and the next state,
+// and the other way around.
+
+static const unsigned kLevelsPerStep = 4;
+static const unsigned kBitsPerStep = 2 * kLevelsPerStep;
+static const unsigned kStepMask = (1 << kBitsPerStep) - 1;
+
+struct CurveTables
+{
+    // indexed by state << 8 | Morton digits,
+    // contains the next state << 8 | Hilbert digits
+    // (the entries are 32-bit so the vector kernels can gather them)
+    uint32_t encode[4 << kBitsPerStep];
+    // indexed by state << 8 | Hilbert digits,
+    // contains the next state << 8 | Morton digits
+    uint32_t decode[4 << kBitsPerStep];
+
+    constexpr CurveTables() : encode(), decode()
+    {
+        for (unsigned state = 0; state < 4; state++) {
+            for (unsigned digits = 0; digits <= kStepMask; digits++) {
+                unsigned encode_state = state, decode_state = state;
+                unsigned hilbert = 0, morton = 0;
+
+                for (int level = kLevelsPerStep - 1; level >= 0; level--) {
+                    unsigned digit = (digits >> (2 * level)) & 3;
+
+                    // encode: digit is a Morton digit
+                    unsigned xb = next_x(encode_state, digit >> 1, digit & 1);
+                    unsigned yb = next_y(encode_state, digit >> 1, digit & 1);
+                    hilbert = (hilbert << 2) | ((3 * xb) ^ yb);
+                    encode_state = next_state(encode_state, xb, yb);
+
+                    // decode: digit is a Hilbert digit, xb and yb are in the
+                    // transformed quadrant, and the transformation is its own inverse
+                    xb = digit >> 1;
+                    yb = (digit ^ xb) & 1;
+                    morton = (morton << 2) | (next_x(decode_state, xb, yb) << 1) | next_y(decode_state, xb, yb);
+                    decode_state = next_state(decode_state, xb, yb);
+                }
+
+                encode[state << kBitsPerStep | digits] = encode_state << kBitsPerStep | hilbert;
+                decode[state << kBitsPerStep | digits] = decode_state << kBitsPerStep | morton;
+            }
+        }
+    }
+
+    // the transformed x bit of a point in the quadrant
+    static constexpr unsigned next_x(unsigned state, unsigned x, unsigned y)
+    {
+        return ((state & 1) ? y : x) ^ (state >> 1);
+    }
+    // the transformed y bit of a point in the quadrant
+    static constexpr unsigned next_y(unsigned state, unsigned x, unsigned y)
+    {
+        return ((state & 1) ? x : y) ^ (state >> 1);
+    }
+    // the state of the sub-quadrant at transformed coordinates xb, yb
+    static constexpr unsigned next_state(unsigned state, unsigned xb, unsigned yb)
+    {
+        if (yb == 0) {
+            if (xb == 1)
+                state ^= 2;
+            state ^= 1;
+        }
+        return state;
+    }
+};
+
+static constexpr CurveTables tables;
+
+// Returns the number of levels of a curve of size n, or -1 if
+// the fast kernels cannot handle it
+static inline int
+get_levels(uint64_t n)
+{
+    if (n == 0 || (n & (n-1)) != 0 || n > (1ULL << 32))
+        return -1;
+    return __builtin_ctzll(n);
+}
+
+// The walk is done a whole step at a time, as if the curve had extra levels
+// at the top; x and y are zero there, so those levels contribute nothing to d,
+// but each of them swaps x and y, which we cancel by choosing the initial state
+static inline unsigned
+get_initial_state(unsigned levels)
+{
+    return ((kLevelsPerStep - levels % kLevelsPerStep) % kLevelsPerStep) & 1;
+}
+
+static inline uint64_t
+morton_to_hilbert(unsigned levels, uint64_t morton)
+{
+    unsigned state = get_initial_state(levels);
+    uint64_t d = 0;
+    for (int step = (levels + kLevelsPerStep - 1) / kLevelsPerStep - 1; step >= 0; step--) {
+        unsigned digits = (morton >> (step * kBitsPerStep)) & kStepMask;
+        uint32_t next = tables.encode[state << kBitsPerStep | digits];
+        d = (d << kBitsPerStep) | (next & kStepMask);
+        state = next >> kBitsPerStep;
+    }
+    return d;
+}
+
+static inline uint64_t
+hilbert_to_morton(unsigned levels, uint64_t d)
+{
+    unsigned state = get_initial_state(levels);
+    uint64_t morton = 0;
+    for (int step = (levels + kLevelsPerStep - 1) / kLevelsPerStep - 1; step >= 0; step--) {
+        unsigned digits = (d >> (step * kBitsPerStep)) & kStepMask;
+        uint32_t next = tables.decode[state << kBitsPerStep | digits];
+        morton = (morton << kBitsPerStep) | (next & kStepMask);
+        state = next >> kBitsPerStep;
+    }
+    return morton;
+}
+
+// spreads the low 32 bits of v to the even bits of the result
+static inline uint64_t
+spread_bits(uint64_t v)
+{
+    v &= 0xFFFFFFFFULL;
+    v = (v | (v << 16)) & 0x0000FFFF0000FFFFULL;
+    v = (v | (v << 8)) & 0x00FF00FF00FF00FFULL;
+    v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    v = (v | (v << 2)) & 0x3333333333333333ULL;
+    v = (v | (v << 1)) & 0x5555555555555555ULL;
+    return v;
+}
+
+// the inverse of spread_bits
+static inline uint64_t
+compact_bits(uint64_t v)
+{
+    v &= 0x5555555555555555ULL;
+    v = (v | (v >> 1)) & 0x3333333333333333ULL;
+    v = (v | (v >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+    v = (v | (v >> 4)) & 0x00FF00FF00FF00FFULL;
+    v = (v | (v >> 8)) & 0x0000FFFF0000FFFFULL;
+    v = (v | (v >> 16)) & 0x00000000FFFFFFFFULL;
+    return v;
+}
+
+static uint64_t
+table_xy2d(uint64_t n, uint64_t x, uint64_t y)
+{
+    int levels = get_levels(n);
+    if (levels < 0)
+        return xy2d(n, x, y);
+    return morton_to_hilbert(levels, spread_bits(x) << 1 | spread_bits(y));
+}
+
+static void
+table_d2xy(uint64_t n, uint64_t d, uint64_t& x, uint64_t& y)
+{
+    int levels = get_levels(n);
+    if (levels < 0)
+        return d2xy(n, d, x, y);
+    uint64_t morton = hilbert_to_morton(levels, d);
+    x = compact_bits(morton >> 1);
+    y = compact_bits(morton);
+}
+
+static void
+table_xy2d_batch(uint64_t n, const std::pair<uint64_t, uint64_t>* points, uint64_t* d, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        d[i] = table_xy2d(n, points[i].first, points[i].second);
+}
+
+static void
+table_d2xy_batch(uint64_t n, const uint64_t* d, std::pair<uint64_t, uint64_t>* points, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        table_d2xy(n, d[i], points[i].first, points[i].second);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("bmi2"))) static uint64_t
+bmi2_xy2d(uint64_t n, uint64_t x, uint64_t y)
+{
+    int levels = get_levels(n);
+    if (levels < 0)
+        return xy2d(n, x, y);
+    return morton_to_hilbert(levels, _pdep_u64(x, 0xAAAAAAAAAAAAAAAAULL) | _pdep_u64(y, 0x5555555555555555ULL));
+}
+
+__attribute__((target("bmi2"))) static void
+bmi2_d2xy(uint64_t n, uint64_t d, uint64_t& x, uint64_t& y)
+{
+    int levels = get_levels(n);
+    if (levels < 0)
+        return d2xy(n, d, x, y);
+    uint64_t morton = hilbert_to_morton(levels, d);
+    x = _pext_u64(morton, 0xAAAAAAAAAAAAAAAAULL);
+    y = _pext_u64(morton, 0x5555555555555555ULL);
+}
+
+__attribute__((target("bmi2"))) static void
+bmi2_xy2d_batch(uint64_t n, const std::pair<uint64_t, uint64_t>* points, uint64_t* d, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        d[i] = bmi2_xy2d(n, points[i].first, points[i].second);
+}
+
+__attribute__((target("bmi2"))) static void
+bmi2_d2xy_batch(uint64_t n, const uint64_t* d, std::pair<uint64_t, uint64_t>* points, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        bmi2_d2xy(n, d[i], points[i].first, points[i].second);
+}
+
+// The vector kernels convert one point per 32-bit lane, splitting the
+// coordinates in 16-bit halves so that each half of the Morton code fits
+// in a lane. They walk 16 or 32 levels, whichever is enough for the
+// curve, starting from the state that cancels the swaps of the extra
+// levels at the top (see get_initial_state()), so all lanes do the same work.
+
+__attribute__((target("avx2,bmi2"))) static inline __m256i
+avx2_spread_bits(__m256i v)
+{
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 8)), _mm256_set1_epi32(0x00FF00FF));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 4)), _mm256_set1_epi32(0x0F0F0F0F));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 2)), _mm256_set1_epi32(0x33333333));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 1)), _mm256_set1_epi32(0x55555555));
+    return v;
+}
+
+__attribute__((target("avx2,bmi2"))) static inline __m256i
+avx2_compact_bits(__m256i v)
+{
+    v = _mm256_and_si256(v, _mm256_set1_epi32(0x55555555));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi32(v, 1)), _mm256_set1_epi32(0x33333333));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi32(v, 2)), _mm256_set1_epi32(0x0F0F0F0F));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi32(v, 4)), _mm256_set1_epi32(0x00FF00FF));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi32(v, 8)), _mm256_set1_epi32(0x0000FFFF));
+    return v;
+}
+
+// walks 16 levels of the curve in each lane, through <table>
+__attribute__((target("avx2,bmi2"))) static inline __m256i
+avx2_walk(const uint32_t* table, __m256i& state, __m256i digits)
+{
+    const __m256i step_mask = _mm256_set1_epi32(kStepMask);
+    __m256i result = _mm256_setzero_si256();
+    for (int step = 32 / kBitsPerStep - 1; step >= 0; step--) {
+        __m256i step_digits = _mm256_and_si256(_mm256_srli_epi32(digits, step * kBitsPerStep), step_mask);
+        __m256i index = _mm256_or_si256(_mm256_slli_epi32(state, kBitsPerStep), step_digits);
+        __m256i next = _mm256_i32gather_epi32(reinterpret_cast<const int*>(table), index, 4);
+        result = _mm256_or_si256(_mm256_slli_epi32(result, kBitsPerStep), _mm256_and_si256(next, step_mask));
+        state = _mm256_srli_epi32(next, kBitsPerStep);
+    }
+    return result;
+}
+
+__attribute__((target("avx2,bmi2"))) static void
+avx2_xy2d_batch(uint64_t n, const std::pair<uint64_t, uint64_t>* points, uint64_t* d, size_t count)
+{
+    int levels = get_levels(n);
+    if (levels < 0)
+        return bmi2_xy2d_batch(n, points, d, count);
+
+    // the low 32-bit words of x and y, in units of 32-bit words
+    const __m256i x_index = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+    const __m256i y_index = _mm256_add_epi32(x_index, _mm256_set1_epi32(2));
+    const __m256i low_mask = _mm256_set1_epi32(0xFFFF);
+
+    size_t i;
+    for (i = 0; i + 8 <= count; i += 8) {
+        const int *base = reinterpret_cast<const int*>(points + i);
+        __m256i x = _mm256_i32gather_epi32(base, x_index, 4);
+        __m256i y = _mm256_i32gather_epi32(base, y_index, 4);
+
+        __m256i morton_high = _mm256_or_si256(_mm256_slli_epi32(avx2_spread_bits(_mm256_srli_epi32(x, 16)), 1),
+                                              avx2_spread_bits(_mm256_srli_epi32(y, 16)));
+        __m256i morton_low = _mm256_or_si256(_mm256_slli_epi32(avx2_spread_bits(_mm256_and_si256(x, low_mask)), 1),
+                                             avx2_spread_bits(_mm256_and_si256(y, low_mask)));
+
+        __m256i state = _mm256_set1_epi32((32 - levels) & 1);
+        __m256i d_high = _mm256_setzero_si256();
+        if (levels > 16)
+            d_high = avx2_walk(tables.encode, state, morton_high);
+        else
+            state = _mm256_set1_epi32((16 - levels) & 1);
+        __m256i d_low = avx2_walk(tables.encode, state, morton_low);
+
+        // unpacking works within each 128-bit half, so the halves
+        // come out as d0 d1 d4 d5 and d2 d3 d6 d7
+        __m256i first = _mm256_unpacklo_epi32(d_low, d_high);
+        __m256i second = _mm256_unpackhi_epi32(d_low, d_high);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i), _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i + 4), _mm256_permute2x128_si256(first, second, 0x31));
+    }
+
+    bmi2_xy2d_batch(n, points + i, d + i, count - i);
+}
+
+__attribute__((target("avx2,bmi2"))) static void
+avx2_d2xy_batch(uint64_t n, const uint64_t* d, std::pair<uint64_t, uint64_t>* points, size_t count)
+{
+    int levels = get_levels(n);
+    if (levels < 0)
+        return bmi2_d2xy_batch(n, d, points, count);
+
+    const __m256i low_index = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+    const __m256i high_index = _mm256_add_epi32(low_index, _mm256_set1_epi32(1));
+
+    size_t i;
+    for (i = 0; i + 8 <= count; i += 8) {
+        const int *base = reinterpret_cast<const int*>(d + i);
+        __m256i d_low = _mm256_i32gather_epi32(base, low_index, 4);
+        __m256i d_high = _mm256_i32gather_epi32(base, high_index, 4);
+
+        __m256i state = _mm256_set1_epi32((32 - levels) & 1);
+        __m256i morton_high = _mm256_setzero_si256();
+        if (levels > 16)
+            morton_high = avx2_walk(tables.decode, state, d_high);
+        else
+            state = _mm256_set1_epi32((16 - levels) & 1);
+        __m256i morton_low = avx2_walk(tables.decode, state, d_low);
+
+        __m256i x = _mm256_or_si256(_mm256_slli_epi32(avx2_compact_bits(_mm256_srli_epi32(morton_high, 1)), 16),
+                                    avx2_compact_bits(_mm256_srli_epi32(morton_low, 1)));
+        __m256i y = _mm256_or_si256(_mm256_slli_epi32(avx2_compact_bits(morton_high), 16),
+                                    avx2_compact_bits(morton_low));
+
+        // x0 y0 x1 y1 x4 y4 x5 y5 and x2 y2 x3 y3 x6 y6 x7 y7, zero-extended to 64 bits
+        __m256i first = _mm256_unpacklo_epi32(x, y);
+        __m256i second = _mm256_unpackhi_epi32(x, y);
+        __m256i *out = reinterpret_cast<__m256i*>(points + i);
+        _mm256_storeu_si256(out, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(first)));
+        _mm256_storeu_si256(out + 1, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(second)));
+        _mm256_storeu_si256(out + 2, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(first, 1)));
+        _mm256_storeu_si256(out + 3, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(second, 1)));
+    }
+
+    bmi2_d2xy_batch(n, d + i, points + i, count - i);
+}
+
+// GCC's AVX-512 intrinsics use deliberately uninitialized values as the
+// "don't care" source of unmasked operations, which trips its own warning
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+
+__attribute__((target("avx512f,bmi2"))) static inline __m512i
+avx512_spread_bits(__m512i v)
+{
+    v = _mm512_and_si512(_mm512_or_si512(v, _mm512_slli_epi32(v, 8)), _mm512_set1_epi32(0x00FF00FF));
+    v = _mm512_and_si512(_mm512_or_si512(v, _mm512_slli_epi32(v, 4)), _mm512_set1_epi32(0x0F0F0F0F));
+    v = _mm512_and_si512(_mm512_or_si512(v, _mm512_slli_epi32(v, 2)), _mm512_set1_epi32(0x33333333));
+    v = _mm512_and_si512(_mm512_or_si512(v, _mm512_slli_epi32(v, 1)), _mm512_set1_epi32(0x55555555));
+    return v;
+}
+
+__attribute__((target("avx512f,bmi2"))) static inline __m512i
+avx512_compact_bits(__m512i v)
+{
+    v = _mm512_and_si512(v, _mm512_set1_epi32(0x55555555));
+    v = _mm512_and_si512(_mm512_or_si512(v, _mm512_srli_epi32(v, 1)), _mm512_set1_epi32(0x33333333));
+    v = _mm512_and_si512(_mm512_or_si512(v, _mm512_srli_epi32(v, 2)), _mm512_set1_epi32(0x0F0F0F0F));
+    v = _mm512_and_si512(_mm512_or_si512(v, _mm512_srli_epi32(v, 4)), _mm512_set1_epi32(0x00FF00FF));
+    v = _mm512_and_si512(_mm512_or_si512(v, _mm512_srli_epi32(v, 8)), _mm512_set1_epi32(0x0000FFFF));
+    return v;
+}
+
+__attribute__((target("avx512f,bmi2"))) static inline __m512i
+avx512_walk(const uint32_t* table, __m512i& state, __m512i digits)
+{
+    const __m512i step_mask = _mm512_set1_epi32(kStepMask);
+    __m512i result = _mm512_setzero_si512();
+    for (int step = 32 / kBitsPerStep - 1; step >= 0; step--) {
+        __m512i step_digits = _mm512_and_si512(_mm512_srli_epi32(digits, step * kBitsPerStep), step_mask);
+        __m512i index = _mm512_or_si512(_mm512_slli_epi32(state, kBitsPerStep), step_digits);
+        __m512i next = _mm512_i32gather_epi32(index, table, 4);
+        result = _mm512_or_si512(_mm512_slli_epi32(result, kBitsPerStep), _mm512_and_si512(next, step_mask));
+        state = _mm512_srli_epi32(next, kBitsPerStep);
+    }
+    return result;
+}
+
+__attribute__((target("avx512f,bmi2"))) static void
+avx512_xy2d_batch(uint64_t n, const std::pair<uint64_t, uint64_t>* points, uint64_t* d, size_t count)
+{
+    int levels = get_levels(n);
+    if (levels < 0)
+        return bmi2_xy2d_batch(n, points, d, count);
+
+    const __m512i x_index = _mm512_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28, 32, 36, 40, 44, 48, 52, 56, 60);
+    const __m512i y_index = _mm512_add_epi32(x_index, _mm512_set1_epi32(2));
+    const __m512i low_mask = _mm512_set1_epi32(0xFFFF);
+    // unpacking works within each 128-bit quarter, these restore the order
+    const __m512i first_order = _mm512_setr_epi64(0, 1, 8, 9, 2, 3, 10, 11);
+    const __m512i second_order = _mm512_setr_epi64(4, 5, 12, 13, 6, 7, 14, 15);
+
+    size_t i;
+    for (i = 0; i + 16 <= count; i += 16) {
+        const void *base = points + i;
+        __m512i x = _mm512_i32gather_epi32(x_index, base, 4);
+        __m512i y = _mm512_i32gather_epi32(y_index, base, 4);
+
+        __m512i morton_high = _mm512_or_si512(_mm512_slli_epi32(avx512_spread_bits(_mm512_srli_epi32(x, 16)), 1),
+                                              avx512_spread_bits(_mm512_srli_epi32(y, 16)));
+        __m512i morton_low = _mm512_or_si512(_mm512_slli_epi32(avx512_spread_bits(_mm512_and_si512(x, low_mask)), 1),
+                                             avx512_spread_bits(_mm512_and_si512(y, low_mask)));
+
+        __m512i state = _mm512_set1_epi32((32 - levels) & 1);
+        __m512i d_high = _mm512_setzero_si512();
+        if (levels > 16)
+            d_high = avx512_walk(tables.encode, state, morton_high);
+        else
+            state = _mm512_set1_epi32((16 - levels) & 1);
+        __m512i d_low = avx512_walk(tables.encode, state, morton_low);
+
+        __m512i first = _mm512_unpacklo_epi32(d_low, d_high);
+        __m512i second = _mm512_unpackhi_epi32(d_low, d_high);
+        _mm512_storeu_si512(d + i, _mm512_permutex2var_epi64(first, first_order, second));
+        _mm512_storeu_si512(d + i + 8, _mm512_permutex2var_epi64(first, second_order, second));
+    }
+
+    avx2_xy2d_batch(n, points + i, d + i, count - i);
+}
+
+__attribute__((target("avx512f,bmi2"))) static void
+avx512_d2xy_batch(uint64_t n, const uint64_t* d, std::pair<uint64_t, uint64_t>* points, size_t count)
+{
+    int levels = get_levels(n);
+    if (levels < 0)
+        return bmi2_d2xy_batch(n, d, points, count);
+
+    const __m512i low_index = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+    const __m512i high_index = _mm512_add_epi32(low_index, _mm512_set1_epi32(1));
+    const __m512i first_order = _mm512_setr_epi64(0, 1, 8, 9, 2, 3, 10, 11);
+    const __m512i second_order = _mm512_setr_epi64(4, 5, 12, 13, 6, 7, 14, 15);
+
+    size_t i;
+    for (i = 0; i + 16 <= count; i += 16) {
+        const void *base = d + i;
+        __m512i d_low = _mm512_i32gather_epi32(low_index, base, 4);
+        __m512i d_high = _mm512_i32gather_epi32(high_index, base, 4);
+
+        __m512i state = _mm512_set1_epi32((32 - levels) & 1);
+        __m512i morton_high = _mm512_setzero_si512();
+        if (levels > 16)
+            morton_high = avx512_walk(tables.decode, state, d_high);
+        else
+            state = _mm512_set1_epi32((16 - levels) & 1);
+        __m512i morton_low = avx512_walk(tables.decode, state, d_low);
+
+        __m512i x = _mm512_or_si512(_mm512_slli_epi32(avx512_compact_bits(_mm512_srli_epi32(morton_high, 1)), 16),
+                                    avx512_compact_bits(_mm512_srli_epi32(morton_low, 1)));
+        __m512i y = _mm512_or_si512(_mm512_slli_epi32(avx512_compact_bits(morton_high), 16),
+                                    avx512_compact_bits(morton_low));
+
+        // widen to 64 bits, then interleave x and y
+        __m256i halves[2][2] = {
+            { _mm512_castsi512_si256(x), _mm512_castsi512_si256(y) },
+            { _mm512_extracti64x4_epi64(x, 1), _mm512_extracti64x4_epi64(y, 1) }
+        };
+        for (int half = 0; half < 2; half++) {
+            __m512i x64 = _mm512_cvtepu32_epi64(halves[half][0]);
+            __m512i y64 = _mm512_cvtepu32_epi64(halves[half][1]);
+            __m512i first = _mm512_unpacklo_epi64(x64, y64);
+            __m512i second = _mm512_unpackhi_epi64(x64, y64);
+            _mm512_storeu_si512(points + i + 8 * half, _mm512_permutex2var_epi64(first, first_order, second));
+            _mm512_storeu_si512(points + i + 8 * half + 4, _mm512_permutex2var_epi64(first, second_order, second));
+        }
+    }
+
+    avx2_d2xy_batch(n, d + i, points + i, count - i);
+}
+
+#pragma GCC diagnostic pop
+
+static bool
+have_bmi2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("bmi2");
+}
+
+static bool
+have_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2");
+}
+
+static bool
+have_avx512()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") && have_avx2();
+}
+
+#endif
+
+static const Kernel table_kernel = { "table", table_xy2d, table_d2xy, table_xy2d_batch, table_d2xy_batch };
+#ifdef HAVE_X86_KERNELS
+static const Kernel bmi2_kernel = { "bmi2", bmi2_xy2d, bmi2_d2xy, bmi2_xy2d_batch, bmi2_d2xy_batch };
+static const Kernel avx2_kernel = { "avx2", bmi2_xy2d, bmi2_d2xy, avx2_xy2d_batch, avx2_d2xy_batch };
+static const Kernel avx512_kernel = { "avx512", bmi2_xy2d, bmi2_d2xy, avx512_xy2d_batch, avx512_d2xy_batch };
+#endif
+
+std::vector<Kernel>
+get_available_kernels()
+{
+    std::vector<Kernel> kernels;
+#ifdef HAVE_X86_KERNELS
+    if (have_avx512())
+        kernels.push_back(avx512_kernel);
+    if (have_avx2())
+        kernels.push_back(avx2_kernel);
+    if (have_bmi2())
+        kernels.push_back(bmi2_kernel);
+#endif
+    kernels.push_back(table_kernel);
+    return kernels;
+}
+
+// the portable kernel is used until the static constructors run,
+// in case other static constructors need it
+static const Kernel* selected_kernel = &table_kernel;
+
+namespace {
+struct KernelSelector
+{
+    KernelSelector()
+    {
+#ifdef HAVE_X86_KERNELS
+        if (have_avx512())
+            selected_kernel = &avx512_kernel;
+        else if (have_avx2())
+            selected_kernel = &avx2_kernel;
+        else if (have_bmi2())
+            selected_kernel = &bmi2_kernel;
+#endif
+    }
+};
+}
+static KernelSelector kernel_selector;
+
+namespace {
+struct IntervalSearch
+{
+    std::pair<uint64_t, uint64_t> lower;
+    std::pair<uint64_t, uint64_t> upper;
+    uint64_t min_size;
+    std::vector<std::pair<uint64_t, uint64_t>>& intervals;
+
+    // visits the quadrant of side <size> at (x, y), which covers the curve from <d>
+    // and is transformed according to <state>
+    void visit(uint64_t x, uint64_t y, uint64_t size, uint64_t d, unsigned state)
+    {
+        uint64_t x_last = x + (size - 1), y_last = y + (size - 1);
+        if (x_last < lower.first || x > upper.first || y_last < lower.second || y > upper.second)
+            return;
+
+        bool inside = x >= lower.first && x_last <= upper.first && y >= lower.second && y_last <= upper.second;
+        if (inside || size <= min_size) {
+            // size * size wraps around to 0 for the whole curve of side 2^32,
+            // which still gives the correct last position
+            uint64_t last = d + (size * size - 1);
+            if (!intervals.empty() && intervals.back().second + 1 == d)
+                intervals.back().second = last;
+            else
+                intervals.push_back(std::make_pair(d, last));
+            return;
+        }
+
+        // the children are visited in curve order, so the intervals come out sorted
+        uint64_t half = size / 2;
+        for (unsigned digit = 0; digit < 4; digit++) {
+            unsigned xb = digit >> 1;
+            unsigned yb = (digit ^ xb) & 1;
+            visit(x + CurveTables::next_x(state, xb, yb) * half, y + CurveTables::next_y(state, xb, yb) * half,
+                  half, d + digit * half * half, CurveTables::next_state(state, xb, yb));
+        }
+    }
+};
+}
+
+void
+rectangle_to_intervals(uint64_t n, const std::pair<uint64_t, uint64_t>& lower,
+                       const std::pair<uint64_t, uint64_t>& upper, uint64_t min_size,
+                       std::vector<std::pair<uint64_t, uint64_t>>& intervals)
+{
+    assert(get_levels(n) >= 0);
+    assert(min_size > 0 && (min_size & (min_size - 1)) == 0);
+
+    IntervalSearch search{ lower, upper, min_size, intervals };
+    search.visit(0, 0, n, 0, 0);
+}
+
+uint64_t
+fast_xy2d(uint64_t n, uint64_t x, uint64_t y)
+{
+    return selected_kernel->xy2d(n, x, y);
+}
+
+void
+fast_d2xy(uint64_t n, uint64_t d, uint64_t& x, uint64_t& y)
+{
+    selected_kernel->d2xy(n, d, x, y);
+}
+
+void
+xy2d_batch(uint64_t n, const std::pair<uint64_t, uint64_t>* points, uint64_t* d, size_t count)
+{
+    selected_kernel->xy2d_batch(n, points, d, count);
+}
+
+void
+d2xy_batch(uint64_t n, const uint64_t* d, std::pair<uint64_t, uint64_t>* points, size_t count)
+{
+    selected_kernel->d2xy_batch(n, d, points, count);
+}
+
+}
+
+}
@@ -21,6 +21,10 @@
 #pragma once
 
 #include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
 
 namespace libhdht
 {
@@ -74,6 +78,48 @@ void d2xy(T n, T d, T& x, T& y) {
     }
 }
 
+// Fast versions of xy2d and d2xy, for 64-bit values
+//
+// They walk four levels of the curve at a time, with a state transition
+// table indexed by the interleaved bits of the coordinates, and use the
+// BMI2 pdep/pext instructions to interleave the bits when the CPU has them.
+// They compute the same curve as the templates above, which are kept as the
+// reference implementation; n must be a power of two, and values of n larger
+// than 2^32 fall back to the reference.
+uint64_t fast_xy2d(uint64_t n, uint64_t x, uint64_t y);
+void fast_d2xy(uint64_t n, uint64_t d, uint64_t& x, uint64_t& y);
+
+// Convert <count> points at once, from and to contiguous arrays
+// With AVX2 or AVX-512, 8 or 16 points are converted in parallel.
+void xy2d_batch(uint64_t n, const std::pair<uint64_t, uint64_t>* points, uint64_t* d, size_t count);
+void d2xy_batch(uint64_t n, const uint64_t* d, std::pair<uint64_t, uint64_t>* points, size_t count);
+
+// Appends to <intervals> the sorted, disjoint [first, last] intervals of the
+// curve that cover the rectangle from <lower> to <upper> (inclusive)
+// The rectangle is split recursively in quadrants, and quadrants fully inside
+// it become intervals, so the number of intervals grows with the perimeter of
+// the rectangle rather than its area. Quadrants of side <min_size> that are only
+// partially inside are included whole, which bounds the number of intervals
+// at the cost of covering some points outside the rectangle; with a min_size
+// of 1, the intervals cover exactly the rectangle.
+// n and min_size must be powers of two, and n must be at most 2^32.
+void rectangle_to_intervals(uint64_t n, const std::pair<uint64_t, uint64_t>& lower,
+                            const std::pair<uint64_t, uint64_t>& upper, uint64_t min_size,
+                            std::vector<std::pair<uint64_t, uint64_t>>& intervals);
+
+// An implementation of the fast and batch functions
+struct Kernel {
+    const char *name;
+    uint64_t (*xy2d)(uint64_t n, uint64_t x, uint64_t y);
+    void (*d2xy)(uint64_t n, uint64_t d, uint64_t& x, uint64_t& y);
+    void (*xy2d_batch)(uint64_t n, const std::pair<uint64_t, uint64_t>* points, uint64_t* d, size_t count);
+    void (*d2xy_batch)(uint64_t n, const uint64_t* d, std::pair<uint64_t, uint64_t>* points, size_t count);
+};
+
+// Returns the kernels supported by this CPU, starting with the one
+// used by the fast and batch functions
+std::vector<Kernel> get_available_kernels();
+
 }
 
 }
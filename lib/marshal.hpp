@@ -50,6 +50,12 @@ public:
     uv::Buffer close();
     void reserve(size_t capacity);
 
+    // the number of bytes written so far
+    size_t size() const
+    {
+        return m_length;
+    }
+
     void write(const uint8_t* buffer, size_t length, bool adjust_endian = false);
 
     template<typename T>
@@ -95,6 +101,11 @@ private:
 public:
     BufferReader(const uv::Buffer& buffer) : m_buffer(buffer), m_off(0) {}
 
+    size_t remaining() const
+    {
+        return m_buffer.len - m_off;
+    }
+
     template<typename T>
     T read()
     {
@@ -251,6 +262,38 @@ struct single_marshaller<GeoPoint2D>
     }
 };
 
+template<>
+struct single_marshaller<SearchCursor>
+{
+    static void to_buffer(BufferWriter& writer, const SearchCursor& obj)
+    {
+        writer.write(obj.after);
+        single_marshaller<net::Address>::to_buffer(writer, obj.server);
+    }
+
+    static SearchCursor from_buffer(rpc::Peer& peer, BufferReader& reader)
+    {
+        NodeID after = reader.read<NodeID>();
+        net::Address server = single_marshaller<net::Address>::from_buffer(peer, reader);
+        return SearchCursor{ after, server };
+    }
+};
+
+template<>
+struct single_marshaller<Neighbour>
+{
+    static void to_buffer(BufferWriter& writer, const Neighbour& obj)
+    {
+        writer.write(obj.id);
+        writer.write(obj.distance);
+    }
+
+    static Neighbour from_buffer(rpc::Peer& peer, BufferReader& reader)
+    {
+        return Neighbour{ reader.read<NodeID>(), reader.read<double>() };
+    }
+};
+
 template<typename... Args>
 struct single_marshaller<std::tuple<Args...>>
 {
@@ -295,16 +338,16 @@ struct single_marshaller<std::unordered_map<Key, Value>>
 {
     static void to_buffer(BufferWriter& writer, const std::unordered_map<Key, Value>& obj)
     {
-        if (obj.size() > std::numeric_limits<uint16_t>::max())
-            throw std::length_error("Maps with more than 65536 elements cannot be marshalled");
-        writer.write(static_cast<uint16_t>(obj.size()));
+        if (obj.size() > std::numeric_limits<uint32_t>::max())
+            throw std::length_error("Maps with more than 2^32 elements cannot be marshalled");
+        writer.write(static_cast<uint32_t>(obj.size()));
         for (const auto& iter : obj)
             single_marshaller<std::pair<Key, Value>>::to_buffer(writer, iter);
     }
 
     static std::unordered_map<Key, Value> from_buffer(rpc::Peer& peer, BufferReader& reader)
     {
-        size_t n = reader.read<uint16_t>();
+        size_t n = reader.read<uint32_t>();
         std::unordered_map<Key, Value> map;
         for (size_t i = 0; i < n; i++)
             map.insert(single_marshaller<std::pair<Key, Value>>::from_buffer(peer, reader));
@@ -317,20 +360,28 @@ struct single_marshaller<std::vector<Type>>
 {
     static void to_buffer(BufferWriter& writer, const std::vector<Type>& obj)
     {
-        if (obj.size() > std::numeric_limits<uint16_t>::max())
-            throw std::length_error("Vectors with more than 65536 elements cannot be marshalled");
-        writer.write(static_cast<uint16_t>(obj.size()));
+        if (obj.size() > std::numeric_limits<uint32_t>::max())
+            throw std::length_error("Vectors with more than 2^32 elements cannot be marshalled");
+        writer.write(static_cast<uint32_t>(obj.size()));
         for (const auto& iter : obj)
             single_marshaller<Type>::to_buffer(writer, iter);
     }
 
-    static std::vector<Type> from_buffer(rpc::Peer& peer, BufferReader& reader)
+    // append the elements in <reader> to <result>
+    static void append_from_buffer(rpc::Peer& peer, BufferReader& reader, std::vector<Type>& result)
     {
-        size_t n = reader.read<uint16_t>();
-        std::vector<Type> result;
-        result.reserve(n);
+        size_t n = reader.read<uint32_t>();
+        // every element takes at least one byte, so don't trust the count
+        // for more than that
+        result.reserve(result.size() + std::min(n, reader.remaining()));
         for (size_t i = 0; i < n; i++)
             result.push_back(single_marshaller<Type>::from_buffer(peer, reader));
+    }
+
+    static std::vector<Type> from_buffer(rpc::Peer& peer, BufferReader& reader)
+    {
+        std::vector<Type> result;
+        append_from_buffer(peer, reader, result);
         return result;
     }
 };
@@ -420,6 +471,30 @@ struct proxy_invoker<void, Args...>  {
     }
 };
 
+// specialization for calls that return a vector, which can be streamed
+// Each part of the reply is a vector too, and it is decoded as soon as it
+// arrives, so only the elements are kept until the reply is complete
+template<typename... Args, typename Type>
+struct proxy_invoker<std::vector<Type>, Args...>  {
+    void operator()(std::shared_ptr<rpc::Peer> peer, uint16_t opcode, uint64_t object_id, const typename convert_proxy_to_stub<Args>::type&... args, const std::function<void(rpc::Error*, std::vector<Type>)>& callback) const {
+        BufferWriter writer;
+        pack_marshaller<typename convert_proxy_to_stub<Args>::type...>::to_buffer(writer, args...);
+        auto result = std::make_shared<std::vector<Type>>();
+        peer->invoke_request(opcode, object_id, writer.close(), [peer, callback, result](rpc::Error* error, const uv::Buffer* buffer) {
+            if (error) {
+                callback(error, std::vector<Type>());
+            } else {
+                BufferReader reader(*buffer);
+                single_marshaller<std::vector<Type>>::append_from_buffer(*peer, reader, *result);
+                callback(nullptr, std::move(*result));
+            }
+        }, [peer, result](const uv::Buffer& part) {
+            BufferReader reader(part);
+            single_marshaller<std::vector<Type>>::append_from_buffer(*peer, reader, *result);
+        });
+    }
+};
+
 // specialization for calls that return a tuple
 template<typename... Args, typename... ReturnArgs>
 struct proxy_invoker<std::tuple<ReturnArgs...>, Args...>  {
@@ -455,6 +530,24 @@ struct reply_invoker {
     }
 };
 
+// specialization for calls that return a vector, which can be streamed
+template<typename Type>
+struct reply_invoker<std::vector<Type>> {
+    void operator()(std::shared_ptr<rpc::Peer> peer, uint64_t request_id, const std::vector<Type>& args) const {
+        BufferWriter writer;
+        single_marshaller<std::vector<Type>>::to_buffer(writer, args);
+        peer->send_reply(request_id, writer.close());
+    }
+
+    // send <args> as a part of the reply, which the caller receives
+    // concatenated with the other parts and the final reply
+    void part(std::shared_ptr<rpc::Peer> peer, uint64_t request_id, const std::vector<Type>& args) const {
+        BufferWriter writer;
+        single_marshaller<std::vector<Type>>::to_buffer(writer, args);
+        peer->send_reply_part(request_id, writer.close());
+    }
+};
+
 // specialization for calls that return void
 template<>
 struct reply_invoker<void> {
@@ -474,6 +567,13 @@ struct reply_invoker<std::tuple<Args...>> {
     }
 };
 
+template<typename Return, typename... Args>
+void send_reply_part(std::shared_ptr<rpc::Peer> peer, uint64_t request_id, Args&&... args)
+{
+    reply_invoker<Return> invoker;
+    invoker.part(peer, request_id, std::forward<Args>(args)...);
+}
+
 }
 
 }
@@ -42,7 +42,9 @@ Address::Address(const std::string& str)
         if (close_bracket == std::string::npos)
             throw net::Error("Invalid IPv6 address (missing close bracket)");
 
+        // addresses are compared bytewise, so the padding must be zero too
         sockaddr_in6 in6_addr;
+        memset(&in6_addr, 0, sizeof(in6_addr));
         in6_addr.sin6_family = AF_INET6;
         if (!inet_pton(AF_INET6, str.substr(1, close_bracket-1).c_str(), &in6_addr.sin6_addr))
             throw net::Error("Invalid IPv6 address");
@@ -58,6 +60,7 @@ Address::Address(const std::string& str)
     } else {
         size_t colon = str.find(':');
         sockaddr_in in4_addr;
+        memset(&in4_addr, 0, sizeof(in4_addr));
         in4_addr.sin_family = AF_INET;
         if (!inet_pton(AF_INET, str.substr(0, colon).c_str(), &in4_addr.sin_addr))
             throw net::Error("Invalid IPv4 address");
@@ -22,8 +22,12 @@
 #include "hilbert-values.hpp"
 #include "endian.hpp"
 
+#include <cassert>
 #include <cctype>
+#include <cmath>
 #include <exception>
+#include <new>
+#include <vector>
 
 namespace libhdht {
 
@@ -69,7 +73,7 @@ NodeID::NodeID(const GeoPoint2D& point, uint8_t resolution)
     // the resolution of the grid is half of that
     uint64_t shift = (64 - resolution);
     uint64_t n = (1ULL << (resolution/2));
-    uint64_t d = hilbert_values::xy2d(n, fixed_point.first >> (64 - resolution / 2), fixed_point.second >> (64 - resolution / 2));
+    uint64_t d = hilbert_values::fast_xy2d(n, fixed_point.first >> (64 - resolution / 2), fixed_point.second >> (64 - resolution / 2));
 
     d <<= shift;
     d = htobe64(d);
@@ -104,7 +108,7 @@ NodeID::to_point(uint8_t resolution) const
     uint64_t x, y;
     uint64_t n = (1ULL << (resolution/2));
     uint64_t d = to_hilbert_value(resolution);
-    hilbert_values::d2xy(n, d, x, y);
+    hilbert_values::fast_d2xy(n, d, x, y);
     return std::make_pair(x, y);
 }
 
@@ -241,32 +245,112 @@ NodeIDRange::to_string() const
     return "from " + m_from.to_string() + " to " + to.to_string() + " (mask " + std::to_string(m_mask) + ")";
 }
 
+// the coordinates of the lower corner of the cell at <x>, <y>, in a grid
+// with 2^<bits> cells per side (see GeoPoint2D::to_fixed_point())
+static GeoPoint2D
+cell_corner(double x, double y, int bits)
+{
+    return GeoPoint2D{ std::ldexp(x, -bits) * 180.0 - 90.0,
+                       std::ldexp(y, -bits) * 360.0 - 180.0 };
+}
+
+double
+min_distance_to_cells(const GeoPoint2D& pt, const rtree::Rectangle& cells, uint8_t resolution)
+{
+    // the upper corner of the last cell is the lower corner of the next one
+    // (which is computed in floating point, because it can be past the grid)
+    int bits = resolution / 2;
+    GeoPoint2D lower = cell_corner(cells.get_lower().first, cells.get_lower().second, bits);
+    GeoPoint2D upper = cell_corner(cells.get_upper().first + 1.0, cells.get_upper().second + 1.0, bits);
+    return GeoPoint2D::min_distance(pt, lower, upper);
+}
+
 ServerNode::ServerNode(const NodeIDRange& id_range) : m_range(id_range)
 {}
 
+ClientPool::~ClientPool()
+{
+    for (uint32_t i = 0; i < m_n_slots; i++) {
+        Slot& slot = slot_at(i);
+        if (slot.generation & 1)
+            slot.get_client()->~ClientNode();
+    }
+}
 
-LocalServerNode::LocalServerNode(const NodeIDRange& range, uint8_t resolution)
-    : ServerNode(range), m_clients(1ULL << (resolution/2)), m_resolution(resolution)
+ClientNode *
+ClientPool::create(const NodeID& id, const GeoPoint2D& coordinates)
+{
+    uint32_t index;
+    if (m_free_list != kNoSlot) {
+        index = m_free_list;
+    } else {
+        if (m_n_slots == kNoSlot)
+            throw std::bad_alloc();
+        if (m_n_slots % kSlabSize == 0)
+            m_slabs.emplace_back(new Slot[kSlabSize]);
+        index = m_n_slots;
+        slot_at(index).generation = 0;
+    }
+
+    Slot& slot = slot_at(index);
+    assert(!(slot.generation & 1));
+    ClientHandle handle{ index, slot.generation + 1 };
+    ClientNode *client = new (&slot.storage) ClientNode(handle, id, coordinates);
+
+    // only commit the slot once the client was constructed
+    if (index == m_free_list)
+        m_free_list = slot.next_free;
+    else
+        m_n_slots++;
+    slot.generation++;
+    m_size++;
+    return client;
+}
+
+void
+ClientPool::destroy(ClientNode *client)
+{
+    ClientHandle handle = client->get_handle();
+    assert(get(handle) == client);
+
+    Slot& slot = slot_at(handle.index);
+    client->~ClientNode();
+    slot.generation++;
+    slot.next_free = m_free_list;
+    m_free_list = handle.index;
+    m_size--;
+}
+
+
+LocalServerNode::LocalServerNode(const NodeIDRange& range, uint8_t resolution, ClientPool& pool)
+    : ServerNode(range), m_clients(1ULL << (resolution/2)), m_resolution(resolution), m_pool(pool)
 {}
 
 LocalServerNode *
 LocalServerNode::split()
 {
-    LocalServerNode *new_node = new LocalServerNode(m_range, m_resolution);
+    LocalServerNode *new_node = new LocalServerNode(m_range, m_resolution, m_pool);
     try {
         m_range.increase_mask();
         new_node->m_range.increase_mask();
         new_node->m_range.from().set_bit_at(m_range.mask()-1, 1);
 
-        rtree::RTree left(1ULL << (m_resolution/2)), right(1ULL << (m_resolution/2));
-        m_clients.foreach_entry([&left, &right, this](const std::shared_ptr<rtree::LeafEntry>& entry) -> void {
-            ClientNode *client = static_cast<ClientNode*>(entry->get_data());
-            auto pt = client->get_id().to_point(m_resolution);
-            if (client->get_id().bit_at(m_range.mask()-1))
-                right.insert(pt, client);
+        // the entries are visited in Hilbert order, and already carry their
+        // Hilbert value, so each half can be packed directly
+        // The bit of the node ID that tells the halves apart is also a bit
+        // of the Hilbert value, so the clients themselves are not touched
+        uint8_t split_bit = m_resolution - m_range.mask();
+        std::vector<rtree::LeafEntry> left_entries, right_entries;
+        m_clients.foreach_entry([&left_entries, &right_entries, split_bit](const rtree::LeafEntry& entry) -> void {
+            if ((entry.get_lhv() >> split_bit) & 1)
+                right_entries.push_back(entry);
             else
-                left.insert(pt, client);
+                left_entries.push_back(entry);
         });
+
+        rtree::RTree left(1ULL << (m_resolution/2)), right(1ULL << (m_resolution/2));
+        left.bulk_load(std::move(left_entries));
+        right.bulk_load(std::move(right_entries));
         std::swap(m_clients, left);
         std::swap(new_node->m_clients, right);
 
@@ -277,19 +361,58 @@ LocalServerNode::split()
     }
 }
 
+// adopt_nodes() rebuilds the R-tree unless the adopted node has less than
+// 1/kAdoptRebuildRatio as many clients as this one
+static const size_t kAdoptRebuildRatio = 8;
+
 void
 LocalServerNode::adopt_nodes(LocalServerNode *from)
 {
-    from->foreach_client([this](ClientNode *client) {
-        add_client(client);
+    assert(m_resolution == from->m_resolution);
+
+    // a handful of clients is cheaper to insert one by one than
+    // to rebuild the whole tree; either way, the entries already
+    // have their point and Hilbert value, so there is nothing to convert
+    if (from->load() < load() / kAdoptRebuildRatio) {
+        from->m_clients.foreach_entry([this](const rtree::LeafEntry& entry) {
+            m_clients.insert(entry);
+        });
+        return;
+    }
+
+    std::vector<rtree::LeafEntry> entries;
+    entries.reserve(load() + from->load());
+    m_clients.foreach_entry([&entries](const rtree::LeafEntry& entry) {
+        entries.push_back(entry);
     });
+    from->m_clients.foreach_entry([&entries](const rtree::LeafEntry& entry) {
+        entries.push_back(entry);
+    });
+    m_clients.bulk_load(std::move(entries));
 }
 
 void
 LocalServerNode::add_client(ClientNode *client)
 {
     auto pt = client->get_id().to_point(m_resolution);
-    m_clients.insert(pt, client);
+    m_clients.insert(pt, client->get_handle().to_data());
+}
+
+void
+LocalServerNode::remove_client(ClientNode *client, const NodeID& old_id)
+{
+    auto pt = old_id.to_point(m_resolution);
+    m_clients.erase(pt, client->get_handle().to_data());
+}
+
+void
+LocalServerNode::update_client(ClientNode *client, const NodeID& old_id)
+{
+    auto old_pt = old_id.to_point(m_resolution);
+    auto new_pt = client->get_id().to_point(m_resolution);
+    if (old_pt == new_pt)
+        return;
+    m_clients.update(old_pt, new_pt, client->get_handle().to_data());
 }
 
 
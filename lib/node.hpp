@@ -26,6 +26,9 @@
 #include <cstring>
 #include <string>
 #include <cassert>
+#include <memory>
+#include <type_traits>
+#include <vector>
 
 #include <libhdht/geo.hpp>
 #include <libhdht/net.hpp>
@@ -35,9 +38,40 @@
 
 namespace libhdht {
 
+// A reference to a ClientNode in a ClientPool
+// The generation changes every time the slot is reused, so a handle to
+// a client that was freed is detected and resolves to nullptr
+struct ClientHandle
+{
+    uint32_t index;
+    uint32_t generation;
+
+    bool operator==(const ClientHandle& o) const
+    {
+        return index == o.index && generation == o.generation;
+    }
+
+    // handles are stored in the R-tree in place of the data pointer
+    void *to_data() const
+    {
+        static_assert(sizeof(void*) >= sizeof(uint64_t), "handles must fit in a pointer");
+        return reinterpret_cast<void*>(uintptr_t(index) << 32 | generation);
+    }
+    static ClientHandle from_data(const void *data)
+    {
+        uintptr_t bits = reinterpret_cast<uintptr_t>(data);
+        return ClientHandle{ uint32_t(bits >> 32), uint32_t(bits) };
+    }
+};
+
+// A lower bound of the distance, in meters, from <pt> to the clients located
+// in <cells>, in the grid of the Hilbert curve of the given resolution
+double min_distance_to_cells(const GeoPoint2D& pt, const rtree::Rectangle& cells, uint8_t resolution);
+
 // A client (ie, a mobile phone with a real-world location) in the DHT
 class ClientNode
 {
+    ClientHandle m_handle;
     std::shared_ptr<rpc::Peer> m_peer;
     NodeID m_node_id;
     GeoPoint2D m_coordinates;
@@ -45,9 +79,15 @@ class ClientNode
     bool m_registered = false;
 
 public:
-    ClientNode(const NodeID& id, const GeoPoint2D& coordinates) : m_node_id(id), m_coordinates(coordinates) {}
+    ClientNode(ClientHandle handle, const NodeID& id, const GeoPoint2D& coordinates) :
+        m_handle(handle), m_node_id(id), m_coordinates(coordinates) {}
     ~ClientNode() {}
 
+    ClientHandle get_handle() const
+    {
+        return m_handle;
+    }
+
     bool is_registered() const
     {
         return m_registered;
@@ -140,15 +180,73 @@ public:
     }
 };
 
+// Owns the ClientNodes of a Table
+// Clients are allocated in slabs, so they are packed together and never
+// move, and they are addressed by handle from the R-trees
+class ClientPool
+{
+    static const size_t kSlabSize = 1024;
+    static const uint32_t kNoSlot = UINT32_MAX;
+
+    // the generation is odd while the slot is in use
+    struct Slot {
+        typename std::aligned_storage<sizeof(ClientNode), alignof(ClientNode)>::type storage;
+        uint32_t generation;
+        uint32_t next_free;
+
+        ClientNode *get_client()
+        {
+            return reinterpret_cast<ClientNode*>(&storage);
+        }
+    };
+
+    std::vector<std::unique_ptr<Slot[]>> m_slabs;
+    uint32_t m_n_slots = 0;
+    uint32_t m_free_list = kNoSlot;
+    size_t m_size = 0;
+
+    Slot& slot_at(uint32_t index) const
+    {
+        return m_slabs[index / kSlabSize][index % kSlabSize];
+    }
+
+public:
+    ClientPool() {}
+    ~ClientPool();
+    ClientPool(const ClientPool&) = delete;
+    ClientPool& operator=(const ClientPool&) = delete;
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    ClientNode *create(const NodeID& id, const GeoPoint2D& coordinates);
+    void destroy(ClientNode *client);
+
+    // the client that <handle> refers to, or nullptr if it was destroyed
+    ClientNode *get(ClientHandle handle) const
+    {
+        if (handle.index >= m_n_slots)
+            return nullptr;
+        Slot& slot = slot_at(handle.index);
+        if (slot.generation != handle.generation)
+            return nullptr;
+        return slot.get_client();
+    }
+};
+
 // A server node owned by this library/process
 class LocalServerNode : public ServerNode
 {
     // the clients that are registered with this server
+    // the R-tree stores the handles of the clients, which are resolved in m_pool
     rtree::RTree m_clients;
     uint8_t m_resolution;
+    ClientPool& m_pool;
 
 public:
-    LocalServerNode(const NodeIDRange& id, uint8_t resolution);
+    LocalServerNode(const NodeIDRange& id, uint8_t resolution, ClientPool& pool);
 
     virtual LocalServerNode* split() override;
 
@@ -171,19 +269,72 @@ public:
     void add_client(ClientNode *client);
     void remove_client(ClientNode *client)
     {
-        // TODO
+        remove_client(client, client->get_id());
+    }
+    // remove a client that was added when its id was old_id
+    void remove_client(ClientNode *client, const NodeID& old_id);
+    // update the position of a client whose id changed from old_id
+    void update_client(ClientNode *client, const NodeID& old_id);
+
+    // call callback with every client located in rect
+    template<typename Callback>
+    void search(const rtree::Rectangle& rect, const Callback& callback) const
+    {
+        m_clients.search(rect, [&callback, this](const rtree::LeafEntry& entry) {
+            ClientNode *client = m_pool.get(ClientHandle::from_data(entry.get_data()));
+            assert(client != nullptr);
+            callback(client);
+        });
+    }
+
+    // call visitor with the clients located in rect whose Hilbert value is
+    // at least from, in Hilbert order (ie, node ID order), until visitor
+    // returns false
+    template<typename Visitor>
+    void search_from(const rtree::Rectangle& rect, uint64_t from, const Visitor& visitor) const
+    {
+        m_clients.search_from(rect, from, [&visitor, this](const rtree::LeafEntry& entry) {
+            ClientNode *client = m_pool.get(ClientHandle::from_data(entry.get_data()));
+            assert(client != nullptr);
+            return visitor(client);
+        });
     }
 
-    std::vector<std::shared_ptr<rtree::LeafEntry>> search(const rtree::Rectangle& rect) const
+    // call callback with the handle and the cell of every client located in
+    // rect, without resolving the handles
+    template<typename Callback>
+    void search_handles(const rtree::Rectangle& rect, const Callback& callback) const
     {
-        return m_clients.search(rect);
+        m_clients.search(rect, [&callback](const rtree::LeafEntry& entry) {
+            callback(ClientHandle::from_data(entry.get_data()), entry.get_point());
+        });
+    }
+
+    // call visitor with each client, and a lower bound of its distance from
+    // pt, in order of increasing bound, until visitor returns false
+    // the actual distances can be in a different order, because clients
+    // are only located up to the cell of the grid they are in
+    template<typename Visitor>
+    void visit_nearest(const GeoPoint2D& pt, const Visitor& visitor) const
+    {
+        m_clients.visit_nearest([&pt, this](const rtree::Rectangle& cells) {
+            return min_distance_to_cells(pt, cells, m_resolution);
+        }, [&visitor, this](const rtree::LeafEntry& entry, double bound) {
+            ClientNode *client = m_pool.get(ClientHandle::from_data(entry.get_data()));
+            assert(client != nullptr);
+            return visitor(client, bound);
+        });
     }
 
     template<typename Callback>
     void foreach_client(const Callback& callback) const
     {
-        m_clients.foreach_entry([&callback](std::shared_ptr<rtree::LeafEntry> entry) {
-            callback(static_cast<ClientNode*>(entry->get_data()));
+        m_clients.foreach_entry([&callback, this](const rtree::LeafEntry& entry) {
+            // a node that was taken out of the table is not told about
+            // the clients that are forgotten later, so skip those
+            ClientNode *client = m_pool.get(ClientHandle::from_data(entry.get_data()));
+            if (client != nullptr)
+                callback(client);
         });
     }
 };
@@ -39,7 +39,10 @@ static const int MASTER_OBJECT_ID = 1;
 enum class SetLocationResult : uint8_t
 {
     SameServer,
-    DifferentServer
+    DifferentServer,
+    // only in a batch of locations: the client is not registered with the
+    // server, or it could not be handed over to its new server
+    Failed
 };
 
 enum class ClientRegistrationResult : uint8_t
@@ -49,10 +52,17 @@ enum class ClientRegistrationResult : uint8_t
     ClientAlreadyExists
 };
 
-typedef std::tuple<net::Address, NodeIDRange> AddressAndRange;
+// the address of the owner of a range, the range, and the version of the
+// owner's table when it answered (of two answers of the same server, the
+// one with the larger version is the more recent)
+typedef std::tuple<net::Address, NodeIDRange, uint64_t> AddressAndRange;
 typedef std::tuple<ClientRegistrationResult, NodeID> ClientRegistrationReply;
 typedef std::tuple<SetLocationResult, NodeID, net::Address> SetLocationReply;
+// the current node ID of a client, and its new location
+typedef std::pair<NodeID, GeoPoint2D> LocationUpdate;
 typedef std::unordered_map<std::string, std::string> MetadataType;
+// the clients found, whether there are more, and where the search continues
+typedef std::tuple<std::vector<NodeID>, bool, SearchCursor> SearchPage;
 
 
 // Step 1: forward declare all classes
@@ -121,6 +131,17 @@ protected:\
         }\
         rpc::impl::reply_invoker<return_type> invoker; \
         invoker(peer, request_id, std::forward<Args>(args)...); \
+    } \
+    /* only for requests that return a vector: send some of the results now, */ \
+    /* and the rest with reply_##opcode() */ \
+    template<typename... Args> \
+    void reply_part_##opcode(uint64_t request_id, Args&&... args) {\
+        std::shared_ptr<rpc::Peer> peer = get_peer();\
+        if (!peer) {\
+            log(LOG_ERR, "Partial reply to request " #opcode " dropped (peer was garbage collected)");\
+            return;\
+        }\
+        rpc::impl::send_reply_part<return_type>(peer, request_id, std::forward<Args>(args)...); \
     }
 #include "protocol.inc.hpp"
 #undef request
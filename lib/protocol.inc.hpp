@@ -72,15 +72,15 @@ begin_class(Server)
 
     // find_controlling_server: find the address of the server that controls the
     // range containing this NodeID
-    // returns the address of the server and the range (which a server would use
-    // to refine its own DHT)
+    // returns the address of the server, the range and the version of its table
+    // (which a server uses to remember who owns the range, so the next lookup
+    // goes there directly)
     // this is called by a client or server
     request(AddressAndRange, find_controlling_server, NodeID)
 
     // find_server_for_point: find the address of the server that controls the
     // range containing this point
-    // returns the address of the server and the range (which a server would use
-    // to refine its own DHT)
+    // returns the same as find_controlling_server
     // this is called by a client or server
     request(AddressAndRange, find_server_for_point, GeoPoint2D)
 
@@ -106,6 +106,58 @@ begin_class(Server)
     // forward_search_clients: find all clients that are registered in the DHT in this
     // rectangle (which is already in DHT coordinates)
     request(std::vector<NodeID>, forward_search_clients, std::pair<uint64_t, uint64_t>, std::pair<uint64_t, uint64_t>, std::pair<uint64_t, uint64_t>)
+
+    // search_radius: find all clients that are registered in the DHT within this
+    // many meters of this point
+    request(std::vector<NodeID>, search_radius, GeoPoint2D, double)
+
+    // forward_search_radius: same as search_radius, but only in the ranges within
+    // the given Hilbert bounds
+    // the distance is checked by this server, so only the clients in the circle
+    // are returned
+    request(std::vector<NodeID>, forward_search_radius, GeoPoint2D, double, std::pair<uint64_t, uint64_t>)
+
+    // search_clients_paged: find at most limit clients in this rectangle, in
+    // node ID order, starting at the cursor
+    // the server only looks at its own ranges, and at most one other server,
+    // so a page can be short even if there are more clients
+    // this is called by a client only
+    request(SearchPage, search_clients_paged, GeoPoint2D, GeoPoint2D, SearchCursor, uint32_t)
+
+    // forward_search_clients_paged: same as search_clients_paged, but the
+    // rectangle is already in DHT coordinates, and only the ranges owned by
+    // this server are searched
+    // this is called by a server to the server in the cursor
+    request(SearchPage, forward_search_clients_paged, std::pair<uint64_t, uint64_t>, std::pair<uint64_t, uint64_t>, SearchCursor, uint32_t)
+
+    // knn_clients: find the k clients that are closest to this point, nearest
+    // first, with their distance in meters
+    // this is called by a client only
+    request(std::vector<Neighbour>, knn_clients, GeoPoint2D, uint32_t)
+
+    // forward_knn_clients: find the k clients closest to this point among those
+    // closer than the given distance, within the given Hilbert bounds
+    // the parts of the bounds that this server does not own are forwarded
+    // to their owners in turn
+    // this is called by a server to the servers that could hold some of the neighbours
+    request(std::vector<Neighbour>, forward_knn_clients, GeoPoint2D, uint32_t, double, std::pair<uint64_t, uint64_t>)
+
+    // set_locations_batch: set the physical location of many clients at once,
+    // each identified by its current node ID (if several clients are in the
+    // same cell, and share that ID, one of them is moved)
+    // returns one reply per update, in the same order: SameServer if the client
+    // is still controlled by this server, DifferentServer and the address of the
+    // server that controls it now otherwise, or Failed if the client is unknown or
+    // could not be handed over (the gateway should fall back to find_controlling_server)
+    // the updates for clients of other servers are forwarded, one call per server
+    // this is called by a server, or by a client connected from a host the
+    // server was told to trust as gateway (eg, for a fleet of devices)
+    request(std::vector<SetLocationReply>, set_locations_batch, std::vector<LocationUpdate>)
+
+    // forward_set_locations_batch: same as set_locations_batch, but the updates
+    // for clients this server does not have fail rather than being forwarded again
+    // this is called by a server to the server that owns the clients
+    request(std::vector<SetLocationReply>, forward_set_locations_batch, std::vector<LocationUpdate>)
 end_class
 
 begin_class(Client)
@@ -0,0 +1,159 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "rcu.hpp"
+
+#include <cstdint>
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <vector>
+
+#include <libhdht/logging.hpp>
+
+namespace libhdht
+{
+
+namespace rcu
+{
+
+namespace
+{
+
+struct alignas(64) Slot
+{
+    // the epoch the thread entered its read section in, or 0 outside of one
+    std::atomic<uint64_t> epoch;
+    std::atomic<bool> taken;
+};
+
+Slot slots[MAX_READERS];
+std::atomic<uint64_t> global_epoch(1);
+
+struct Retired
+{
+    void *object;
+    void (*destroy)(void*);
+    // no read section that entered after this epoch can see the object
+    uint64_t epoch;
+};
+
+struct RetiredList
+{
+    std::mutex lock;
+    std::vector<Retired> objects;
+
+    // at exit, there are no readers left
+    ~RetiredList()
+    {
+        for (const Retired& retired : objects)
+            retired.destroy(retired.object);
+    }
+};
+
+RetiredList retired_list;
+
+// the slot of the current thread, taken on its first read section and
+// given back when the thread exits
+struct ThreadSlot
+{
+    Slot *slot = nullptr;
+    unsigned depth = 0;
+
+    ~ThreadSlot()
+    {
+        if (slot != nullptr)
+            slot->taken.store(false, std::memory_order_release);
+    }
+
+    Slot *get()
+    {
+        if (slot != nullptr)
+            return slot;
+        for (Slot& candidate : slots) {
+            bool expected = false;
+            if (!candidate.taken.load(std::memory_order_relaxed) &&
+                candidate.taken.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                slot = &candidate;
+                return slot;
+            }
+        }
+        log(LOG_EMERG, "More than %zu threads reading at once", MAX_READERS);
+        std::terminate();
+    }
+};
+
+thread_local ThreadSlot thread_slot;
+
+}
+
+ReadSection::ReadSection()
+{
+    // the announcement must be visible to writers before the values are
+    // read: a writer that misses it retired its value before this read
+    if (thread_slot.depth++ == 0)
+        thread_slot.get()->epoch.store(global_epoch.load());
+}
+
+ReadSection::~ReadSection()
+{
+    if (--thread_slot.depth == 0)
+        thread_slot.slot->epoch.store(0, std::memory_order_release);
+}
+
+void
+retire(void *object, void (*destroy)(void*))
+{
+    // readers that enter from now on see the new value
+    uint64_t epoch = global_epoch.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> guard(retired_list.lock);
+        retired_list.objects.push_back(Retired{ object, destroy, epoch });
+    }
+    reclaim();
+}
+
+void
+reclaim()
+{
+    uint64_t oldest = UINT64_MAX;
+    for (const Slot& slot : slots) {
+        uint64_t epoch = slot.epoch.load();
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    std::vector<Retired> to_free;
+    {
+        std::lock_guard<std::mutex> guard(retired_list.lock);
+        auto& objects = retired_list.objects;
+        auto it = std::partition(objects.begin(), objects.end(), [oldest](const Retired& retired) {
+            return retired.epoch >= oldest;
+        });
+        to_free.assign(it, objects.end());
+        objects.erase(it, objects.end());
+    }
+    for (const Retired& retired : to_free)
+        retired.destroy(retired.object);
+}
+
+}
+
+}
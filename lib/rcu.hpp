@@ -0,0 +1,95 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+namespace libhdht
+{
+
+// Read-copy-update: values that are read from any thread without locks,
+// and replaced as a whole
+// Readers get the current value within a ReadSection, and writers publish
+// a new value; the old one is freed once every read section that could
+// still see it has ended (epoch based reclamation)
+namespace rcu
+{
+
+// Readers announce the epoch they entered, in one slot per thread; this
+// many threads can be in a read section at once
+static const size_t MAX_READERS = 256;
+
+// The values read from Pointers stay valid for as long as this lives
+// Sections can nest, and must end on the thread they began on
+class ReadSection
+{
+public:
+    ReadSection();
+    ~ReadSection();
+    ReadSection(const ReadSection&) = delete;
+    ReadSection& operator=(const ReadSection&) = delete;
+};
+
+// free <object> with <destroy> once no read section can see it anymore
+void retire(void *object, void (*destroy)(void*));
+// free the retired objects that no read section can see anymore
+void reclaim();
+
+template<typename T>
+class Pointer
+{
+private:
+    std::atomic<const T*> m_value;
+
+    static void destroy(void *object)
+    {
+        delete static_cast<const T*>(object);
+    }
+
+public:
+    Pointer(std::unique_ptr<const T>&& value = nullptr) : m_value(value.release()) {}
+    Pointer(const Pointer&) = delete;
+    Pointer& operator=(const Pointer&) = delete;
+    // there must be no readers left
+    ~Pointer()
+    {
+        delete m_value.load();
+    }
+
+    // the current value, valid until the end of the enclosing ReadSection
+    const T* get() const
+    {
+        return m_value.load();
+    }
+
+    // replace the value (there can only be one writer at a time)
+    void publish(std::unique_ptr<const T>&& value)
+    {
+        const T *old = m_value.exchange(value.release());
+        if (old != nullptr)
+            retire(const_cast<T*>(old), destroy);
+    }
+};
+
+}
+
+}
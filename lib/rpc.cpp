@@ -21,7 +21,9 @@
 #include "libhdht-private.hpp"
 #include "endian.hpp"
 
+#include <atomic>
 #include <deque>
+#include <mutex>
 #include <new>
 
 namespace libhdht
@@ -50,6 +52,9 @@ private:
     }
 
 public:
+    // the largest partial message unpin() copies out of the read buffers
+    static const size_t MAX_UNPIN_SIZE = 1024;
+
     void add_buffer(uv::Buffer&& buffer)
     {
         compact();
@@ -62,6 +67,38 @@ public:
         return m_size;
     }
 
+    // Read buffers are whole blocks of the loop's BufferPool, which are
+    // released once they are consumed; a small partial message is copied
+    // out instead, so an idle connection does not hold on to a whole block
+    void unpin()
+    {
+        compact();
+        if (m_size == 0 || m_size > MAX_UNPIN_SIZE)
+            return;
+        bool pooled = false;
+        for (const auto& buffer : m_buffers)
+            pooled = pooled || buffer.is_pooled();
+        if (!pooled)
+            return;
+
+        try {
+            BufferWriter writer;
+            writer.reserve(m_size);
+            size_t off = m_off;
+            for (const auto& buffer : m_buffers) {
+                writer.write((uint8_t*)buffer.base + off, buffer.len - off, false);
+                off = 0;
+            }
+            std::deque<uv::Buffer> buffers;
+            buffers.emplace_back(writer.close());
+
+            m_buffers.swap(buffers);
+            m_off = 0;
+        } catch(const std::bad_alloc& e) {
+            // keep the blocks, we'll try again on the next read
+        }
+    }
+
     uv::Buffer read(size_t size)
     {
         compact();
@@ -80,8 +117,8 @@ public:
             BufferWriter writer;
             writer.reserve(size);
 
+            writer.write((uint8_t*)start, first.len - m_off, false);
             m_off += size;
-            writer.write((uint8_t*)start, first.len, false);
             m_off -= first.len;
             m_buffers.pop_front();
 
@@ -101,6 +138,25 @@ public:
         }
     }
 
+    // like read(), but append to <writer>, with no intermediate copy
+    void read_into(BufferWriter& writer, size_t size)
+    {
+        compact();
+        m_size -= size;
+
+        while (size > 0) {
+            const uv::Buffer& front(m_buffers.front());
+            size_t to_write = std::min(front.len - m_off, size);
+            writer.write((uint8_t*)front.base + m_off, to_write, false);
+            size -= to_write;
+            m_off += to_write;
+            if (m_off == front.len) {
+                m_off = 0;
+                m_buffers.pop_front();
+            }
+        }
+    }
+
     void advance(size_t off)
     {
         m_size -= off;
@@ -113,6 +169,83 @@ public:
     }
 };
 
+class Inbox;
+
+// An in-process connection between two contexts, which can run on
+// different threads
+// Each side is a Connection on the loop of its own context, and what one
+// side writes is delivered to the other through the Inbox of its context
+// Side 0 is the one that connected, side 1 the one that accepted
+struct Channel
+{
+    std::shared_ptr<Inbox> inboxes[2];
+    // the listening address of the context of each side
+    net::Address addresses[2];
+    // each is only touched by the thread of its side, and is reset
+    // when the connection is closed
+    Connection* connections[2] = { nullptr, nullptr };
+};
+
+// The queue of the messages that the in-process connections of other
+// threads send to a context, which wakes up the loop of the context
+// Messages are pushed on a stack, and the loop takes all of them at once
+// without locking; pushers only lock each other and close() out, so
+// that the handle that wakes up the loop is not freed under them
+class Inbox
+{
+public:
+    enum class MessageType
+    {
+        Connect,
+        Data,
+        Close
+    };
+
+private:
+    struct Message {
+        Message *next;
+        MessageType type;
+        std::shared_ptr<Channel> channel;
+        // the side of the channel that the message is for
+        int side;
+        uv::Buffer data;
+    };
+
+    Context *m_context;
+    uv_async_t *m_async;
+    std::atomic<Message*> m_head;
+    // held by push() and close(); m_closed is only written with it held,
+    // by the thread of the context
+    std::mutex m_lock;
+    bool m_closed;
+
+    static void free_messages(Message *list)
+    {
+        while (list) {
+            Message *next = list->next;
+            delete list;
+            list = next;
+        }
+    }
+    void deliver(Message& message);
+    void drain();
+
+public:
+    Inbox(Context *ctx);
+    Inbox(const Inbox&) = delete;
+    Inbox& operator=(const Inbox&) = delete;
+    ~Inbox()
+    {
+        free_messages(m_head.exchange(nullptr));
+    }
+
+    // stop delivering messages, from the thread of the context
+    // (messages pushed afterwards are dropped)
+    void close();
+
+    // deliver a message to side <side> of <channel>, from any thread
+    void push(MessageType type, const std::shared_ptr<Channel>& channel, int side, uv::Buffer&& data = uv::Buffer());
+};
 
 class Connection : public uv::TCPSocket
 {
@@ -120,13 +253,21 @@ private:
     Context* m_context;
     std::shared_ptr<Peer> m_peer;
     net::Address m_address;
+    // for an in-process connection, instead of the socket
+    std::shared_ptr<Channel> m_channel;
+    int m_side = 0;
 
     // State associated with reading
     LogicalBuffer m_temporary_buffers;
     uint16_t m_opcode = 0;
     uint64_t m_current_request = 0;
     uint64_t m_current_object = 0;
+    uint32_t m_current_error = 0;
     size_t m_expected_bytes = 0;
+    // the frames received so far of a message that has more frames
+    std::unique_ptr<BufferWriter> m_partial_payload;
+    uint16_t m_partial_opcode = 0;
+    uint64_t m_partial_request = 0;
     enum class State
     {
         ReadingOpcode,
@@ -136,6 +277,38 @@ private:
         ReadingPayload
     } m_state = State::ReadingOpcode;
 
+    // State associated with writing
+    // Messages are queued until the Context flushes them, at the end of
+    // the loop iteration, and then written with a single uv_write()
+    // The headers of the queued frames are packed in m_pending_headers,
+    // the payloads are borrowed from the Peer's OutstandingRequests, or
+    // owned by m_pending_payloads
+    struct PendingFrame {
+        size_t header_offset;
+        size_t header_length;
+        const char *payload;
+        size_t payload_length;
+    };
+    std::unique_ptr<BufferWriter> m_pending_headers;
+    std::vector<PendingFrame> m_pending_frames;
+    std::vector<uint64_t> m_pending_request_ids;
+    std::vector<uv::Buffer> m_pending_payloads;
+    size_t m_pending_bytes = 0;
+
+    // the messages that went out in each write, until it completes
+    struct Batch {
+        uv::Buffer headers;
+        std::vector<uint64_t> request_ids;
+        std::vector<uv::Buffer> payloads;
+    };
+    std::unordered_map<uint64_t, Batch> m_batches;
+    uint64_t m_next_batch_id = 0;
+
+    template<typename WriteFields>
+    void queue_message(uint16_t opcode, uint64_t request_id, uv::Buffer&& payload, const WriteFields& write_fields);
+    void message_received(uint16_t opcode, uint64_t object_id, uint64_t request_id, uint32_t error_code, const uv::Buffer& payload);
+    void message_complete(uint64_t request_id, uv::Error err);
+
 public:
     Connection(Context *ctx) : uv::TCPSocket(ctx->get_event_loop())
     {
@@ -146,6 +319,25 @@ public:
         m_context = ctx;
         connect(address);
     }
+    // one side of an in-process connection
+    // (the socket is never connected, it only exists to be closed)
+    Connection(Context *ctx, std::shared_ptr<Channel> channel, int side) :
+        uv::TCPSocket(ctx->get_event_loop()),
+        m_address(channel->addresses[1 - side]),
+        m_channel(channel),
+        m_side(side)
+    {
+        m_context = ctx;
+    }
+
+    bool is_local() const
+    {
+        return m_channel != nullptr;
+    }
+    const net::Address& get_address() const
+    {
+        return m_address;
+    }
 
     void set_address(const net::Address& address)
     {
@@ -169,6 +361,12 @@ public:
                      RemoteError error);
     void write_reply(uint64_t request_id,
                      const uv::Buffer& payload);
+    // write one part of a streamed reply; the connection keeps the payload
+    // until it is written
+    void write_reply_part(uint64_t request_id,
+                          uv::Buffer&& payload);
+    // write all the queued messages
+    void flush();
 
     virtual void connected(uv::Error err) override;
     virtual void closed() override;
@@ -198,6 +396,16 @@ Connection::connected(uv::Error err)
 void
 Connection::closed()
 {
+    // anything that was not written yet is lost
+    m_context->cancel_flush(this);
+    m_pending_frames.clear();
+    m_pending_request_ids.clear();
+    m_pending_payloads.clear();
+
+    if (m_channel) {
+        m_channel->connections[m_side] = nullptr;
+        m_channel->inboxes[1 - m_side]->push(Inbox::MessageType::Close, m_channel, 1 - m_side);
+    }
     if (m_peer) {
         m_peer->drop_connection(this);
         m_context->remove_peer_address(m_peer, m_address);
@@ -235,21 +443,34 @@ Connection::read_callback(uv::Error err, uv::Buffer&& buffer)
                 m_opcode = le16toh(header->opcode);
                 m_current_request = le64toh(header->request_id);
 
-                if (m_opcode == 0) {
+                uint16_t opcode = m_opcode & ~(protocol::MORE_FLAG | protocol::PART_FLAG);
+                if (opcode == 0) {
                     log(LOG_ERR, "Invalid request with null opcode");
                     // Close the connection with extreme prejudice
                     close();
                     return;
                 }
-                if (m_opcode != protocol::REPLY_FLAG &&
-                    m_opcode >= (uint16_t)::libhdht::protocol::Opcode::max_opcode) {
+                if (opcode != protocol::REPLY_FLAG &&
+                    opcode >= (uint16_t)::libhdht::protocol::Opcode::max_opcode) {
                     log(LOG_ERR, "Invalid request opcode");
                     // Close the connection with extreme prejudice
                     close();
                     return;
                 }
+                if (opcode != protocol::REPLY_FLAG && (m_opcode & protocol::PART_FLAG)) {
+                    log(LOG_ERR, "Invalid streamed request");
+                    close();
+                    return;
+                }
+                // the frames of a message are always written together
+                if (m_partial_payload &&
+                    ((m_opcode & ~protocol::MORE_FLAG) != m_partial_opcode || m_current_request != m_partial_request)) {
+                    log(LOG_ERR, "Invalid frame in the middle of a message");
+                    close();
+                    return;
+                }
 
-                if (m_opcode == protocol::REPLY_FLAG) {
+                if (opcode == protocol::REPLY_FLAG) {
                     m_state = State::ReadingError;
                 } else {
                     m_state = State::ReadingObjectId;
@@ -287,19 +508,15 @@ Connection::read_callback(uv::Error err, uv::Buffer&& buffer)
                 uint32_t *p_error_code = (uint32_t*) error_code_buffer.base;
                 uint32_t error_code = le32toh(*p_error_code);
 
-                if (error_code == 0) { // no error!
-                    m_state = State::ReadingPayloadSize;
-                } else {
-                    rpc::RemoteError error(error_code);
-
-                    uint64_t request_id = m_current_request;
-                    m_expected_bytes = 0;
-                    m_opcode = 0;
-                    m_current_request = 0;
-                    m_current_object = 0;
-                    m_state = State::ReadingOpcode;
-                    m_peer->reply_received(request_id, &error, nullptr);
+                if (error_code != 0 && (m_opcode & (protocol::MORE_FLAG | protocol::PART_FLAG))) {
+                    log(LOG_ERR, "Invalid error reply in multiple frames");
+                    close();
+                    return;
                 }
+
+                // errors have an (empty) payload too
+                m_current_error = error_code;
+                m_state = State::ReadingPayloadSize;
                 break;
             } else {
                 has_data = false;
@@ -312,6 +529,13 @@ Connection::read_callback(uv::Error err, uv::Buffer&& buffer)
                 uint16_t *p_payload_size = (uint16_t*) payload_size_buffer.base;
                 uint16_t payload_size = le16toh(*p_payload_size);
 
+                size_t received = m_partial_payload ? m_partial_payload->size() : 0;
+                if (received + payload_size > protocol::MAX_PAYLOAD_SIZE) {
+                    log(LOG_ERR, "Message too large");
+                    close();
+                    return;
+                }
+
                 m_expected_bytes = payload_size;
                 m_state = State::ReadingPayload;
                 break;
@@ -322,26 +546,35 @@ Connection::read_callback(uv::Error err, uv::Buffer&& buffer)
 
         case State::ReadingPayload:
             if (m_temporary_buffers.size() >= m_expected_bytes) {
-                uv::Buffer payload = m_temporary_buffers.read(m_expected_bytes);
-
-                if (m_opcode & protocol::REPLY_FLAG) {
-                    uint64_t request_id = m_current_request;
-                    m_expected_bytes = 0;
-                    m_opcode = 0;
-                    m_current_request = 0;
-                    m_current_object = 0;
-                    m_state = State::ReadingOpcode;
-                    m_peer->reply_received(request_id, nullptr, &payload);
+                uint16_t opcode = m_opcode;
+                uint64_t object_id = m_current_object;
+                uint64_t request_id = m_current_request;
+                uint32_t error = m_current_error;
+                size_t frame_size = m_expected_bytes;
+                m_expected_bytes = 0;
+                m_opcode = 0;
+                m_current_request = 0;
+                m_current_object = 0;
+                m_current_error = 0;
+                m_state = State::ReadingOpcode;
+
+                if (opcode & protocol::MORE_FLAG) {
+                    // copy the frame out of the read buffers, so they can be
+                    // recycled while the rest of the message arrives
+                    if (!m_partial_payload) {
+                        m_partial_payload.reset(new BufferWriter);
+                        m_partial_opcode = opcode & ~protocol::MORE_FLAG;
+                        m_partial_request = request_id;
+                    }
+                    m_temporary_buffers.read_into(*m_partial_payload, frame_size);
+                } else if (m_partial_payload) {
+                    m_temporary_buffers.read_into(*m_partial_payload, frame_size);
+                    uv::Buffer payload = m_partial_payload->close();
+                    m_partial_payload.reset();
+                    message_received(opcode, object_id, request_id, error, payload);
                 } else {
-                    uint16_t opcode = m_opcode;
-                    uint64_t object_id = m_current_object;
-                    uint64_t request_id = m_current_request;
-                    m_expected_bytes = 0;
-                    m_opcode = 0;
-                    m_current_request = 0;
-                    m_current_object = 0;
-                    m_state = State::ReadingOpcode;
-                    m_peer->request_received(opcode, object_id, request_id, payload);
+                    uv::Buffer payload = m_temporary_buffers.read(frame_size);
+                    message_received(opcode, object_id, request_id, error, payload);
                 }
                 break;
             } else {
@@ -350,85 +583,283 @@ Connection::read_callback(uv::Error err, uv::Buffer&& buffer)
             }
         }
     }
+
+    m_temporary_buffers.unpin();
 }
 
 void
-Connection::write_complete(uint64_t req_id, uv::Error err)
+Connection::message_received(uint16_t opcode, uint64_t object_id, uint64_t request_id, uint32_t error_code, const uv::Buffer& payload)
 {
-    // if this connection was already severed, ignore the error
-    if (!is_usable())
-        return;
+    if (!(opcode & protocol::REPLY_FLAG)) {
+        m_peer->request_received(opcode, object_id, request_id, payload);
+    } else if (error_code != 0) {
+        rpc::RemoteError error(error_code);
+        m_peer->reply_received(request_id, &error, nullptr, false);
+    } else {
+        m_peer->reply_received(request_id, nullptr, &payload, opcode & protocol::PART_FLAG);
+    }
+}
 
+void
+Connection::message_complete(uint64_t req_id, uv::Error err)
+{
     std::string name(m_address.to_string());
     if (err) {
         log(LOG_WARNING, "Write error to %s: %s", name.c_str(), err.what());
-        close();
-
         m_peer->write_failed(req_id, err);
     } else {
         log(LOG_DEBUG, "Successfully written %s %llu to %s", (req_id & (1ULL<<63) ? "reply" : "request"), req_id & ~(1ULL<<63), name.c_str());
     }
 }
 
+void
+Connection::write_complete(uint64_t batch_id, uv::Error err)
+{
+    auto it = m_batches.find(batch_id);
+    assert(it != m_batches.end());
+    Batch batch(std::move(it->second));
+    m_batches.erase(it);
+
+    // if this connection was already severed, ignore the error
+    if (!is_usable())
+        return;
+
+    for (uint64_t req_id : batch.request_ids)
+        message_complete(req_id, err);
+    if (err)
+        close();
+}
+
+template<typename WriteFields>
+void
+Connection::queue_message(uint16_t opcode, uint64_t request_id, uv::Buffer&& payload, const WriteFields& write_fields)
+{
+    assert(payload.len <= protocol::MAX_PAYLOAD_SIZE);
+    if (!m_pending_headers)
+        m_pending_headers.reset(new BufferWriter);
+    BufferWriter& header = *m_pending_headers;
+
+    // split the payload in frames, which all point into it
+    size_t off = 0;
+    do {
+        size_t frame_size = std::min(payload.len - off, protocol::MAX_FRAME_SIZE);
+        bool more = off + frame_size < payload.len;
+
+        size_t header_offset = header.size();
+        header.write(static_cast<uint16_t>(more ? opcode | protocol::MORE_FLAG : opcode));
+        header.write(request_id);
+        write_fields(header);
+        header.write(static_cast<uint16_t>(frame_size));
+
+        PendingFrame frame { header_offset, header.size() - header_offset,
+            payload.base + off, frame_size };
+        m_pending_frames.push_back(frame);
+        m_pending_bytes += frame.header_length + frame.payload_length;
+        off += frame_size;
+    } while (off < payload.len);
+
+    m_pending_request_ids.push_back(opcode & protocol::REPLY_FLAG ? request_id | (1ULL<<63) : request_id);
+    if (payload.is_owned())
+        m_pending_payloads.emplace_back(std::move(payload));
+
+    if (m_pending_bytes >= m_context->get_max_batch_size())
+        flush();
+    else if (m_pending_request_ids.size() == 1)
+        m_context->schedule_flush(this);
+}
+
+void
+Connection::flush()
+{
+    if (m_pending_frames.empty())
+        return;
+    m_context->cancel_flush(this);
+
+    uint64_t batch_id = m_next_batch_id++;
+    Batch& batch = m_batches[batch_id];
+    batch.headers = m_pending_headers->close();
+    m_pending_headers.reset();
+    batch.request_ids.swap(m_pending_request_ids);
+    batch.payloads.swap(m_pending_payloads);
+
+    std::vector<uv::Buffer> buffers;
+    buffers.reserve(2 * m_pending_frames.size());
+    for (const PendingFrame& frame : m_pending_frames) {
+        buffers.emplace_back((uint8_t*)batch.headers.base + frame.header_offset, frame.header_length);
+        buffers.emplace_back((uint8_t*)frame.payload, frame.payload_length);
+    }
+    m_pending_frames.clear();
+    size_t n_bytes = m_pending_bytes;
+    m_pending_bytes = 0;
+
+    if (m_channel) {
+        // in process, the batch is copied into a single buffer, which the
+        // other side parses as if it was read from a socket
+        try {
+            BufferWriter writer;
+            writer.reserve(n_bytes);
+            for (const uv::Buffer& buffer : buffers)
+                writer.write((const uint8_t*)buffer.base, buffer.len, false);
+            m_channel->inboxes[1 - m_side]->push(Inbox::MessageType::Data, m_channel, 1 - m_side, writer.close());
+            write_complete(batch_id, 0);
+        } catch(const std::bad_alloc& e) {
+            write_complete(batch_id, UV_ENOBUFS);
+        }
+        return;
+    }
+
+    // the headers and the owned payloads stay in the batch, and the other
+    // payloads in their OutstandingRequest, until the write is complete
+    try {
+        write(batch_id, buffers.data(), buffers.size());
+    } catch(const uv::Error& err) {
+        write_complete(batch_id, err);
+    }
+}
+
 void
 Connection::write_request(uint16_t opcode,
                           uint64_t request_id,
                           uint64_t object_id,
                           const uv::Buffer& payload)
 {
-    try {
-        BufferWriter header;
-        header.reserve(sizeof(protocol::BaseRequest));
-        header.write(opcode);
-        header.write(request_id);
+    // the payload is written from the OutstandingRequest, which lives at least
+    // until the reply arrives, so after the write is complete
+    queue_message(opcode, request_id, uv::Buffer((uint8_t*)payload.base, payload.len), [object_id](BufferWriter& header) {
         header.write(object_id);
-        assert(payload.len <= protocol::MAX_PAYLOAD_SIZE);
-        header.write(static_cast<uint16_t>(payload.len));
-
-        uv::Buffer buffers[2] = { header.close(), uv::Buffer((uint8_t*)payload.base, payload.len, false) };
-        write(request_id, buffers, 2);
-    } catch(const uv::Error& err) {
-        write_complete(request_id, err);
-    }
+    });
 }
 
 void
 Connection::write_reply(uint64_t request_id,
                         const uv::Buffer& payload)
 {
-    try {
-        BufferWriter header;
-        header.reserve(sizeof(protocol::BaseResponse));
-        header.write(protocol::REPLY_FLAG);
-        header.write(request_id);
+    // as for requests, the payload is kept alive by its OutstandingRequest
+    queue_message(protocol::REPLY_FLAG, request_id, uv::Buffer((uint8_t*)payload.base, payload.len), [](BufferWriter& header) {
         header.write(static_cast<uint32_t>(0) /* error code */);
-        assert(payload.len <= protocol::MAX_PAYLOAD_SIZE);
-        header.write(static_cast<uint16_t>(payload.len));
+    });
+}
 
-        uv::Buffer buffers[2] = { header.close(), uv::Buffer((uint8_t*)payload.base, payload.len, false) };
-        write(request_id | (1ULL<<63), buffers, 2);
-    } catch(const uv::Error& err) {
-        write_complete(request_id | (1ULL<<63), err);
-    }
+void
+Connection::write_reply_part(uint64_t request_id,
+                             uv::Buffer&& payload)
+{
+    queue_message(protocol::REPLY_FLAG | protocol::PART_FLAG, request_id, std::move(payload), [](BufferWriter& header) {
+        header.write(static_cast<uint32_t>(0) /* error code */);
+    });
 }
 
 void
 Connection::write_error(uint64_t request_id,
                         RemoteError error)
 {
-    try {
-        BufferWriter header;
-        header.reserve(sizeof(protocol::BaseResponse));
-        header.write(protocol::REPLY_FLAG);
-        header.write(request_id);
+    queue_message(protocol::REPLY_FLAG, request_id, uv::Buffer(), [&error](BufferWriter& header) {
         header.write(error.code());
-        header.write(static_cast<uint16_t>(0));
+    });
+}
 
-        uv::Buffer buffers[1] = { header.close() };
-        write(request_id | (1ULL<<63), buffers, 1);
-    } catch(const uv::Error& err) {
-        write_complete (request_id | (1ULL<<63), err);
+Inbox::Inbox(Context *ctx) : m_context(ctx), m_head(nullptr), m_closed(false)
+{
+    m_async = new uv_async_t;
+    uv_async_init(ctx->get_event_loop().loop(), m_async, [](uv_async_t *handle) {
+        static_cast<Inbox*>(handle->data)->drain();
+    });
+    m_async->data = this;
+    // like the flush handle, this does not keep the loop alive
+    uv_unref((uv_handle_t*)m_async);
+}
+
+void
+Inbox::close()
+{
+    {
+        // wait for the pushers that could still wake up the loop
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_closed = true;
     }
+    free_messages(m_head.exchange(nullptr));
+    m_context = nullptr;
+    uv_close((uv_handle_t*)m_async, [](uv_handle_t *handle) {
+        delete (uv_async_t*)handle;
+    });
+}
+
+void
+Inbox::push(MessageType type, const std::shared_ptr<Channel>& channel, int side, uv::Buffer&& data)
+{
+    std::unique_ptr<Message> message(new Message{ nullptr, type, channel, side, std::move(data) });
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_closed)
+        return;
+    message->next = m_head.load(std::memory_order_relaxed);
+    while (!m_head.compare_exchange_weak(message->next, message.get(), std::memory_order_release, std::memory_order_relaxed))
+        ;
+    message.release();
+    uv_async_send(m_async);
+}
+
+void
+Inbox::drain()
+{
+    if (m_closed)
+        return;
+
+    // the stack has the last message first
+    Message *list = m_head.exchange(nullptr, std::memory_order_acquire);
+    Message *ordered = nullptr;
+    while (list) {
+        Message *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    while (ordered) {
+        std::unique_ptr<Message> message(ordered);
+        ordered = ordered->next;
+        deliver(*message);
+    }
+}
+
+void
+Inbox::deliver(Message& message)
+{
+    Channel& channel = *message.channel;
+    Connection *connection = channel.connections[message.side];
+
+    switch (message.type) {
+    case MessageType::Connect:
+        connection = new Connection(m_context, message.channel, message.side);
+        channel.connections[message.side] = connection;
+        m_context->new_connection(connection);
+        break;
+
+    case MessageType::Data:
+        if (connection)
+            connection->read_callback(0, std::move(message.data));
+        break;
+
+    case MessageType::Close:
+        if (connection)
+            connection->read_callback(UV_EOF, uv::Buffer());
+        break;
+    }
+}
+
+// the inboxes of the contexts that accept in-process connections,
+// by the addresses they listen on
+static std::mutex local_contexts_lock;
+static std::unordered_map<net::Address, std::shared_ptr<Inbox>> local_contexts;
+
+static std::shared_ptr<Inbox>
+find_local_context(const net::Address& address)
+{
+    std::lock_guard<std::mutex> guard(local_contexts_lock);
+    auto it = local_contexts.find(address);
+    if (it == local_contexts.end())
+        return nullptr;
+    return it->second;
 }
 
 }
@@ -438,7 +869,9 @@ Peer::adopt_connection(impl::Connection* connection)
 {
     m_available_connections.push_back(connection);
     connection->set_peer(shared_from_this());
-    connection->start_reading();
+    // in-process connections are fed by the Inbox instead
+    if (!connection->is_local())
+        connection->start_reading();
 }
 
 void
@@ -472,7 +905,7 @@ Peer::get_connection()
     if (!address.is_valid())
         return nullptr;
 
-    impl::Connection *new_connection = new impl::Connection(m_context, address);
+    impl::Connection *new_connection = m_context->connect(address);
     adopt_connection(new_connection);
     return new_connection;
 }
@@ -488,7 +921,8 @@ void
 Peer::invoke_request(uint16_t opcode,
                      uint64_t object_id,
                      uv::Buffer&& payload,
-                     const std::function<void(Error*, const uv::Buffer*)>& callback)
+                     const std::function<void(Error*, const uv::Buffer*)>& callback,
+                     const std::function<void(const uv::Buffer&)>& part_callback)
 {
     if (payload.len > protocol::MAX_PAYLOAD_SIZE) {
         rpc::NetworkError err(UV_E2BIG);
@@ -504,6 +938,7 @@ Peer::invoke_request(uint16_t opcode,
 
     uint64_t request_id = m_next_req_id++;
     OutstandingRequest& req = queue_request(request_id, 0, std::move(payload), callback);
+    req.part_callback = part_callback;
     connection->write_request(opcode, request_id, object_id, req.payload);
     // TODO start a retransmission timeout
 }
@@ -512,6 +947,7 @@ void
 Peer::send_error(uint64_t request_id,
                  RemoteError error)
 {
+    m_lost_replies.erase(request_id);
     OutstandingRequest& req = queue_request(request_id | (1ULL<<63), error, uv::Buffer(), nullptr);
     impl::Connection *connection = get_connection();
     if (connection == nullptr) {
@@ -534,6 +970,16 @@ void
 Peer::send_reply(uint64_t request_id,
                  uv::Buffer&& reply)
 {
+    if (reply.len > protocol::MAX_PAYLOAD_SIZE) {
+        log(LOG_ERR, "Reply to request %llu is too large", (unsigned long long)request_id);
+        send_error(request_id, E2BIG);
+        return;
+    }
+    if (m_lost_replies.erase(request_id) > 0) {
+        log(LOG_ERR, "Reply to request %llu is incomplete", (unsigned long long)request_id);
+        send_error(request_id, EIO);
+        return;
+    }
     OutstandingRequest& req = queue_request(request_id | (1ULL<<63), 0, std::move(reply), nullptr);
     impl::Connection *connection = get_connection();
     if (connection == nullptr) {
@@ -544,6 +990,28 @@ Peer::send_reply(uint64_t request_id,
     connection->write_reply(request_id, req.payload);
 }
 
+void
+Peer::send_reply_part(uint64_t request_id,
+                      uv::Buffer&& part)
+{
+    // unlike whole replies, parts are not kept around for retransmission,
+    // so once one is lost the request fails, with the last part
+    if (m_lost_replies.count(request_id) > 0)
+        return;
+    if (part.len > protocol::MAX_PAYLOAD_SIZE) {
+        log(LOG_ERR, "Partial reply to request %llu is too large", (unsigned long long)request_id);
+        m_lost_replies.insert(request_id);
+        return;
+    }
+    impl::Connection *connection = get_connection();
+    if (connection == nullptr) {
+        m_lost_replies.insert(request_id);
+        return;
+    }
+
+    connection->write_reply_part(request_id, std::move(part));
+}
+
 void
 Peer::request_received(uint16_t opcode, uint64_t object_id, uint64_t request_id, const uv::Buffer& payload)
 {
@@ -560,7 +1028,7 @@ Peer::request_received(uint16_t opcode, uint64_t object_id, uint64_t request_id,
 }
 
 void
-Peer::reply_received(uint64_t request_id, rpc::RemoteError* error, const uv::Buffer* payload)
+Peer::reply_received(uint64_t request_id, rpc::RemoteError* error, const uv::Buffer* payload, bool is_part)
 {
     auto it = m_requests.find(request_id);
 
@@ -569,6 +1037,18 @@ Peer::reply_received(uint64_t request_id, rpc::RemoteError* error, const uv::Buf
         return;
     }
 
+    if (is_part) {
+        if (it->second.part_callback) {
+            it->second.part_callback(*payload);
+        } else {
+            log(LOG_WARNING, "Received unexpected partial reply to request %llu", (unsigned long long)request_id);
+            rpc::RemoteError error(EPROTO);
+            it->second.callback(&error, nullptr);
+            m_requests.erase(it);
+        }
+        return;
+    }
+
     it->second.callback(error, payload);
     m_requests.erase(it);
 }
@@ -601,15 +1081,16 @@ class Server : public uv::TCPSocket
 private:
     Context *m_context;
     net::Address m_address;
+    bool m_shared;
 
 public:
-    Server(Context *ctx, const net::Address& address) :
+    Server(Context *ctx, const net::Address& address, bool shared) :
         uv::TCPSocket(ctx->get_event_loop()),
         m_context(ctx),
-        m_address(address)
+        m_address(address),
+        m_shared(shared)
     {
-        listen(address);
-        start_reading();
+        listen(address, shared);
     }
     Server(const Server&) = delete;
     Server(Server&&) = delete;
@@ -620,6 +1101,10 @@ public:
     {
         return m_address;
     }
+    bool is_shared() const
+    {
+        return m_shared;
+    }
 
     virtual void new_connection() override
     {
@@ -632,18 +1117,107 @@ public:
 }
 
 Context::Context(uv::Loop& loop) : m_loop(loop)
-{}
+{
+    m_flush_handle = new uv_prepare_t;
+    uv_prepare_init(loop.loop(), m_flush_handle);
+    m_flush_handle->data = this;
+    // pending writes alone do not keep the loop alive, the sockets do
+    uv_unref((uv_handle_t*)m_flush_handle);
+}
 
 Context::~Context()
-{}
+{
+    if (m_inbox) {
+        std::lock_guard<std::mutex> guard(impl::local_contexts_lock);
+        for (auto it = impl::local_contexts.begin(); it != impl::local_contexts.end(); ) {
+            if (it->second == m_inbox)
+                it = impl::local_contexts.erase(it);
+            else
+                it++;
+        }
+        m_inbox->close();
+    }
+
+    // the handle is freed once libuv is done with it, which can be after us
+    uv_close((uv_handle_t*)m_flush_handle, [](uv_handle_t *handle) {
+        delete (uv_prepare_t*)handle;
+    });
+}
+
+void
+Context::schedule_flush(impl::Connection* connection)
+{
+    if (m_pending_connections.empty()) {
+        uv_prepare_start(m_flush_handle, [](uv_prepare_t *handle) {
+            static_cast<Context*>(handle->data)->flush_pending();
+        });
+    }
+    m_pending_connections.push_back(connection);
+}
+
+void
+Context::cancel_flush(impl::Connection* connection)
+{
+    auto it = std::find(m_pending_connections.begin(), m_pending_connections.end(), connection);
+    if (it == m_pending_connections.end())
+        return;
+    *it = m_pending_connections.back();
+    m_pending_connections.pop_back();
+    if (m_pending_connections.empty())
+        uv_prepare_stop(m_flush_handle);
+}
 
 void
-Context::add_address(const net::Address& address)
+Context::flush_pending()
 {
-    auto socket = std::make_unique<impl::Server>(this, address);
+    std::vector<impl::Connection*> connections;
+    connections.swap(m_pending_connections);
+    for (auto connection : connections)
+        connection->flush();
+
+    if (m_pending_connections.empty())
+        uv_prepare_stop(m_flush_handle);
+}
+
+void
+Context::add_address(const net::Address& address, bool shared)
+{
+    auto socket = std::make_unique<impl::Server>(this, address, shared);
     m_listening_sockets.push_back(std::move(socket));
+    // other contexts would not know which one they connect to
+    if (m_inbox && !shared) {
+        std::lock_guard<std::mutex> guard(impl::local_contexts_lock);
+        impl::local_contexts[address] = m_inbox;
+    }
 
-    log(LOG_INFO, "Listening on address %s", address.to_string().c_str());
+    log(LOG_INFO, "Listening on %saddress %s", shared ? "shared " : "", address.to_string().c_str());
+}
+
+void
+Context::enable_in_process()
+{
+    if (!m_inbox)
+        m_inbox = std::make_shared<impl::Inbox>(this);
+}
+
+impl::Connection*
+Context::connect(const net::Address& address)
+{
+    net::Address own_address = get_listening_address();
+    std::shared_ptr<impl::Inbox> inbox = m_inbox ? impl::find_local_context(address) : nullptr;
+    // the other side identifies us by our listening address
+    if (!inbox || inbox == m_inbox || !own_address.is_valid())
+        return new impl::Connection(this, address);
+
+    auto channel = std::make_shared<impl::Channel>();
+    channel->inboxes[0] = m_inbox;
+    channel->inboxes[1] = inbox;
+    channel->addresses[0] = own_address;
+    channel->addresses[1] = address;
+    impl::Connection *connection = new impl::Connection(this, channel, 0);
+    channel->connections[0] = connection;
+    inbox->push(impl::Inbox::MessageType::Connect, channel, 1);
+    return connection;
 }
 
 std::shared_ptr<Peer>
@@ -670,21 +1244,25 @@ Context::get_peer(const net::Address& address, Context::AddressType type)
 net::Address
 Context::get_listening_address() const
 {
-    if (m_listening_sockets.empty())
-        return net::Address();
-
-    return m_listening_sockets.front()->get_listening_address();
+    for (const auto& socket : m_listening_sockets) {
+        if (!socket->is_shared())
+            return socket->get_listening_address();
+    }
+    return net::Address();
 }
 
 void
 Context::new_connection(impl::Connection* connection)
 {
     try {
-        net::Address address = connection->get_peer_name();
+        net::Address address = connection->is_local() ? connection->get_address() : connection->get_peer_name();
         connection->set_address(address);
         log(LOG_INFO, "New connection from %s", address.to_string().c_str());
 
-        get_peer(address, AddressType::Dynamic)->adopt_connection(connection);
+        std::shared_ptr<Peer> peer = get_peer(address, AddressType::Dynamic);
+        if (!peer->m_remote_address.is_valid())
+            peer->m_remote_address = address;
+        peer->adopt_connection(connection);
     } catch(std::exception& e) {
         log(LOG_WARNING, "Failed to handle new connection: %s", e.what());
     }
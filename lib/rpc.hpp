@@ -44,7 +44,18 @@ namespace protocol
 {
 
 static const uint16_t REPLY_FLAG = 1<<15;
-static const size_t MAX_PAYLOAD_SIZE = std::numeric_limits<uint16_t>::max();
+// Messages are sent as a sequence of frames, each with its own header and
+// at most MAX_FRAME_SIZE bytes of payload; MORE_FLAG is set on all frames
+// of a message except the last one
+static const uint16_t MORE_FLAG = 1<<14;
+// set on a reply that is one part of a streamed reply, which continues
+// with more parts and ends with a reply that does not have this flag
+static const uint16_t PART_FLAG = 1<<13;
+static const uint16_t FLAGS_MASK = REPLY_FLAG | MORE_FLAG | PART_FLAG;
+
+static const size_t MAX_FRAME_SIZE = std::numeric_limits<uint16_t>::max();
+// the largest message that is accepted, in any number of frames
+static const size_t MAX_PAYLOAD_SIZE = 64 * 1024 * 1024;
 
 struct MessageHeader
 {
@@ -72,6 +83,7 @@ namespace impl
 {
 class Connection;
 class Server;
+class Inbox;
 }
 
 class Peer;
@@ -91,15 +103,23 @@ private:
         rpc::RemoteError error;
         uv::Buffer payload;
         std::function<void(Error*, const uv::Buffer*)> callback;
+        // called with each part of a streamed reply, before the callback
+        // is called with the last one
+        std::function<void(const uv::Buffer&)> part_callback;
     };
     OutstandingRequest& queue_request(uint64_t request_id, rpc::RemoteError error, uv::Buffer&& payload, const std::function<void(Error*, const uv::Buffer*)>& callback);
 
     Context *m_context;
     std::unordered_set<net::Address> m_addresses;
+    // where the connection this peer was created for came from
+    net::Address m_remote_address;
     std::vector<impl::Connection*> m_available_connections;
     std::unordered_map<uint64_t, std::weak_ptr<Proxy>> m_proxies;
     std::unordered_map<uint64_t, std::shared_ptr<Stub>> m_stubs;
     std::unordered_map<uint64_t, OutstandingRequest> m_requests;
+    // the requests that lost a part of their reply, which must fail rather
+    // than end with a reply that looks complete
+    std::unordered_set<uint64_t> m_lost_replies;
     uint64_t m_next_stub_id = 0;
     uint64_t m_next_req_id = 0;
     // NOTE(keshav2): Commented out to avoid unused warning
@@ -115,7 +135,7 @@ private:
     void drop_connection(impl::Connection*);
 
     void write_failed(uint64_t request_id, uv::Error err);
-    void reply_received(uint64_t request_id, rpc::RemoteError*, const uv::Buffer* payload);
+    void reply_received(uint64_t request_id, rpc::RemoteError*, const uv::Buffer* payload, bool is_part);
     void request_received(uint16_t opcode, uint64_t object_id, uint64_t request_id, const uv::Buffer& payload);
 
 public:
@@ -133,6 +153,13 @@ public:
         // FIXME: choose one that is connectable
         return *m_addresses.begin();
     }
+    // the address this peer connected from, as seen when its connection was
+    // accepted (unlike the listening addresses, which the peer announces,
+    // this cannot be made up); invalid if we connected to the peer instead
+    const net::Address& get_remote_address() const
+    {
+        return m_remote_address;
+    }
 
     std::shared_ptr<Stub> get_stub(uint64_t object)
     {
@@ -181,13 +208,18 @@ public:
     void invoke_request(uint16_t opcode,
                         uint64_t object_id,
                         uv::Buffer&& request,
-                        const std::function<void(Error*, const uv::Buffer*)>&);
+                        const std::function<void(Error*, const uv::Buffer*)>&,
+                        const std::function<void(const uv::Buffer&)>& part_callback = nullptr);
     void send_error(uint64_t request_id,
                     rpc::RemoteError error);
     void send_fatal_error(uint64_t request_id,
                           rpc::RemoteError error);
     void send_reply(uint64_t request_id,
                     uv::Buffer&& reply);
+    // send a part of the reply to <request_id>, which is completed
+    // later by send_reply() or send_error()
+    void send_reply_part(uint64_t request_id,
+                         uv::Buffer&& part);
 };
 
 class Proxy : public std::enable_shared_from_this<Proxy>
@@ -263,7 +295,10 @@ public:
 
 class Context
 {
+    friend class Peer;
     friend class impl::Server;
+    friend class impl::Connection;
+    friend class impl::Inbox;
 
 private:
     uv::Loop& m_loop;
@@ -271,11 +306,30 @@ private:
     std::unordered_map<net::Address, std::weak_ptr<Peer>> m_known_peers;
     std::vector<std::function<void(std::shared_ptr<Peer>)>> m_stub_factories;
 
+    // the connections that have messages queued, which are flushed
+    // right before the loop goes back to polling
+    std::vector<impl::Connection*> m_pending_connections;
+    uv_prepare_t *m_flush_handle;
+    size_t m_max_batch_size = DEFAULT_MAX_BATCH_SIZE;
+
+    // the messages of the in-process connections to this context, if it
+    // accepts them
+    std::shared_ptr<impl::Inbox> m_inbox;
+
+    // open a connection to <address>, in process if possible
+    impl::Connection* connect(const net::Address& address);
     void new_connection(impl::Connection*);
+    void schedule_flush(impl::Connection*);
+    void cancel_flush(impl::Connection*);
+    void flush_pending();
 
 public:
     enum class AddressType { Static, Dynamic };
 
+    // the number of bytes queued on a connection that causes it to
+    // be flushed right away
+    static const size_t DEFAULT_MAX_BATCH_SIZE = 64 * 1024;
+
     Context(uv::Loop& loop);
     ~Context();
 
@@ -284,9 +338,22 @@ public:
     {
         m_stub_factories.emplace_back(std::forward<Callback>(callback));
     }
-    void add_address(const net::Address& address);
+    // listen on <address>
+    // With <shared>, the sockets of other contexts, usually on other threads,
+    // can listen on the same address, and the kernel spreads the incoming
+    // connections among them; a shared address is never the listening
+    // address of the context
+    void add_address(const net::Address& address, bool shared = false);
     net::Address get_listening_address() const;
 
+    // Connect to the other contexts of this process that enabled this too,
+    // and accept their connections, through in-process queues rather than
+    // TCP sockets
+    // The contexts can run on different threads, but must be enabled before
+    // adding their addresses, and they must all stop before any of them
+    // is destroyed
+    void enable_in_process();
+
     bool has_peer(const net::Address& address) const
     {
         return m_known_peers.find(address) != m_known_peers.end();
@@ -300,6 +367,15 @@ public:
     {
         return m_loop;
     }
+
+    size_t get_max_batch_size() const
+    {
+        return m_max_batch_size;
+    }
+    void set_max_batch_size(size_t max_batch_size)
+    {
+        m_max_batch_size = max_batch_size;
+    }
 };
 
 }
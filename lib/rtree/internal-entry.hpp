@@ -18,12 +18,10 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
-#pragma once
 
-#include <memory>
+#pragma once
 
 #include "node-entry.hpp"
-#include "node.hpp"
 #include "rectangle.hpp"
 
 namespace libhdht {
@@ -31,30 +29,32 @@ namespace libhdht {
 namespace rtree {
 
 // A data entry for an internal RTree node.
-class InternalEntry : public NodeEntry {
-  public:
-    // InternalEntry constructor
-    InternalEntry(Node* node);
-
-    // Internal Entry destructor
-    ~InternalEntry();
+// The MBR and LHV of the child are cached here, so that traversing
+// the tree does not need to touch the children that are not visited
+struct InternalEntry {
+    HilbertValue lhv;
+    Rectangle mbr;
+    Node* node;
 
     // Get the maximum bounding rectangle (MBR) for this entry
-    std::shared_ptr<Rectangle> get_mbr() override;
+    const Rectangle& get_mbr() const
+    {
+        return mbr;
+    }
 
     // Get the largest Hilbert value (LHV) for this entry
-    HilbertValue get_lhv() override;
-
-    // Get the Node this entry belongs to
-    Node* get_node();
-
-    // Returns true if this entry is a LeafEntry
-    bool is_leaf_entry() override;
-  private:
-    Node* node_;
+    HilbertValue get_lhv() const
+    {
+        return lhv;
+    }
+
+    // Get the Node this entry points to
+    Node* get_node() const
+    {
+        return node;
+    }
 };
 
-} // namespace rtree
+}
 
 } // namespace libhdht
-
@@ -18,9 +18,8 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
-#pragma once
 
-#include <memory>
+#pragma once
 
 #include "node-entry.hpp"
 #include "rectangle.hpp"
@@ -30,33 +29,35 @@ namespace libhdht {
 namespace rtree {
 
 // A data entry for an RTree leaf node.
-class LeafEntry : public NodeEntry {
-  public:
-    // LeafEntry constructor
-    LeafEntry(const Point& pt, HilbertValue lhv, void* data);
-
-    // LeafEntry destructor
-    ~LeafEntry() {};
+// The MBR of a leaf entry is degenerate, so we only store the point
+struct LeafEntry {
+    HilbertValue lhv;
+    Point point;
+    void* data;
 
     // Get the maximum bounding rectangle (MBR) of this entry
-    std::shared_ptr<Rectangle> get_mbr() override;
+    Rectangle get_mbr() const
+    {
+        return Rectangle(point, point);
+    }
 
     // Get the largest Hilbert value (LHV) of this entry
-    HilbertValue get_lhv() override;
+    HilbertValue get_lhv() const
+    {
+        return lhv;
+    }
 
-    // Returns true if this entry is a LeafEntry
-    bool is_leaf_entry() override;
+    // Get the point this entry is located at
+    const Point& get_point() const
+    {
+        return point;
+    }
 
     // Returns the data associated with this entry
     void *get_data() const
     {
-        return m_data;
+        return data;
     }
-
-  private:
-    std::shared_ptr<Rectangle> mbr_;
-    HilbertValue lhv_;
-    void *m_data;
 };
 
 }
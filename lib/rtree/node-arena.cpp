@@ -0,0 +1,154 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include "node-arena.hpp"
+#include "../rcu.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace libhdht {
+
+namespace rtree {
+
+const size_t NodeArena::kMinChunkSize;
+const size_t NodeArena::kMaxChunkSize;
+
+NodeArena::NodeArena(uint32_t capacity)
+    : capacity_(capacity),
+      leaf_size_(Node::allocation_size(true, capacity)),
+      internal_size_(Node::allocation_size(false, capacity)),
+      chunk_size_(std::max(kMinChunkSize, internal_size_)),
+      memory_usage_(0),
+      chunk_cursor_(nullptr), chunk_end_(nullptr),
+      free_leaves_(nullptr), free_internals_(nullptr), concurrent_(false) {
+
+}
+
+NodeArena::~NodeArena() {
+    clear();
+}
+
+NodeArena::NodeArena(NodeArena&& from)
+    : capacity_(from.capacity_),
+      leaf_size_(from.leaf_size_),
+      internal_size_(from.internal_size_),
+      chunk_size_(from.chunk_size_),
+      memory_usage_(from.memory_usage_),
+      chunks_(std::move(from.chunks_)),
+      chunk_cursor_(from.chunk_cursor_), chunk_end_(from.chunk_end_),
+      free_leaves_(from.free_leaves_), free_internals_(from.free_internals_),
+      concurrent_(from.concurrent_) {
+    from.chunks_.clear();
+    from.memory_usage_ = 0;
+    from.chunk_cursor_ = from.chunk_end_ = nullptr;
+    from.free_leaves_ = from.free_internals_ = nullptr;
+}
+
+NodeArena& NodeArena::operator=(NodeArena&& from) {
+    clear();
+    swap(from);
+    return *this;
+}
+
+void NodeArena::swap(NodeArena& with) {
+    std::swap(capacity_, with.capacity_);
+    std::swap(leaf_size_, with.leaf_size_);
+    std::swap(internal_size_, with.internal_size_);
+    std::swap(chunk_size_, with.chunk_size_);
+    std::swap(memory_usage_, with.memory_usage_);
+    std::swap(chunks_, with.chunks_);
+    std::swap(chunk_cursor_, with.chunk_cursor_);
+    std::swap(chunk_end_, with.chunk_end_);
+    std::swap(free_leaves_, with.free_leaves_);
+    std::swap(free_internals_, with.free_internals_);
+    std::swap(concurrent_, with.concurrent_);
+}
+
+void NodeArena::clear() {
+    // Node is trivially destructible, so there is no need to walk the chunks
+    static_assert(std::is_trivially_destructible<Node>::value, "Node must be trivially destructible");
+    if (concurrent_ && !chunks_.empty()) {
+        // readers may still be in the nodes
+        rcu::retire(new std::vector<void*>(std::move(chunks_)), [](void* object) {
+            std::vector<void*>* chunks = static_cast<std::vector<void*>*>(object);
+            for (void* chunk : *chunks)
+                free(chunk);
+            delete chunks;
+        });
+    } else {
+        for (void* chunk : chunks_)
+            free(chunk);
+    }
+    chunks_.clear();
+    memory_usage_ = 0;
+    chunk_size_ = std::max(kMinChunkSize, internal_size_);
+    chunk_cursor_ = chunk_end_ = nullptr;
+    free_leaves_ = free_internals_ = nullptr;
+}
+
+Node* NodeArena::allocate(bool leaf) {
+    FreeNode*& free_list = leaf ? free_leaves_ : free_internals_;
+    size_t size = leaf ? leaf_size_ : internal_size_;
+
+    if (free_list != nullptr) {
+        // a freed node is not constructed again: readers that still hold it
+        // can tell from its version that it changed
+        Node* node = reinterpret_cast<Node*>(free_list);
+        free_list = free_list->next;
+        node->reset(concurrent_);
+        return node;
+    }
+
+    if (chunk_cursor_ == nullptr || size_t(chunk_end_ - chunk_cursor_) < size) {
+        void* chunk;
+        chunks_.reserve(chunks_.size() + 1);
+        if (posix_memalign(&chunk, kCacheLineSize, chunk_size_) != 0)
+            throw std::bad_alloc();
+        chunks_.push_back(chunk);
+        memory_usage_ += chunk_size_;
+        chunk_cursor_ = static_cast<char*>(chunk);
+        chunk_end_ = chunk_cursor_ + chunk_size_;
+        chunk_size_ = std::max(std::min(chunk_size_ * 2, kMaxChunkSize), chunk_size_);
+    }
+    void* memory = chunk_cursor_;
+    chunk_cursor_ += size;
+    return new (memory) Node(leaf, capacity_, concurrent_);
+}
+
+void NodeArena::release(Node* node) {
+    node->begin_change();
+    FreeNode*& free_list = node->is_leaf() ? free_leaves_ : free_internals_;
+    FreeNode* free_node = reinterpret_cast<FreeNode*>(node);
+    free_node->next = free_list;
+    free_list = free_node;
+}
+
+size_t NodeArena::memory_usage() const {
+    return memory_usage_;
+}
+
+}
+
+} // namespace libhdht
@@ -0,0 +1,104 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "node.hpp"
+
+namespace libhdht {
+
+namespace rtree {
+
+// A slab allocator for the nodes of a single RTree
+//
+// Nodes are carved out of cache line aligned chunks, which start small and
+// double in size up to kMaxChunkSize, and are recycled through a free list,
+// so building a tree costs one allocation every few hundred nodes instead
+// of several allocations per entry. Leaf and internal
+// nodes have different sizes, and are kept in separate free lists.
+// All memory is returned when the arena is destroyed, so nodes need not
+// be freed one by one.
+//
+// An arena for a tree with concurrent readers hands out nodes that track
+// their version (see Node), keeps the version of the freed nodes it reuses,
+// and frees its memory only once no rcu::ReadSection can still use it.
+class NodeArena {
+  public:
+    // NodeArena constructor
+    // capacity: the number of entries in each node
+    NodeArena(uint32_t capacity);
+
+    // NodeArena destructor, frees all nodes allocated from this arena
+    ~NodeArena();
+
+    // NodeArena copy and assign
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+    NodeArena(NodeArena&& from);
+    NodeArena& operator=(NodeArena&& from);
+    void swap(NodeArena& with);
+
+    // Allocates a new, empty Node
+    Node* allocate(bool leaf);
+
+    // Returns <node> to the arena, to be reused by a later allocate()
+    void release(Node* node);
+
+    // Returns the number of bytes of memory held by this arena
+    size_t memory_usage() const;
+
+    // Makes the nodes allocated from now on support concurrent readers
+    void set_concurrent(bool concurrent) {
+        concurrent_ = concurrent;
+    }
+    bool is_concurrent() const {
+        return concurrent_;
+    }
+
+  private:
+    struct FreeNode {
+        FreeNode* next;
+    };
+    static const size_t kMinChunkSize = 4 * 1024;
+    static const size_t kMaxChunkSize = 64 * 1024;
+
+    void clear();
+
+    uint32_t capacity_;
+    size_t leaf_size_;
+    size_t internal_size_;
+    size_t chunk_size_; // the size of the next chunk
+    size_t memory_usage_;
+    std::vector<void*> chunks_;
+    char* chunk_cursor_; // the next free byte in the last chunk
+    char* chunk_end_;
+    FreeNode* free_leaves_;
+    FreeNode* free_internals_;
+    bool concurrent_;
+};
+
+}
+
+} // namespace libhdht
@@ -18,37 +18,80 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
-#pragma once
 
-#include <memory>
+#pragma once
 
-#include "rectangle.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
 
 namespace libhdht {
 
 namespace rtree {
 
-// A data entry for an RTree node. Can either belong to a leaf node
-// or an internal node.
-class NodeEntry {
-  public:
-    typedef uint64_t HilbertValue;
-
-    // NodeEntry destructor
-    virtual ~NodeEntry();
+// The position of a point along the Hilbert curve
+typedef uint64_t HilbertValue;
 
-    // Get the maximum bounding rectangle (MBR) of this NodeEntry
-    virtual std::shared_ptr<Rectangle> get_mbr() = 0;
+// Node entries are plain structs, stored inline in the owning Node
+// (see leaf-entry.hpp and internal-entry.hpp)
+class Node;
+struct LeafEntry;
+struct InternalEntry;
 
-    // Get the largest Hilbert value (LHV) of this NodeEntry
-    virtual HilbertValue get_lhv() = 0;
-
-    // Returns true if this entry is a leaf entry
-    virtual bool is_leaf_entry() = 0;
+// A view over the entries stored in a Node
+// It does not own the entries, and it is invalidated by any
+// modification of the Node
+template<typename Entry>
+class EntrySpan {
+  public:
+    typedef Entry* iterator;
+
+    EntrySpan(Entry* begin, size_t size) : begin_(begin), size_(size) {}
+
+    // a span of mutable entries converts to a span of const entries
+    template<typename Other, typename = typename std::enable_if<std::is_convertible<Other*, Entry*>::value>::type>
+    EntrySpan(const EntrySpan<Other>& other) : begin_(other.begin()), size_(other.size()) {}
+
+    Entry* begin() const
+    {
+        return begin_;
+    }
+
+    Entry* end() const
+    {
+        return begin_ + size_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    Entry& operator[](size_t i) const
+    {
+        return begin_[i];
+    }
+
+    Entry& front() const
+    {
+        return begin_[0];
+    }
+
+    Entry& back() const
+    {
+        return begin_[size_-1];
+    }
+
+  private:
+    Entry* begin_;
+    size_t size_;
 };
 
 }
 
 } // namespace libhdht
-
-
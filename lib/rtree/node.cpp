@@ -18,58 +18,94 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
-#include "node.hpp"
 
-#include <memory>
+#include "node.hpp"
 
-#include "internal-entry.hpp"
-#include "rectangle.hpp"
+#include <algorithm>
+#include <cassert>
+#include <thread>
 
 namespace libhdht {
 
 namespace rtree {
 
-Node::Node() {
-    prev_sibling_ = nullptr;
-    next_sibling_ = nullptr;
+NodePolicy NodePolicy::for_capacity(uint32_t capacity) {
+    assert(capacity >= 2);
+
+    NodePolicy policy;
+    policy.capacity = capacity;
+    policy.cooperating_siblings = capacity <= 8 ? 3 : 2;
+    policy.min_fill = std::max(1U, capacity * 2 / 5);
+    return policy;
 }
 
-Node::~Node() {
+Node::Node(bool leaf, uint32_t capacity, bool concurrent)
+    : parent_(nullptr), lhv_(kDefaultHilbertValue), size_(0), capacity_(capacity), leaf_(leaf),
+      concurrent_(concurrent), version_(0) {
 
 }
 
-bool Node::is_leaf() const {
-    return leaf_;
+void Node::reset(bool concurrent) {
+    // a reader may still be in this Node, so its version must not go back,
+    // and the entries it can read must stay within the capacity
+    concurrent_ = concurrent;
+    begin_change();
+    parent_ = nullptr;
+    mbr_ = Rectangle();
+    lhv_ = kDefaultHilbertValue;
+    size_.store(0, std::memory_order_relaxed);
 }
 
-void Node::set_leaf(bool status) {
-    leaf_ = status;
+// the Nodes locked by the write in progress on this thread
+// (writes to one tree happen on one thread at a time, so this is all the
+// bookkeeping they need)
+static thread_local std::vector<Node*> locked_nodes;
+
+void Node::lock() {
+    // the version becomes odd before anything changes
+    locked_nodes.push_back(this);
+    version_.store(version_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
 }
 
-std::shared_ptr<Rectangle> Node::get_mbr() {
-    return mbr_;
+void Node::end_write() {
+    for (Node* node : locked_nodes)
+        node->version_.store(node->version_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    locked_nodes.clear();
 }
 
-Node::HilbertValue Node::get_lhv() {
-    return lhv_;
+uint32_t Node::read_version() const {
+    uint32_t version = version_.load(std::memory_order_acquire);
+    while (version & 1) {
+        std::this_thread::yield();
+        version = version_.load(std::memory_order_acquire);
+    }
+    return version;
 }
 
-void Node::adjust_mbr() {
-    if (entries_.size() == 0) {
-        mbr_.reset(new Rectangle());
+size_t Node::allocation_size(bool leaf, uint32_t capacity) {
+    size_t entry_size = leaf ? sizeof(LeafEntry) : sizeof(InternalEntry);
+    size_t size = sizeof(Node) + capacity * entry_size;
+
+    // round up to a whole number of cache lines
+    return (size + kCacheLineSize - 1) / kCacheLineSize * kCacheLineSize;
+}
+
+template<typename Entry>
+static void adjust_mbr_helper(EntrySpan<const Entry> entries, Rectangle& mbr) {
+    if (entries.empty()) {
+        mbr = Rectangle();
         return;
     }
-    std::shared_ptr<Rectangle> current_mbr = entries_[0]->get_mbr();
-    const Point& current_mbr_upper = current_mbr->get_upper();
-    const Point& current_mbr_lower = current_mbr->get_lower();
 
-    Point new_mbr_upper(current_mbr_upper);
-    Point new_mbr_lower(current_mbr_lower);
+    Rectangle first = entries.front().get_mbr();
+    Point new_mbr_upper(first.get_upper());
+    Point new_mbr_lower(first.get_lower());
 
-    for (const auto& entry : entries_) {
-        std::shared_ptr<Rectangle> mbr = entry->get_mbr();
-        const Point& upper = mbr->get_upper();
-        const Point& lower = mbr->get_lower();
+    for (const Entry& entry : entries) {
+        const Rectangle& entry_mbr = entry.get_mbr();
+        const Point& upper = entry_mbr.get_upper();
+        const Point& lower = entry_mbr.get_lower();
 
         new_mbr_upper.first = std::max(upper.first, new_mbr_upper.first);
         new_mbr_upper.second = std::max(upper.second, new_mbr_upper.second);
@@ -78,129 +114,152 @@ void Node::adjust_mbr() {
         new_mbr_lower.second = std::min(lower.second, new_mbr_lower.second);
     }
 
-    mbr_.reset(new Rectangle(new_mbr_upper, new_mbr_lower));
+    mbr = Rectangle(new_mbr_upper, new_mbr_lower);
+}
+
+void Node::adjust_mbr() {
+    const Node* self = this;
+    if (leaf_)
+        adjust_mbr_helper(self->get_entries<LeafEntry>(), mbr_);
+    else
+        adjust_mbr_helper(self->get_entries<InternalEntry>(), mbr_);
 }
 
 void Node::adjust_lhv() {
-    if (entries_.size() == 0) {
+    if (size() == 0) {
         lhv_ = kDefaultHilbertValue;
         return;
     }
 
-    const HilbertValue current_lhv = entries_[0]->get_lhv();
-    HilbertValue new_lhv = current_lhv;
+    // entries are sorted by LHV, so the largest is always the last one
+    if (leaf_)
+        lhv_ = get_entries<LeafEntry>().back().get_lhv();
+    else
+        lhv_ = get_entries<InternalEntry>().back().get_lhv();
+}
 
-    for (const auto& entry : entries_) {
-        new_lhv = std::max(new_lhv, entry->get_lhv());
+void Node::adjust_entries() {
+    assert(!leaf_);
+    for (InternalEntry& entry : get_entries<InternalEntry>()) {
+        // concurrent readers only need to retry if something changed
+        if (entry.mbr == entry.node->get_mbr() && entry.lhv == entry.node->get_lhv())
+            continue;
+        begin_change();
+        entry.mbr = entry.node->get_mbr();
+        entry.lhv = entry.node->get_lhv();
     }
-
-    lhv_ = new_lhv;
 }
 
-std::vector<std::shared_ptr<NodeEntry>> Node::get_entries() const {
-    return entries_;
-}
+size_t Node::get_index_in_parent() const {
+    assert(parent_ != nullptr);
+
+    EntrySpan<InternalEntry> entries = parent_->get_entries<InternalEntry>();
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].node == this)
+            return i;
+    }
 
-Node* Node::get_parent() const {
-    return parent_;
+    assert(false);
+    return 0;
 }
 
-Node* Node::get_prev_sibling() const {
-    return prev_sibling_;
+std::vector<Node*> Node::get_cooperating_siblings(size_t count) {
+    std::vector<Node*> cooperating_siblings;
+
+    if (parent_ == nullptr || count <= 1) {
+        cooperating_siblings.push_back(this);
+        return cooperating_siblings;
+    }
+
+    // take a window of <count> siblings around this node, preferring
+    // the ones before it, and shift it to fit in the parent
+    EntrySpan<InternalEntry> entries = parent_->get_entries<InternalEntry>();
+    size_t index = get_index_in_parent();
+    count = std::min(count, entries.size());
+    size_t first = index >= count / 2 ? index - count / 2 : 0;
+    first = std::min(first, entries.size() - count);
+
+    cooperating_siblings.reserve(count);
+    for (size_t i = first; i < first + count; i++)
+        cooperating_siblings.push_back(entries[i].node);
+
+    return cooperating_siblings;
 }
 
-Node* Node::get_next_sibling() const {
-    return next_sibling_;
+template<typename Entry>
+static size_t upper_bound_helper(EntrySpan<const Entry> entries, HilbertValue hv) {
+    const Entry* it = std::upper_bound(entries.begin(), entries.end(), hv, [](HilbertValue lhv, const Entry& other) {
+        return lhv < other.get_lhv();
+    });
+    return it - entries.begin();
 }
 
-void Node::set_parent(Node* node) {
-    this->parent_ = node;
+size_t Node::upper_bound(HilbertValue hv) const {
+    if (leaf_)
+        return upper_bound_helper(get_entries<LeafEntry>(), hv);
+    else
+        return upper_bound_helper(get_entries<InternalEntry>(), hv);
 }
 
-void Node::set_prev_sibling(Node* node) {
-    this->prev_sibling_ = node;
+template<typename Entry>
+void Node::insert_at(const Entry& entry, size_t index) {
+    uint32_t size = size_.load(std::memory_order_relaxed);
+    assert(size < capacity_);
+    assert(index <= size);
+
+    begin_change();
+    Entry* begin = reinterpret_cast<Entry*>(this + 1);
+    std::copy_backward(begin + index, begin + size, begin + size + 1);
+    begin[index] = entry;
+    size_.store(size + 1, std::memory_order_relaxed);
 }
 
-void Node::set_next_sibling(Node* node) {
-    this->next_sibling_ = node;
+void Node::insert_entry(const LeafEntry& entry, size_t index) {
+    assert(leaf_);
+    insert_at(entry, index);
 }
 
-std::vector<Node*> Node::get_cooperating_siblings() {
-    std::vector<Node*> cooperating_siblings;
+void Node::insert_entry(const InternalEntry& entry, size_t index) {
+    assert(!leaf_);
+    insert_at(entry, index);
+    entry.node->set_parent(this);
+}
 
-    if (this->prev_sibling_ != nullptr) {
-        cooperating_siblings.push_back(this->prev_sibling_);
-    }
-    cooperating_siblings.push_back(this);
-    if (this->next_sibling_ != nullptr) {
-        cooperating_siblings.push_back(this->next_sibling_);
-    }
+template<typename Entry>
+void Node::remove_at(size_t index) {
+    uint32_t size = size_.load(std::memory_order_relaxed);
+    assert(index < size);
 
-    return cooperating_siblings;
+    begin_change();
+    Entry* begin = reinterpret_cast<Entry*>(this + 1);
+    std::copy(begin + index + 1, begin + size, begin + index);
+    size_.store(size - 1, std::memory_order_relaxed);
 }
 
-void Node::clear_entries() {
-    entries_.clear();
+void Node::remove_entry(size_t index) {
+    if (leaf_)
+        remove_at<LeafEntry>(index);
+    else
+        remove_at<InternalEntry>(index);
 }
 
-void Node::insert_leaf_entry(std::shared_ptr<NodeEntry> entry) {
-    // TODO(keshav2): Assert node is leaf
-    // TODO(keshav2): Assert node has capacity
-    const HilbertValue entry_lhv = entry->get_lhv();
-    auto it = entries_.begin();
-    for (; it != entries_.end(); it++) {
-        if (entry_lhv < (*it)->get_lhv()) {
-            entries_.insert(it, entry);
-            return;
-        }
-    }
-    entries_.insert(it, entry);
-}
-
-void Node::insert_internal_entry(std::shared_ptr<NodeEntry> entry) {
-    // TODO(keshav2): Assert node is internal
-    // TODO(keshav2): Assert node has capacity
-    const HilbertValue entry_lhv = entry->get_lhv();
-    auto it = entries_.begin();
-    bool inserted = false;
-    for (; it != entries_.end(); it++) {
-        if (entry_lhv < (*it)->get_lhv()) {
-            it = entries_.insert(it, entry);
-            inserted = true;
-            break;
-        }
-    }
-    if (!inserted) {
-        it = entries_.insert(it, entry);
-    }
-    Node* node = std::dynamic_pointer_cast<InternalEntry>(*it)->get_node();;
-
-    // Set parent
-    node->set_parent(this);
-
-    // Set previous sibling
-    if (it != entries_.begin()) {
-        auto prev_it = it;
-        prev_it--;
-    node->set_prev_sibling(std::dynamic_pointer_cast<InternalEntry>(*prev_it)->get_node());
-    } else {
-        node->set_prev_sibling(nullptr);
-    }
-
-    // Set next sibling
-    auto end = entries_.end();
-    end--;
-    if (it != end) {
-        auto next_it = it;
-        next_it++;
-        node->set_next_sibling(std::dynamic_pointer_cast<InternalEntry>(*next_it)->get_node());
-    } else {
-        node->set_next_sibling(nullptr);
-    }
+void Node::append_entry(const LeafEntry& entry) {
+    uint32_t size = size_.load(std::memory_order_relaxed);
+    assert(leaf_);
+    assert(size < capacity_);
+    begin_change();
+    reinterpret_cast<LeafEntry*>(this + 1)[size] = entry;
+    size_.store(size + 1, std::memory_order_relaxed);
 }
 
-bool Node::has_capacity() const {
-    return entries_.size() < kMaxCapacity;
+void Node::append_entry(const InternalEntry& entry) {
+    uint32_t size = size_.load(std::memory_order_relaxed);
+    assert(!leaf_);
+    assert(size < capacity_);
+    begin_change();
+    reinterpret_cast<InternalEntry*>(this + 1)[size] = entry;
+    size_.store(size + 1, std::memory_order_relaxed);
+    entry.node->set_parent(this);
 }
 
 }
@@ -18,86 +18,200 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+
 #pragma once
 
 #include "node-entry.hpp"
+#include "leaf-entry.hpp"
+#include "internal-entry.hpp"
 #include "rectangle.hpp"
 
-#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
 
 namespace libhdht {
 
 namespace rtree {
 
 const uint64_t kDefaultHilbertValue = 0;
-const uint64_t kMaxCapacity = 5;
+
+// The size of a cache line; nodes are sized and aligned to a multiple of this
+const size_t kCacheLineSize = 64;
+
+// How many entries a node holds, and how full nodes are split and
+// underfull nodes are merged
+struct NodePolicy {
+    // the maximum number of entries in a node
+    uint32_t capacity;
+
+    // the number of nodes (the overflowing node and its siblings) that pool
+    // their entries before a new node is allocated, ie the s of the
+    // s-to-(s+1) split of the Hilbert R-tree
+    uint32_t cooperating_siblings;
+
+    // the minimum number of entries in a node other than the root; a node
+    // that falls below this after a deletion takes entries from its
+    // cooperating siblings, or is merged into them
+    uint32_t min_fill;
+
+    // Returns the default policy for nodes of <capacity> entries
+    // Small nodes use the 2-to-3 split with both siblings, as in the original
+    // Hilbert R-tree paper; larger nodes only cooperate with one sibling,
+    // because each split copies every pooled entry.
+    static NodePolicy for_capacity(uint32_t capacity);
+};
 
 // An RTree node
+//
+// Nodes are allocated from the NodeArena of the owning RTree, and store
+// their entries inline, right after the node header: a leaf node holds
+// LeafEntries, an internal node holds InternalEntries. In both cases the
+// entries are sorted by LHV.
+//
+// In a tree with concurrent readers, each node also has a version, which
+// is odd while a write is changing its entries: readers copy the entries
+// without locking and check that the version did not change meanwhile
+// (optimistic concurrency, as in a seqlock).
 class Node {
   public:
-    typedef uint64_t HilbertValue;
+    typedef rtree::HilbertValue HilbertValue;
 
     // Node constructor
-    Node();
+    // The node must be followed by enough memory for <capacity> entries
+    // (see allocation_size())
+    Node(bool leaf, uint32_t capacity, bool concurrent = false);
 
-    // Node destructor
-    ~Node();
+    // Nodes are owned by the arena and never copied
+    Node(const Node&) = delete;
+    Node& operator=(const Node&) = delete;
+
+    // Returns the number of bytes needed to store a node with <capacity> entries
+    static size_t allocation_size(bool leaf, uint32_t capacity);
 
     // ----------//
     // Accessors //
     // ----------//
 
     // Returns true if this Node is a leaf
-    bool is_leaf() const;
+    bool is_leaf() const {
+        return leaf_;
+    }
 
     // Returns the maximum bounding rectangle (MBR) of the entries rooted at this Node
-    std::shared_ptr<Rectangle> get_mbr();
+    const Rectangle& get_mbr() const {
+        return mbr_;
+    }
 
     // Returns the largest Hilbert value (LHV) of the entries rooted at this Node
-    HilbertValue get_lhv();
-
-    // Returns the list of entries stored at this Node
-    std::vector<std::shared_ptr<NodeEntry>> get_entries() const;
+    HilbertValue get_lhv() const {
+        return lhv_;
+    }
+
+    // Returns the number of entries stored at this Node
+    size_t size() const {
+        return size_.load(std::memory_order_relaxed);
+    }
+
+    // Returns the maximum number of entries stored at this Node
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    // Returns the entries stored at this Node, which must be of type <Entry>
+    // (LeafEntry for a leaf, InternalEntry otherwise)
+    template<typename Entry>
+    EntrySpan<Entry> get_entries() {
+        return EntrySpan<Entry>(reinterpret_cast<Entry*>(this + 1), size());
+    }
+    template<typename Entry>
+    EntrySpan<const Entry> get_entries() const {
+        return EntrySpan<const Entry>(reinterpret_cast<const Entry*>(this + 1), size());
+    }
 
     // Returns a pointer to this Node's parent
-    Node* get_parent() const;
-
-    // Returns a pointer to this Node's previous sibling
-    Node* get_prev_sibling() const;
-
-    // Returns a pointer to this Node's next sibling
-    Node* get_next_sibling() const;
-
-    // Sets the Node to a leaf node if <status> is true
-    void set_leaf(bool status);
-
-    // Returns a list of nodes to assist with the overflow handling procedure
-    std::vector<Node*> get_cooperating_siblings();
-
-    // Returns true if the Node has less than kMaxCapacity entries
-    bool has_capacity() const;
+    Node* get_parent() const {
+        return parent_;
+    }
+
+    // Returns the position of the entry pointing to this Node in its parent
+    size_t get_index_in_parent() const;
+
+    // Returns the position of the first entry with LHV greater than <hv>,
+    // which is where an entry with LHV <hv> is inserted
+    size_t upper_bound(HilbertValue hv) const;
+
+    // Returns a list of nodes to assist with the overflow handling procedure:
+    // this Node and up to <count>-1 adjacent siblings under the same parent,
+    // in LHV order
+    std::vector<Node*> get_cooperating_siblings(size_t count);
+
+    // Returns true if the Node has less than capacity() entries
+    bool has_capacity() const {
+        return size() < capacity_;
+    }
+
+    // -------------------//
+    // Concurrent readers //
+    // -------------------//
+
+    // Returns the version of this Node, waiting until no write is changing it
+    uint32_t read_version() const;
+
+    // Returns true if this Node did not change since <version> was read, so
+    // what was read from it in the meantime is consistent
+    bool validate(uint32_t version) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return version_.load(std::memory_order_relaxed) == version;
+    }
+
+    // Returns the entries of this Node, which must be of type <Entry>, while
+    // a writer may be changing them: what is read from them is only
+    // consistent if the version is validated afterwards
+    template<typename Entry>
+    EntrySpan<const Entry> peek_entries() const {
+        uint32_t size = size_.load(std::memory_order_relaxed);
+        return EntrySpan<const Entry>(reinterpret_cast<const Entry*>(this + 1), std::min(size, capacity_));
+    }
 
     // ----------//
     // Modifiers //
     // ----------//
 
-    // Adds <entry> to this Node, assuming this is a leaf node
-    void insert_leaf_entry(std::shared_ptr<NodeEntry> entry);
+    // Adds <entry> to this Node at position <index>; the caller is
+    // responsible for keeping the entries sorted
+    void insert_entry(const LeafEntry& entry, size_t index);
+    void insert_entry(const InternalEntry& entry, size_t index);
 
-    // Adds <entry> to this Node, assuming this is an internal node
-    void insert_internal_entry(std::shared_ptr<NodeEntry> entry);
+    // Adds <entry> at the end of this Node; the caller is responsible
+    // for keeping the entries sorted
+    void append_entry(const LeafEntry& entry);
+    void append_entry(const InternalEntry& entry);
+
+    // Removes the entry at position <index> of this Node, keeping the
+    // remaining entries sorted
+    void remove_entry(size_t index);
 
     // Sets the parent pointer of this Node
-    void set_parent(Node* node);
+    void set_parent(Node* node) {
+        parent_ = node;
+    }
 
-    // Sets the previous sibling pointer of this Node
-    void set_prev_sibling(Node* node);
+    // Clears all entries stored at this Node
+    void clear_entries() {
+        begin_change();
+        size_.store(0, std::memory_order_relaxed);
+    }
 
-    // Sets the next sibling pointer of this node
-    void set_next_sibling(Node* node);
+    // Empties this freed Node, to be reused as the same kind of Node
+    // Unlike the constructor, this keeps counting the versions, and marks the
+    // Node as changing, so readers that still hold it can tell
+    void reset(bool concurrent);
 
-    // Clears all entries stored at this Node
-    void clear_entries();
+    // Refreshes the MBR and LHV cached in the entries of an internal Node
+    // from the children they point to
+    void adjust_entries();
 
     // Recomputes the MBR for this Node
     void adjust_mbr();
@@ -105,16 +219,46 @@ class Node {
     // Recomputes the LHV for this Node
     void adjust_lhv();
 
+    // Called before the entries of this Node change, or before it is freed:
+    // in a tree with concurrent readers, the Node is marked as changing until
+    // the end of the write (see end_write())
+    void begin_change() {
+        if (concurrent_ && (version_.load(std::memory_order_relaxed) & 1) == 0)
+            lock();
+    }
+
+    // Ends the current write on this thread, letting the readers use
+    // the Nodes it changed
+    static void end_write();
+
   private:
+    void lock();
+
+    template<typename Entry>
+    void insert_at(const Entry& entry, size_t index);
+    template<typename Entry>
+    void remove_at(size_t index);
+
     Node* parent_;
-    Node* prev_sibling_;
-    Node* next_sibling_;
-    std::shared_ptr<Rectangle> mbr_;
+    Rectangle mbr_;
     HilbertValue lhv_;
+    std::atomic<uint32_t> size_; // read by concurrent readers too
+    uint32_t capacity_;
     bool leaf_;
-    std::vector<std::shared_ptr<NodeEntry>> entries_;
+    bool concurrent_;
+    std::atomic<uint32_t> version_;
 };
 
+static_assert(sizeof(Node) % alignof(InternalEntry) == 0 && sizeof(Node) % alignof(LeafEntry) == 0,
+              "Node entries must be correctly aligned");
+
+// The number of cache lines filled by a leaf node of the default capacity
+const size_t kDefaultLeafCacheLines = 12;
+
+// The default capacity of a node, chosen so that a full leaf fills
+// exactly kDefaultLeafCacheLines cache lines
+const uint32_t kDefaultCapacity = (kDefaultLeafCacheLines * kCacheLineSize - sizeof(Node)) / sizeof(LeafEntry);
+
 }
 
 } // namespace libhdht
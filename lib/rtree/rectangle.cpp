@@ -20,6 +20,7 @@
 
 #include "rectangle.hpp"
 
+#include <cmath>
 #include <cstdint>
 #include <vector>
 
@@ -70,6 +71,25 @@ Rectangle::contains(const Point &pt) const
     return contains(Rectangle(pt, pt));
 }
 
+// the distance from <x> to the interval [<lower>, <upper>]
+static inline double
+interval_distance(uint64_t x, uint64_t lower, uint64_t upper)
+{
+    if (x < lower)
+        return double(lower - x);
+    if (x > upper)
+        return double(x - upper);
+    return 0;
+}
+
+double
+Rectangle::min_distance(const Point &pt) const
+{
+    double dx = interval_distance(pt.first, lower_.first, upper_.first);
+    double dy = interval_distance(pt.second, lower_.second, upper_.second);
+    return std::sqrt(dx * dx + dy * dy);
+}
+
 Rectangle
 Rectangle::intersection(const Rectangle &one, const Rectangle &two)
 {
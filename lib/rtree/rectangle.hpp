@@ -38,9 +38,6 @@ class Rectangle {
     // Rectangle constructor
     Rectangle(const Point& upper, const Point& lower);
 
-    // Rectangle destructor
-    ~Rectangle() {}
-
     // Get the center of the Rectangle
     Point get_center() const;
 
@@ -93,6 +90,19 @@ class Rectangle {
     // Returns true if <pt> is contained in this Rectangle
     bool contains(const Point& pt) const;
 
+    // Returns the Euclidean distance from <pt> to the closest point of this
+    // Rectangle (0 if <pt> is contained in it)
+    double min_distance(const Point& pt) const;
+
+    bool operator==(const Rectangle& other) const
+    {
+        return upper_ == other.upper_ && lower_ == other.lower_;
+    }
+    bool operator!=(const Rectangle& other) const
+    {
+        return !(*this == other);
+    }
+
   private:
     Point upper_;
     Point lower_;
@@ -18,192 +18,290 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+
 #include "rtree-helper.hpp"
 
-#include <cmath>
-#include <memory>
+#include <algorithm>
+#include <type_traits>
 #include <vector>
 #include <cassert>
 
-#include "node-entry.hpp"
-#include "internal-entry.hpp"
-#include "rectangle.hpp"
-
 namespace libhdht {
 
 namespace rtree {
 
-Node* RTreeHelper::choose_leaf(Node* root, Node::HilbertValue hv_to_insert) {
+Node* RTreeHelper::choose_leaf(Node* root, HilbertValue hv_to_insert) {
     if (root == nullptr) {
         return nullptr;
     }
 
-    if (root->is_leaf()) {
-        return root;
+    Node* node = root;
+    while (!node->is_leaf()) {
+        // pick the first entry with LHV greater than the inserted value,
+        // or the last one if there is none
+        EntrySpan<const InternalEntry> entries = node->get_entries<InternalEntry>();
+        assert(!entries.empty());
+        const InternalEntry* it = entries.begin();
+        while (it != &entries.back() && it->get_lhv() <= hv_to_insert)
+            it++;
+        node = it->get_node();
     }
-
-    auto it = root->get_entries().begin();
-    for (; it != root->get_entries().end(); it++) {
-        const auto hv = (*it)->get_lhv();
-        if (hv > hv_to_insert) {
-            Node* node = std::dynamic_pointer_cast<InternalEntry>(*it)->get_node();
-            return RTreeHelper::choose_leaf(node, hv_to_insert);
-        }
-    }
-
-    Node* node = std::dynamic_pointer_cast<InternalEntry>(*--it)->get_node();
-    return RTreeHelper::choose_leaf(node, hv_to_insert);
+    return node;
 }
 
-std::vector<std::shared_ptr<LeafEntry>> RTreeHelper::search(const Rectangle& query, Node* root) {
-    std::vector<std::shared_ptr<LeafEntry>> results;
-    if (root == nullptr) {
-        return results;
-    }
+Node* RTreeHelper::find_leaf(Node* root, HilbertValue hv, const Point& pt, const void* data, size_t& index) {
     if (root->is_leaf()) {
-        for (std::shared_ptr<NodeEntry> entry : root->get_entries()) {
-            assert(entry->is_leaf_entry());
-            if (entry->get_mbr()->intersects(query)) {
-                results.push_back(std::static_pointer_cast<LeafEntry>(entry));
+        EntrySpan<const LeafEntry> entries = root->get_entries<LeafEntry>();
+        for (size_t i = 0; i < entries.size(); i++) {
+            const LeafEntry& entry = entries[i];
+            if (entry.get_lhv() == hv && entry.get_data() == data && entry.get_point() == pt) {
+                index = i;
+                return root;
             }
         }
-    } else {
-        for (std::shared_ptr<NodeEntry> entry : root->get_entries()) {
-            if (entry->get_mbr()->intersects(query)) {
-                assert(!entry->is_leaf_entry());
-                std::vector<std::shared_ptr<LeafEntry>> temp = search(query, std::static_pointer_cast<InternalEntry> (entry)->get_node());
-                results.reserve(results.size() + temp.size());
-                results.insert(results.end(), temp.begin(), temp.end());
-            }
+        return nullptr;
+    }
+
+    // entries with the same Hilbert value can be spread over consecutive
+    // children, so keep looking until a child with a larger LHV
+    for (const InternalEntry& entry : root->get_entries<InternalEntry>()) {
+        if (entry.get_lhv() < hv)
+            continue;
+        if (entry.get_mbr().contains(pt)) {
+            Node* leaf = find_leaf(entry.get_node(), hv, pt, data, index);
+            if (leaf != nullptr)
+                return leaf;
         }
+        if (entry.get_lhv() > hv)
+            break;
     }
-    return results;
+    return nullptr;
 }
 
-Node* RTreeHelper::handle_overflow(Node* node, std::shared_ptr<NodeEntry> entry, std::vector<Node*>& siblings) {
-    std::vector<std::shared_ptr<NodeEntry>> entries;
-    std::vector<Node*>::iterator node_it;
+template<typename Entry>
+Node* RTreeHelper::handle_overflow(NodeArena& arena, const NodePolicy& policy, Node* node, const Entry& entry, size_t index,
+                                   Node*& last_sibling) {
+    std::vector<Node*> siblings = node->get_cooperating_siblings(policy.cooperating_siblings);
     Node* new_node = nullptr;
 
-    RTreeHelper::insert_entry(entries, entry);
-    siblings = node->get_cooperating_siblings();
-    for (auto it = siblings.begin(); it != siblings.end(); it++) {
-        Node* sibling = *it;
-        if (sibling == nullptr) continue;
-        const std::vector<std::shared_ptr<NodeEntry>>& sibling_entries = sibling->get_entries();
-        for (auto e : sibling_entries) {
-            RTreeHelper::insert_entry(entries, e);
-        }
-        sibling->clear_entries();
-        if (sibling == node) {
-            node_it = it;
-        }
+    // siblings are in LHV order, and so are their entries, so concatenating
+    // them keeps the list sorted, and the new entry goes at the same position
+    // relative to the entries of <node>
+    std::vector<Entry> entries;
+    entries.reserve(siblings.size() * policy.capacity + 1);
+    size_t position = 0;
+    for (Node* sibling : siblings) {
+        if (sibling == node)
+            position = entries.size() + index;
+        EntrySpan<Entry> sibling_entries = sibling->get_entries<Entry>();
+        entries.insert(entries.end(), sibling_entries.begin(), sibling_entries.end());
     }
+    entries.insert(entries.begin() + position, entry);
 
-    size_t total_capacity = siblings.size() * kMaxCapacity;
-    if (entries.size() >= total_capacity) {
+    size_t total_capacity = siblings.size() * policy.capacity;
+    if (entries.size() > total_capacity) {
         // We need a new node because there is no capacity in the existing nodes
-        new_node = new Node();
-        new_node->set_leaf(entry->is_leaf_entry());
-
-        // Adjust the sibling pointers as follows:
-        // node_prev_sibling -> node
-        // |-> node_prev_sibling -> new_node -> node
-        Node* node_prev_sibling = node->get_prev_sibling();
-        if (node_prev_sibling != nullptr) {
-            node_prev_sibling->set_next_sibling(new_node);
-        }
-        new_node->set_prev_sibling(node->get_prev_sibling());
-        node->set_prev_sibling(new_node);
-        new_node->set_next_sibling(node);
-
-        // Insert the new node where the original node was
-        siblings.insert(node_it, new_node);
+        // The new node goes after the last sibling, and takes the highest entries
+        new_node = arena.allocate(node->is_leaf());
+        last_sibling = siblings.back();
+        siblings.push_back(new_node);
     }
 
+    for (Node* sibling : siblings)
+        sibling->clear_entries();
+
     // Redistribute the entries
     RTreeHelper::distribute_entries(entries, siblings);
 
     return new_node;
 }
 
-Node* RTreeHelper::adjust_tree(Node* root, Node* node, Node* new_node, std::vector<Node*>& siblings) {
-    Node* new_parent = nullptr;
-    std::vector<Node*> local_siblings;
-    std::vector<Node*> new_siblings;
-    bool done = false;
-    while (!done) {
+template Node* RTreeHelper::handle_overflow<LeafEntry>(NodeArena&, const NodePolicy&, Node*, const LeafEntry&, size_t, Node*&);
+template Node* RTreeHelper::handle_overflow<InternalEntry>(NodeArena&, const NodePolicy&, Node*, const InternalEntry&, size_t, Node*&);
+
+Node* RTreeHelper::adjust_tree(NodeArena& arena, const NodePolicy& policy, Node* root, Node* node, Node* new_node) {
+    while (true) {
         Node* parent = node->get_parent();
         if (parent == nullptr) {
-            done = true;
-
             if (new_node != nullptr) {
-                std::shared_ptr<InternalEntry> node_entry = std::make_shared<InternalEntry>(node);
-                std::shared_ptr<InternalEntry> new_node_entry = std::make_shared<InternalEntry>(new_node);
-                root = new Node();
-                root->set_leaf(false);
-                root->insert_internal_entry(node_entry);
-                root->insert_internal_entry(new_node_entry);
+                // the root was split, grow the tree by one level
+                root = arena.allocate(false);
+                root->append_entry(make_internal_entry(node));
+                root->append_entry(make_internal_entry(new_node));
+                root->adjust_lhv();
+                root->adjust_mbr();
             }
-        } else {
-            if (new_node != nullptr) {
-                std::shared_ptr<InternalEntry> new_node_entry = std::make_shared<InternalEntry>(new_node);
-                if (parent->has_capacity()) {
-                    parent->insert_internal_entry(new_node_entry);
-                    parent->adjust_lhv();
-                    parent->adjust_mbr();
-                    new_siblings.push_back(parent);
-                } else {
-                    new_parent = RTreeHelper::handle_overflow(parent, new_node_entry, new_siblings);
-                }
+            return root;
+        }
+
+        // all the nodes that were touched at this level share the same parent,
+        // so refreshing the parent entries is enough to account for them
+        HilbertValue old_lhv = parent->get_lhv();
+        Rectangle old_mbr = parent->get_mbr();
+        parent->adjust_entries();
+
+        Node* new_parent = nullptr;
+        if (new_node != nullptr) {
+            // nodes can share the same LHV, so the new node is placed next to the
+            // node it was split from, rather than by LHV
+            InternalEntry new_node_entry = make_internal_entry(new_node);
+            size_t index = node->get_index_in_parent() + 1;
+            if (parent->has_capacity()) {
+                parent->insert_entry(new_node_entry, index);
+                parent->adjust_lhv();
+                parent->adjust_mbr();
             } else {
-                new_siblings.push_back(parent);
+                new_parent = RTreeHelper::handle_overflow(arena, policy, parent, new_node_entry, index, parent);
             }
+        } else {
+            parent->adjust_lhv();
+            parent->adjust_mbr();
 
-            for (auto& sibling : local_siblings) {
-                sibling->get_parent()->adjust_lhv();
-                sibling->get_parent()->adjust_mbr();
-            }
+            // nothing changed from here upwards
+            if (parent->get_lhv() == old_lhv && parent->get_mbr() == old_mbr)
+                return root;
+        }
 
-            local_siblings.clear();
-            for (const auto& sibling : new_siblings) {
-                local_siblings.push_back(sibling);
-            }
+        node = parent;
+        new_node = new_parent;
+    }
+}
 
-            node = parent;
-            new_node = new_parent;
+template<typename Entry>
+bool RTreeHelper::handle_underflow(NodeArena& arena, const NodePolicy& policy, Node* node) {
+    std::vector<Node*> siblings = node->get_cooperating_siblings(policy.cooperating_siblings);
+
+    std::vector<Entry> entries;
+    entries.reserve(siblings.size() * policy.capacity);
+    for (Node* sibling : siblings) {
+        EntrySpan<Entry> sibling_entries = sibling->get_entries<Entry>();
+        entries.insert(entries.end(), sibling_entries.begin(), sibling_entries.end());
+    }
+
+    // If the siblings cannot all stay above the minimum fill, merge them into
+    // one less node; the merged nodes are still below capacity, because each
+    // of them takes less than siblings.size() / (siblings.size() - 1) times
+    // the minimum fill
+    // The last sibling is the one that goes away, which is only possible if
+    // it has siblings or it is empty
+    Node* removed = nullptr;
+    if (entries.size() < siblings.size() * policy.min_fill &&
+        (siblings.size() > 1 || entries.empty())) {
+        removed = siblings.back();
+        siblings.pop_back();
+    }
+
+    for (Node* sibling : siblings)
+        sibling->clear_entries();
+    if (!siblings.empty())
+        RTreeHelper::distribute_entries(entries, siblings);
+
+    if (removed != nullptr) {
+        Node* parent = removed->get_parent();
+        parent->remove_entry(removed->get_index_in_parent());
+        arena.release(removed);
+        return true;
+    }
+    return false;
+}
+
+template bool RTreeHelper::handle_underflow<LeafEntry>(NodeArena&, const NodePolicy&, Node*);
+template bool RTreeHelper::handle_underflow<InternalEntry>(NodeArena&, const NodePolicy&, Node*);
+
+Node* RTreeHelper::condense_tree(NodeArena& arena, const NodePolicy& policy, Node* root, Node* node) {
+    while (node != root) {
+        Node* parent = node->get_parent();
+
+        bool removed = false;
+        if (node->size() < policy.min_fill) {
+            if (node->is_leaf())
+                removed = RTreeHelper::handle_underflow<LeafEntry>(arena, policy, node);
+            else
+                removed = RTreeHelper::handle_underflow<InternalEntry>(arena, policy, node);
         }
+
+        HilbertValue old_lhv = parent->get_lhv();
+        Rectangle old_mbr = parent->get_mbr();
+        parent->adjust_entries();
+        parent->adjust_lhv();
+        parent->adjust_mbr();
+
+        // nothing changed from here upwards
+        if (!removed && parent->get_lhv() == old_lhv && parent->get_mbr() == old_mbr)
+            return root;
+
+        node = parent;
+    }
+
+    // the root is allowed to be underfull, but an internal root with a single
+    // child is a wasted level, and an empty leaf root is an empty tree
+    while (!root->is_leaf() && root->size() == 1) {
+        Node* child = root->get_entries<InternalEntry>().front().get_node();
+        child->set_parent(nullptr);
+        arena.release(root);
+        root = child;
+    }
+    if (root->size() == 0) {
+        arena.release(root);
+        return nullptr;
     }
     return root;
 }
 
-void RTreeHelper::distribute_entries(std::vector<std::shared_ptr<NodeEntry>>& entries, std::vector<Node*>& siblings) {
-    int entries_per_node = (int) (std::ceil(static_cast<float> (entries.size()) / siblings.size()));
+template<typename Entry>
+void RTreeHelper::distribute_entries(const std::vector<Entry>& entries, const std::vector<Node*>& siblings) {
+    // spread the entries as evenly as possible, keeping them in order
+    size_t n_entries = entries.size();
+    size_t n_siblings = siblings.size();
 
-    uint32_t entry_idx = 0;
-    for (const auto& sibling : siblings) {
-        for (int i = 0; i < entries_per_node && entry_idx < entries.size(); i++) {
-            if (entries[entry_idx]->is_leaf_entry()) {
-                sibling->insert_leaf_entry(entries[entry_idx++]);
-            } else {
-                sibling->insert_internal_entry(entries[entry_idx++]);
-            }
-        }
+    size_t entry_idx = 0;
+    for (size_t i = 0; i < n_siblings; i++) {
+        Node* sibling = siblings[i];
+        size_t end = n_entries * (i + 1) / n_siblings;
+        for (; entry_idx < end; entry_idx++)
+            sibling->append_entry(entries[entry_idx]);
         sibling->adjust_lhv();
         sibling->adjust_mbr();
     }
 }
 
-void RTreeHelper::insert_entry(std::vector<std::shared_ptr<NodeEntry>>& entries,
-                               const std::shared_ptr<NodeEntry>& entry) {
-    auto it = entries.begin();
-    for (; it != entries.end(); it++) {
-        if ((*it)->get_lhv() > entry->get_lhv()) {
-            entries.insert(it, entry);
-            return;
-        }
+template void RTreeHelper::distribute_entries<LeafEntry>(const std::vector<LeafEntry>&, const std::vector<Node*>&);
+template void RTreeHelper::distribute_entries<InternalEntry>(const std::vector<InternalEntry>&, const std::vector<Node*>&);
+
+// Packs <entries> into full nodes of one level of the tree, and appends
+// the entries pointing to the new nodes to <parent_entries>
+template<typename Entry>
+static void pack_level(NodeArena& arena, const NodePolicy& policy, const std::vector<Entry>& entries,
+                       std::vector<InternalEntry>& parent_entries) {
+    bool leaf = std::is_same<Entry, LeafEntry>::value;
+    size_t n_nodes = (entries.size() + policy.capacity - 1) / policy.capacity;
+
+    std::vector<Node*> nodes;
+    nodes.reserve(n_nodes);
+    for (size_t i = 0; i < n_nodes; i++)
+        nodes.push_back(arena.allocate(leaf));
+
+    // spreading the entries evenly, rather than filling all nodes but the last,
+    // keeps every node above the minimum fill
+    RTreeHelper::distribute_entries(entries, nodes);
+
+    parent_entries.reserve(parent_entries.size() + n_nodes);
+    for (Node* node : nodes)
+        parent_entries.push_back(RTreeHelper::make_internal_entry(node));
+}
+
+Node* RTreeHelper::pack(NodeArena& arena, const NodePolicy& policy, const std::vector<LeafEntry>& entries) {
+    if (entries.empty())
+        return nullptr;
+
+    std::vector<InternalEntry> level;
+    pack_level(arena, policy, entries, level);
+    while (level.size() > 1) {
+        std::vector<InternalEntry> parent_level;
+        pack_level(arena, policy, level, parent_level);
+        level.swap(parent_level);
     }
-    entries.insert(it, entry);
+    return level.front().get_node();
 }
 
 }
@@ -18,13 +18,16 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+
 #pragma once
 
-#include <memory>
+#include <algorithm>
+#include <queue>
 #include <vector>
 #include <cassert>
 
 #include "node.hpp"
+#include "node-arena.hpp"
 #include "node-entry.hpp"
 #include "leaf-entry.hpp"
 #include "internal-entry.hpp"
@@ -37,36 +40,221 @@ namespace rtree {
 class RTreeHelper {
   public:
     // Chooses the appropriate leaf node of the R-Tree rooted at <root> to insert <hv_to_insert> into
-    static Node* choose_leaf(Node* root, Node::HilbertValue hv_to_insert);
+    static Node* choose_leaf(Node* root, HilbertValue hv_to_insert);
+
+    // Finds the LeafEntry <pt>:<data>, with Hilbert value <hv>, in the tree rooted at <root>
+    // Returns the leaf that stores it and sets <index> to its position in the leaf,
+    // or returns nullptr if there is no such entry
+    static Node* find_leaf(Node* root, HilbertValue hv, const Point& pt, const void* data, size_t& index);
+
+    // Calls <visitor> on each LeafEntry in the tree rooted at <root> that is contained in <query>
+    // This does not allocate: the visitor is responsible for storing the results, if needed
+    template<typename Visitor>
+    static void search(const Rectangle& query, const Node* root, Visitor& visitor)
+    {
+        if (root->is_leaf()) {
+            for (const LeafEntry& entry : root->get_entries<LeafEntry>()) {
+                if (query.contains(entry.get_point()))
+                    visitor(entry);
+            }
+        } else {
+            for (const InternalEntry& entry : root->get_entries<InternalEntry>()) {
+                if (entry.get_mbr().intersects(query))
+                    search(query, entry.get_node(), visitor);
+            }
+        }
+    }
+
+    // Calls <visitor> on each LeafEntry in the tree rooted at <root> that is
+    // contained in <query> and has a Hilbert value of at least <from>, in
+    // Hilbert order, until <visitor> returns false
+    // Returns false if <visitor> stopped the search
+    template<typename Visitor>
+    static bool search_from(const Rectangle& query, HilbertValue from, const Node* root, Visitor& visitor)
+    {
+        if (root->is_leaf()) {
+            for (const LeafEntry& entry : root->get_entries<LeafEntry>()) {
+                if (entry.get_lhv() >= from && query.contains(entry.get_point()) && !visitor(entry))
+                    return false;
+            }
+        } else {
+            // the subtrees whose largest value is before <from> have nothing left
+            for (const InternalEntry& entry : root->get_entries<InternalEntry>()) {
+                if (entry.get_lhv() >= from && entry.get_mbr().intersects(query) &&
+                    !search_from(query, from, entry.get_node(), visitor))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // The progress of a search with concurrent writers, which survives
+    // restarts from the root
+    struct ConcurrentSearch {
+        const Rectangle query;
+        // the leaves up to this Hilbert value were searched already...
+        HilbertValue after;
+        // ...except for the entries with that very value, which can spread
+        // over several leaves, and of which only these were visited
+        std::vector<const void*> visited_at_after;
+        // the entries found in the current leaf
+        std::vector<LeafEntry> found;
+
+        ConcurrentSearch(const Rectangle& query) : query(query), after(0) {}
+
+        bool visited(const LeafEntry& entry, size_t n_visited) const
+        {
+            if (entry.get_lhv() != after)
+                return entry.get_lhv() < after;
+            auto end = visited_at_after.begin() + n_visited;
+            return std::find(visited_at_after.begin(), end, entry.get_data()) != end;
+        }
+    };
+
+    // Calls <visitor> on each LeafEntry in the subtree of <node> that is
+    // contained in the query of <search> and was not visited yet
+    // <version> is the version of <node> when it was found in the tree
+    // Returns false if a writer got in the way, and the search must start
+    // over from the root
+    template<typename Visitor>
+    static bool search_concurrent(ConcurrentSearch& search, const Node* node, uint32_t version, Visitor& visitor)
+    {
+        if (node->is_leaf()) {
+            // the entries at <after> visited in the previous leaves
+            std::vector<const void*>& visited = search.visited_at_after;
+            size_t n_visited = visited.size();
+
+            EntrySpan<const LeafEntry> entries = node->peek_entries<LeafEntry>();
+            if (search.found.size() < entries.size())
+                search.found.resize(node->capacity());
+            size_t n_found = 0;
+            for (const LeafEntry& entry : entries) {
+                if (search.query.contains(entry.get_point()) && !search.visited(entry, n_visited))
+                    search.found[n_found++] = entry;
+            }
+            HilbertValue last = entries.empty() ? search.after : entries.back().get_lhv();
+            if (!node->validate(version))
+                return false;
 
-    // Returns a list of LeafEntry pointers in the tree rooted at <root> that are contained with <query>
-    static std::vector<std::shared_ptr<LeafEntry>> search(const Rectangle& query, Node* root);
+            for (size_t i = 0; i < n_found; i++) {
+                const LeafEntry& entry = search.found[i];
+                visitor(entry);
+                if (entry.get_lhv() == last)
+                    visited.push_back(entry.get_data());
+            }
+            if (last > search.after) {
+                visited.erase(visited.begin(), visited.begin() + n_visited);
+                search.after = last;
+            }
+            return true;
+        }
 
-    // Rebalances tree rooted at <root> after insertion
-    static Node* adjust_tree(Node* root, Node* leaf, Node* new_leaf, std::vector<Node*>& siblings);
+        for (const InternalEntry& entry : node->peek_entries<InternalEntry>()) {
+            if (entry.get_lhv() < search.after || !entry.get_mbr().intersects(search.query))
+                continue;
 
-    // Takes care of the case where adding a new entry to a node increases its capacity beyond the limit
-    static Node* handle_overflow(Node* node, std::shared_ptr<NodeEntry> entry, std::vector<Node*>& siblings);
+            // the child is only known to be in the tree if <node> did not
+            // change since, and from then on its version tells
+            const Node* child = entry.get_node();
+            uint32_t child_version = child->read_version();
+            if (!node->validate(version))
+                return false;
+            if (!search_concurrent(search, child, child_version, visitor))
+                return false;
+        }
+        // the children that were skipped must have been skipped on
+        // consistent entries too
+        return node->validate(version);
+    }
+
+    // Calls <visitor> with each LeafEntry in the tree rooted at <root> and its distance, in order
+    // of increasing distance, until <visitor> returns false
+    // <distance> maps a Rectangle to a lower bound of the distance of the points in it (which,
+    // for a Rectangle made of a single point, is the distance of that point)
+    // The traversal is best-first: nodes are opened in order of the distance of their MBR,
+    // so only the nodes closer than the last visited entry are ever opened
+    template<typename Distance, typename Visitor>
+    static void nearest(const Node* root, const Distance& distance, Visitor& visitor)
+    {
+        // either a node to open or an entry to visit, as soon as nothing is closer
+        struct Item {
+            double distance;
+            const Node* node;
+            const LeafEntry* entry;
+
+            bool operator<(const Item& other) const
+            {
+                // the priority queue is a max-heap, and the nearest must come first
+                return distance > other.distance;
+            }
+        };
+
+        std::priority_queue<Item> queue;
+        queue.push(Item{ distance(root->get_mbr()), root, nullptr });
+        while (!queue.empty()) {
+            Item item = queue.top();
+            queue.pop();
+
+            const Node* node = item.node;
+            if (item.entry != nullptr) {
+                if (!visitor(*item.entry, item.distance))
+                    return;
+            } else if (node->is_leaf()) {
+                for (const LeafEntry& entry : node->get_entries<LeafEntry>())
+                    queue.push(Item{ distance(Rectangle(entry.get_point(), entry.get_point())), nullptr, &entry });
+            } else {
+                for (const InternalEntry& entry : node->get_entries<InternalEntry>())
+                    queue.push(Item{ distance(entry.get_mbr()), entry.get_node(), nullptr });
+            }
+        }
+    }
+
+    // Rebalances tree rooted at <root> after <node> was modified and possibly split into <new_node>,
+    // which goes right after <node> in the parent
+    // Returns the new root of the tree
+    static Node* adjust_tree(NodeArena& arena, const NodePolicy& policy, Node* root, Node* node, Node* new_node);
+
+    // Takes care of the case where adding <entry> at position <index> of <node> increases its capacity beyond the limit
+    // Returns the newly allocated node, if any, that must be inserted in the parent right after <last_sibling>
+    template<typename Entry>
+    static Node* handle_overflow(NodeArena& arena, const NodePolicy& policy, Node* node, const Entry& entry, size_t index,
+                                 Node*& last_sibling);
+
+    // Rebalances the tree rooted at <root> after entries were removed from <node>, merging
+    // underfull nodes with their cooperating siblings and shrinking the tree if needed
+    // Returns the new root of the tree, or nullptr if the tree is now empty
+    static Node* condense_tree(NodeArena& arena, const NodePolicy& policy, Node* root, Node* node);
+
+    // Takes care of the case where removing an entry from a node leaves it with less than
+    // the minimum fill, by borrowing entries from its siblings or merging it into them
+    // Returns true if a node was removed from the parent of <node>
+    template<typename Entry>
+    static bool handle_underflow(NodeArena& arena, const NodePolicy& policy, Node* node);
 
     // Re-distributes <entries> among the Nodes in <siblings>
-    static void distribute_entries(std::vector<std::shared_ptr<NodeEntry>>& entries, std::vector<Node*>& siblings);
+    template<typename Entry>
+    static void distribute_entries(const std::vector<Entry>& entries, const std::vector<Node*>& siblings);
 
-    // Inserts <entry> into <entries> in increasing order of LHV
-    static void insert_entry(std::vector<std::shared_ptr<NodeEntry>>& entries, const std::shared_ptr<NodeEntry>& entry);
+    // Builds a tree out of <entries>, which must be sorted by LHV, by packing
+    // them bottom-up into as few nodes as possible
+    // Returns the root of the new tree, or nullptr if <entries> is empty
+    static Node* pack(NodeArena& arena, const NodePolicy& policy, const std::vector<LeafEntry>& entries);
+
+    // Builds the entry pointing to <node> in its parent
+    static InternalEntry make_internal_entry(Node* node)
+    {
+        return InternalEntry{ node->get_lhv(), node->get_mbr(), node };
+    }
 
     template<typename Callback>
-    static void foreach_entry(Node* root, const Callback& callback)
+    static void foreach_entry(const Node* root, const Callback& callback)
     {
         if (root->is_leaf()) {
-            for (const auto& entry : root->get_entries()) {
-                assert(entry->is_leaf_entry());
-                callback(std::static_pointer_cast<LeafEntry>(entry));
-            }
+            for (const LeafEntry& entry : root->get_entries<LeafEntry>())
+                callback(entry);
         } else {
-            for (const auto& entry : root->get_entries()) {
-                assert(!entry->is_leaf_entry());
-                foreach_entry(std::static_pointer_cast<InternalEntry>(entry)->get_node(), callback);
-            }
+            for (const InternalEntry& entry : root->get_entries<InternalEntry>())
+                foreach_entry(entry.get_node(), callback);
         }
     }
 };
@@ -74,4 +262,3 @@ class RTreeHelper {
 }
 
 } // namespace libhdht
-
@@ -18,8 +18,12 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+
 #include "rtree.hpp"
 
+#include <algorithm>
+#include <cassert>
+
 #include "leaf-entry.hpp"
 #include "node.hpp"
 #include "rtree-helper.hpp"
@@ -31,38 +35,162 @@ namespace rtree {
 
 RTree::HilbertValue RTree::hilbert_value_for_point(const Point& pt) const
 {
-    return hilbert_values::xy2d(m_max_dimension, pt.first, pt.second);
+    return hilbert_values::fast_xy2d(m_max_dimension, pt.first, pt.second);
 }
 
-void RTree::insert(const Point& pt, void *data) {
-    HilbertValue hv(hilbert_value_for_point (pt));
-    std::shared_ptr<LeafEntry> entry = std::make_shared<LeafEntry>(pt, hv, data);
-    std::vector<Node*> siblings;
+// Lets concurrent readers back into the nodes changed by a write, when
+// the write is over (even if it throws)
+class WriteSection {
+  public:
+    WriteSection() {}
+    ~WriteSection() {
+        Node::end_write();
+    }
+    WriteSection(const WriteSection&) = delete;
+    WriteSection& operator=(const WriteSection&) = delete;
+};
+
+void RTree::enable_concurrent_reads() {
+    if (arena_.is_concurrent())
+        return;
+
+    // the nodes already in the tree must track their versions too, which
+    // is the same as rebuilding them in a concurrent arena
+    NodeArena arena(policy_.capacity);
+    arena.set_concurrent(true);
+    arena_.swap(arena);
+    if (root_ != nullptr) {
+        std::vector<LeafEntry> entries;
+        entries.reserve(m_size);
+        RTreeHelper::foreach_entry(root_, [&entries](const LeafEntry& entry) {
+            entries.push_back(entry);
+        });
+        WriteSection write;
+        root_ = RTreeHelper::pack(arena_, policy_, entries);
+    }
+}
+
+std::vector<LeafEntry> RTree::make_entries(const std::vector<Point>& points, const std::vector<void*>& data) const {
+    assert(points.size() == data.size());
+
+    std::vector<HilbertValue> values(points.size());
+    hilbert_values::xy2d_batch(m_max_dimension, points.data(), values.data(), points.size());
+
+    std::vector<LeafEntry> entries;
+    entries.reserve(points.size());
+    for (size_t i = 0; i < points.size(); i++)
+        entries.push_back(LeafEntry{ values[i], points[i], data[i] });
+    return entries;
+}
+
+void RTree::insert(const LeafEntry& entry) {
+    WriteSection write;
+    HilbertValue hv(entry.get_lhv());
 
     // Find the appropriate leaf node
     Node* leaf = RTreeHelper::choose_leaf(this->root_, hv);
     if (leaf == nullptr) {
-        leaf = new Node();
-        leaf->set_leaf(true);
+        leaf = arena_.allocate(true);
         root_ = leaf;
     }
 
     // Insert r in a leaf node
     Node* new_leaf = nullptr;
+    size_t index = leaf->upper_bound(hv);
     if (leaf->has_capacity()) {
-        leaf->insert_leaf_entry(entry);
+        leaf->insert_entry(entry, index);
         leaf->adjust_mbr();
         leaf->adjust_lhv();
     } else {
-        new_leaf = RTreeHelper::handle_overflow(leaf, entry, siblings);
+        new_leaf = RTreeHelper::handle_overflow(arena_, policy_, leaf, entry, index, leaf);
     }
 
     // Propogate changes upward
-    this->root_ = RTreeHelper::adjust_tree(this->root_, leaf, new_leaf, siblings);
+    this->root_ = RTreeHelper::adjust_tree(arena_, policy_, this->root_, leaf, new_leaf);
 
     m_size++;
 }
 
+bool RTree::erase(const Point& pt, const void* data) {
+    if (root_ == nullptr)
+        return false;
+
+    WriteSection write;
+    size_t index;
+    Node* leaf = RTreeHelper::find_leaf(root_, hilbert_value_for_point(pt), pt, data, index);
+    if (leaf == nullptr)
+        return false;
+
+    leaf->remove_entry(index);
+    leaf->adjust_mbr();
+    leaf->adjust_lhv();
+    root_ = RTreeHelper::condense_tree(arena_, policy_, root_, leaf);
+
+    m_size--;
+    return true;
+}
+
+bool RTree::update(const Point& old_pt, const Point& new_pt, void* data) {
+    if (root_ == nullptr)
+        return false;
+
+    size_t index;
+    Node* leaf = RTreeHelper::find_leaf(root_, hilbert_value_for_point(old_pt), old_pt, data, index);
+    if (leaf == nullptr)
+        return false;
+
+    LeafEntry new_entry(make_entry(new_pt, data));
+    HilbertValue hv(new_entry.get_lhv());
+    EntrySpan<const LeafEntry> entries = leaf->get_entries<LeafEntry>();
+
+    // the entry can stay in this leaf if its new Hilbert value falls between
+    // those of the other entries, or if it did not change at all
+    bool in_place = hv == entries[index].get_lhv();
+    if (!in_place && entries.size() > 1) {
+        HilbertValue first = entries[index == 0 ? 1 : 0].get_lhv();
+        HilbertValue last = entries[index == entries.size() - 1 ? index - 1 : entries.size() - 1].get_lhv();
+        in_place = first <= hv && hv <= last;
+    }
+
+    if (in_place) {
+        WriteSection write;
+        leaf->remove_entry(index);
+        leaf->insert_entry(new_entry, leaf->upper_bound(hv));
+        leaf->adjust_mbr();
+        leaf->adjust_lhv();
+        root_ = RTreeHelper::adjust_tree(arena_, policy_, root_, leaf, nullptr);
+        return true;
+    }
+
+    // insert first, so the entry is not lost if we run out of memory
+    insert(new_pt, data);
+    erase(old_pt, data);
+    return true;
+}
+
+void RTree::bulk_load(std::vector<LeafEntry> entries) {
+    auto by_lhv = [](const LeafEntry& one, const LeafEntry& two) {
+        return one.get_lhv() < two.get_lhv();
+    };
+    // entries coming from another RTree are usually sorted already
+    if (!std::is_sorted(entries.begin(), entries.end(), by_lhv))
+        std::sort(entries.begin(), entries.end(), by_lhv);
+
+    // build in a new arena, so this tree is untouched if we run out of memory
+    NodeArena arena(policy_.capacity);
+    arena.set_concurrent(arena_.is_concurrent());
+    Node* root;
+    {
+        WriteSection write;
+        root = RTreeHelper::pack(arena, policy_, entries);
+    }
+
+    // concurrent readers must find the new root before the old nodes go away
+    root_ = root;
+    arena_.swap(arena);
+    m_size = entries.size();
+}
+
 }
 
 } // namespace libhdht
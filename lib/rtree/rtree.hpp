@@ -18,17 +18,21 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+
 #pragma once
 
-#include <memory>
+#include <atomic>
+#include <iterator>
 #include <vector>
 
 #include "node.hpp"
+#include "node-arena.hpp"
 #include "node-entry.hpp"
 #include "leaf-entry.hpp"
 #include "rectangle.hpp"
 
 #include "rtree-helper.hpp"
+#include "../rcu.hpp"
 
 namespace libhdht {
 
@@ -36,28 +40,35 @@ namespace rtree {
 
 class RTree {
   public:
-    typedef uint64_t HilbertValue;
+    typedef rtree::HilbertValue HilbertValue;
 
     // Rtree constructor
     // max_dimension: the maximum size in either dimension
-    RTree(uint64_t max_dimension) : m_max_dimension(max_dimension), m_size(0), root_(nullptr) {}
+    // capacity: the maximum number of entries in a node
+    RTree(uint64_t max_dimension, uint32_t capacity = kDefaultCapacity)
+        : RTree(max_dimension, NodePolicy::for_capacity(capacity)) {}
+    RTree(uint64_t max_dimension, const NodePolicy& policy)
+        : m_max_dimension(max_dimension), m_size(0), policy_(policy), arena_(policy.capacity), root_(nullptr) {}
 
     // RTree destructor
-    ~RTree() {
-        delete root_;
-    }
+    // (the nodes are freed all at once by the arena)
+    ~RTree() {}
 
     // RTree copy and assign
     RTree(const RTree&) = delete;
     RTree& operator=(const RTree&) = delete;
-    RTree(RTree&& from) : m_max_dimension(from.m_max_dimension), m_size(from.m_size), root_(from.root_) {
+    RTree(RTree&& from) : m_max_dimension(from.m_max_dimension), m_size(from.m_size),
+        policy_(from.policy_), arena_(std::move(from.arena_)), root_(from.root_.load()) {
         from.root_ = nullptr;
+        from.m_size = 0;
     }
     RTree& operator=(RTree&& from) {
-        delete root_;
         m_max_dimension = from.m_max_dimension;
         m_size = from.m_size;
-        root_ = from.root_;
+        policy_ = from.policy_;
+        // concurrent readers must find the new root before the old nodes go away
+        root_ = from.root_.load();
+        arena_ = std::move(from.arena_);
         from.root_ = nullptr;
         from.m_size = 0;
         return *this;
@@ -66,7 +77,11 @@ class RTree {
     {
         std::swap(m_size, with.m_size);
         std::swap(m_max_dimension, with.m_max_dimension);
-        std::swap(root_, with.root_);
+        std::swap(policy_, with.policy_);
+        arena_.swap(with.arena_);
+        Node* root = root_;
+        root_ = with.root_.load();
+        with.root_ = root;
     }
 
     // Return the size of this RTree
@@ -75,11 +90,161 @@ class RTree {
         return m_size;
     }
 
+    // Return the node policy of this RTree
+    const NodePolicy& policy() const
+    {
+        return policy_;
+    }
+
+    // Return the number of bytes used to store the nodes of this RTree
+    size_t memory_usage() const
+    {
+        return arena_.memory_usage();
+    }
+
+    // Let other threads call search_concurrent() while this RTree changes
+    // The changes still happen on one thread at a time, and become a little
+    // slower, because each of them marks the nodes it changes; the mode
+    // moves with the tree, and cannot be turned off
+    void enable_concurrent_reads();
+    bool has_concurrent_reads() const
+    {
+        return arena_.is_concurrent();
+    }
+
+    // Returns the LeafEntry that stores <pt>:<data> in this RTree
+    LeafEntry make_entry(const Point& pt, void* data) const
+    {
+        return LeafEntry{ hilbert_value_for_point(pt), pt, data };
+    }
+
+    // Returns the LeafEntries that store <points>[i]:<data>[i] in this RTree,
+    // converting all the points to Hilbert values in one batch
+    std::vector<LeafEntry> make_entries(const std::vector<Point>& points, const std::vector<void*>& data) const;
+
     // Insert <r>:<data> into this RTree
-    void insert(const Point& r, void* data);
-    std::vector<std::shared_ptr<LeafEntry>> search(const Rectangle& query) const
+    void insert(const Point& r, void* data)
+    {
+        insert(make_entry(r, data));
+    }
+    // Insert <entry>, which must come from make_entry() (or from an RTree
+    // with the same max_dimension)
+    void insert(const LeafEntry& entry);
+
+    // Remove <pt>:<data> from this RTree
+    // Returns false if there is no such entry
+    bool erase(const Point& pt, const void* data);
+
+    // Move <data> from <old_pt> to <new_pt>
+    // This is done in place if the entry stays in the same leaf, which is
+    // the common case for small movements
+    // Returns false, and leaves the tree unchanged, if <old_pt>:<data> is not
+    // in this RTree
+    bool update(const Point& old_pt, const Point& new_pt, void* data);
+
+    // Replace the contents of this RTree with <entries>
+    // The entries must come from make_entry() (or from an RTree with the same
+    // max_dimension); they are sorted by Hilbert value and packed bottom-up,
+    // which is much faster than inserting them one at a time
+    void bulk_load(std::vector<LeafEntry> entries);
+    template<typename InputIterator>
+    void bulk_load(InputIterator first, InputIterator last)
     {
-        return RTreeHelper::search(query, root_);
+        bulk_load(std::vector<LeafEntry>(first, last));
+    }
+
+    // Call <visitor> with every LeafEntry contained in <query>
+    // The traversal itself does not allocate any memory
+    template<typename Visitor>
+    void search(const Rectangle& query, Visitor&& visitor) const
+    {
+        if (root_ == nullptr)
+            return;
+        RTreeHelper::search(query, root_, visitor);
+    }
+
+    // Call <visitor> with the LeafEntries contained in <query> whose Hilbert
+    // value is at least <from>, in Hilbert order, until <visitor> returns false
+    // The subtrees before <from> are skipped, and so is the rest of the tree
+    // once <visitor> stops, so the first few entries are found without
+    // going through all of them
+    template<typename Visitor>
+    void search_from(const Rectangle& query, HilbertValue from, Visitor&& visitor) const
+    {
+        if (root_ == nullptr)
+            return;
+        RTreeHelper::search_from(query, from, root_, visitor);
+    }
+
+    // Like search(), from any thread, while another thread may be changing
+    // this RTree (see enable_concurrent_reads())
+    // The search never waits for a whole change, only for the nodes it is
+    // about to read: each leaf is read as of a single point in time, and when
+    // a change gets in the way the search starts over from the root, skipping
+    // the leaves it already went through. The entries are visited in Hilbert
+    // order and at most once, except for those that move ahead of the search
+    // while it runs, which can be visited at both places (and those that move
+    // behind it are missed).
+    template<typename Visitor>
+    void search_concurrent(const Rectangle& query, Visitor&& visitor) const
+    {
+        rcu::ReadSection section;
+        RTreeHelper::ConcurrentSearch search(query);
+        while (true) {
+            const Node* root = root_;
+            if (root == nullptr)
+                return;
+            uint32_t version = root->read_version();
+            if (root_ != root)
+                continue;
+            if (RTreeHelper::search_concurrent(search, root, version, visitor))
+                return;
+        }
+    }
+
+    // Write every LeafEntry contained in <query> to the output iterator <out>
+    template<typename OutputIterator>
+    OutputIterator search_into(const Rectangle& query, OutputIterator out) const
+    {
+        search(query, [&out](const LeafEntry& entry) {
+            *out++ = entry;
+        });
+        return out;
+    }
+
+    // Return all LeafEntries contained in <query>
+    std::vector<LeafEntry> search(const Rectangle& query) const
+    {
+        std::vector<LeafEntry> results;
+        search_into(query, std::back_inserter(results));
+        return results;
+    }
+
+    // Call <visitor> with each LeafEntry and its distance, nearest first, until
+    // <visitor> returns false
+    // <distance> maps a Rectangle to a lower bound of the distance of the
+    // points in it, and a Rectangle made of a single point to its distance
+    template<typename Distance, typename Visitor>
+    void visit_nearest(const Distance& distance, Visitor&& visitor) const
+    {
+        if (root_ == nullptr)
+            return;
+        RTreeHelper::nearest(root_, distance, visitor);
+    }
+
+    // Return the <k> LeafEntries closest to <pt>, nearest first
+    std::vector<LeafEntry> nearest(const Point& pt, size_t k) const
+    {
+        std::vector<LeafEntry> results;
+        if (k == 0)
+            return results;
+        visit_nearest([&pt](const Rectangle& rect) {
+            return rect.min_distance(pt);
+        }, [&results, k](const LeafEntry& entry, double) {
+            results.push_back(entry);
+            return results.size() < k;
+        });
+        return results;
     }
 
     template<typename Callback>
@@ -95,10 +260,10 @@ class RTree {
 
     uint64_t m_max_dimension;
     size_t m_size; // the number of elements
-    Node* chooseLeaf(Node::HilbertValue hv);
-    Node* handleOverflow(Node* leaf);
-    Node* root_;
-
+    NodePolicy policy_;
+    NodeArena arena_;
+    // changed last in a write, so concurrent readers find consistent nodes
+    std::atomic<Node*> root_;
 };
 
 }
@@ -20,20 +20,38 @@
 
 #include "libhdht-private.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <unordered_map>
 
 namespace libhdht
 {
 
 static std::shared_ptr<protocol::ServerProxy> maybe_register_with_server(rpc::Context *ctx, const net::Address& address);
 
+// the largest page of a paged search
+static const uint32_t kMaxSearchPageSize = 4096;
+// the most neighbours returned by a nearest neighbour search
+static const uint32_t kMaxNeighbours = 4096;
+// the most location updates in a batch
+static const uint32_t kMaxLocationBatchSize = 4096;
+
 class ServerMasterImpl : public protocol::ServerStub {
 private:
     rpc::Context *m_rpc;
     Table *m_table;
+    // the servers of this process that the table was divided among in
+    // advance, if any
+    const std::vector<net::Address> *m_shards;
+    // the clients trusted to set the locations of other clients
+    const std::vector<net::Address> *m_gateways;
     bool is_server = false;
     bool is_client = false;
     ClientNode *m_client_node = nullptr;
+    // the handle of m_client_node, which notices when another request (such
+    // as a batch of locations) hands the client over to another server
+    ClientHandle m_client_handle{ 0, 0 };
 
     // check that the peer corresponding to this stub registered as client or
     // server
@@ -52,6 +70,41 @@ private:
         if (!is_client)
             throw rpc::RemoteError(EPERM);
     }
+    // check that the peer registered as server, or as a client connected
+    // from a host this server was told to trust as gateway
+    void check_gateway_or_server()
+    {
+        if (is_server)
+            return;
+        // the address the client announced in client_hello proves nothing,
+        // the one it connected from does
+        const net::Address& remote_address = get_peer()->get_remote_address();
+        if (!is_client || !remote_address.is_valid() ||
+            std::none_of(m_gateways->begin(), m_gateways->end(), [&remote_address](const net::Address& gateway) {
+                return gateway.same_host(remote_address);
+            }))
+            throw rpc::RemoteError(EPERM);
+    }
+    // the client registered through this peer, if it was not forgotten since
+    ClientNode *get_client_node()
+    {
+        if (m_client_node != nullptr && m_table->get_client(m_client_handle) != m_client_node)
+            m_client_node = nullptr;
+        return m_client_node;
+    }
+    void set_client_node(ClientNode *client_node)
+    {
+        m_client_node = client_node;
+        if (client_node != nullptr)
+            m_client_handle = client_node->get_handle();
+    }
+
+    static void check_circle(const GeoPoint2D& center, double radius)
+    {
+        // written so that NaNs are rejected too
+        if (!(std::abs(center.latitude) <= 90 && std::abs(center.longitude) <= 180 && radius >= 0))
+            throw rpc::RemoteError(EINVAL);
+    }
 
     void send_node_to_peer(ServerNode *node, std::shared_ptr<protocol::ServerProxy> proxy)
     {
@@ -124,10 +177,13 @@ private:
     }
 
 public:
-    ServerMasterImpl(std::shared_ptr<rpc::Peer> peer, uint64_t object_id, rpc::Context *rpc, Table *table) :
+    ServerMasterImpl(std::shared_ptr<rpc::Peer> peer, uint64_t object_id, rpc::Context *rpc, Table *table, const std::vector<net::Address> *shards,
+                     const std::vector<net::Address> *gateways) :
         protocol::ServerStub(peer, object_id),
         m_rpc(rpc),
-        m_table(table)
+        m_table(table),
+        m_shards(shards),
+        m_gateways(gateways)
     {
         assert(object_id == protocol::MASTER_OBJECT_ID);
     }
@@ -153,6 +209,12 @@ public:
         peer->add_listening_address(server_address);
         register_server();
 
+        if (std::find(m_shards->begin(), m_shards->end(), server_address) != m_shards->end()) {
+            // the table was divided in advance, there is nothing to balance
+            reply_server_hello(request_id);
+            return;
+        }
+
         auto proxy = peer->get_proxy<protocol::ServerProxy>(protocol::MASTER_OBJECT_ID);
         auto self = shared_from_this();
         m_table->load_balance_with_peer(proxy, [self, proxy, this](Table::LoadBalanceAction action, ServerNode *node) {
@@ -186,8 +248,8 @@ public:
 
         // if this client double registered cause it got confused, just move it to the right place
         protocol::ClientRegistrationResult result;
-        if (!m_client_node)
-            m_client_node = m_table->get_or_create_client_node(existing_node_id, point);
+        if (!get_client_node())
+            set_client_node(m_table->get_or_create_client_node(existing_node_id, point));
 
         if (m_client_node) {
             log(LOG_INFO, "Assuming control of node %s", m_client_node->get_id().to_string().c_str());
@@ -265,6 +327,7 @@ public:
         auto peer = m_rpc->get_peer(address);
         client_node->set_peer(peer);
         client_node->set_all_metadata(std::move(metadata));
+        reply_adopt_client(request_id);
     }
 
     virtual void handle_find_server_for_point(uint64_t request_id, GeoPoint2D point) override
@@ -282,24 +345,65 @@ public:
 
         log(LOG_INFO, "Received FindControllingServer for %s", node_id.to_string().c_str());
 
+        find_controlling_server(request_id, node_id, true);
+    }
+
+    // reply to <request_id> with the owner of <node_id>, asking the server
+    // that owns it if it is not us
+    // With <use_cache>, the owner learned by a previous lookup is asked
+    // directly, rather than the server of the coarser range in the table
+    void find_controlling_server(uint64_t request_id, const NodeID& node_id, bool use_cache)
+    {
         ServerNode *node = m_table->find_controlling_server(node_id);
 
         if (node->is_local()) {
             log(LOG_INFO, "Found node locally in range %s", node->get_range().to_string().c_str());
-            reply_find_controlling_server(request_id, m_rpc->get_listening_address(), node->get_range());
+            reply_find_controlling_server(request_id, m_rpc->get_listening_address(), node->get_range(),
+                m_table->ranges_version());
             return;
         }
 
-        auto proxy = dynamic_cast<RemoteServerNode*>(node)->get_proxy();
+        // the other servers of the process tell us what they own
+        const SharedRangeTable *shared_ranges = m_table->shared_ranges();
+        if (shared_ranges != nullptr) {
+            rcu::ReadSection section;
+            const SharedRangeTable::Snapshot *snapshot = shared_ranges->snapshot();
+            const SharedRangeTable::Owner *shared_owner = SharedRangeTable::find(*snapshot, node_id);
+            if (shared_owner != nullptr && !(shared_owner->address == m_rpc->get_listening_address())) {
+                log(LOG_INFO, "Found node in shared range %s", shared_owner->range.to_string().c_str());
+                reply_find_controlling_server(request_id, shared_owner->address, shared_owner->range, shared_owner->version);
+                return;
+            }
+        }
+
+        auto proxy = static_cast<RemoteServerNode*>(node)->get_proxy();
+        const RangeOwnerCache::Owner *owner = use_cache ? m_table->find_cached_owner(node_id) : nullptr;
+        bool from_cache = owner != nullptr;
+        NodeIDRange cached_range;
+        if (from_cache) {
+            log(LOG_INFO, "Asking cached owner of range %s", owner->range.to_string().c_str());
+            proxy = owner->proxy;
+            cached_range = owner->range;
+        }
         if (proxy == nullptr) {
             log(LOG_WARNING, "Found unknown region in the table: %s", node->get_range().to_string().c_str());
             reply_error(request_id, ENXIO);
             return;
         }
         auto self = shared_from_this();
-        proxy->invoke_find_controlling_server([self, request_id, node_id, this](rpc::Error *err, const net::Address& address, const NodeIDRange& subrange) {
+        proxy->invoke_find_controlling_server([self, request_id, node_id, from_cache, cached_range, this](rpc::Error *err, const net::Address& address, const NodeIDRange& subrange, uint64_t version) {
+            auto remote_err = dynamic_cast<rpc::RemoteError*>(err);
+            if (err && from_cache) {
+                // the owner we remembered does not own the range anymore (or is gone),
+                // so go the long way
+                if (remote_err && (remote_err->code() == EACCES || remote_err->code() == ENXIO)) {
+                    log(LOG_INFO, "Cached owner of range %s is out of date", cached_range.to_string().c_str());
+                    m_table->forget_owner(cached_range);
+                }
+                find_controlling_server(request_id, node_id, false);
+                return;
+            }
             if (err) {
-                auto remote_err = dynamic_cast<rpc::RemoteError*>(err);
                 if (remote_err)
                     reply_error(request_id, *remote_err);
                 else
@@ -310,7 +414,8 @@ public:
             ServerNode *node = m_table->find_controlling_server(node_id);
             if (node->is_local()) {
                 // race condition: we became leader for this range while were asking someone about iter
-                reply_find_controlling_server(request_id, m_rpc->get_listening_address(), node->get_range());
+                reply_find_controlling_server(request_id, m_rpc->get_listening_address(), node->get_range(),
+                    m_table->ranges_version());
                 return;
             }
 
@@ -326,9 +431,12 @@ public:
                 return;
             }
 
-            auto subproxy = maybe_register_with_server(m_rpc, address);
-            m_table->add_remote_server_node(subrange, subproxy);
-            reply_find_controlling_server(request_id, address, subrange);
+            // the table already points to the owner of a range it knows exactly
+            if (!(node->get_range() == subrange)) {
+                auto subproxy = maybe_register_with_server(m_rpc, address);
+                m_table->learn_owner(subrange, subproxy, version);
+            }
+            reply_find_controlling_server(request_id, address, subrange, version);
         }, node_id);
     }
 
@@ -336,8 +444,11 @@ public:
     {
         check_client();
 
-        if (m_client_node == nullptr)
+        if (get_client_node() == nullptr)
             throw rpc::RemoteError(ENXIO);
+        // a batch of locations is handing the client over to another server
+        if (!m_table->find_controlling_server(m_client_node->get_id())->is_local())
+            throw rpc::RemoteError(EAGAIN);
 
         new_location.canonicalize();
         log(LOG_INFO, "Moving client %s to %s", get_peer()->get_listening_address().to_string().c_str(),
@@ -351,6 +462,14 @@ public:
         }
 
         auto proxy = static_cast<RemoteServerNode*>(new_server)->get_proxy();
+        // the owner of a finer range, if a lookup found one, rather than the
+        // server of the range in the table, which would refuse the client
+        const RangeOwnerCache::Owner *owner = m_table->find_cached_owner(m_client_node->get_id());
+        NodeIDRange cached_range;
+        if (owner != nullptr) {
+            proxy = owner->proxy;
+            cached_range = owner->range;
+        }
         if (proxy == nullptr) {
             log(LOG_WARNING, "Found unknown region in the table: %s", new_server->get_range().to_string().c_str());
             reply_error(request_id, ENXIO);
@@ -358,15 +477,18 @@ public:
         }
         auto self = shared_from_this();
         log(LOG_INFO, "Transfering client to %s", proxy->get_address().to_string().c_str());
-        proxy->invoke_adopt_client([proxy, self, request_id, new_location, this](rpc::Error *err) {
-            ClientNode *client_node = m_client_node;
+        proxy->invoke_adopt_client([proxy, self, request_id, new_location, from_cache = owner != nullptr, cached_range, this](rpc::Error *err) {
+            ClientNode *client_node = get_client_node();
             m_client_node = nullptr;
 
             if (err) {
-                auto client_name = m_client_node->get_address().to_string();
-                log(LOG_ERR, "Failed to transfer client %s: %s", client_name.c_str(), err->what());
+                log(LOG_ERR, "Failed to transfer client %s: %s",
+                    get_peer()->get_listening_address().to_string().c_str(), err->what());
 
                 auto remote_err = dynamic_cast<rpc::RemoteError*>(err);
+                // the owner we remembered gave the range away
+                if (from_cache && remote_err && remote_err->code() == EACCES)
+                    m_table->forget_owner(cached_range);
                 if (remote_err)
                     reply_error(request_id, *remote_err);
                 else
@@ -374,18 +496,223 @@ public:
                 return;
             }
 
-            m_table->forget_client(client_node);
+            // unless a batch of locations handed it over in the meantime
+            if (client_node != nullptr)
+                m_table->forget_client(client_node);
             reply_set_location(request_id, protocol::SetLocationResult::DifferentServer,
                 m_table->get_node_id_for_point(new_location), proxy->get_address());
         }, m_client_node->get_id(), m_client_node->get_coordinates(),
         m_client_node->get_address(), m_client_node->get_all_metadata());
     }
 
+    // the replies to a batch of locations, which is done once the clients
+    // handed over and the updates forwarded to other servers are
+    struct LocationBatch {
+        std::vector<protocol::SetLocationReply> replies;
+        // one more than the handovers and forwards in flight, until all
+        // the updates were looked at
+        size_t pending = 1;
+        std::function<void(const std::vector<protocol::SetLocationReply>&)> done;
+
+        void finish_one()
+        {
+            if (--pending == 0)
+                done(replies);
+        }
+    };
+
+    // the server that <node_id>, which is in the range of <server> in the
+    // table, should be asked about
+    std::shared_ptr<protocol::ServerProxy> find_owner_proxy(const NodeID& node_id, ServerNode *server)
+    {
+        // the other servers of the process tell us what they own
+        const SharedRangeTable *shared_ranges = m_table->shared_ranges();
+        if (shared_ranges != nullptr) {
+            net::Address address;
+            {
+                rcu::ReadSection section;
+                const SharedRangeTable::Owner *shared_owner = SharedRangeTable::find(*shared_ranges->snapshot(), node_id);
+                if (shared_owner != nullptr)
+                    address = shared_owner->address;
+            }
+            if (address.is_valid() && !(address == m_rpc->get_listening_address()))
+                return maybe_register_with_server(m_rpc, address);
+        }
+
+        const RangeOwnerCache::Owner *owner = m_table->find_cached_owner(node_id);
+        if (owner != nullptr)
+            return owner->proxy;
+        return static_cast<RemoteServerNode*>(server)->get_proxy();
+    }
+
+    // hand <client>, which moved to the range of <new_server>, over to its
+    // server, and fill the reply at <index> of <batch>
+    void hand_over_client(std::shared_ptr<LocationBatch> batch, size_t index, ClientNode *client, ServerNode *new_server)
+    {
+        auto proxy = static_cast<RemoteServerNode*>(new_server)->get_proxy();
+        const RangeOwnerCache::Owner *owner = m_table->find_cached_owner(client->get_id());
+        NodeIDRange cached_range;
+        if (owner != nullptr) {
+            proxy = owner->proxy;
+            cached_range = owner->range;
+        }
+        if (proxy == nullptr) {
+            // keep the client until its server can be found, the reply stays Failed
+            log(LOG_WARNING, "Found unknown region in the table: %s", new_server->get_range().to_string().c_str());
+            return;
+        }
+
+        auto self = shared_from_this();
+        batch->pending++;
+        proxy->invoke_adopt_client([self, batch, index, proxy, handle = client->get_handle(), from_cache = owner != nullptr, cached_range, this](rpc::Error *err) {
+            ClientNode *client = m_table->get_client(handle);
+            if (err) {
+                log(LOG_ERR, "Failed to transfer client to %s: %s", proxy->get_address().to_string().c_str(), err->what());
+
+                auto remote_err = dynamic_cast<rpc::RemoteError*>(err);
+                // the owner we remembered gave the range away
+                if (from_cache && remote_err && remote_err->code() == EACCES)
+                    m_table->forget_owner(cached_range);
+            } else if (client != nullptr) {
+                batch->replies[index] = protocol::SetLocationReply(protocol::SetLocationResult::DifferentServer,
+                    client->get_id(), proxy->get_address());
+            }
+
+            // the client is not in any of our ranges anymore, so either way
+            // it is not ours; its own connection will notice
+            if (client != nullptr)
+                m_table->forget_client(client);
+            batch->finish_one();
+        }, client->get_id(), client->get_coordinates(), client->get_address(), client->get_all_metadata());
+    }
+
+    // move the clients of <updates> that belong to this server, forward the
+    // others to their servers (with one call per server) if <forward>, and
+    // call <done> with the replies once all are known
+    void set_locations(std::vector<protocol::LocationUpdate>& updates, bool forward,
+                       std::function<void(const std::vector<protocol::SetLocationReply>&)> done)
+    {
+        auto batch = std::make_shared<LocationBatch>();
+        batch->replies.assign(updates.size(), protocol::SetLocationReply(protocol::SetLocationResult::Failed, NodeID(), net::Address()));
+        batch->done = std::move(done);
+
+        // take the clients in Hilbert order of their current IDs, so those
+        // of each LocalServerNode come together, and its R-tree is updated
+        // in order
+        std::vector<uint32_t> order;
+        order.reserve(updates.size());
+        for (uint32_t i = 0; i < updates.size(); i++) {
+            if (updates[i].first.is_valid())
+                order.push_back(i);
+        }
+        std::sort(order.begin(), order.end(), [&updates](uint32_t a, uint32_t b) {
+            return updates[a].first < updates[b].first;
+        });
+
+        // the updates for other servers, by server
+        std::vector<std::pair<std::shared_ptr<protocol::ServerProxy>, std::vector<uint32_t>>> forwards;
+        std::unordered_map<protocol::ServerProxy*, size_t> forward_of_proxy;
+
+        for (uint32_t index : order) {
+            const NodeID& node_id = updates[index].first;
+            GeoPoint2D& new_location = updates[index].second;
+            new_location.canonicalize();
+
+            ServerNode *server = m_table->find_controlling_server(node_id);
+            if (!server->is_local()) {
+                if (!forward)
+                    continue;
+                auto proxy = find_owner_proxy(node_id, server);
+                if (proxy == nullptr) {
+                    log(LOG_WARNING, "Found unknown region in the table: %s", server->get_range().to_string().c_str());
+                    continue;
+                }
+                auto it = forward_of_proxy.find(proxy.get());
+                if (it == forward_of_proxy.end()) {
+                    it = forward_of_proxy.emplace(proxy.get(), forwards.size()).first;
+                    forwards.emplace_back(proxy, std::vector<uint32_t>());
+                }
+                forwards[it->second].second.push_back(index);
+                continue;
+            }
+
+            ClientNode *client = m_table->get_existing_client_node(node_id);
+            if (client == nullptr)
+                continue;
+            ServerNode *new_server = m_table->move_client(client, new_location);
+            if (new_server->is_local())
+                batch->replies[index] = protocol::SetLocationReply(protocol::SetLocationResult::SameServer, client->get_id(), net::Address());
+            else
+                hand_over_client(batch, index, client, new_server);
+        }
+
+        auto self = shared_from_this();
+        for (auto& forward : forwards) {
+            auto proxy = forward.first;
+            std::vector<protocol::LocationUpdate> forwarded;
+            forwarded.reserve(forward.second.size());
+            for (uint32_t index : forward.second)
+                forwarded.push_back(updates[index]);
+
+            log(LOG_INFO, "Forwarding %zu locations to %s", forwarded.size(), proxy->get_address().to_string().c_str());
+            batch->pending++;
+            proxy->invoke_forward_set_locations_batch([self, batch, proxy, indices = std::move(forward.second), this](rpc::Error *err, const std::vector<protocol::SetLocationReply>& replies) {
+                if (err) {
+                    log(LOG_ERR, "Failed to forward locations to %s: %s", proxy->get_address().to_string().c_str(), err->what());
+                } else if (replies.size() != indices.size()) {
+                    // the other peer is being weird
+                    log(LOG_ERR, "Server %s replied to %zu locations out of %zu", proxy->get_address().to_string().c_str(),
+                        replies.size(), indices.size());
+                } else {
+                    for (size_t i = 0; i < indices.size(); i++) {
+                        protocol::SetLocationReply reply = replies[i];
+                        // tell the caller where the clients that did not
+                        // change server are
+                        if (std::get<0>(reply) == protocol::SetLocationResult::SameServer)
+                            reply = protocol::SetLocationReply(protocol::SetLocationResult::DifferentServer, std::get<1>(reply), proxy->get_address());
+                        batch->replies[indices[i]] = reply;
+                    }
+                }
+                batch->finish_one();
+            }, forwarded);
+        }
+
+        batch->finish_one();
+    }
+
+    virtual void handle_set_locations_batch(uint64_t request_id, std::vector<protocol::LocationUpdate> updates) override
+    {
+        check_gateway_or_server();
+        if (updates.size() > kMaxLocationBatchSize)
+            throw rpc::RemoteError(E2BIG);
+
+        log(LOG_INFO, "Received a batch of %zu locations from %s", updates.size(),
+            get_peer()->get_listening_address().to_string().c_str());
+
+        auto self = shared_from_this();
+        set_locations(updates, true, [self, request_id, this](const std::vector<protocol::SetLocationReply>& replies) {
+            reply_set_locations_batch(request_id, replies);
+        });
+    }
+
+    virtual void handle_forward_set_locations_batch(uint64_t request_id, std::vector<protocol::LocationUpdate> updates) override
+    {
+        check_server();
+        if (updates.size() > kMaxLocationBatchSize)
+            throw rpc::RemoteError(E2BIG);
+
+        // unlike with clients, the updates do not go on to other servers
+        auto self = shared_from_this();
+        set_locations(updates, false, [self, request_id, this](const std::vector<protocol::SetLocationReply>& replies) {
+            reply_forward_set_locations_batch(request_id, replies);
+        });
+    }
+
     virtual void handle_set_metadata(uint64_t request_id, std::string key, std::string value) override
     {
         check_client();
 
-        if (m_client_node == nullptr)
+        if (get_client_node() == nullptr)
             throw rpc::RemoteError(ENXIO);
 
         log(LOG_INFO, "Setting metadata key %s to \"%s\" for client %s", key.c_str(), value.c_str(),
@@ -450,11 +777,13 @@ public:
         check_client();
 
         auto self = shared_from_this();
-        m_table->search_clients(m_table->get_rectangle_for_points(upper, lower), 0, (uint64_t)-1, [self, request_id, this](rpc::Error* error, std::vector<NodeID>* reply) {
+        m_table->search_clients(m_table->get_rectangle_for_points(upper, lower), 0, (uint64_t)-1, [self, request_id, this](rpc::Error* error, const std::vector<NodeID>* reply, bool last) {
             if (error) {
                 reply_error(request_id, EIO);
-            } else {
+            } else if (last) {
                 reply_search_clients(request_id, *reply);
+            } else {
+                reply_part_search_clients(request_id, *reply);
             }
         });
     }
@@ -465,14 +794,177 @@ public:
 
         auto self = shared_from_this();
         m_table->search_clients(rtree::Rectangle(upper, lower), hilbert_bounds.first, hilbert_bounds.second,
-            [self, request_id, this](rpc::Error* error, std::vector<NodeID>* reply) {
+            [self, request_id, this](rpc::Error* error, const std::vector<NodeID>* reply, bool last) {
             if (error) {
                 reply_error(request_id, EIO);
-            } else {
+            } else if (last) {
                 reply_forward_search_clients(request_id, *reply);
+            } else {
+                reply_part_forward_search_clients(request_id, *reply);
+            }
+        });
+    }
+
+    virtual void handle_search_radius(uint64_t request_id, GeoPoint2D center, double radius) override
+    {
+        check_client();
+        check_circle(center, radius);
+
+        auto self = shared_from_this();
+        m_table->search_radius(center, radius, 0, (uint64_t)-1, [self, request_id, this](rpc::Error* error, const std::vector<NodeID>* reply, bool last) {
+            if (error) {
+                reply_error(request_id, EIO);
+            } else if (last) {
+                reply_search_radius(request_id, *reply);
+            } else {
+                reply_part_search_radius(request_id, *reply);
             }
         });
     }
+
+    virtual void handle_forward_search_radius(uint64_t request_id, GeoPoint2D center, double radius, std::pair<uint64_t, uint64_t> hilbert_bounds) override
+    {
+        check_server();
+        check_circle(center, radius);
+
+        auto self = shared_from_this();
+        m_table->search_radius(center, radius, hilbert_bounds.first, hilbert_bounds.second,
+            [self, request_id, this](rpc::Error* error, const std::vector<NodeID>* reply, bool last) {
+            if (error) {
+                reply_error(request_id, EIO);
+            } else if (last) {
+                reply_forward_search_radius(request_id, *reply);
+            } else {
+                reply_part_forward_search_radius(request_id, *reply);
+            }
+        });
+    }
+
+    // the cursor of the page that continues at <after> in <server>
+    // (without a server if the owner of <server> is unknown, so that the
+    // next page is looked up again from <after>)
+    SearchCursor make_cursor(ServerNode *server, const NodeID& after)
+    {
+        if (server->is_local())
+            return SearchCursor{ after, m_rpc->get_listening_address() };
+        auto proxy = static_cast<RemoteServerNode*>(server)->get_proxy();
+        if (proxy == nullptr)
+            return SearchCursor{ after, net::Address() };
+        return SearchCursor{ after, proxy->get_address() };
+    }
+
+    // ask another server for the page at <cursor>, and reply with its page
+    void forward_search_page(uint64_t request_id, std::shared_ptr<protocol::ServerProxy> proxy,
+                             const rtree::Rectangle& rectangle, const SearchCursor& cursor, uint32_t limit)
+    {
+        if (proxy == nullptr) {
+            log(LOG_WARNING, "Found unknown region in the table at %s", cursor.after.to_string().c_str());
+            reply_error(request_id, ENXIO);
+            return;
+        }
+
+        auto self = shared_from_this();
+        proxy->invoke_forward_search_clients_paged([self, request_id, this](rpc::Error* error, const std::vector<NodeID>& results, bool more, const SearchCursor& next) {
+            if (error)
+                reply_error(request_id, EIO);
+            else
+                reply_search_clients_paged(request_id, results, more, next);
+        }, rectangle.get_lower(), rectangle.get_upper(), cursor, limit);
+    }
+
+    virtual void handle_search_clients_paged(uint64_t request_id, GeoPoint2D lower, GeoPoint2D upper, SearchCursor cursor, uint32_t limit) override
+    {
+        check_client();
+        if (limit == 0)
+            throw rpc::RemoteError(EINVAL);
+        limit = std::min(limit, kMaxSearchPageSize);
+
+        rtree::Rectangle rectangle = m_table->get_rectangle_for_points(upper, lower);
+
+        // the server in the cursor comes from a page returned by another
+        // server, which can know better than our table, but only known
+        // servers are trusted
+        net::Address own_address = m_rpc->get_listening_address();
+        if (cursor.server.is_valid() && !(cursor.server == own_address) && m_rpc->has_peer(cursor.server)) {
+            forward_search_page(request_id, maybe_register_with_server(m_rpc, cursor.server), rectangle, cursor, limit);
+            return;
+        }
+
+        // a new search starts where the rectangle does along the curve
+        if (cursor.after.is_all_zeros() && !cursor.server.is_valid())
+            cursor.after = m_table->search_page_start(rectangle);
+
+        ServerNode *owner = m_table->find_controlling_server(cursor.after);
+        if (!owner->is_local()) {
+            forward_search_page(request_id, static_cast<RemoteServerNode*>(owner)->get_proxy(), rectangle, cursor, limit);
+            return;
+        }
+
+        std::vector<NodeID> results;
+        NodeID next_after;
+        ServerNode *next = m_table->search_clients_page(rectangle, cursor.after, limit, results, next_after);
+        if (next == nullptr) {
+            reply_search_clients_paged(request_id, results, false, SearchCursor());
+        } else if (results.empty() && !next->is_local()) {
+            // don't return an empty page, the remote part is needed now
+            forward_search_page(request_id, static_cast<RemoteServerNode*>(next)->get_proxy(), rectangle,
+                make_cursor(next, next_after), limit);
+        } else {
+            reply_search_clients_paged(request_id, results, true, make_cursor(next, next_after));
+        }
+    }
+
+    virtual void handle_forward_search_clients_paged(uint64_t request_id, std::pair<uint64_t, uint64_t> lower, std::pair<uint64_t, uint64_t> upper, SearchCursor cursor, uint32_t limit) override
+    {
+        check_server();
+        if (limit == 0)
+            throw rpc::RemoteError(EINVAL);
+        limit = std::min(limit, kMaxSearchPageSize);
+
+        // unlike with clients, the search does not go on to other servers
+        std::vector<NodeID> results;
+        NodeID next_after;
+        ServerNode *next = m_table->search_clients_page(rtree::Rectangle(upper, lower), cursor.after, limit, results, next_after);
+        if (next == nullptr)
+            reply_forward_search_clients_paged(request_id, results, false, SearchCursor());
+        else
+            reply_forward_search_clients_paged(request_id, results, true, make_cursor(next, next_after));
+    }
+
+    virtual void handle_knn_clients(uint64_t request_id, GeoPoint2D point, uint32_t k) override
+    {
+        check_client();
+        if (k == 0)
+            throw rpc::RemoteError(EINVAL);
+        k = std::min(k, kMaxNeighbours);
+
+        auto self = shared_from_this();
+        m_table->knn_clients(point, k, [self, request_id, this](rpc::Error* error, const std::vector<Neighbour>* reply) {
+            if (error)
+                reply_error(request_id, EIO);
+            else
+                reply_knn_clients(request_id, *reply);
+        });
+    }
+
+    virtual void handle_forward_knn_clients(uint64_t request_id, GeoPoint2D point, uint32_t k, double max_distance, std::pair<uint64_t, uint64_t> hilbert_bounds) override
+    {
+        check_server();
+        if (k == 0)
+            throw rpc::RemoteError(EINVAL);
+        k = std::min(k, kMaxNeighbours);
+
+        // the caller's table can be coarser than ours: parts of the bounds
+        // may have moved on to other servers, which are asked in turn
+        auto self = shared_from_this();
+        m_table->knn_clients(point, k, max_distance, hilbert_bounds.first, hilbert_bounds.second,
+                             [self, request_id, this](rpc::Error* error, const std::vector<Neighbour>* reply) {
+            if (error)
+                reply_error(request_id, EIO);
+            else
+                reply_forward_knn_clients(request_id, *reply);
+        });
+    }
 };
 
 ServerContext::ServerContext(uv::Loop& loop, uint8_t resolution) :
@@ -480,7 +972,7 @@ ServerContext::ServerContext(uv::Loop& loop, uint8_t resolution) :
     m_table(std::make_unique<Table>(resolution))
 {
     m_rpc->add_stub_factory([this](std::shared_ptr<rpc::Peer> peer) {
-        peer->create_named_stub<ServerMasterImpl>(protocol::MASTER_OBJECT_ID, m_rpc.get(), m_table.get());
+        peer->create_named_stub<ServerMasterImpl>(protocol::MASTER_OBJECT_ID, m_rpc.get(), m_table.get(), &m_shards, &m_gateways);
     });
 }
 
@@ -488,9 +980,24 @@ ServerContext::~ServerContext()
 {}
 
 void
-ServerContext::add_address(const net::Address& address)
+ServerContext::add_address(const net::Address& address, bool shared)
 {
-    m_rpc->add_address(address);
+    m_rpc->add_address(address, shared);
+}
+
+ShardGroup::ShardGroup(const std::vector<net::Address>& addresses) :
+    m_addresses(addresses),
+    m_ranges(std::make_shared<SharedRangeTable>())
+{}
+
+void
+ServerContext::set_shards(const ShardGroup& shards, size_t index)
+{
+    assert(index < shards.size());
+    m_shards = shards.m_addresses;
+    m_shard_index = index;
+    m_rpc->enable_in_process();
+    m_table->share_ranges(shards.m_ranges, m_shards[index]);
 }
 
 void
@@ -499,6 +1006,12 @@ ServerContext::add_peer(const net::Address& address)
     m_peers.push_back(address);
 }
 
+void
+ServerContext::add_gateway(const net::Address& address)
+{
+    m_gateways.push_back(address);
+}
+
 std::shared_ptr<protocol::ServerProxy>
 maybe_register_with_server(rpc::Context *ctx, const net::Address& address)
 {
@@ -524,9 +1037,50 @@ maybe_register_with_server(rpc::Context *ctx, const net::Address& address)
     return master;
 }
 
+// each server gets a few contiguous ranges, so that the shares are
+// within 1/2^SHARD_EXTRA_BITS of each other
+static const int SHARD_EXTRA_BITS = 3;
+
+void
+ServerContext::start_shard()
+{
+    uint8_t bits = SHARD_EXTRA_BITS;
+    while ((1ULL << bits) < (m_shards.size() << SHARD_EXTRA_BITS))
+        bits++;
+    bits = std::min<uint8_t>(bits, m_table->resolution());
+
+    std::vector<std::shared_ptr<protocol::ServerProxy>> proxies(m_shards.size());
+    for (size_t i = 0; i < m_shards.size(); i++) {
+        if (i != m_shard_index)
+            proxies[i] = maybe_register_with_server(m_rpc.get(), m_shards[i]);
+    }
+
+    size_t n_ranges = 1ULL << bits;
+    for (size_t k = 0; k < n_ranges; k++) {
+        NodeIDRange range(NodeID(), bits);
+        for (uint8_t i = 0; i < bits; i++)
+            range.from().set_bit_at(i, (k >> (bits - 1 - i)) & 1);
+
+        size_t owner = k * m_shards.size() / n_ranges;
+        if (owner == m_shard_index)
+            m_table->add_local_server_node(range);
+        else
+            m_table->add_remote_server_node(range, proxies[owner]);
+    }
+}
+
 void
 ServerContext::start()
 {
+    if (!m_shards.empty()) {
+        if (m_peers.empty()) {
+            start_shard();
+            return;
+        }
+        // each server joins on its own, and balances its ranges with the others
+        m_shards.clear();
+    }
+
     if (m_peers.empty()) {
         // become the controller of the whole table
         m_table->add_local_server_node(NodeIDRange());
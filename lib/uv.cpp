@@ -20,7 +20,9 @@
 
 #include "libhdht-private.hpp"
 
+#include <cerrno>
 #include <new>
+#include <unistd.h>
 
 namespace libhdht
 {
@@ -28,7 +30,7 @@ namespace libhdht
 namespace uv
 {
 
-TCPSocket::TCPSocket(uv_loop_t* loop)
+TCPSocket::TCPSocket(uv_loop_t* loop, BufferPool *read_pool) : m_read_pool(read_pool)
 {
     uv_tcp_init(loop, this);
 }
@@ -70,8 +72,25 @@ TCPSocket::connect(const net::Address& address)
 }
 
 void
-TCPSocket::listen(const net::Address& address)
+TCPSocket::listen(const net::Address& address, bool reuse_port)
 {
+    if (reuse_port) {
+        // libuv only creates the socket when binding, too late to set the option
+        int fd = socket(address.family(), SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            throw Error(-errno);
+        int enable = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+            int err = errno;
+            ::close(fd);
+            throw Error(-err);
+        }
+        int err = uv_tcp_open(this, fd);
+        if (err < 0) {
+            ::close(fd);
+            Error::check(err);
+        }
+    }
     Error::check(uv_tcp_bind(this, address.get(), 0));
     Error::check(uv_listen(handle_cast<uv_stream_t>(this), 0, [](uv_stream_t* server, int status) {
         TCPSocket *self = handle_downcast(server);
@@ -91,72 +110,120 @@ TCPSocket::accept(TCPSocket *client)
 }
 
 static void
-alloc_memory(uv_handle_t*, size_t suggested_size, uv_buf_t *buf)
+alloc_memory(BufferPool *pool, size_t suggested_size, uv_buf_t *buf)
+{
+    if (pool) {
+        buf->base = pool->acquire();
+        buf->len = buf->base ? pool->block_size() : 0;
+    } else {
+        buf->base = (char*)malloc(suggested_size);
+        buf->len = buf->base ? suggested_size : 0;
+    }
+}
+
+// takes back the memory handed out by alloc_memory(), wrapping the
+// first <nread> bytes, or releasing it if nothing was read
+static Buffer
+take_read_buffer(BufferPool *pool, ssize_t nread, const uv_buf_t *uv_buffer)
 {
-    buf->base = (char*)malloc(suggested_size);
-    buf->len = buf->base ? suggested_size : 0;
+    if (uv_buffer->base == nullptr)
+        return Buffer();
+
+    // with no pool, the memory came from malloc, and the buffer frees it
+    Buffer buffer(uv_buffer->base, nread > 0 ? nread : 0, pool);
+    if (nread <= 0)
+        return Buffer();
+    return buffer;
 }
 
 void
 TCPSocket::start_reading()
 {
-    Error::check(uv_read_start(handle_cast<uv_stream_t>(this), alloc_memory, [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* uv_buffer) {
+    Error::check(uv_read_start(handle_cast<uv_stream_t>(this), [](uv_handle_t* handle, size_t suggested_size, uv_buf_t *buf) {
+        alloc_memory(handle_downcast(handle)->m_read_pool, suggested_size, buf);
+    }, [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* uv_buffer) {
+        uv::Buffer buffer = take_read_buffer(handle_downcast(stream)->m_read_pool, nread, uv_buffer);
         if (nread == 0) {
             // EAGAIN
-            free(uv_buffer->base);
             return;
         }
         uv::Error error(nread < 0 ? nread : 0);
-        uv::Buffer buffer;
-
-        if (nread > 0)
-            buffer = uv::Buffer((const uint8_t*)uv_buffer->base, nread, true);
-        else
-            free(uv_buffer->base);
         handle_downcast(stream)->read_callback(error, std::move(buffer));
     }));
 }
 
 void
-TCPSocket::write(uint64_t req_id, const Buffer* buffers, size_t nbuffers)
+TCPSocket::write(uint64_t req_id, Buffer* buffers, size_t nbuffers)
 {
+    // the buffers that are handed over are stored right after the request,
+    // so there is a single allocation per write
     struct request : uv_write_t
     {
-        std::vector<Buffer> buf;
-        std::vector<uv_buf_t> uv_buf;
         uint64_t req_id;
+        size_t n_owned;
+
+        Buffer* owned()
+        {
+            return reinterpret_cast<Buffer*>(this + 1);
+        }
+
+        static void destroy(request *req)
+        {
+            for (size_t i = 0; i < req->n_owned; i++)
+                req->owned()[i].~Buffer();
+            req->~request();
+            ::operator delete(req);
+        }
     };
-    auto req = new (std::nothrow) request();
-    if (req == nullptr) {
+    static_assert(sizeof(request) % alignof(Buffer) == 0, "buffers must be aligned after the request");
+
+    size_t n_owned = 0;
+    for (size_t i = 0; i < nbuffers; i++) {
+        if (buffers[i].is_owned())
+            n_owned++;
+    }
+    void *memory = ::operator new(sizeof(request) + n_owned * sizeof(Buffer), std::nothrow);
+    if (memory == nullptr) {
         write_complete(req_id, UV_ENOBUFS);
         return;
     }
-
+    auto req = new (memory) request();
     req->req_id = req_id;
-    req->buf.reserve(nbuffers);
-    req->uv_buf.reserve(nbuffers);
+    req->n_owned = 0;
+
+    // libuv copies the buffer descriptors, so those can live on the stack
+    static const size_t MAX_STACK_BUFFERS = 4;
+    uv_buf_t stack_buffers[MAX_STACK_BUFFERS];
+    std::vector<uv_buf_t> heap_buffers;
+    uv_buf_t *uv_buffers = stack_buffers;
+    if (nbuffers > MAX_STACK_BUFFERS) {
+        heap_buffers.resize(nbuffers);
+        uv_buffers = heap_buffers.data();
+    }
+
+    size_t n_uv_buffers = 0;
     for (size_t i = 0; i < nbuffers; i++) {
-        const uv::Buffer& copy_from(buffers[i]);
-        if (!copy_from)
+        Buffer& buffer(buffers[i]);
+        if (!buffer)
             continue;
-        req->buf.emplace_back(copy_from.clone());
-        if (!req->buf.back()) {
-            write_complete(req_id, UV_ENOBUFS);
-            delete req;
-            return;
-        }
-        req->uv_buf.emplace_back(req->buf.back());
+        uv_buffers[n_uv_buffers++] = buffer;
+        if (buffer.is_owned())
+            new (&req->owned()[req->n_owned++]) Buffer(std::move(buffer));
     }
 
-    Error::check(uv_write(req, handle_cast<uv_stream_t>(this), &req->uv_buf[0], req->uv_buf.size(), [](uv_write_t *uv_req, int status) {
+    int err = uv_write(req, handle_cast<uv_stream_t>(this), uv_buffers, n_uv_buffers, [](uv_write_t *uv_req, int status) {
         request *req = static_cast<request*>(uv_req);
         handle_downcast(req->handle)->write_complete(req->req_id, status);
-        delete req;
-    }));
+        request::destroy(req);
+    });
+    if (err < 0) {
+        request::destroy(req);
+        Error::check(err);
+    }
 }
 
 
-TTY::TTY(uv_loop_t *loop, int fd)
+TTY::TTY(uv_loop_t *loop, int fd, BufferPool *read_pool) : m_read_pool(read_pool)
 {
     uv_tty_init(loop, this, fd, 1 /* readable */);
 }
@@ -164,19 +231,15 @@ TTY::TTY(uv_loop_t *loop, int fd)
 void
 TTY::start_reading()
 {
-    Error::check(uv_read_start(handle_cast<uv_stream_t>(this), alloc_memory, [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* uv_buffer) {
+    Error::check(uv_read_start(handle_cast<uv_stream_t>(this), [](uv_handle_t* handle, size_t suggested_size, uv_buf_t *buf) {
+        alloc_memory(handle_downcast(handle)->m_read_pool, suggested_size, buf);
+    }, [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* uv_buffer) {
+        uv::Buffer buffer = take_read_buffer(handle_downcast(stream)->m_read_pool, nread, uv_buffer);
         if (nread == 0) {
             // EAGAIN
-            free(uv_buffer->base);
             return;
         }
         uv::Error error(nread < 0 ? nread : 0);
-        uv::Buffer buffer;
-
-        if (nread > 0)
-            buffer = uv::Buffer((const uint8_t*)uv_buffer->base, nread, true);
-        else
-            free(uv_buffer->base);
         handle_downcast(stream)->read_line(error, std::move(buffer));
     }));
 }
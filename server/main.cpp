@@ -21,6 +21,8 @@
 #include <libhdht/libhdht.hpp>
 
 #include <cstdio>
+#include <memory>
+#include <thread>
 #include <unistd.h>
 
 using namespace libhdht;
@@ -37,25 +39,30 @@ static void debug_logger(int priority, const char *msg, va_list va)
 
 // 4 billion points in the grid
 static const int DEFAULT_RESOLUTION = 32;
+static const unsigned MAX_WORKERS = 256;
 
 struct Options
 {
     net::Address own_address;
     std::vector<net::Name> known_peers;
+    std::vector<net::Address> gateways;
+    unsigned n_workers = 1;
 
     void help(const char* argv0) {
         fprintf(stderr, "Usage:\n");
-        fprintf(stderr, "  %s -l ADDRESS [-p PEER]*\n\n", argv0);
+        fprintf(stderr, "  %s -l ADDRESS [-j N] [-p PEER]* [-g HOST]*\n\n", argv0);
         fprintf(stderr, "Options:\n");
         fprintf(stderr, "  -h         : show this help\n");
         fprintf(stderr, "  -d         : enable debugging (log to stderr instead of syslog)\n");
+        fprintf(stderr, "  -g HOST    : accept location batches from the clients connected from the given IP address\n");
+        fprintf(stderr, "  -j N       : run N servers, on N threads, sharing the listening address\n");
         fprintf(stderr, "  -l ADDRESS : listen on the given address\n");
         fprintf(stderr, "  -p PEER    : connect to the given peer\n");
     }
 
     Options(int argc, char* const* argv) {
         int opt;
-        while ((opt = getopt(argc, argv, ":dl:p:")) >= 0) {
+        while ((opt = getopt(argc, argv, ":dg:j:l:p:")) >= 0) {
             switch(opt) {
             case '?':
                 fprintf(stderr, "Invalid option %c\n", optopt);
@@ -71,10 +78,32 @@ struct Options
                 set_log_function(debug_logger);
                 break;
 
+            case 'g':
+                try {
+                    gateways.emplace_back(optarg);
+                } catch(const net::Error& e) {
+                    fprintf(stderr, "Invalid argument to -g: %s\n", e.what());
+                    help(argv[0]);
+                    exit(1);
+                }
+                break;
+
             case 'h':
                 help(argv[0]);
                 exit(0);
 
+            case 'j': {
+                char *end;
+                unsigned long n = strtoul(optarg, &end, 10);
+                if (*end != '\0' || n == 0 || n > MAX_WORKERS) {
+                    fprintf(stderr, "Invalid argument to -j: expected a number between 1 and %u\n", MAX_WORKERS);
+                    help(argv[0]);
+                    exit(1);
+                }
+                n_workers = n;
+                break;
+            }
+
             case 'l':
                 try {
                     own_address = net::Address(optarg);
@@ -103,23 +132,63 @@ int main(int argc, char* const* argv)
 
     Options opts(argc, argv);
     {
-        libhdht::uv::Loop event_loop;
+        // one server per worker, each with its own loop
+        // With more than one, they all accept connections on the address given,
+        // and each also listens on its own port, one of those following it
+        std::vector<net::Address> addresses;
+        if (opts.n_workers == 1) {
+            addresses.push_back(opts.own_address);
+        } else {
+            for (unsigned i = 0; i < opts.n_workers; i++) {
+                net::Address address = opts.own_address;
+                address.set_port(opts.own_address.get_port() + 1 + i);
+                addresses.push_back(address);
+            }
+        }
+        ShardGroup shards(addresses);
 
-        ServerContext ctx(event_loop, DEFAULT_RESOLUTION);
+        std::vector<std::unique_ptr<libhdht::uv::Loop>> event_loops;
+        std::vector<std::unique_ptr<ServerContext>> contexts;
         try {
-            ctx.add_address(opts.own_address);
-            for (auto& peer : opts.known_peers) {
-                auto addresses = peer.resolve_sync();
-                if (!addresses.empty())
-                    ctx.add_peer(addresses.front());
+            for (unsigned i = 0; i < opts.n_workers; i++) {
+                event_loops.emplace_back(new libhdht::uv::Loop);
+                contexts.emplace_back(new ServerContext(*event_loops.back(), DEFAULT_RESOLUTION));
+
+                ServerContext& ctx = *contexts.back();
+                if (opts.n_workers > 1)
+                    ctx.set_shards(shards, i);
+                ctx.add_address(addresses[i]);
+                if (opts.n_workers > 1)
+                    ctx.add_address(opts.own_address, true);
+                for (auto& gateway : opts.gateways)
+                    ctx.add_gateway(gateway);
+                for (auto& peer : opts.known_peers) {
+                    auto peer_addresses = peer.resolve_sync();
+                    if (!peer_addresses.empty())
+                        ctx.add_peer(peer_addresses.front());
+                }
             }
-            ctx.start();
+            // all the servers are listening before any of them looks for the others
+            for (auto& ctx : contexts)
+                ctx->start();
         } catch(std::runtime_error& e) {
             log(LOG_EMERG, "Failed to initialize daemon: %s", e.what());
             exit(1);
         }
 
-        event_loop.run();
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < opts.n_workers; i++) {
+            libhdht::uv::Loop *event_loop = event_loops[i].get();
+            workers.emplace_back([event_loop]() {
+                event_loop->run();
+            });
+        }
+        event_loops[0]->run();
+        for (auto& worker : workers)
+            worker.join();
+
+        // the servers must all be stopped before any is destroyed
+        contexts.clear();
     }
 
     libhdht::fini();
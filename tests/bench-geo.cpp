@@ -0,0 +1,104 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+// Measure the throughput of the great-circle distance, for
+// GeoPoint2D::distance() and for each kernel supported by this CPU at a few
+// error bounds, and of filtering points by radius
+//
+// Usage: bench-geo [N_POINTS [RADIUS]]
+
+#include "../lib/geo-batch.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace libhdht;
+using namespace libhdht::geo;
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// keeps the compiler from optimizing away the distances
+static volatile double sink;
+
+static void report(const char* kernel, double max_error, size_t n_points, double time)
+{
+    printf("%-10s %10g %16.0f\n", kernel, max_error, n_points / time);
+}
+
+int main(int argc, const char* const* argv)
+{
+    size_t n_points = argc > 1 ? atol(argv[1]) : 1000000;
+    double radius = argc > 2 ? atof(argv[2]) : 100000;
+
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> latitude(-90, 90), longitude(-180, 180);
+    std::vector<double> latitudes(n_points), longitudes(n_points), distances(n_points);
+    for (size_t i = 0; i < n_points; i++) {
+        latitudes[i] = latitude(rng);
+        longitudes[i] = longitude(rng);
+    }
+    GeoPoint2D origin{ 37.4275, -122.1697 };
+
+    printf("%zu points\n", n_points);
+    printf("%-10s %10s %16s\n", "kernel", "max error", "points/s");
+
+    double sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n_points; i++)
+        sum += GeoPoint2D::distance(origin, GeoPoint2D{ latitudes[i], longitudes[i] });
+    report("reference", 0, n_points, seconds_since(start));
+
+    const double max_errors[] = { 2, 0.05, 1e-4, 1e-6, 0 };
+    for (const Kernel& kernel : get_available_kernels()) {
+        for (double max_error : max_errors) {
+            start = std::chrono::steady_clock::now();
+            kernel.distance_batch(origin, latitudes.data(), longitudes.data(), distances.data(),
+                                  n_points, max_error);
+            report(kernel.name, max_error, n_points, seconds_since(start));
+            sum += distances[n_points / 2];
+        }
+    }
+
+    printf("\nfiltering within %g meters\n", radius);
+    printf("%-10s %16s %16s\n", "method", "points/s", "found");
+
+    size_t n_found = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n_points; i++) {
+        if (GeoPoint2D::distance(origin, GeoPoint2D{ latitudes[i], longitudes[i] }) <= radius)
+            n_found++;
+    }
+    printf("%-10s %16.0f %16zu\n", "reference", n_points / seconds_since(start), n_found);
+
+    std::vector<uint32_t> indices(n_points);
+    start = std::chrono::steady_clock::now();
+    n_found = filter_within_radius(origin, radius, latitudes.data(), longitudes.data(), n_points,
+                                   indices.data());
+    printf("%-10s %16.0f %16zu\n", "batch", n_points / seconds_since(start), n_found);
+
+    sink = sum;
+}
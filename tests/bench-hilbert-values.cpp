@@ -0,0 +1,106 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+// Measure the throughput of the Hilbert curve conversions, for the reference
+// implementation and for each kernel supported by this CPU, one point at
+// a time and in batches
+//
+// Usage: bench-hilbert-values [N_POINTS [LEVELS]]
+
+#include "../lib/hilbert-values.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace libhdht::hilbert_values;
+
+typedef std::pair<uint64_t, uint64_t> Point;
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// keeps the compiler from optimizing away the conversions
+static volatile uint64_t sink;
+
+static void report(const char* kernel, const char* method, size_t n_points, double xy2d_time, double d2xy_time)
+{
+    printf("%-10s %-8s %16.0f %16.0f\n", kernel, method, n_points / xy2d_time, n_points / d2xy_time);
+}
+
+int main(int argc, const char* const* argv)
+{
+    size_t n_points = argc > 1 ? atol(argv[1]) : 1000000;
+    int levels = argc > 2 ? atoi(argv[2]) : 32;
+    uint64_t n = 1ULL << levels;
+
+    std::mt19937_64 rng(42);
+    std::vector<Point> points(n_points), decoded(n_points);
+    std::vector<uint64_t> d(n_points);
+    for (auto& pt : points)
+        pt = std::make_pair(rng() & (n-1), rng() & (n-1));
+    for (size_t i = 0; i < n_points; i++)
+        d[i] = xy2d(n, points[i].first, points[i].second);
+
+    printf("%zu points, curve of %d levels\n", n_points, levels);
+    printf("%-10s %-8s %16s %16s\n", "kernel", "method", "xy2d points/s", "d2xy points/s");
+
+    uint64_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& pt : points)
+        sum += xy2d(n, pt.first, pt.second);
+    double xy2d_time = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n_points; i++)
+        d2xy(n, d[i], decoded[i].first, decoded[i].second);
+    double d2xy_time = seconds_since(start);
+    report("reference", "scalar", n_points, xy2d_time, d2xy_time);
+
+    std::vector<uint64_t> result(n_points);
+    for (const Kernel& kernel : get_available_kernels()) {
+        start = std::chrono::steady_clock::now();
+        for (const auto& pt : points)
+            sum += kernel.xy2d(n, pt.first, pt.second);
+        xy2d_time = seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < n_points; i++)
+            kernel.d2xy(n, d[i], decoded[i].first, decoded[i].second);
+        d2xy_time = seconds_since(start);
+        report(kernel.name, "scalar", n_points, xy2d_time, d2xy_time);
+
+        start = std::chrono::steady_clock::now();
+        kernel.xy2d_batch(n, points.data(), result.data(), n_points);
+        xy2d_time = seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        kernel.d2xy_batch(n, d.data(), decoded.data(), n_points);
+        d2xy_time = seconds_since(start);
+        report(kernel.name, "batch", n_points, xy2d_time, d2xy_time);
+
+        if (result != d || decoded != points)
+            printf("%s: wrong results!\n", kernel.name);
+    }
+
+    sink = sum;
+}
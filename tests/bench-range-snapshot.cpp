@@ -0,0 +1,153 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+// Measure the throughput of range lookups from several threads at once,
+// in the snapshot of the range table and, for comparison, in the table
+// itself behind a mutex, with the table idle and while another thread
+// changes it
+//
+// Usage: bench-range-snapshot [N_LOOKUPS [MAX_THREADS]]
+
+#include "../lib/libhdht-private.hpp"
+#include "../lib/rcu.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace libhdht;
+
+static const uint8_t RESOLUTION = 32;
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// keeps the compiler from optimizing away the lookups
+static std::atomic<uintptr_t> sink;
+
+static void ignore_log(int, const char*, va_list)
+{
+}
+
+// make a random change to the ranges of <table>
+static void change_table(Table& table, std::mt19937_64& rng)
+{
+    if (rng() % 4 == 0) {
+        table.load_balance_with_peer(nullptr, [](Table::LoadBalanceAction action, ServerNode* node) {
+            if (action == Table::LoadBalanceAction::RelinquishRange)
+                delete node;
+        });
+        return;
+    }
+
+    // take over the range of a random ID, or its parent
+    NodeIDRange range = table.find_controlling_server(NodeID(rng() & 0xFFFFFFFF, RESOLUTION))->get_range();
+    if (rng() % 2 && range.mask() > 0) {
+        NodeID from = range.from();
+        from.set_bit_at(range.mask() - 1, 0);
+        range = NodeIDRange(from, range.mask() - 1);
+    }
+    table.add_local_server_node(range);
+}
+
+// runs <lookup> over <ids> from <n_threads> threads, while <change> is
+// called in a loop on this thread if given, and returns the lookups/s
+template<typename Lookup>
+static double run(const std::vector<NodeID>& ids, int n_threads, Lookup lookup, std::function<void()> change)
+{
+    std::atomic<int> running(n_threads);
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n_threads; i++) {
+        threads.emplace_back([&]() {
+            uintptr_t sum = 0;
+            for (const NodeID& id : ids)
+                sum += lookup(id);
+            sink += sum;
+            running--;
+        });
+    }
+    if (change) {
+        while (running.load() > 0)
+            change();
+    }
+    for (auto& thread : threads)
+        thread.join();
+    return ids.size() * n_threads / seconds_since(start);
+}
+
+int main(int argc, const char* const* argv)
+{
+    size_t n_lookups = argc > 1 ? atol(argv[1]) : 1000000;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+
+    set_log_function(ignore_log);
+
+    std::mt19937_64 rng(42);
+    Table table(RESOLUTION);
+    for (int i = 0; i < 5000; i++)
+        change_table(table, rng);
+
+    std::vector<NodeID> ids;
+    ids.reserve(n_lookups);
+    for (size_t i = 0; i < n_lookups; i++)
+        ids.push_back(NodeID(rng() & 0xFFFFFFFF, RESOLUTION));
+
+    printf("%zu lookups per thread, %zu ranges\n", n_lookups, table.ranges_snapshot()->size());
+    printf("%-8s %-10s %16s %16s\n", "threads", "method", "idle lookups/s", "busy lookups/s");
+
+    std::mutex lock;
+    auto locked_lookup = [&](const NodeID& id) {
+        std::lock_guard<std::mutex> guard(lock);
+        return uintptr_t(table.find_controlling_server(id));
+    };
+    auto locked_change = [&]() {
+        std::lock_guard<std::mutex> guard(lock);
+        change_table(table, rng);
+    };
+    auto snapshot_lookup = [&](const NodeID& id) {
+        rcu::ReadSection section;
+        return uintptr_t(&table.ranges_snapshot()->find(id));
+    };
+    auto snapshot_change = [&]() {
+        change_table(table, rng);
+    };
+
+    for (int n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        double idle = run(ids, n_threads, locked_lookup, nullptr);
+        double busy = run(ids, n_threads, locked_lookup, locked_change);
+        printf("%-8d %-10s %16.0f %16.0f\n", n_threads, "mutex", idle, busy);
+
+        idle = run(ids, n_threads, snapshot_lookup, nullptr);
+        busy = run(ids, n_threads, snapshot_lookup, snapshot_change);
+        printf("%-8d %-10s %16.0f %16.0f\n", n_threads, "snapshot", idle, busy);
+    }
+}
@@ -0,0 +1,147 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+// Measure the throughput of an RTree shared by several threads, each doing
+// 90% location updates and 10% searches, with searches under a reader lock
+// and with concurrent searches that take no lock
+//
+// Usage: bench-rtree-concurrent [N_POINTS [N_OPERATIONS [MAX_THREADS]]]
+
+#include "../lib/rtree/rtree.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+using namespace libhdht::rtree;
+
+static const uint64_t kMaxDimension = 1ULL << 16;
+// the side of the searched squares, about 1% of the map
+static const uint64_t kQuerySize = kMaxDimension / 10;
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static Point move_point(std::mt19937_64& rng, const Point& pt)
+{
+    auto move = [&rng](uint64_t x) {
+        int64_t moved = int64_t(x) + int64_t(rng() % 201) - 100;
+        return uint64_t(std::min<int64_t>(kMaxDimension - 1, std::max<int64_t>(0, moved)));
+    };
+    return Point(move(pt.first), move(pt.second));
+}
+
+static Rectangle random_query(std::mt19937_64& rng)
+{
+    uint64_t x = rng() % (kMaxDimension - kQuerySize), y = rng() % (kMaxDimension - kQuerySize);
+    return Rectangle(Point(x + kQuerySize, y + kQuerySize), Point(x, y));
+}
+
+// runs <n_operations> on each of <n_threads> threads, each moving its own
+// share of <points>, and returns the operations/s
+// <update> and <search> do the locking
+template<typename Update, typename Search>
+static double run(std::vector<Point>& points, std::vector<int>& ids, int n_threads, size_t n_operations,
+                  Update update, Search search)
+{
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < n_threads; t++) {
+        threads.emplace_back([&, t]() {
+            std::mt19937_64 rng(t);
+            size_t hits = 0;
+            for (size_t i = 0; i < n_operations; i++) {
+                if (rng() % 10 == 0) {
+                    search(random_query(rng), [&hits](const LeafEntry&) { hits++; });
+                } else {
+                    size_t index = (rng() % (points.size() / n_threads)) * n_threads + t;
+                    Point new_pt = move_point(rng, points[index]);
+                    update(points[index], new_pt, &ids[index]);
+                    points[index] = new_pt;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    return n_operations * n_threads / seconds_since(start);
+}
+
+int main(int argc, const char* const* argv)
+{
+    size_t n_points = argc > 1 ? atol(argv[1]) : 100000;
+    size_t n_operations = argc > 2 ? atol(argv[2]) : 100000;
+    int max_threads = argc > 3 ? atoi(argv[3]) : 8;
+
+    std::mt19937_64 rng(42);
+    std::vector<Point> points;
+    std::vector<int> ids(n_points);
+    for (size_t i = 0; i < n_points; i++)
+        points.push_back(Point(rng() % kMaxDimension, rng() % kMaxDimension));
+
+    printf("%zu points, %zu operations per thread\n", n_points, n_operations);
+    printf("%-8s %-12s %16s\n", "threads", "searches", "operations/s");
+
+    for (int n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        {
+            RTree rtree(kMaxDimension);
+            for (size_t i = 0; i < n_points; i++)
+                rtree.insert(points[i], &ids[i]);
+
+            std::shared_timed_mutex lock;
+            double throughput = run(points, ids, n_threads, n_operations,
+                [&](const Point& old_pt, const Point& new_pt, void* data) {
+                    std::unique_lock<std::shared_timed_mutex> guard(lock);
+                    rtree.update(old_pt, new_pt, data);
+                }, [&](const Rectangle& query, std::function<void(const LeafEntry&)> visitor) {
+                    std::shared_lock<std::shared_timed_mutex> guard(lock);
+                    rtree.search(query, visitor);
+                });
+            printf("%-8d %-12s %16.0f\n", n_threads, "locked", throughput);
+        }
+
+        {
+            RTree rtree(kMaxDimension);
+            rtree.enable_concurrent_reads();
+            for (size_t i = 0; i < n_points; i++)
+                rtree.insert(points[i], &ids[i]);
+
+            // the writers still take turns
+            std::mutex lock;
+            double throughput = run(points, ids, n_threads, n_operations,
+                [&](const Point& old_pt, const Point& new_pt, void* data) {
+                    std::lock_guard<std::mutex> guard(lock);
+                    rtree.update(old_pt, new_pt, data);
+                }, [&](const Rectangle& query, std::function<void(const LeafEntry&)> visitor) {
+                    rtree.search_concurrent(query, visitor);
+                });
+            printf("%-8d %-12s %16.0f\n", n_threads, "concurrent", throughput);
+        }
+    }
+}
@@ -0,0 +1,104 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+// Sweep the RTree node capacity, and measure insert, bulk load and query throughput
+//
+// Usage: bench-rtree [N_POINTS [N_QUERIES]]
+
+#include "../lib/rtree/rtree.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace libhdht::rtree;
+
+static const uint64_t kMaxDimension = 1ULL << 16;
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void run(uint32_t capacity, const std::vector<Point>& points, const std::vector<Rectangle>& queries)
+{
+    RTree rtree(kMaxDimension, capacity);
+
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& pt : points)
+        rtree.insert(pt, nullptr);
+    double insert_time = seconds_since(start);
+
+    std::vector<void*> data(points.size(), nullptr);
+    start = std::chrono::steady_clock::now();
+    RTree packed(kMaxDimension, capacity);
+    packed.bulk_load(packed.make_entries(points, data));
+    double bulk_load_time = seconds_since(start);
+
+    size_t hits = 0;
+    start = std::chrono::steady_clock::now();
+    for (const auto& query : queries)
+        rtree.search(query, [&hits](const LeafEntry&) { hits++; });
+    double query_time = seconds_since(start);
+
+    size_t packed_hits = 0;
+    start = std::chrono::steady_clock::now();
+    for (const auto& query : queries)
+        packed.search(query, [&packed_hits](const LeafEntry&) { packed_hits++; });
+    double packed_query_time = seconds_since(start);
+
+    printf("%8u %8zu %14.0f %14.0f %14.0f %14.0f %12zu %10.1f %10.1f\n", capacity, Node::allocation_size(true, capacity),
+           points.size() / insert_time, points.size() / bulk_load_time,
+           queries.size() / query_time, queries.size() / packed_query_time, hits,
+           rtree.memory_usage() / double(points.size()), packed.memory_usage() / double(points.size()));
+}
+
+int main(int argc, const char* const* argv)
+{
+    size_t n_points = argc > 1 ? atol(argv[1]) : 1000000;
+    size_t n_queries = argc > 2 ? atol(argv[2]) : 10000;
+
+    std::mt19937_64 rng(42);
+    std::uniform_int_distribution<uint64_t> coord(0, kMaxDimension - 1);
+    std::uniform_int_distribution<uint64_t> extent(0, kMaxDimension / 256);
+
+    std::vector<Point> points;
+    points.reserve(n_points);
+    for (size_t i = 0; i < n_points; i++)
+        points.emplace_back(coord(rng), coord(rng));
+
+    std::vector<Rectangle> queries;
+    queries.reserve(n_queries);
+    for (size_t i = 0; i < n_queries; i++) {
+        uint64_t x = coord(rng), y = coord(rng);
+        uint64_t w = extent(rng), h = extent(rng);
+        queries.emplace_back(std::make_pair(std::min(x + w, kMaxDimension - 1), std::min(y + h, kMaxDimension - 1)),
+                             std::make_pair(x, y));
+    }
+
+    printf("%zu points, %zu queries (default capacity %u)\n", n_points, n_queries, kDefaultCapacity);
+    printf("%8s %8s %14s %14s %14s %14s %12s %10s %10s\n", "capacity", "leaf B", "inserts/s", "bulk/s",
+           "queries/s", "packed q/s", "hits", "B/point", "packed B/p");
+    for (uint32_t capacity : { 4, 5, 8, 14, 16, 22, 24, 30, 32, 48, 64, 128 })
+        run(capacity, points, queries);
+}
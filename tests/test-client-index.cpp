@@ -0,0 +1,169 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "../lib/libhdht-private.hpp"
+
+#include <cstdarg>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+using namespace libhdht;
+
+static const uint8_t RESOLUTION = 32;
+
+static void ignore_log(int, const char*, va_list)
+{
+}
+
+static void test_pool()
+{
+    // more than a slab, so handles go across slabs
+    static const size_t N_CLIENTS = 3000;
+
+    ClientPool pool;
+    std::vector<ClientNode*> clients;
+    for (size_t i = 0; i < N_CLIENTS; i++) {
+        ClientNode *client = pool.create(NodeID(i, RESOLUTION), GeoPoint2D{ 0, 0 });
+        assert(pool.get(client->get_handle()) == client);
+        clients.push_back(client);
+    }
+    assert(pool.size() == N_CLIENTS);
+
+    // free every other client, their handles stop resolving
+    std::vector<ClientHandle> freed;
+    for (size_t i = 0; i < N_CLIENTS; i += 2) {
+        freed.push_back(clients[i]->get_handle());
+        pool.destroy(clients[i]);
+        clients[i] = nullptr;
+    }
+    assert(pool.size() == N_CLIENTS / 2);
+    for (const ClientHandle& handle : freed)
+        assert(pool.get(handle) == nullptr);
+    for (size_t i = 1; i < N_CLIENTS; i += 2) {
+        assert(pool.get(clients[i]->get_handle()) == clients[i]);
+        assert(clients[i]->get_id() == NodeID(i, RESOLUTION));
+    }
+
+    // new clients reuse the slots, with a new generation, so the old
+    // handles still resolve to nothing
+    std::unordered_set<uint32_t> freed_slots;
+    for (const ClientHandle& handle : freed)
+        freed_slots.insert(handle.index);
+    for (size_t i = 0; i < freed.size(); i++) {
+        ClientNode *client = pool.create(NodeID(N_CLIENTS + i, RESOLUTION), GeoPoint2D{ 0, 0 });
+        ClientHandle handle = client->get_handle();
+        assert(freed_slots.count(handle.index) == 1);
+        assert(pool.get(handle) == client);
+    }
+    assert(pool.size() == N_CLIENTS / 2 + freed.size());
+    for (const ClientHandle& handle : freed)
+        assert(pool.get(handle) == nullptr);
+
+    // a handle past the end of the pool does not resolve either
+    assert(pool.get(ClientHandle{ uint32_t(N_CLIENTS + 1), 1 }) == nullptr);
+}
+
+// every client of <expected> can be found through <index>, and IDs with no
+// client are not found
+static void check_index(const ClientIndex& index, const std::unordered_map<ClientNode*, NodeID>& expected,
+                        const std::vector<NodeID>& missing_ids)
+{
+    assert(index.size() == expected.size());
+    for (const auto& it : expected) {
+        ClientNode *found = index.find(it.second);
+        assert(found != nullptr);
+        assert(found->get_id() == it.second);
+        assert(expected.count(found) == 1);
+    }
+    for (const NodeID& id : missing_ids)
+        assert(index.find(id) == nullptr);
+
+    size_t n_visited = 0;
+    index.foreach_client([&](ClientNode *client) {
+        assert(expected.count(client) == 1);
+        n_visited++;
+    });
+    assert(n_visited == expected.size());
+}
+
+static void test_index()
+{
+    static const size_t N_CLIENTS = 20000;
+    // few distinct IDs, so many clients share one and the probe sequences
+    // are long, and erasing shifts entries back through them
+    static const uint64_t N_IDS = 5000;
+
+    std::mt19937_64 rng(42);
+    ClientPool pool;
+    ClientIndex index;
+    std::unordered_map<ClientNode*, NodeID> expected;
+    std::unordered_map<uint64_t, size_t> per_id;
+
+    assert(index.find(NodeID(1, RESOLUTION)) == nullptr);
+    index.erase(pool.create(NodeID(1, RESOLUTION), GeoPoint2D{ 0, 0 }));
+    assert(index.size() == 0);
+
+    // the table grows many times along the way
+    for (size_t i = 0; i < N_CLIENTS; i++) {
+        uint64_t value = rng() % N_IDS;
+        ClientNode *client = pool.create(NodeID(value, RESOLUTION), GeoPoint2D{ 0, 0 });
+        index.insert(client);
+        expected[client] = client->get_id();
+        per_id[value]++;
+    }
+    check_index(index, expected, { NodeID(N_IDS, RESOLUTION) });
+
+    // erase the clients in random order, checking that the others are
+    // still reachable after the entries were shifted back
+    std::vector<ClientNode*> order;
+    for (const auto& it : expected)
+        order.push_back(it.first);
+    std::shuffle(order.begin(), order.end(), rng);
+    for (size_t i = 0; i < order.size(); i++) {
+        ClientNode *client = order[i];
+        uint64_t value = client->get_id().to_hilbert_value(RESOLUTION);
+        index.erase(client);
+        expected.erase(client);
+        // erasing twice does nothing
+        index.erase(client);
+
+        std::vector<NodeID> missing;
+        if (--per_id[value] == 0)
+            missing.push_back(client->get_id());
+        if (i % 1000 == 0 || i + 1 == order.size())
+            check_index(index, expected, missing);
+        else
+            assert(missing.empty() || index.find(missing.front()) == nullptr);
+    }
+    assert(index.size() == 0);
+}
+
+int main()
+{
+    set_log_function(ignore_log);
+
+    test_pool();
+    test_index();
+}
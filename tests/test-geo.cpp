@@ -0,0 +1,206 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include "../lib/geo-batch.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+using namespace libhdht;
+using namespace libhdht::geo;
+
+// the haversine formula in long double, switching to the antipode of <lat2, lon2>
+// when the points are more than a quarter of the way around
+static double reference_distance(const GeoPoint2D& origin, double lat2, double lon2)
+{
+    const long double R = 6371000;
+    long double phi1 = origin.latitude * (M_PIl / 180);
+    long double phi2 = lat2 * (M_PIl / 180);
+    long double dlambda = (lon2 - origin.longitude) * (M_PIl / 180);
+
+    long double k = cosl(phi1) * cosl(phi2);
+    long double sin_a = sinl((phi2 - phi1) / 2), sin_b = sinl(dlambda / 2);
+    long double sin_s = sinl((phi2 + phi1) / 2), cos_b = cosl(dlambda / 2);
+    long double h = sin_a * sin_a + k * sin_b * sin_b;
+    long double g = sin_s * sin_s + k * cos_b * cos_b;
+    if (h <= g)
+        return 2 * R * asinl(sqrtl(h));
+    else
+        return 2 * R * (M_PIl / 2 - asinl(sqrtl(g)));
+}
+
+static double clamp(double value, double min, double max)
+{
+    return std::min(std::max(value, min), max);
+}
+
+// random points around <origin>: a quarter nearby, a quarter close to
+// its antipode, and the rest anywhere
+static void random_points(std::mt19937_64& rng, const GeoPoint2D& origin, size_t count,
+                          std::vector<double>& latitudes, std::vector<double>& longitudes)
+{
+    std::uniform_real_distribution<double> latitude(-90, 90), longitude(-180, 180);
+    latitudes.resize(count);
+    longitudes.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        switch (i % 4) {
+        case 0:
+            latitudes[i] = clamp(origin.latitude + latitude(rng) / 10000, -90, 90);
+            longitudes[i] = clamp(origin.longitude + longitude(rng) / 10000, -180, 180);
+            break;
+        case 1:
+            latitudes[i] = clamp(-origin.latitude + latitude(rng) / 10000, -90, 90);
+            longitudes[i] = origin.longitude + 180 + longitude(rng) / 10000;
+            if (longitudes[i] > 180)
+                longitudes[i] -= 360;
+            longitudes[i] = clamp(longitudes[i], -180, 180);
+            break;
+        default:
+            latitudes[i] = latitude(rng);
+            longitudes[i] = longitude(rng);
+        }
+    }
+}
+
+static void test_accuracy()
+{
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> latitude(-90, 90), longitude(-180, 180);
+    const double max_errors[] = { 10, 2, 0.05, 1e-3, 1e-4, 1e-6, 1e-9 };
+
+    for (const Kernel& kernel : get_available_kernels()) {
+        std::cout << "Testing kernel " << kernel.name << std::endl;
+
+        for (int i = 0; i < 20; i++) {
+            GeoPoint2D origin{ latitude(rng), longitude(rng) };
+            // the poles and the antimeridian
+            if (i == 0)
+                origin = GeoPoint2D{ 90, 0 };
+            else if (i == 1)
+                origin = GeoPoint2D{ -90, 180 };
+            else if (i == 2)
+                origin = GeoPoint2D{ 12.5, -180 };
+
+            // a count that is not a multiple of the vector width
+            std::vector<double> latitudes, longitudes;
+            random_points(rng, origin, 10007, latitudes, longitudes);
+            std::vector<double> distances(latitudes.size());
+
+            for (double max_error : max_errors) {
+                kernel.distance_batch(origin, latitudes.data(), longitudes.data(), distances.data(),
+                                      latitudes.size(), max_error);
+                // below 1e-6, the standard library is as good as it gets
+                double tolerance = std::max(max_error, 1e-7);
+                for (size_t j = 0; j < latitudes.size(); j++)
+                    assert(std::abs(distances[j] - reference_distance(origin, latitudes[j], longitudes[j])) <= tolerance);
+            }
+        }
+
+        // the same point, and exactly antipodal points
+        double latitudes[] = { 45, -45, 90 };
+        double longitudes[] = { 10, -170, 0 };
+        double distances[3];
+        kernel.distance_batch(GeoPoint2D{ 45, 10 }, latitudes, longitudes, distances, 3, 1e-3);
+        assert(distances[0] <= 1e-3);
+        assert(std::abs(distances[1] - M_PI * 6371000) <= 1e-3);
+        assert(std::abs(distances[2] - M_PI / 4 * 6371000) <= 1e-3);
+    }
+
+    // the default kernel agrees with GeoPoint2D::distance() away from the antipode
+    GeoPoint2D origin{ 37.4275, -122.1697 };
+    std::vector<double> latitudes(1000), longitudes(1000), distances(1000);
+    for (size_t i = 0; i < latitudes.size(); i++) {
+        latitudes[i] = clamp(origin.latitude + latitude(rng) / 10, -90, 90);
+        longitudes[i] = clamp(origin.longitude + longitude(rng) / 10, -180, 180);
+    }
+    distance_batch(origin, latitudes.data(), longitudes.data(), distances.data(), latitudes.size());
+    for (size_t i = 0; i < latitudes.size(); i++)
+        assert(std::abs(distances[i] - GeoPoint2D::distance(origin, GeoPoint2D{ latitudes[i], longitudes[i] })) <= kDefaultMaxError);
+}
+
+static void test_filter()
+{
+    std::mt19937_64 rng(43);
+    std::uniform_real_distribution<double> latitude(-90, 90), longitude(-180, 180);
+    const double radii[] = { 0, 100, 50000, 2000000, 10000000, 30000000 };
+
+    for (int i = 0; i < 50; i++) {
+        GeoPoint2D center{ latitude(rng), longitude(rng) };
+        // close to a pole, and on both sides of the antimeridian
+        if (i == 0)
+            center = GeoPoint2D{ 89.99, 10 };
+        else if (i == 1)
+            center = GeoPoint2D{ -10, 179.999 };
+        else if (i == 2)
+            center = GeoPoint2D{ 60, -180 };
+
+        for (double radius : radii) {
+            // points spread over a few times the radius around the center
+            double spread = std::min(std::max(radius * 3 / 111000, 0.01), 180.0);
+            size_t count = 5003;
+            std::vector<double> latitudes(count), longitudes(count);
+            for (size_t j = 0; j < count; j++) {
+                latitudes[j] = clamp(center.latitude + latitude(rng) / 90 * spread, -90, 90);
+                longitudes[j] = center.longitude + longitude(rng) / 180 * spread;
+                if (longitudes[j] > 180)
+                    longitudes[j] -= 360;
+                else if (longitudes[j] < -180)
+                    longitudes[j] += 360;
+            }
+            // and the center itself
+            latitudes[0] = center.latitude;
+            longitudes[0] = center.longitude;
+
+            std::vector<uint32_t> indices(count);
+            size_t n_found = filter_within_radius(center, radius, latitudes.data(), longitudes.data(),
+                                                  count, indices.data());
+            assert(std::is_sorted(indices.begin(), indices.begin() + n_found));
+            assert(n_found >= 1 && indices[0] == 0);
+
+            // points clearly inside are found, points clearly outside are not
+            size_t k = 0;
+            for (size_t j = 0; j < count; j++) {
+                bool found = k < n_found && indices[k] == j;
+                if (found)
+                    k++;
+                double distance = reference_distance(center, latitudes[j], longitudes[j]);
+                if (distance <= radius - kDefaultMaxError)
+                    assert(found);
+                else if (distance > radius + kDefaultMaxError)
+                    assert(!found);
+            }
+            assert(k == n_found);
+        }
+    }
+}
+
+int main()
+{
+    test_accuracy();
+    test_filter();
+}
@@ -21,9 +21,15 @@
 
 #include "../lib/hilbert-values.hpp"
 
+#include <algorithm>
 #include <cstdint>
-#include <cassert>
+#include <cstdlib>
 #include <iostream>
+#include <random>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
 
 using namespace libhdht::hilbert_values;
 
@@ -39,8 +45,131 @@ static void reverse(int n, int d)
     std::cout << "p(" << d << ") = (" << x << ", " << y << ")" << std::endl;
 }
 
+// checks that <kernel> agrees with the reference implementation at (x, y)
+static void check_point(const Kernel& kernel, uint64_t n, uint64_t x, uint64_t y)
+{
+    uint64_t d = xy2d(n, x, y);
+    assert(kernel.xy2d(n, x, y) == d);
+
+    uint64_t fast_x, fast_y;
+    kernel.d2xy(n, d, fast_x, fast_y);
+    assert(fast_x == x && fast_y == y);
+}
+
+static void differential_test()
+{
+    std::mt19937_64 rng(42);
+    for (const Kernel& kernel : get_available_kernels()) {
+        std::cout << "Testing kernel " << kernel.name << std::endl;
+
+        // every point of the small curves, including the ones whose
+        // number of levels is not a multiple of the table step
+        for (uint64_t n = 1; n <= 64; n *= 2) {
+            for (uint64_t x = 0; x < n; x++) {
+                for (uint64_t y = 0; y < n; y++)
+                    check_point(kernel, n, x, y);
+            }
+        }
+
+        // random points of the larger ones, up to the full 64-bit range
+        for (int levels = 7; levels <= 32; levels++) {
+            uint64_t n = 1ULL << levels;
+            for (int i = 0; i < 10000; i++)
+                check_point(kernel, n, rng() & (n-1), rng() & (n-1));
+            check_point(kernel, n, n-1, n-1);
+            check_point(kernel, n, 0, n-1);
+            check_point(kernel, n, n-1, 0);
+        }
+
+        // the sizes the kernels don't handle go to the reference
+        check_point(kernel, 1ULL << 33, 1234567890ULL, 98765432ULL);
+
+        // batches, with a count that is not a multiple of the vector width
+        for (int levels = 0; levels <= 32; levels++) {
+            uint64_t n = 1ULL << levels;
+            const size_t count = 1000 + levels;
+            std::vector<std::pair<uint64_t, uint64_t>> points(count), decoded(count);
+            std::vector<uint64_t> d(count);
+            for (auto& pt : points)
+                pt = std::make_pair(rng() & (n-1), rng() & (n-1));
+
+            kernel.xy2d_batch(n, points.data(), d.data(), count);
+            for (size_t i = 0; i < count; i++)
+                assert(d[i] == xy2d(n, points[i].first, points[i].second));
+
+            kernel.d2xy_batch(n, d.data(), decoded.data(), count);
+            assert(decoded == points);
+        }
+    }
+
+    uint64_t x, y;
+    fast_d2xy(1ULL << 20, fast_xy2d(1ULL << 20, 123456, 654321), x, y);
+    assert(x == 123456 && y == 654321);
+
+    std::pair<uint64_t, uint64_t> point(123456, 654321);
+    uint64_t d;
+    xy2d_batch(1ULL << 20, &point, &d, 1);
+    assert(d == xy2d<uint64_t>(1ULL << 20, 123456, 654321));
+}
+
+static void test_intervals()
+{
+    std::mt19937_64 rng(43);
+    for (uint64_t n = 1; n <= 64; n *= 2) {
+        for (int i = 0; i < 200; i++) {
+            uint64_t x1 = rng() % n, x2 = rng() % n, y1 = rng() % n, y2 = rng() % n;
+            std::pair<uint64_t, uint64_t> lower(std::min(x1, x2), std::min(y1, y2));
+            std::pair<uint64_t, uint64_t> upper(std::max(x1, x2), std::max(y1, y2));
+
+            std::vector<bool> expected(n * n, false);
+            for (uint64_t x = lower.first; x <= upper.first; x++) {
+                for (uint64_t y = lower.second; y <= upper.second; y++)
+                    expected[xy2d(n, x, y)] = true;
+            }
+
+            for (uint64_t min_size = 1; min_size <= n; min_size *= 2) {
+                std::vector<std::pair<uint64_t, uint64_t>> intervals;
+                rectangle_to_intervals(n, lower, upper, min_size, intervals);
+
+                std::vector<bool> covered(n * n, false);
+                for (size_t j = 0; j < intervals.size(); j++) {
+                    assert(intervals[j].first <= intervals[j].second);
+                    // sorted, and adjacent intervals are merged
+                    if (j > 0)
+                        assert(intervals[j-1].second + 1 < intervals[j].first);
+                    for (uint64_t d = intervals[j].first; d <= intervals[j].second; d++)
+                        covered[d] = true;
+                }
+
+                // exact at full precision, a superset otherwise
+                for (uint64_t d = 0; d < n * n; d++) {
+                    if (min_size == 1)
+                        assert(covered[d] == expected[d]);
+                    else
+                        assert(covered[d] || !expected[d]);
+                }
+            }
+        }
+    }
+
+    // the whole curve at the largest size is a single interval
+    std::vector<std::pair<uint64_t, uint64_t>> intervals;
+    rectangle_to_intervals(1ULL << 32, std::make_pair(0, 0), std::make_pair((1ULL << 32) - 1, (1ULL << 32) - 1), 1, intervals);
+    assert(intervals.size() == 1);
+    assert(intervals[0].first == 0 && intervals[0].second == UINT64_MAX);
+
+    // a large rectangle needs few intervals
+    intervals.clear();
+    rectangle_to_intervals(1ULL << 32, std::make_pair(1000, 1000), std::make_pair(3000000000ULL, 2000000000ULL),
+                           1ULL << 20, intervals);
+    assert(intervals.size() < 10000);
+}
+
 int main()
 {
+    test_intervals();
+    differential_test();
+
     std::cout << "N = 4" << std::endl;
     forward (4, 0, 0);
     std::cout << "(0, 1) = " << xy2d(4, 0, 1) << std::endl;
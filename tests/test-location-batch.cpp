@@ -0,0 +1,162 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "../lib/libhdht-private.hpp"
+#include "../include/libhdht/server.hpp"
+
+#include <cstdarg>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+using namespace libhdht;
+using namespace libhdht::protocol;
+
+static const uint8_t RESOLUTION = 32;
+static const char *SERVER_ADDRESS = "127.0.0.1:19881";
+// the addresses the clients register with; they do not listen on them,
+// and they all connect from 127.0.0.1
+static const char *CLIENT_ADDRESS = "127.0.0.1:19882";
+static const char *GATEWAY_ADDRESS = "127.0.0.1:19883";
+// a trusted host that the clients do not connect from
+static const char *TRUSTED_ADDRESS = "127.0.0.2:19884";
+
+static void ignore_log(int, const char*, va_list)
+{
+}
+
+// a client of the server, with its own connection
+struct Client
+{
+    rpc::Context *ctx;
+    std::shared_ptr<ServerProxy> proxy;
+    net::Address address;
+    NodeID id;
+
+    Client(uv::Loop& loop, const char *address) : ctx(new rpc::Context(loop)), address(address)
+    {
+        proxy = ctx->get_peer(net::Address(SERVER_ADDRESS))->get_proxy<ServerProxy>(MASTER_OBJECT_ID);
+    }
+
+    void hello(const GeoPoint2D& point, const std::function<void()>& then)
+    {
+        proxy->invoke_client_hello([this, then](rpc::Error *error, ClientRegistrationResult result, NodeID new_id) {
+            assert(error == nullptr);
+            assert(result == ClientRegistrationResult::ClientCreated);
+            id = new_id;
+            then();
+        }, address, NodeID(), point);
+    }
+};
+
+struct Test
+{
+    uv::Loop& loop;
+    ServerContext& server;
+    Client client, other_client, gateway;
+    bool done = false;
+
+    Test(uv::Loop& loop, ServerContext& server) :
+        loop(loop),
+        server(server),
+        client(loop, CLIENT_ADDRESS),
+        other_client(loop, TRUSTED_ADDRESS),
+        gateway(loop, GATEWAY_ADDRESS) {}
+
+    void start()
+    {
+        client.hello(GeoPoint2D{ 37.4, -122.1 }, [this]() {
+            other_client.hello(GeoPoint2D{ 51.5, -0.1 }, [this]() {
+                gateway.hello(GeoPoint2D{ 0, 0 }, [this]() {
+                    test_client_is_refused();
+                });
+            });
+        });
+    }
+
+    // a client that registers with the address of a trusted host, but
+    // does not connect from it, cannot move the others
+    void test_client_is_refused()
+    {
+        std::vector<LocationUpdate> updates{ std::make_pair(client.id, GeoPoint2D{ -33.9, 151.2 }) };
+        other_client.proxy->invoke_set_locations_batch([this](rpc::Error *error, std::vector<SetLocationReply> replies) {
+            auto remote_error = dynamic_cast<rpc::RemoteError*>(error);
+            assert(remote_error != nullptr && remote_error->code() == EPERM);
+            assert(replies.empty());
+
+            // from now on, the clients on this host are gateways
+            server.add_gateway(net::Address(GATEWAY_ADDRESS));
+            test_gateway();
+        }, updates);
+    }
+
+    // the gateway moves both, and an unknown client fails on its own
+    void test_gateway()
+    {
+        GeoPoint2D new_point{ -33.9, 151.2 }, other_new_point{ 35.6, 139.7 };
+        NodeID unknown(12345, RESOLUTION);
+        std::vector<LocationUpdate> updates{
+            std::make_pair(client.id, new_point),
+            std::make_pair(unknown, GeoPoint2D{ 0, 0 }),
+            std::make_pair(other_client.id, other_new_point),
+        };
+        gateway.proxy->invoke_set_locations_batch([this, new_point, other_new_point](rpc::Error *error, std::vector<SetLocationReply> replies) {
+            assert(error == nullptr);
+            assert(replies.size() == 3);
+            assert(std::get<0>(replies[0]) == SetLocationResult::SameServer);
+            assert(std::get<1>(replies[0]) == NodeID(new_point, RESOLUTION));
+            assert(std::get<0>(replies[1]) == SetLocationResult::Failed);
+            assert(std::get<0>(replies[2]) == SetLocationResult::SameServer);
+            assert(std::get<1>(replies[2]) == NodeID(other_new_point, RESOLUTION));
+            test_moved(new_point);
+        }, updates);
+    }
+
+    // the client can be found where the gateway moved it
+    void test_moved(const GeoPoint2D& new_point)
+    {
+        gateway.proxy->invoke_knn_clients([this, new_point](rpc::Error *error, std::vector<Neighbour> neighbours) {
+            assert(error == nullptr);
+            assert(neighbours.size() == 1);
+            assert(neighbours[0].id == NodeID(new_point, RESOLUTION));
+            done = true;
+            loop.stop();
+        }, new_point, uint32_t(1));
+    }
+};
+
+int main()
+{
+    set_log_function(ignore_log);
+
+    // the server and the contexts cannot be destroyed while they are
+    // connected, so they are left for the exit to clean up
+    uv::Loop *loop = new uv::Loop;
+    ServerContext *server = new ServerContext(*loop, RESOLUTION);
+    server->add_address(net::Address(SERVER_ADDRESS));
+    server->add_gateway(net::Address(TRUSTED_ADDRESS));
+    server->start();
+
+    Test *test = new Test(*loop, *server);
+    test->start();
+    loop->run();
+    assert(test->done);
+}
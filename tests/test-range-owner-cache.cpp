@@ -0,0 +1,150 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "../lib/libhdht-private.hpp"
+
+#include <cstdarg>
+
+#undef NDEBUG
+#include <cassert>
+
+using namespace libhdht;
+
+static const uint8_t RESOLUTION = 32;
+
+static void ignore_log(int, const char*, va_list)
+{
+}
+
+// the range of the IDs that start with the <mask> bits of <prefix>
+static NodeIDRange make_range(uint64_t prefix, uint8_t mask)
+{
+    NodeID from;
+    for (uint8_t i = 0; i < mask; i++)
+        from.set_bit_at(i, (prefix >> (mask - 1 - i)) & 1);
+    return NodeIDRange(from, mask);
+}
+
+// an ID in the range of <prefix>, and <mask>
+static NodeID make_id(uint64_t prefix, uint8_t mask, uint64_t suffix = 0)
+{
+    return NodeID(prefix << (RESOLUTION - mask) | suffix, RESOLUTION);
+}
+
+static void test_overlap(std::shared_ptr<protocol::ServerProxy> one, std::shared_ptr<protocol::ServerProxy> two)
+{
+    RangeOwnerCache cache;
+    assert(cache.find(make_id(0, 1)) == nullptr);
+
+    cache.insert(RangeOwnerCache::Owner{ make_range(0b01, 2), one, 1 });
+    assert(cache.find(make_id(0b01, 2, 12345))->proxy == one);
+    assert(cache.find(make_id(0b00, 2)) == nullptr);
+    assert(cache.find(make_id(0b10, 2)) == nullptr);
+
+    // a finer range replaces the one that contains it, whole
+    cache.insert(RangeOwnerCache::Owner{ make_range(0b010, 3), two, 1 });
+    assert(cache.size() == 1);
+    assert(cache.find(make_id(0b010, 3))->proxy == two);
+    assert(cache.find(make_id(0b011, 3)) == nullptr);
+
+    // a coarser range replaces all those that start within it
+    cache.insert(RangeOwnerCache::Owner{ make_range(0b0100, 4), one, 1 });
+    cache.insert(RangeOwnerCache::Owner{ make_range(0b0111, 4), two, 1 });
+    cache.insert(RangeOwnerCache::Owner{ make_range(0b1000, 4), two, 1 });
+    assert(cache.size() == 3);
+    cache.insert(RangeOwnerCache::Owner{ make_range(0b01, 2), one, 2 });
+    assert(cache.size() == 2);
+    assert(cache.find(make_id(0b0111, 4))->range == make_range(0b01, 2));
+    assert(cache.find(make_id(0b1000, 4))->range == make_range(0b1000, 4));
+
+    // only the exact range is erased
+    cache.erase(make_range(0b010, 3));
+    assert(cache.size() == 2);
+    cache.erase(make_range(0b01, 2));
+    assert(cache.size() == 1);
+    assert(cache.find(make_id(0b01, 2)) == nullptr);
+}
+
+static void test_versions(std::shared_ptr<protocol::ServerProxy> one, std::shared_ptr<protocol::ServerProxy> two)
+{
+    RangeOwnerCache cache;
+    cache.insert(RangeOwnerCache::Owner{ make_range(0b0, 1), one, 5 });
+
+    // an older answer of the same server does not replace a newer one
+    cache.insert(RangeOwnerCache::Owner{ make_range(0b00, 2), one, 4 });
+    assert(cache.size() == 1);
+    const RangeOwnerCache::Owner *owner = cache.find(make_id(0b00, 2));
+    assert(owner->range == make_range(0b0, 1) && owner->version == 5);
+
+    // but a newer one does
+    cache.insert(RangeOwnerCache::Owner{ make_range(0b00, 2), one, 6 });
+    owner = cache.find(make_id(0b00, 2));
+    assert(owner->range == make_range(0b00, 2) && owner->version == 6);
+    assert(cache.find(make_id(0b01, 2)) == nullptr);
+
+    // versions of different servers are not comparable, so the last
+    // answer wins
+    cache.insert(RangeOwnerCache::Owner{ make_range(0b00, 2), two, 1 });
+    owner = cache.find(make_id(0b00, 2));
+    assert(owner->proxy == two && owner->version == 1);
+}
+
+static void test_capacity(std::shared_ptr<protocol::ServerProxy> one)
+{
+    RangeOwnerCache cache(3);
+    cache.insert(RangeOwnerCache::Owner{ make_range(0b00, 2), one, 1 });
+    cache.insert(RangeOwnerCache::Owner{ make_range(0b01, 2), one, 1 });
+    cache.insert(RangeOwnerCache::Owner{ make_range(0b10, 2), one, 1 });
+
+    // the least recently used entry goes first
+    assert(cache.find(make_id(0b00, 2)) != nullptr);
+    cache.insert(RangeOwnerCache::Owner{ make_range(0b11, 2), one, 1 });
+    assert(cache.size() == 3);
+    assert(cache.find(make_id(0b01, 2)) == nullptr);
+    assert(cache.find(make_id(0b00, 2)) != nullptr);
+    assert(cache.find(make_id(0b10, 2)) != nullptr);
+    assert(cache.find(make_id(0b11, 2)) != nullptr);
+
+    // replacing overlapping entries does not evict anything else
+    cache.insert(RangeOwnerCache::Owner{ make_range(0b110, 3), one, 2 });
+    assert(cache.size() == 3);
+    assert(cache.find(make_id(0b00, 2)) != nullptr);
+    assert(cache.find(make_id(0b10, 2)) != nullptr);
+}
+
+int main()
+{
+    set_log_function(ignore_log);
+
+    uv::Loop loop;
+    {
+        // the proxies are never used to send anything, only to tell the
+        // servers apart
+        rpc::Context ctx(loop);
+        auto one = ctx.get_peer(net::Address("127.0.0.1:9001"))->get_proxy<protocol::ServerProxy>(protocol::MASTER_OBJECT_ID);
+        auto two = ctx.get_peer(net::Address("127.0.0.1:9002"))->get_proxy<protocol::ServerProxy>(protocol::MASTER_OBJECT_ID);
+        assert(!(one->get_address() == two->get_address()));
+
+        test_overlap(one, two);
+        test_versions(one, two);
+        test_capacity(one);
+    }
+    loop.run();
+}
@@ -0,0 +1,200 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "../lib/libhdht-private.hpp"
+#include "../lib/rcu.hpp"
+
+#include <atomic>
+#include <cstdarg>
+#include <random>
+#include <thread>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+using namespace libhdht;
+
+static const int N_READERS = 4;
+static const uint8_t RESOLUTION = 32;
+
+static void ignore_log(int, const char*, va_list)
+{
+}
+
+// A value that is overwritten when it is freed, so a reader that could
+// still see it notices
+struct Payload {
+    static const size_t N_VALUES = 16;
+    uint64_t values[N_VALUES];
+
+    Payload(uint64_t value)
+    {
+        for (size_t i = 0; i < N_VALUES; i++)
+            values[i] = value;
+    }
+    ~Payload()
+    {
+        for (size_t i = 0; i < N_VALUES; i++)
+            values[i] = 0;
+    }
+};
+
+static void test_pointer()
+{
+    static const uint64_t N_PUBLISHES = 100000;
+
+    rcu::Pointer<Payload> pointer(std::make_unique<Payload>(1));
+    std::atomic<bool> done(false);
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < N_READERS; i++) {
+        readers.emplace_back([&]() {
+            uint64_t last = 0;
+            while (!done.load()) {
+                rcu::ReadSection section;
+                const Payload *payload = pointer.get();
+                uint64_t value = payload->values[0];
+                // values only go up, and are never freed under us
+                assert(value >= last);
+                for (size_t j = 1; j < Payload::N_VALUES; j++)
+                    assert(payload->values[j] == value);
+                last = value;
+            }
+        });
+    }
+
+    for (uint64_t i = 2; i <= N_PUBLISHES; i++)
+        pointer.publish(std::make_unique<Payload>(i));
+    done = true;
+    for (auto& reader : readers)
+        reader.join();
+
+    rcu::ReadSection section;
+    assert(pointer.get()->values[0] == N_PUBLISHES);
+}
+
+static NodeID random_id(std::mt19937_64& rng)
+{
+    return NodeID(rng() & 0xFFFFFFFF, RESOLUTION);
+}
+
+// a range to take over: the range of a random ID, or one that contains it
+// (the table only merges ranges that start where an existing one starts)
+static NodeIDRange random_range(const Table& table, std::mt19937_64& rng)
+{
+    NodeIDRange range = table.find_controlling_server(random_id(rng))->get_range();
+    int levels = std::uniform_int_distribution<int>(0, 3)(rng);
+    while (levels-- > 0 && range.mask() > 0) {
+        NodeID from = range.from();
+        from.set_bit_at(range.mask() - 1, 0);
+        range = NodeIDRange(from, range.mask() - 1);
+    }
+    return range;
+}
+
+// the ranges of <snapshot> cover the whole space, in order
+static void check_snapshot(const RangeSnapshot& snapshot)
+{
+    assert(snapshot.size() > 0);
+    assert(snapshot.at(0).range.from().is_all_zeros());
+
+    // the sizes of the ranges, in units of 2^-16 of the space (load balancing
+    // splits local ranges down to a mask of 16)
+    uint64_t covered = 0;
+    for (size_t i = 0; i < snapshot.size(); i++) {
+        const NodeIDRange& range = snapshot.at(i).range;
+        assert(range.mask() <= 16);
+        if (i > 0) {
+            assert(snapshot.at(i-1).range.from() < range.from());
+            assert(!snapshot.at(i-1).range.contains(range.from()));
+        }
+        covered += uint64_t(1) << (16 - range.mask());
+    }
+    assert(covered == uint64_t(1) << 16);
+}
+
+static void test_table()
+{
+    static const int N_CHANGES = 20000;
+
+    Table table(RESOLUTION);
+    std::atomic<bool> done(false);
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < N_READERS; i++) {
+        readers.emplace_back([&, i]() {
+            std::mt19937_64 rng(i);
+            uint64_t last_version = 0;
+            size_t n_checks = 0;
+            while (!done.load()) {
+                rcu::ReadSection section;
+                const RangeSnapshot *snapshot = table.ranges_snapshot();
+                assert(snapshot->version() >= last_version);
+                last_version = snapshot->version();
+
+                if (n_checks++ % 64 == 0)
+                    check_snapshot(*snapshot);
+                for (int j = 0; j < 16; j++) {
+                    NodeID id = random_id(rng);
+                    assert(snapshot->find(id).range.contains(id));
+                }
+            }
+        });
+    }
+
+    std::mt19937_64 rng(42);
+    uint64_t last_version = table.ranges_version();
+    for (int i = 0; i < N_CHANGES; i++) {
+        if (i % 4 == 3) {
+            // hand half of every big local range to a peer
+            table.load_balance_with_peer(nullptr, [](Table::LoadBalanceAction action, ServerNode* node) {
+                if (action == Table::LoadBalanceAction::RelinquishRange)
+                    delete node;
+            });
+        } else {
+            table.add_local_server_node(random_range(table, rng));
+        }
+        assert(table.ranges_version() >= last_version);
+        last_version = table.ranges_version();
+    }
+    done = true;
+    for (auto& reader : readers)
+        reader.join();
+
+    rcu::ReadSection section;
+    const RangeSnapshot *snapshot = table.ranges_snapshot();
+    assert(snapshot->version() == table.ranges_version());
+    check_snapshot(*snapshot);
+    for (size_t i = 0; i < snapshot->size(); i++) {
+        const RangeSnapshot::Entry& entry = snapshot->at(i);
+        ServerNode *server = table.find_controlling_server(entry.range.from());
+        assert(server->get_range() == entry.range);
+        assert(server->is_local() == entry.is_local);
+    }
+}
+
+int main()
+{
+    set_log_function(ignore_log);
+
+    test_pointer();
+    test_table();
+}
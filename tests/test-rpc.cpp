@@ -0,0 +1,206 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "../lib/libhdht-private.hpp"
+
+#include <cstdarg>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+using namespace libhdht;
+using namespace libhdht::protocol;
+
+static const char *SERVER_ADDRESS = "127.0.0.1:19871";
+// the largest string, which takes more than a frame with its length
+static const size_t LARGE_SIZE = 65535;
+static const size_t N_PARTS = 3;
+static const size_t N_PART_IDS = 10000;
+static const size_t N_FINAL_IDS = 5;
+static const size_t N_SINGLE_FRAME_MESSAGES = 2000;
+// larger than what the connection copies out of its read buffers, so a
+// message that spans two of them is read from the middle of the first
+static const size_t MAX_VALUE_SIZE = 3001;
+
+static void ignore_log(int, const char*, va_list)
+{
+}
+
+static std::string make_value(size_t size, size_t seed)
+{
+    std::string value(size, '\0');
+    for (size_t i = 0; i < size; i++)
+        value[i] = char('a' + (i * 7 + seed) % 26);
+    return value;
+}
+
+static NodeID make_id(size_t i)
+{
+    return NodeID(i, 32);
+}
+
+// a server that fails every request, so that the test only implements
+// the ones it uses
+class UnimplementedServer : public ServerStub
+{
+public:
+    UnimplementedServer(std::shared_ptr<rpc::Peer> peer, uint64_t object_id) : ServerStub(peer, object_id) {}
+
+#define begin_class(name)
+#define end_class
+#define request(return_type, opcode, ...) \
+    virtual void handle_##opcode(uint64_t, __VA_ARGS__) override { throw rpc::RemoteError(ENOSYS); }
+#include "../lib/protocol.inc.hpp"
+#undef request
+#undef end_class
+#undef begin_class
+};
+
+// stores metadata as sent, and streams search results in parts
+class TestServer : public UnimplementedServer
+{
+private:
+    std::unordered_map<std::string, std::string> m_values;
+
+public:
+    TestServer(std::shared_ptr<rpc::Peer> peer, uint64_t object_id) : UnimplementedServer(peer, object_id) {}
+
+    virtual void handle_set_metadata(uint64_t request_id, std::string key, std::string value) override
+    {
+        m_values[key] = value;
+        reply_set_metadata(request_id);
+    }
+
+    virtual void handle_get_metadata(uint64_t request_id, NodeID, std::string key) override
+    {
+        auto it = m_values.find(key);
+        if (it == m_values.end())
+            throw rpc::RemoteError(ENOENT);
+        reply_get_metadata(request_id, it->second);
+    }
+
+    virtual void handle_search_clients(uint64_t request_id, GeoPoint2D, GeoPoint2D) override
+    {
+        // each part is larger than a frame, so parts have more frames too
+        size_t next = 0;
+        for (size_t part = 0; part < N_PARTS; part++) {
+            std::vector<NodeID> ids;
+            for (size_t i = 0; i < N_PART_IDS; i++)
+                ids.push_back(make_id(next++));
+            reply_part_search_clients(request_id, ids);
+        }
+        std::vector<NodeID> ids;
+        for (size_t i = 0; i < N_FINAL_IDS; i++)
+            ids.push_back(make_id(next++));
+        reply_search_clients(request_id, ids);
+    }
+};
+
+struct Test
+{
+    uv::Loop& loop;
+    std::shared_ptr<ServerProxy> proxy;
+    size_t n_single_frame_replies = 0;
+    bool done = false;
+
+    // a request of three frames, and a reply of two
+    void test_large_messages()
+    {
+        std::string key = make_value(LARGE_SIZE, 1);
+        proxy->invoke_set_metadata([this, key](rpc::Error *error) {
+            assert(error == nullptr);
+            proxy->invoke_get_metadata([this](rpc::Error *error, std::string value) {
+                assert(error == nullptr);
+                assert(value == make_value(LARGE_SIZE, 0));
+                test_streamed_reply();
+            }, make_id(1), key);
+        }, key, make_value(LARGE_SIZE, 0));
+    }
+
+    // parts of many frames, followed by the final reply
+    void test_streamed_reply()
+    {
+        proxy->invoke_search_clients([this](rpc::Error *error, std::vector<NodeID> ids) {
+            assert(error == nullptr);
+            assert(ids.size() == N_PARTS * N_PART_IDS + N_FINAL_IDS);
+            for (size_t i = 0; i < ids.size(); i++)
+                assert(ids[i] == make_id(i));
+            test_single_frame_messages();
+        }, GeoPoint2D{ 0, 0 }, GeoPoint2D{ 1, 1 });
+    }
+
+    // many messages of odd sizes, read together, so that headers and
+    // payloads are split across the read buffers
+    void test_single_frame_messages()
+    {
+        for (size_t i = 0; i < N_SINGLE_FRAME_MESSAGES; i++) {
+            std::string key = "single" + std::to_string(i);
+            proxy->invoke_set_metadata([](rpc::Error *error) {
+                assert(error == nullptr);
+            }, key, make_value(i * 131 % MAX_VALUE_SIZE, i));
+        }
+        for (size_t i = 0; i < N_SINGLE_FRAME_MESSAGES; i++) {
+            std::string key = "single" + std::to_string(i);
+            proxy->invoke_get_metadata([this, i](rpc::Error *error, std::string value) {
+                assert(error == nullptr);
+                assert(value == make_value(i * 131 % MAX_VALUE_SIZE, i));
+                // replies come in order
+                assert(n_single_frame_replies == i);
+                if (++n_single_frame_replies == N_SINGLE_FRAME_MESSAGES)
+                    test_error();
+            }, make_id(i), key);
+        }
+    }
+
+    void test_error()
+    {
+        proxy->invoke_get_metadata([this](rpc::Error *error, std::string) {
+            auto remote_error = dynamic_cast<rpc::RemoteError*>(error);
+            assert(remote_error != nullptr && remote_error->code() == ENOENT);
+            done = true;
+            loop.stop();
+        }, make_id(0), std::string("missing"));
+    }
+};
+
+int main()
+{
+    set_log_function(ignore_log);
+
+    // the contexts cannot be destroyed while they are listening, so they
+    // are left for the exit to clean up
+    uv::Loop *loop = new uv::Loop;
+    rpc::Context *server = new rpc::Context(*loop);
+    server->add_stub_factory([](std::shared_ptr<rpc::Peer> peer) {
+        peer->create_named_stub<TestServer>(MASTER_OBJECT_ID);
+    });
+    net::Address address(SERVER_ADDRESS);
+    server->add_address(address);
+
+    rpc::Context *client = new rpc::Context(*loop);
+    auto peer = client->get_peer(address);
+    Test test{ *loop, peer->get_proxy<ServerProxy>(MASTER_OBJECT_ID) };
+    test.test_large_messages();
+    loop->run();
+    assert(test.done);
+}
@@ -22,6 +22,13 @@
 
 #undef NDEBUG
 #include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <thread>
 using namespace libhdht::rtree;
 
 static void test_search() {
@@ -33,10 +40,10 @@ static void test_search() {
     rtree.insert(std::make_pair<uint64_t, uint64_t>(3, 3), &data);
     Rectangle rectangle(std::make_pair<uint64_t, uint64_t>(2, 2),
                         std::make_pair<uint64_t, uint64_t>(0, 0));
-    std::vector<std::shared_ptr<LeafEntry>> results = rtree.search(rectangle);
+    std::vector<LeafEntry> results = rtree.search(rectangle);
     assert(results.size() == 3);
     for (const auto& result : results) {
-        assert(*static_cast<float*>(result->get_data()) == data);
+        assert(*static_cast<float*>(result.get_data()) == data);
     }
 }
 
@@ -50,11 +57,345 @@ static void test_overflow() {
     }
     Rectangle rectangle(std::make_pair<uint64_t, uint64_t>(3, 3),
                         std::make_pair<uint64_t, uint64_t>(0, 0));
-    std::vector<std::shared_ptr<LeafEntry>> results = rtree.search(rectangle);
+    std::vector<LeafEntry> results = rtree.search(rectangle);
     assert(results.size() == 9);
 }
 
+static std::vector<const void*> pointers_to(const std::vector<int>& ids) {
+    std::vector<const void*> pointers;
+    for (const int& id : ids)
+        pointers.push_back(&id);
+    return pointers;
+}
+
+// Checks that <rtree> contains exactly <points>, whose data is <data>,
+// except the ones with null data
+static void check_contents(const RTree& rtree, const std::vector<Point>& points, const std::vector<const void*>& data) {
+    size_t n_points = points.size() - std::count(data.begin(), data.end(), nullptr);
+    assert(rtree.size() == n_points);
+
+    size_t count = 0;
+    rtree.foreach_entry([&count](const LeafEntry&) { count++; });
+    assert(count == n_points);
+
+    for (int i = 0; i < 100; i++) {
+        uint64_t x1 = rand() % 1024, x2 = rand() % 1024;
+        uint64_t y1 = rand() % 1024, y2 = rand() % 1024;
+        Rectangle rectangle(std::make_pair(std::max(x1, x2), std::max(y1, y2)),
+                            std::make_pair(std::min(x1, x2), std::min(y1, y2)));
+
+        std::multiset<const void*> expected;
+        for (size_t j = 0; j < points.size(); j++) {
+            if (data[j] != nullptr && rectangle.contains(points[j]))
+                expected.insert(data[j]);
+        }
+        std::multiset<const void*> found;
+        for (const auto& result : rtree.search(rectangle))
+            found.insert(result.get_data());
+        assert(found == expected);
+
+        std::multiset<const void*> visited;
+        rtree.search(rectangle, [&visited](const LeafEntry& entry) {
+            visited.insert(entry.get_data());
+        });
+        assert(visited == expected);
+    }
+}
+
+static void test_many(uint32_t capacity) {
+    const int n_points = 5000;
+    RTree rtree(1024 /* max_dimension */, capacity);
+    std::vector<Point> points;
+    std::vector<int> ids(n_points);
+    srand(42);
+    for (int i = 0; i < n_points; i++) {
+        Point pt(rand() % 1024, rand() % 1024);
+        points.push_back(pt);
+        rtree.insert(pt, &ids[i]);
+    }
+    check_contents(rtree, points, pointers_to(ids));
+}
+
+static void test_bulk_load(uint32_t capacity) {
+    const int n_points = 5000;
+    RTree rtree(1024 /* max_dimension */, capacity);
+    std::vector<Point> points;
+    std::vector<int> ids(2 * n_points);
+    std::vector<LeafEntry> entries;
+    srand(43);
+    for (int i = 0; i < n_points; i++) {
+        Point pt(rand() % 1024, rand() % 1024);
+        points.push_back(pt);
+        entries.push_back(rtree.make_entry(pt, &ids[i]));
+    }
+
+    std::vector<void*> data;
+    for (int i = 0; i < n_points; i++)
+        data.push_back(&ids[i]);
+    std::vector<LeafEntry> batch = rtree.make_entries(points, data);
+    for (int i = 0; i < n_points; i++) {
+        assert(batch[i].get_lhv() == entries[i].get_lhv());
+        assert(batch[i].get_point() == entries[i].get_point());
+        assert(batch[i].get_data() == entries[i].get_data());
+    }
+
+    rtree.bulk_load(entries.begin(), entries.end());
+    check_contents(rtree, points, pointers_to(ids));
+
+    // a packed tree is no larger than one built by insertion
+    RTree inserted(1024 /* max_dimension */, capacity);
+    for (const auto& entry : entries)
+        inserted.insert(entry.get_point(), entry.get_data());
+    assert(rtree.memory_usage() <= inserted.memory_usage());
+
+    // the packed tree stays valid as it grows
+    for (int i = n_points; i < 2 * n_points; i++) {
+        Point pt(rand() % 1024, rand() % 1024);
+        points.push_back(pt);
+        rtree.insert(pt, &ids[i]);
+    }
+    check_contents(rtree, points, pointers_to(ids));
+
+    // and it can be rebuilt from its own entries
+    RTree copy(1024 /* max_dimension */, capacity);
+    copy.bulk_load(rtree.search(Rectangle(std::make_pair(1023, 1023), std::make_pair(0, 0))));
+    check_contents(copy, points, pointers_to(ids));
+
+    rtree.bulk_load(std::vector<LeafEntry>());
+    assert(rtree.size() == 0);
+    assert(rtree.search(Rectangle(std::make_pair(1023, 1023), std::make_pair(0, 0))).empty());
+}
+
+static void test_erase(uint32_t capacity) {
+    const int n_points = 5000;
+    RTree rtree(1024 /* max_dimension */, capacity);
+    std::vector<Point> points;
+    std::vector<int> ids(n_points);
+    srand(44);
+    for (int i = 0; i < n_points; i++) {
+        // a small grid, so that many entries share the same point
+        Point pt(rand() % 64, rand() % 64);
+        points.push_back(pt);
+        rtree.insert(pt, &ids[i]);
+    }
+    std::vector<const void*> data = pointers_to(ids);
+
+    // entries are matched on both point and data
+    assert(!rtree.erase(points[0], &ids[1]) || points[0] == points[1]);
+    assert(!rtree.erase(Point(100, 100), &ids[0]));
+    assert(rtree.size() == n_points);
+
+    std::vector<int> order(n_points);
+    for (int i = 0; i < n_points; i++)
+        order[i] = i;
+    std::random_shuffle(order.begin(), order.end());
+
+    for (int i = 0; i < n_points / 2; i++) {
+        int j = order[i];
+        assert(rtree.erase(points[j], data[j]));
+        assert(!rtree.erase(points[j], data[j]));
+        data[j] = nullptr;
+    }
+    check_contents(rtree, points, data);
+
+    // the tree stays valid as it grows again
+    for (int i = 0; i < n_points / 2; i++) {
+        int j = order[i];
+        rtree.insert(points[j], &ids[j]);
+        data[j] = &ids[j];
+    }
+    check_contents(rtree, points, data);
+
+    // removing everything returns the nodes to the arena, and they are
+    // reused when the tree is filled again
+    for (int i = 0; i < n_points; i++)
+        assert(rtree.erase(points[i], data[i]));
+    assert(rtree.size() == 0);
+    size_t memory_usage = rtree.memory_usage();
+    for (int i = 0; i < n_points; i++)
+        rtree.insert(points[i], &ids[i]);
+    assert(rtree.memory_usage() == memory_usage);
+    check_contents(rtree, points, data);
+}
+
+static void test_update(uint32_t capacity) {
+    const int n_points = 5000;
+    RTree rtree(1024 /* max_dimension */, capacity);
+    std::vector<Point> points;
+    std::vector<int> ids(n_points);
+    srand(45);
+    for (int i = 0; i < n_points; i++) {
+        Point pt(rand() % 1024, rand() % 1024);
+        points.push_back(pt);
+        rtree.insert(pt, &ids[i]);
+    }
+
+    assert(!rtree.update(Point(points[0].first ^ 1, points[0].second), points[0], &ids[0]));
+
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < n_points; i++) {
+            // mostly small movements, sometimes a jump across the map
+            Point& pt = points[i];
+            Point new_pt;
+            if (rand() % 10 == 0) {
+                new_pt = Point(rand() % 1024, rand() % 1024);
+            } else {
+                new_pt.first = std::min<uint64_t>(1023, std::max<int64_t>(0, int64_t(pt.first) + rand() % 5 - 2));
+                new_pt.second = std::min<uint64_t>(1023, std::max<int64_t>(0, int64_t(pt.second) + rand() % 5 - 2));
+            }
+            assert(rtree.update(pt, new_pt, &ids[i]));
+            pt = new_pt;
+        }
+        check_contents(rtree, points, pointers_to(ids));
+    }
+}
+
+static double distance(const Point& one, const Point& two) {
+    double dx = double(one.first) - double(two.first);
+    double dy = double(one.second) - double(two.second);
+    return std::sqrt(dx * dx + dy * dy);
+}
+
+static void test_nearest(uint32_t capacity) {
+    const int n_points = 5000;
+    RTree rtree(1024 /* max_dimension */, capacity);
+    std::vector<Point> points;
+    std::vector<int> ids(n_points);
+    srand(42);
+    for (int i = 0; i < n_points; i++) {
+        Point pt(rand() % 1024, rand() % 1024);
+        points.push_back(pt);
+        rtree.insert(pt, &ids[i]);
+    }
+
+    for (int i = 0; i < 50; i++) {
+        Point query(rand() % 1024, rand() % 1024);
+        size_t k = 1 + rand() % 100;
+
+        std::vector<double> expected;
+        for (const auto& pt : points)
+            expected.push_back(distance(query, pt));
+        std::sort(expected.begin(), expected.end());
+        expected.resize(k);
+
+        // ties can be broken either way, so only the distances are compared
+        std::vector<LeafEntry> results = rtree.nearest(query, k);
+        assert(results.size() == k);
+        for (size_t j = 0; j < k; j++)
+            assert(distance(query, results[j].get_point()) == expected[j]);
+    }
+
+    assert(rtree.nearest(Point(0, 0), 0).empty());
+    assert(rtree.nearest(Point(0, 0), 2 * n_points).size() == n_points);
+    assert(RTree(1024).nearest(Point(0, 0), 1).empty());
+}
+
+// Searches from other threads while the tree changes find the points that
+// never move exactly once, in Hilbert order
+static void test_concurrent(uint32_t capacity) {
+    const int n_static = 2000;
+    const int n_mobile = 2000;
+    const int n_readers = 3;
+    RTree rtree(1024 /* max_dimension */, capacity);
+    std::vector<Point> points;
+    std::vector<int> ids(n_static + n_mobile);
+    std::mt19937 rng(46);
+    for (int i = 0; i < n_static + n_mobile; i++) {
+        Point pt(rng() % 1024, rng() % 1024);
+        points.push_back(pt);
+        // half of the points are there before the concurrent mode starts
+        if (i == (n_static + n_mobile) / 2)
+            rtree.enable_concurrent_reads();
+        rtree.insert(pt, &ids[i]);
+    }
+    assert(rtree.has_concurrent_reads());
+    check_contents(rtree, points, pointers_to(ids));
+
+    std::atomic<bool> done(false);
+    std::vector<std::thread> readers;
+    for (int r = 0; r < n_readers; r++) {
+        readers.emplace_back([&, r]() {
+            std::mt19937 rng(r);
+            while (!done.load()) {
+                uint64_t x1 = rng() % 1024, x2 = rng() % 1024;
+                uint64_t y1 = rng() % 1024, y2 = rng() % 1024;
+                Rectangle rectangle(std::make_pair(std::max(x1, x2), std::max(y1, y2)),
+                                    std::make_pair(std::min(x1, x2), std::min(y1, y2)));
+
+                std::multiset<const void*> expected;
+                for (int i = 0; i < n_static; i++) {
+                    if (rectangle.contains(points[i]))
+                        expected.insert(&ids[i]);
+                }
+                std::multiset<const void*> found;
+                HilbertValue last = 0;
+                rtree.search_concurrent(rectangle, [&](const LeafEntry& entry) {
+                    assert(rectangle.contains(entry.get_point()));
+                    assert(entry.get_lhv() >= last);
+                    last = entry.get_lhv();
+                    if (entry.get_data() < &ids[n_static])
+                        found.insert(entry.get_data());
+                });
+                assert(found == expected);
+            }
+        });
+    }
+
+    for (int round = 0; round < 20; round++) {
+        for (int i = n_static; i < n_static + n_mobile; i++) {
+            Point& pt = points[i];
+            Point new_pt;
+            if (rng() % 10 == 0) {
+                // take the point out and put it back elsewhere
+                assert(rtree.erase(pt, &ids[i]));
+                new_pt = Point(rng() % 1024, rng() % 1024);
+                rtree.insert(new_pt, &ids[i]);
+            } else {
+                new_pt.first = std::min<uint64_t>(1023, std::max<int64_t>(0, int64_t(pt.first) + rng() % 5 - 2));
+                new_pt.second = std::min<uint64_t>(1023, std::max<int64_t>(0, int64_t(pt.second) + rng() % 5 - 2));
+                assert(rtree.update(pt, new_pt, &ids[i]));
+            }
+            pt = new_pt;
+        }
+        if (round % 5 == 4) {
+            std::vector<LeafEntry> entries;
+            rtree.foreach_entry([&entries](const LeafEntry& entry) {
+                entries.push_back(entry);
+            });
+            rtree.bulk_load(entries);
+        }
+    }
+    done = true;
+    for (auto& reader : readers)
+        reader.join();
+
+    check_contents(rtree, points, pointers_to(ids));
+}
+
 int main() {
     test_search();
     test_overflow();
+    test_many(2);
+    test_many(5);
+    test_many(kDefaultCapacity);
+    test_many(64);
+    test_bulk_load(2);
+    test_bulk_load(5);
+    test_bulk_load(kDefaultCapacity);
+    test_bulk_load(64);
+    test_erase(2);
+    test_erase(5);
+    test_erase(kDefaultCapacity);
+    test_erase(64);
+    test_update(2);
+    test_update(5);
+    test_update(kDefaultCapacity);
+    test_update(64);
+    test_nearest(2);
+    test_nearest(5);
+    test_nearest(kDefaultCapacity);
+    test_nearest(64);
+    test_concurrent(2);
+    test_concurrent(5);
+    test_concurrent(kDefaultCapacity);
 }
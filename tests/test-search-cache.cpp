@@ -0,0 +1,251 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "../lib/libhdht-private.hpp"
+
+#include <cstdarg>
+#include <random>
+#include <set>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+using namespace libhdht;
+
+static const uint8_t RESOLUTION = 32;
+
+static void ignore_log(int, const char*, va_list)
+{
+}
+
+static std::vector<SearchCache::Client> make_clients(size_t n)
+{
+    std::vector<SearchCache::Client> clients;
+    for (size_t i = 0; i < n; i++)
+        clients.push_back(SearchCache::Client{ ClientHandle{ uint32_t(i), 1 }, uint32_t(i), uint32_t(i) });
+    return clients;
+}
+
+static void test_split_interval()
+{
+    std::mt19937_64 rng(42);
+    for (int i = 0; i < 1000; i++) {
+        uint64_t first = rng() & 0xFFFFFFFF;
+        uint64_t last = std::min<uint64_t>(0xFFFFFFFF, first + (rng() & 0xFFFFF));
+
+        std::vector<SearchCache::Block> blocks;
+        SearchCache::split_interval(first, last, RESOLUTION, blocks);
+        // the blocks are aligned squares of the grid, which cover the
+        // interval in order
+        uint64_t next = first;
+        for (const auto& block : blocks) {
+            assert(block.first == next);
+            uint64_t size = block.second - block.first + 1;
+            assert((size & (size - 1)) == 0);
+            assert(__builtin_ctzll(size) % 2 == 0);
+            assert((block.first & (size - 1)) == 0);
+            next = block.second + 1;
+        }
+        assert(next == last + 1);
+    }
+}
+
+static void test_budget()
+{
+    static const size_t N_CLIENTS = 100;
+
+    // the cost of an entry, as the cache counts it
+    size_t cost;
+    {
+        SearchCache cache;
+        cache.insert(std::make_pair(0, 3), make_clients(N_CLIENTS));
+        cost = cache.memory();
+    }
+
+    SearchCache::Block a(0, 3), b(4, 7), c(8, 11), d(12, 15);
+    SearchCache cache(3 * cost + cost / 2);
+    assert(cache.insert(a, make_clients(N_CLIENTS)) != nullptr);
+    assert(cache.insert(b, make_clients(N_CLIENTS)) != nullptr);
+    assert(cache.insert(c, make_clients(N_CLIENTS)) != nullptr);
+    assert(cache.size() == 3);
+    assert(cache.memory() == 3 * cost);
+
+    // a was used last, so b is the least recently used, and goes first
+    assert(cache.find(a) != nullptr);
+    assert(cache.insert(d, make_clients(N_CLIENTS)) != nullptr);
+    assert(cache.size() == 3);
+    assert(cache.memory() == 3 * cost);
+    assert(cache.find(b) == nullptr);
+    assert(cache.find(c) != nullptr);
+    assert(cache.find(a) != nullptr);
+    assert(cache.find(d) != nullptr);
+
+    // inserting a cached block keeps the entry that is there
+    const std::vector<SearchCache::Client> *existing = cache.find(a);
+    assert(cache.insert(a, make_clients(1)) == existing);
+    assert(existing->size() == N_CLIENTS);
+
+    // a block larger than the whole budget is not cached, and the others stay
+    assert(!cache.fits(4 * N_CLIENTS));
+    std::vector<SearchCache::Client> large = make_clients(4 * N_CLIENTS);
+    assert(cache.insert(b, std::move(large)) == nullptr);
+    assert(large.size() == 4 * N_CLIENTS);
+    assert(cache.size() == 3);
+
+    // shrinking the budget evicts the least recently used entries
+    cache.set_budget(cost);
+    assert(cache.size() == 1);
+    assert(cache.memory() == cost);
+    assert(cache.find(a) != nullptr);
+
+    cache.clear();
+    assert(cache.size() == 0);
+    assert(cache.memory() == 0);
+    assert(cache.find(a) == nullptr);
+}
+
+static void test_invalidate()
+{
+    static const uint64_t VALUE = 0x12345678;
+
+    SearchCache cache;
+    // every block that contains VALUE, and its next sibling, which does not
+    std::vector<SearchCache::Block> containing, others;
+    for (unsigned bits = 0; bits <= RESOLUTION; bits += 2) {
+        uint64_t mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+        SearchCache::Block block(VALUE & ~mask, VALUE | mask);
+        containing.push_back(block);
+        cache.insert(block, make_clients(1));
+        if (bits < RESOLUTION) {
+            uint64_t sibling = (VALUE & ~mask) ^ (1ULL << bits);
+            others.push_back(std::make_pair(sibling, sibling | mask));
+            cache.insert(others.back(), make_clients(1));
+        }
+    }
+    assert(cache.size() == containing.size() + others.size());
+
+    cache.invalidate(VALUE, RESOLUTION);
+    for (const auto& block : containing)
+        assert(cache.find(block) == nullptr);
+    for (const auto& block : others)
+        assert(cache.find(block) != nullptr);
+    assert(cache.size() == others.size());
+}
+
+static GeoPoint2D random_point(std::mt19937_64& rng)
+{
+    // a small area, so that the searches cover many of the clients
+    std::uniform_real_distribution<double> latitude(37.0, 38.0), longitude(-123.0, -122.0);
+    return GeoPoint2D{ latitude(rng), longitude(rng) };
+}
+
+// the clients of <table> in <rectangle>, as found by a search
+static std::set<NodeID> search(const Table& table, const rtree::Rectangle& rectangle)
+{
+    std::set<NodeID> found;
+    bool complete = false;
+    table.search_clients(rectangle, 0, (uint64_t)-1, [&](rpc::Error *error, const std::vector<NodeID> *ids, bool last) {
+        assert(error == nullptr);
+        found.insert(ids->begin(), ids->end());
+        complete = last;
+    });
+    assert(complete);
+    return found;
+}
+
+// the clients of <clients> in <rectangle>, going through all of them
+static std::set<NodeID> expected(const std::vector<ClientNode*>& clients, const rtree::Rectangle& rectangle)
+{
+    std::set<NodeID> found;
+    for (ClientNode *client : clients) {
+        if (client != nullptr && rectangle.contains(client->get_id().to_point(RESOLUTION)))
+            found.insert(client->get_id());
+    }
+    return found;
+}
+
+// the results of searches follow the clients as they are added, moved and
+// removed, whether the blocks come from the cache or not
+static void test_table()
+{
+    static const size_t N_CLIENTS = 2000;
+    static const int N_ROUNDS = 20;
+
+    std::mt19937_64 rng(42);
+    Table table(RESOLUTION);
+    table.add_local_server_node(NodeIDRange());
+
+    // a client in a cell that already has one is the same client, which is
+    // only counted once
+    std::vector<ClientNode*> clients;
+    std::set<ClientNode*> live;
+    auto create_client = [&]() -> ClientNode* {
+        ClientNode *client = table.get_or_create_client_node(NodeID(), random_point(rng));
+        return live.insert(client).second ? client : nullptr;
+    };
+    for (size_t i = 0; i < N_CLIENTS; i++)
+        clients.push_back(create_client());
+
+    std::vector<rtree::Rectangle> rectangles;
+    rectangles.push_back(table.get_rectangle_for_points(GeoPoint2D{ 38.0, -122.0 }, GeoPoint2D{ 37.0, -123.0 }));
+    rectangles.push_back(table.get_rectangle_for_points(GeoPoint2D{ 37.6, -122.3 }, GeoPoint2D{ 37.2, -122.9 }));
+    rectangles.push_back(table.get_rectangle_for_points(GeoPoint2D{ 37.51, -122.49 }, GeoPoint2D{ 37.5, -122.5 }));
+
+    for (int round = 0; round < N_ROUNDS; round++) {
+        // a small budget in some rounds, which keeps only the smaller
+        // blocks, or none
+        if (round % 5 == 3)
+            table.set_search_cache_budget(round % 2 ? 4096 : 0);
+        else if (round % 5 == 4)
+            table.set_search_cache_budget(SearchCache::DEFAULT_BUDGET);
+
+        for (const auto& rectangle : rectangles) {
+            // twice, so the second one finds the blocks of the first cached
+            assert(search(table, rectangle) == expected(clients, rectangle));
+            assert(search(table, rectangle) == expected(clients, rectangle));
+        }
+
+        for (size_t i = 0; i < clients.size(); i++) {
+            ClientNode *client = clients[i];
+            int action = std::uniform_int_distribution<int>(0, 9)(rng);
+            if (client == nullptr) {
+                if (action == 0)
+                    clients[i] = create_client();
+            } else if (action == 0) {
+                live.erase(client);
+                table.forget_client(client);
+                clients[i] = nullptr;
+            } else if (action == 1) {
+                table.move_client(client, random_point(rng));
+            }
+        }
+    }
+}
+
+int main()
+{
+    set_log_function(ignore_log);
+
+    test_split_interval();
+    test_budget();
+    test_invalidate();
+    test_table();
+}
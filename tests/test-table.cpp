@@ -0,0 +1,407 @@
+/*
+  libhdht: a library for Hilbert-curve based Distributed Hash Tables
+  Copyright 2017 Keshav Santhanam <santhanam.keshav@gmail.com>
+                 Giovanni Campagna <gcampagn@cs.stanford.edu>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 3
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "../lib/libhdht-private.hpp"
+
+#include <algorithm>
+#include <cstdarg>
+#include <limits>
+#include <random>
+#include <unordered_set>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+using namespace libhdht;
+using namespace libhdht::protocol;
+
+static const uint8_t RESOLUTION = 32;
+static const char *FORWARD_ADDRESSES[3] = { "127.0.0.1:19891", "127.0.0.1:19892", "127.0.0.1:19893" };
+
+static void ignore_log(int, const char*, va_list)
+{
+}
+
+// the range of the node IDs that start with the <mask> bits of <prefix>
+static NodeIDRange make_range(uint64_t prefix, uint8_t mask)
+{
+    NodeID from;
+    for (uint8_t i = 0; i < mask; i++)
+        from.set_bit_at(i, (prefix >> (mask - 1 - i)) & 1);
+    return NodeIDRange(from, mask);
+}
+
+static GeoPoint2D random_point(std::mt19937_64& rng)
+{
+    std::uniform_real_distribution<double> latitude(-60.0, 60.0), longitude(-150.0, 150.0);
+    return GeoPoint2D{ latitude(rng), longitude(rng) };
+}
+
+// Two servers that split the table: <tables>[1] owns <remote_range>, and
+// <tables>[0] everything else, each with its share of the clients, some of
+// which are in the same cell (and have the same node ID)
+struct SplitTable
+{
+    Table tables[2] = { { RESOLUTION }, { RESOLUTION } };
+    NodeIDRange remote_range = make_range(0b01, 2);
+    std::vector<std::pair<int, ClientNode*>> clients;
+
+    // <proxy> stands for the other server, it is never called
+    SplitTable(size_t n_clients, std::mt19937_64& rng, std::shared_ptr<protocol::ServerProxy> proxy)
+    {
+        // ranges are added where the table is already split
+        tables[0].add_local_server_node(make_range(0b00, 2));
+        tables[0].add_local_server_node(make_range(0b1, 1));
+        tables[1].add_remote_server_node(make_range(0b00, 2), proxy);
+        tables[1].add_local_server_node(remote_range);
+
+        std::vector<GeoPoint2D> points;
+        while (clients.size() < n_clients) {
+            GeoPoint2D point = random_point(rng);
+            int owner = remote_range.contains(tables[0].get_node_id_for_point(point)) ? 1 : 0;
+            ClientNode *client = tables[owner].get_or_create_client_node(NodeID(), point);
+            assert(client != nullptr);
+            clients.push_back(std::make_pair(owner, client));
+            points.push_back(point);
+
+            // every tenth client also has company in its cell, which is
+            // only possible by moving there
+            if (clients.size() % 10 == 0) {
+                GeoPoint2D other_point;
+                do {
+                    other_point = random_point(rng);
+                } while ((remote_range.contains(tables[0].get_node_id_for_point(other_point)) ? 1 : 0) != owner);
+                ClientNode *other = tables[owner].get_or_create_client_node(NodeID(), other_point);
+                if (other == client)
+                    continue;
+                tables[owner].move_client(other, point);
+                assert(other->get_id() == client->get_id());
+                clients.push_back(std::make_pair(owner, other));
+            }
+        }
+    }
+
+    // the IDs of the clients in <rectangle>, sorted, going through all of them
+    std::vector<NodeID> expected(const rtree::Rectangle& rectangle) const
+    {
+        std::vector<NodeID> ids;
+        for (const auto& client : clients) {
+            const NodeID& id = client.second->get_id();
+            if (rectangle.contains(id.to_point(RESOLUTION)))
+                ids.push_back(id);
+        }
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    }
+};
+
+// page through <rectangle> as the servers would, going to the other table
+// when a page stops at a remote server
+static std::vector<NodeID> search_pages(const SplitTable& split, const rtree::Rectangle& rectangle, size_t limit)
+{
+    std::vector<NodeID> found;
+    int current = 0;
+    NodeID after = split.tables[0].search_page_start(rectangle);
+    assert(after == split.tables[1].search_page_start(rectangle));
+    for (size_t n_pages = 0; ; n_pages++) {
+        assert(n_pages <= split.clients.size() + 4);
+
+        std::vector<NodeID> page;
+        NodeID next;
+        ServerNode *server = split.tables[current].search_clients_page(rectangle, after, limit, page, next);
+
+        // in order and after the cursor, and over the limit only to finish
+        // the cell of the last client
+        for (size_t i = 0; i < page.size(); i++) {
+            assert(after < page[i]);
+            assert(i == 0 || !(page[i] < page[i-1]));
+            assert(i < limit || page[i] == page[limit - 1]);
+        }
+        found.insert(found.end(), page.begin(), page.end());
+
+        if (server == nullptr)
+            break;
+        if (server->is_local()) {
+            // the page is full
+            assert(page.size() >= limit);
+            assert(next == page.back());
+        } else {
+            // the rest of the page is on the other server
+            assert(page.size() <= limit);
+            assert(server->get_range().contains(next) || next == after);
+            current = 1 - current;
+        }
+        after = next;
+    }
+    return found;
+}
+
+static void test_pages(std::shared_ptr<protocol::ServerProxy> proxy)
+{
+    static const size_t N_CLIENTS = 3000;
+
+    std::mt19937_64 rng(42);
+    SplitTable split(N_CLIENTS, rng, proxy);
+
+    std::vector<rtree::Rectangle> rectangles;
+    rectangles.push_back(split.tables[0].get_rectangle_for_points(GeoPoint2D{ 60.0, 150.0 }, GeoPoint2D{ -60.0, -150.0 }));
+    rectangles.push_back(split.tables[0].get_rectangle_for_points(GeoPoint2D{ 45.0, 30.0 }, GeoPoint2D{ -20.0, -100.0 }));
+    rectangles.push_back(split.tables[0].get_rectangle_for_points(GeoPoint2D{ 5.0, 5.0 }, GeoPoint2D{ -5.0, -5.0 }));
+    for (const auto& rectangle : rectangles) {
+        std::vector<NodeID> expected = split.expected(rectangle);
+        for (size_t limit : { 1, 2, 7, 64, 1000, 100000 })
+            assert(search_pages(split, rectangle, limit) == expected);
+    }
+}
+
+// the distances from <pt> of the <k> nearest of <clients> that are closer
+// than <max_distance>, going through all of them
+static std::vector<double> nearest_distances(const std::vector<std::pair<int, ClientNode*>>& clients,
+                                             const GeoPoint2D& pt, size_t k, double max_distance)
+{
+    std::vector<double> distances;
+    for (const auto& client : clients) {
+        double distance = GeoPoint2D::distance(pt, client.second->get_coordinates());
+        if (distance < max_distance)
+            distances.push_back(distance);
+    }
+    std::sort(distances.begin(), distances.end());
+    if (distances.size() > k)
+        distances.resize(k);
+    return distances;
+}
+
+static std::vector<double> distances_of(const std::vector<Neighbour>& neighbours)
+{
+    std::vector<double> distances;
+    for (const auto& neighbour : neighbours)
+        distances.push_back(neighbour.distance);
+    return distances;
+}
+
+static void test_knn(std::shared_ptr<protocol::ServerProxy> proxy)
+{
+    static const size_t N_CLIENTS = 3000;
+    static const int N_QUERIES = 50;
+
+    std::mt19937_64 rng(42);
+    SplitTable split(N_CLIENTS, rng, proxy);
+
+    // within a server, against going through all of its clients
+    std::vector<std::pair<int, ClientNode*>> local_clients;
+    for (const auto& client : split.clients) {
+        if (client.first == 0)
+            local_clients.push_back(client);
+    }
+    for (int i = 0; i < N_QUERIES; i++) {
+        GeoPoint2D pt = random_point(rng);
+        for (size_t k : { 1, 5, 50 }) {
+            double max_distance = std::uniform_real_distribution<double>(1e5, 5e6)(rng);
+            std::vector<Neighbour> neighbours = split.tables[0].knn_local_clients(pt, k, max_distance, 0, (uint64_t)-1);
+            assert(distances_of(neighbours) == nearest_distances(local_clients, pt, k, max_distance));
+            for (const auto& neighbour : neighbours)
+                assert(!split.remote_range.contains(neighbour.id));
+        }
+    }
+
+    // at a client of the first server, the nearest neighbour is that
+    // client, so the range of the other server is pruned and never asked
+    for (size_t i = 0; i < local_clients.size(); i += 100) {
+        bool done = false;
+        split.tables[0].knn_clients(local_clients[i].second->get_coordinates(), 1,
+                                    [&](rpc::Error *error, const std::vector<Neighbour> *neighbours) {
+            assert(error == nullptr);
+            assert(neighbours->size() == 1);
+            assert(neighbours->front().distance == 0);
+            done = true;
+        });
+        assert(done);
+    }
+
+    // the owner of the range of the other server is not known, so a search
+    // that must go there fails rather than dereferencing a missing proxy
+    for (const auto& client : split.clients) {
+        if (client.first != 1)
+            continue;
+        bool done = false;
+        split.tables[0].knn_clients(client.second->get_coordinates(), 5, [&](rpc::Error *error, const std::vector<Neighbour> *neighbours) {
+            auto remote_error = dynamic_cast<rpc::RemoteError*>(error);
+            assert(remote_error != nullptr && remote_error->code() == ENXIO);
+            assert(neighbours == nullptr);
+            done = true;
+        });
+        assert(done);
+        break;
+    }
+}
+
+// a server that fails every request, so that the test only implements
+// the ones it uses
+class UnimplementedServer : public protocol::ServerStub
+{
+public:
+    UnimplementedServer(std::shared_ptr<rpc::Peer> peer, uint64_t object_id) : ServerStub(peer, object_id) {}
+
+#define begin_class(name)
+#define end_class
+#define request(return_type, opcode, ...) \
+    virtual void handle_##opcode(uint64_t, __VA_ARGS__) override { throw rpc::RemoteError(ENOSYS); }
+#include "../lib/protocol.inc.hpp"
+#undef request
+#undef end_class
+#undef begin_class
+};
+
+// answers forwarded nearest neighbour searches from its table, as the
+// servers do
+class KnnServer : public UnimplementedServer
+{
+private:
+    const Table& m_table;
+
+public:
+    KnnServer(std::shared_ptr<rpc::Peer> peer, uint64_t object_id, const Table& table) :
+        UnimplementedServer(peer, object_id), m_table(table) {}
+
+    virtual void handle_forward_knn_clients(uint64_t request_id, GeoPoint2D point, uint32_t k, double max_distance, std::pair<uint64_t, uint64_t> hilbert_bounds) override
+    {
+        auto self = shared_from_this();
+        m_table.knn_clients(point, k, max_distance, hilbert_bounds.first, hilbert_bounds.second,
+                            [self, request_id, this](rpc::Error *error, const std::vector<Neighbour> *reply) {
+            assert(error == nullptr);
+            reply_forward_knn_clients(request_id, *reply);
+        });
+    }
+};
+
+// Three servers over loopback: the first one still thinks that the second
+// one owns the upper half of the curve, but the second one has given the
+// last quarter to the third one since, so the searches that the first
+// one forwards must go on from the second one to the third one
+struct ForwardTest
+{
+    uv::Loop& loop;
+    Table *tables[3];
+    rpc::Context *contexts[3];
+    NodeIDRange ranges[3] = { make_range(0b0, 1), make_range(0b10, 2), make_range(0b11, 2) };
+    std::vector<std::pair<int, ClientNode*>> clients;
+    size_t n_pending = 0;
+
+    ForwardTest(uv::Loop& loop, size_t n_clients, std::mt19937_64& rng) : loop(loop)
+    {
+        for (int i = 0; i < 3; i++) {
+            tables[i] = new Table(RESOLUTION);
+            contexts[i] = new rpc::Context(loop);
+        }
+
+        // ranges are added where the tables are already split
+        tables[0]->add_local_server_node(ranges[0]);
+        tables[0]->add_remote_server_node(make_range(0b1, 1), proxy(0, 1));
+        tables[1]->add_remote_server_node(ranges[0], proxy(1, 0));
+        tables[1]->add_local_server_node(ranges[1]);
+        tables[1]->add_remote_server_node(ranges[2], proxy(1, 2));
+        tables[2]->add_remote_server_node(ranges[0], proxy(2, 0));
+        tables[2]->add_remote_server_node(ranges[1], proxy(2, 1));
+        tables[2]->add_local_server_node(ranges[2]);
+        for (int i = 1; i < 3; i++) {
+            const Table *table = tables[i];
+            contexts[i]->add_stub_factory([table](std::shared_ptr<rpc::Peer> peer) {
+                peer->create_named_stub<KnnServer>(protocol::MASTER_OBJECT_ID, *table);
+            });
+            contexts[i]->add_address(net::Address(FORWARD_ADDRESSES[i]));
+        }
+
+        std::unordered_set<ClientNode*> created;
+        while (clients.size() < n_clients) {
+            GeoPoint2D point = random_point(rng);
+            NodeID id = tables[0]->get_node_id_for_point(point);
+            int owner = 0;
+            while (!ranges[owner].contains(id))
+                owner++;
+            // a point in the cell of an earlier client finds that client
+            ClientNode *client = tables[owner]->get_or_create_client_node(NodeID(), point);
+            if (created.insert(client).second)
+                clients.push_back(std::make_pair(owner, client));
+        }
+    }
+
+    std::shared_ptr<protocol::ServerProxy> proxy(int from, int to)
+    {
+        return contexts[from]->get_peer(net::Address(FORWARD_ADDRESSES[to]))->get_proxy<protocol::ServerProxy>(protocol::MASTER_OBJECT_ID);
+    }
+
+    void query(const GeoPoint2D& pt, size_t k)
+    {
+        n_pending++;
+        tables[0]->knn_clients(pt, k, [this, pt, k](rpc::Error *error, const std::vector<Neighbour> *neighbours) {
+            assert(error == nullptr);
+            assert(distances_of(*neighbours) == nearest_distances(clients, pt, k, std::numeric_limits<double>::infinity()));
+            if (--n_pending == 0)
+                loop.stop();
+        });
+    }
+};
+
+// the contexts and the tables cannot be destroyed while they are
+// listening, so they are left for the exit to clean up
+static void test_forwarded_knn(uv::Loop& loop)
+{
+    static const size_t N_CLIENTS = 3000;
+    static const int N_QUERIES = 50;
+
+    std::mt19937_64 rng(42);
+    ForwardTest *test = new ForwardTest(loop, N_CLIENTS, rng);
+    // the queries that need no other server complete right away, and
+    // must not stop the loop before it runs
+    test->n_pending++;
+    for (int i = 0; i < N_QUERIES; i++) {
+        GeoPoint2D pt = random_point(rng);
+        for (size_t k : { 1, 5, 50 })
+            test->query(pt, k);
+    }
+    // at a client of the third server
+    for (const auto& client : test->clients) {
+        if (client.first == 2) {
+            test->query(client.second->get_coordinates(), 5);
+            break;
+        }
+    }
+    if (--test->n_pending > 0)
+        loop.run();
+    assert(test->n_pending == 0);
+}
+
+int main()
+{
+    set_log_function(ignore_log);
+
+    uv::Loop loop;
+    {
+        rpc::Context ctx(loop);
+        auto proxy = ctx.get_peer(net::Address("127.0.0.1:9001"))->get_proxy<protocol::ServerProxy>(protocol::MASTER_OBJECT_ID);
+
+        test_pages(proxy);
+        test_knn(proxy);
+    }
+    loop.run();
+
+    test_forwarded_knn(loop);
+}